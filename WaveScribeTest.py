@@ -1,17 +1,20 @@
 # Testing script for WaveScribe
-# Checks a range of encoding strength variables 
+# Checks a range of encoding strength variables
 # with conversion to JPEG images of a range of qualities.
+# Runs in process on the wavescribe module (python setup.py build_ext --inplace),
+# the JPEG round trips are done in memory.
 
-from wand.image import Image
-import os
+import io
 import sys
+from concurrent.futures import ThreadPoolExecutor
 
-def cmdecho( cmdstr ):
-    print cmdstr
-    os.system( cmdstr )
+import numpy as np
+from PIL import Image
+
+import wavescribe
 
 if len(sys.argv) < 3:
-    print "    usage:  WaveScribeTest.py <test image> <test string> [strength]"
+    print("    usage:  WaveScribeTest.py <test image> <test string> [strength] [quality]")
     sys.exit(0)
 
 testImage = sys.argv[1]
@@ -22,25 +25,34 @@ if len(sys.argv) > 3 :
 else:
     strength = [0.2,0.4,0.6,0.8]
 
-# if len(sys.argv) > 4 :
-#     quality = [int(sys.argv[4])]
-# else:
-#     quality = [80,90,100]
-    
-for s in strength:
-    cmdecho("bin\\Release\\WaveScribe " + str(s) + " " + testImage + " tmp\\test_%d.png" % (s*10) + ' "' + testString + '"');
-    cmdecho("bin\\Release\\WaveScribe " + str(s) + " tmp\\test_%d.png" % (s*10));
-    #for q in quality:
-        #cmdecho("go run convertImage.go tmp\\test.png tmp\\test.jpg " + str(q))
-        #cmdecho("go run convertImage.go tmp\\test.jpg tmp\\test_jpg.png")
-
-    with Image(filename='tmp\\test_%d.png' % (s*10)) as img:
-        with img.convert('jpg') as toJPG:
-            print "converted to jpg"
-            with toJPG.convert('png') as backToPNG:
-                print "converted back to png"
-                backToPNG.save(filename='tmp\\test_jpg_%d.png' % (s*10))
-
-    cmdecho("bin\\Release\\WaveScribe " + str(s) + " tmp\\test_jpg_%d.png" % (s*10));
-    print "\n",
-    
+if len(sys.argv) > 4 :
+    quality = [int(sys.argv[4])]
+else:
+    quality = [80,90,100]
+
+original = np.array(Image.open(testImage).convert("RGBA"))
+
+def jpegRoundTrip( pixels, q ):
+    jpeg = io.BytesIO()
+    Image.fromarray(pixels).convert("RGB").save(jpeg, "JPEG", quality=q)
+    jpeg.seek(0)
+    return np.array(Image.open(jpeg).convert("RGBA"))
+
+def describe( s, name, result ):
+    return "strength %.1f %-8s : %s (margin %d, mean confidence %.3f)" % (s, name, result["message"].rstrip(), result["margin"], result["meanConfidence"])
+
+def test( s ):
+    marked = original.copy()
+    wavescribe.encode(marked, testString, s)
+
+    lines = [ describe(s, "png", wavescribe.decode(marked, s)) ]
+
+    for q in quality:
+        lines.append(describe(s, "jpeg %d" % q, wavescribe.decode(jpegRoundTrip(marked, q), s)))
+
+    return lines
+
+# the module releases the GIL, so the strengths are tested side by side
+with ThreadPoolExecutor() as pool:
+    for lines in pool.map(test, strength):
+        print("\n".join(lines) + "\n")
@@ -0,0 +1,245 @@
+// Author: Jonathan Decker
+// Description: Per-thread bump allocator for the per-image working buffers
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// first block size and page granularity used for pre-faulting
+static const size_t minBlockSize = 1 << 20;
+static const size_t pageSize = 4096;
+
+Arena::Arena() : current(0), highWater(0), blocksAllocated(0)
+{
+}
+
+Arena::~Arena()
+{
+	freeBlocks();
+}
+
+Arena::Block Arena::newBlock( size_t size )
+{
+	Block b;
+
+	b.base = (unsigned char*)malloc(size + pageSize);
+	b.data = b.base == NULL ? NULL : (unsigned char*)(((size_t)b.base + pageSize - 1) & ~(pageSize - 1));
+	b.size = b.base == NULL ? 0 : size;
+	b.used = 0;
+
+	// touch every page now so the first image does not pay the page faults inside the transform
+	for( size_t i = 0; i < b.size; i += pageSize )
+		b.data[i] = 0;
+
+	++blocksAllocated;
+
+	return b;
+}
+
+void Arena::freeBlocks()
+{
+	for( size_t i = 0; i < blocks.size(); ++i )
+		free(blocks[i].base);
+
+	blocks.clear();
+	current = 0;
+}
+
+void* Arena::alloc( size_t size, size_t align )
+{
+	for( ; current < blocks.size(); ++current )
+	{
+		Block& b = blocks[current];
+		size_t offset = (b.used + align - 1) & ~(align - 1);
+
+		if( offset + size <= b.size )
+		{
+			b.used = offset + size;
+			return b.data + offset;
+		}
+
+		// later blocks start empty
+		if( current + 1 < blocks.size() )
+			blocks[current+1].used = 0;
+	}
+
+	size_t blockSize = minBlockSize;
+	while( blockSize < size + align )
+		blockSize <<= 1;
+
+	Block b = newBlock(blockSize);
+	if( b.data == NULL )
+		return NULL;
+
+	blocks.push_back(b);
+	current = blocks.size() - 1;
+
+	size_t offset = (b.used + align - 1) & ~(align - 1);
+	blocks[current].used = offset + size;
+
+	return blocks[current].data + offset;
+}
+
+Arena::Marker Arena::mark() const
+{
+	Marker m;
+
+	m.block = current;
+	m.offset = current < blocks.size() ? blocks[current].used : 0;
+
+	return m;
+}
+
+void Arena::release( const Marker& marker )
+{
+	if( marker.block == 0 && marker.offset == 0 )
+	{
+		reset();
+		return;
+	}
+
+	current = marker.block;
+	if( current < blocks.size() )
+		blocks[current].used = marker.offset;
+}
+
+bool Arena::resizeLast( void* p, size_t size, size_t newSize )
+{
+	if( current >= blocks.size() )
+		return false;
+
+	Block& b = blocks[current];
+	unsigned char* q = (unsigned char*)p;
+
+	if( q < b.data || q + size != b.data + b.used || (size_t)(q - b.data) + newSize > b.size )
+		return false;
+
+	b.used = (q - b.data) + newSize;
+
+	return true;
+}
+
+void Arena::releaseLast( void* p, size_t size )
+{
+	unsigned char* q = (unsigned char*)p;
+
+	// a realloc that moved on to a new block leaves the old buffer last in the one before
+	for( size_t i = 0; i <= current && i < blocks.size(); ++i )
+	{
+		if( q >= blocks[i].data && q + size == blocks[i].data + blocks[i].used )
+		{
+			blocks[i].used = q - blocks[i].data;
+			return;
+		}
+	}
+}
+
+void Arena::reset()
+{
+	size_t used = 0;
+	for( size_t i = 0; i <= current && i < blocks.size(); ++i )
+		used += blocks[i].used;
+
+	if( used > highWater )
+		highWater = used;
+
+	// one block of the high-water size serves every image seen so far
+	if( blocks.size() > 1 )
+	{
+		size_t blockSize = minBlockSize;
+		while( blockSize < highWater + pageSize )
+			blockSize <<= 1;
+
+		freeBlocks();
+		blocks.push_back(newBlock(blockSize));
+	}
+
+	current = 0;
+	if( !blocks.empty() )
+		blocks[0].used = 0;
+}
+
+void Arena::trim()
+{
+	freeBlocks();
+	highWater = 0;
+}
+
+size_t Arena::capacity() const
+{
+	size_t total = 0;
+
+	for( size_t i = 0; i < blocks.size(); ++i )
+		total += blocks[i].size;
+
+	return total;
+}
+
+size_t arenaFootprint( size_t size )
+{
+	size_t blockSize = minBlockSize;
+	while( blockSize < size + 64 )
+		blockSize <<= 1;
+
+	return blockSize + pageSize;
+}
+
+Arena& threadArena()
+{
+	static thread_local Arena arena;
+	return arena;
+}
+
+// each allocation carries its size in front so realloc can grow or copy it
+static const size_t headerSize = 16;
+
+void* arenaMalloc( size_t size )
+{
+	unsigned char* p = (unsigned char*)threadArena().alloc(size + headerSize, 16);
+
+	if( p == NULL )
+		return NULL;
+
+	*(size_t*)p = size;
+
+	return p + headerSize;
+}
+
+void* arenaRealloc( void* p, size_t size )
+{
+	if( p == NULL )
+		return arenaMalloc(size);
+
+	unsigned char* header = (unsigned char*)p - headerSize;
+	size_t oldSize = *(size_t*)header;
+
+	if( threadArena().resizeLast(header, oldSize + headerSize, size + headerSize) )
+	{
+		*(size_t*)header = size;
+		return p;
+	}
+
+	if( size <= oldSize )
+		return p;
+
+	void* q = arenaMalloc(size);
+
+	if( q != NULL )
+	{
+		memcpy(q, p, oldSize);
+		arenaFree(p);
+	}
+
+	return q;
+}
+
+void arenaFree( void* p )
+{
+	if( p == NULL )
+		return;
+
+	unsigned char* header = (unsigned char*)p - headerSize;
+
+	threadArena().releaseLast(header, *(size_t*)header + headerSize);
+}
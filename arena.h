@@ -0,0 +1,106 @@
+// Author: Jonathan Decker
+// Description: Per-thread bump allocator for the per-image working buffers
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// Hands out aligned memory from large pre-faulted blocks. Nothing is freed individually;
+// the arena is rewound to a marker (ArenaScope) or reset between images. After a reset the
+// blocks are merged into one block of the high-water size, so an arena that has seen the
+// largest image of a workload serves every later image without touching the system allocator.
+class Arena
+{
+public:
+	struct Marker
+	{
+		size_t block;
+		size_t offset;
+	};
+
+	Arena();
+	~Arena();
+
+	void* alloc( size_t size, size_t align = 64 );
+
+	template<typename T>
+	T* allocArray( size_t count )
+	{
+		return (T*)alloc(sizeof(T)*count);
+	}
+
+	Marker mark() const;
+	void release( const Marker& marker );
+
+	// grows or shrinks p in place when it is the last allocation of its block and the block has room.
+	// size is the size p was allocated with
+	bool resizeLast( void* p, size_t size, size_t newSize );
+
+	// gives p back when it is the last allocation of its block, anything else waits for a rewind
+	void releaseLast( void* p, size_t size );
+
+	// rewinds to empty and merges the blocks to the high-water size
+	void reset();
+
+	// rewinds to empty and gives every block back, for a thread that should not keep the memory of
+	// the largest image it has seen
+	void trim();
+
+	size_t capacity() const;
+
+	// number of blocks requested from the system allocator so far
+	size_t systemAllocations() const { return blocksAllocated; }
+
+private:
+	struct Block
+	{
+		unsigned char* base;
+		unsigned char* data;
+		size_t size;
+		size_t used;
+	};
+
+	Block newBlock( size_t size );
+	void freeBlocks();
+
+	std::vector<Block> blocks;
+	size_t current;
+	size_t highWater;
+	size_t blocksAllocated;
+
+	Arena( const Arena& );
+	Arena& operator=( const Arena& );
+};
+
+// arena owned by the calling thread (each pool worker has its own)
+Arena& threadArena();
+
+// the memory an empty arena takes from the system to serve an allocation of size bytes: blocks are
+// powers of two of at least a megabyte, all of it touched
+size_t arenaFootprint( size_t size );
+
+// releases everything allocated from the arena during its lifetime
+class ArenaScope
+{
+public:
+	explicit ArenaScope( Arena& a ) : arena(a), marker(a.mark()) {}
+	~ArenaScope() { arena.release(marker); }
+
+private:
+	Arena& arena;
+	Arena::Marker marker;
+
+	ArenaScope( const ArenaScope& );
+	ArenaScope& operator=( const ArenaScope& );
+};
+
+// malloc-style entry points on the thread arena, used to route stb's allocations. The buffer stb grows
+// by realloc is the last allocation while it grows, so it grows in place; arenaFree only gives back the
+// last allocation, the rest comes back when the arena is rewound
+extern "C"
+{
+	void* arenaMalloc( size_t size );
+	void* arenaRealloc( void* p, size_t size );
+	void  arenaFree( void* p );
+}
@@ -0,0 +1,698 @@
+// Author: Jonathan Decker
+// Description: Whole files read ahead and written behind (asyncfiles.h)
+//
+// A request is one whole file on a descriptor of its own, moved by an engine that marks it over once all
+// of it is transferred or it failed. The io_uring engine is driven from the calling thread with the raw
+// system calls (no liburing): a request longer than one operation moves, or a short transfer, is sent
+// again from where it stopped. The thread engine moves a request with plain blocking calls on one of its
+// threads.
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+	#include <io.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#include <sys/mman.h>
+		#include <sys/syscall.h>
+		#include <linux/io_uring.h>
+		#define ASYNC_URING
+	#endif
+#endif
+
+#include "asyncfiles.h"
+#include "trace.h"
+
+// descriptors the same way on both systems
+static int openFile( const char* path, bool write )
+{
+#ifdef _WIN32
+	return write ? _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE) : _open(path, _O_RDONLY | _O_BINARY);
+#else
+	return write ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : open(path, O_RDONLY);
+#endif
+}
+
+static long transferFile( int fd, unsigned char* data, unsigned int size, bool write )
+{
+#ifdef _WIN32
+	return write ? _write(fd, data, size) : _read(fd, data, size);
+#else
+	return write ? (long)::write(fd, data, size) : (long)::read(fd, data, size);
+#endif
+}
+
+static bool closeFile( int fd )
+{
+#ifdef _WIN32
+	return _close(fd) == 0;
+#else
+	return close(fd) == 0;
+#endif
+}
+
+// false unless fd is a regular file
+static bool regularFileSize( int fd, size_t* size )
+{
+#ifdef _WIN32
+	struct _stat64 info;
+
+	if( _fstat64(fd, &info) != 0 || (info.st_mode & _S_IFMT) != _S_IFREG )
+		return false;
+#else
+	struct stat info;
+
+	if( fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) )
+		return false;
+#endif
+
+	*size = (size_t)info.st_size;
+
+	return true;
+}
+
+// the most one read or write call moves, short of the 2 GB some kernels stop at
+static const size_t maxTransfer = (size_t)1 << 30;
+
+// threads of the fallback engine, each moves one file at a time
+static const unsigned int engineThreads = 4;
+
+struct AsyncRequest
+{
+	AsyncRequest() : size(0), done(0), fd(-1), write(false), issued(false), submitted(false), over(false), ok(false), counted(false), ticket(0) {}
+
+	std::string path;
+	std::vector<unsigned char> data;
+	size_t size;       // bytes to move
+	size_t done;       // moved so far
+	int fd;            // -1 once closed
+	bool write;
+	bool issued;       // opened, and either submitted or failed
+	bool submitted;    // given to the engine, which sets over and ok
+	bool over;
+	bool ok;
+	bool counted;      // a write whose bytes are in writesInFlight
+	unsigned long long ticket;
+};
+
+class AsyncEngine
+{
+public:
+	virtual ~AsyncEngine() {}
+
+	virtual const char* name() const = 0;
+
+	virtual void submit( AsyncRequest* request ) = 0;
+
+	// whether request is over, waiting for it if wait
+	virtual bool finished( AsyncRequest* request, bool wait ) = 0;
+};
+
+// ends a request on its descriptor, a write is only ok if its file closes cleanly
+static void closeRequest( AsyncRequest* request )
+{
+	bool closed = closeFile(request->fd);
+
+	request->fd = -1;
+	request->ok = request->done == request->size && (closed || !request->write);
+}
+
+class ThreadEngine : public AsyncEngine
+{
+public:
+	ThreadEngine() : stopping(false)
+	{
+		for( unsigned int i = 0; i < engineThreads; ++i )
+			threads.push_back(std::thread(&ThreadEngine::run, this));
+	}
+
+	~ThreadEngine()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		queued.notify_all();
+
+		for( size_t i = 0; i < threads.size(); ++i )
+			threads[i].join();
+	}
+
+	const char* name() const { return "threads"; }
+
+	void submit( AsyncRequest* request )
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			queue.push_back(request);
+		}
+		queued.notify_one();
+	}
+
+	bool finished( AsyncRequest* request, bool wait )
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if( wait )
+			over.wait(lock, [request]{ return request->over; });
+
+		return request->over;
+	}
+
+private:
+	void run()
+	{
+		traceThreadName("file io");
+
+		for(;;)
+		{
+			AsyncRequest* request;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queued.wait(lock, [this]{ return stopping || !queue.empty(); });
+
+				if( queue.empty() )
+					return;
+
+				request = queue.front();
+				queue.pop_front();
+			}
+
+			{
+				TRACE_SCOPE_DETAIL(request->write ? "write file" : "read file", request->path.c_str());
+
+				while( request->done < request->size )
+				{
+					unsigned int chunk = (unsigned int)std::min(request->size - request->done, maxTransfer);
+					long n = transferFile(request->fd, &request->data[request->done], chunk, request->write);
+
+					if( n < 0 && errno == EINTR )
+						continue;
+					if( n <= 0 )
+						break;
+
+					request->done += (size_t)n;
+				}
+
+				closeRequest(request);
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				request->over = true;
+			}
+			over.notify_all();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::condition_variable over;
+	std::deque<AsyncRequest*> queue;
+	std::vector<std::thread> threads;
+	bool stopping;
+};
+
+#ifdef ASYNC_URING
+
+// entries of the submission queue, and the most requests in flight
+static const unsigned int uringEntries = 64;
+
+class UringEngine : public AsyncEngine
+{
+public:
+	UringEngine() : ring(-1), inFlight(0), sqMemory(MAP_FAILED), cqMemory(MAP_FAILED), sqeMemory(MAP_FAILED), sqSize(0), cqSize(0), sqeSize(0) {}
+
+	~UringEngine()
+	{
+		// the kernel may still be writing into the buffers of requests nobody waited for
+		while( inFlight > 0 && reap(true) )
+			;
+
+		if( sqeMemory != MAP_FAILED )
+			munmap(sqeMemory, sqeSize);
+		if( cqMemory != MAP_FAILED && cqMemory != sqMemory )
+			munmap(cqMemory, cqSize);
+		if( sqMemory != MAP_FAILED )
+			munmap(sqMemory, sqSize);
+		if( ring >= 0 )
+			closeFile(ring);
+	}
+
+	// false where the kernel has no io_uring or does not let this process have one
+	bool start()
+	{
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+
+		ring = (int)syscall(__NR_io_uring_setup, uringEntries, &params);
+
+		if( ring < 0 || !supportsReadWrite() )
+			return false;
+
+		sqSize = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+		cqSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+		sqeSize = params.sq_entries*sizeof(struct io_uring_sqe);
+
+		// both rings in one mapping where the kernel allows it
+		bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+		if( single )
+			sqSize = cqSize = std::max(sqSize, cqSize);
+
+		sqMemory = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+		cqMemory = single ? sqMemory : mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		sqeMemory = mmap(NULL, sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+
+		if( sqMemory == MAP_FAILED || cqMemory == MAP_FAILED || sqeMemory == MAP_FAILED )
+			return false;
+
+		unsigned char* sq = (unsigned char*)sqMemory;
+		unsigned char* cq = (unsigned char*)cqMemory;
+
+		sqTail = (unsigned int*)(sq + params.sq_off.tail);
+		sqMask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+		sqArray = (unsigned int*)(sq + params.sq_off.array);
+		cqHead = (unsigned int*)(cq + params.cq_off.head);
+		cqTail = (unsigned int*)(cq + params.cq_off.tail);
+		cqMask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+		sqes = (struct io_uring_sqe*)sqeMemory;
+		capacity = std::min(params.sq_entries, params.cq_entries);
+
+		return true;
+	}
+
+	const char* name() const { return "io_uring"; }
+
+	void submit( AsyncRequest* request )
+	{
+		if( request->done == request->size )
+		{
+			closeRequest(request);
+			request->over = true;
+			return;
+		}
+
+		// a full ring makes room first, completions are only seen when reaped
+		while( inFlight >= capacity )
+			reap(true);
+
+		unsigned int tail = *sqTail;
+		struct io_uring_sqe* sqe = &sqes[tail & sqMask];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = request->fd;
+		sqe->addr = (unsigned long long)(size_t)&request->data[request->done];
+		sqe->len = (unsigned int)std::min(request->size - request->done, maxTransfer);
+		sqe->off = request->done;
+		sqe->user_data = (unsigned long long)(size_t)request;
+
+		sqArray[tail & sqMask] = tail & sqMask;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+		++inFlight;
+
+		while( syscall(__NR_io_uring_enter, ring, 1, 0, 0, NULL, 0) < 0 && errno == EINTR )
+			;
+	}
+
+	bool finished( AsyncRequest* request, bool wait )
+	{
+		reap(false);
+
+		if( wait && !request->over )
+		{
+			TRACE_SCOPE_DETAIL("wait file", request->path.c_str());
+
+			while( !request->over )
+			{
+				if( !reap(true) )
+				{
+					// the ring is broken, nothing will complete any more
+					closeRequest(request);
+					request->over = true;
+				}
+			}
+		}
+
+		return request->over;
+	}
+
+private:
+	// plain reads and writes came after io_uring itself (5.6): an older kernel fails every one of them
+	// with -EINVAL, and cannot be asked either
+	bool supportsReadWrite()
+	{
+		const unsigned int ops = 64;
+		std::vector<unsigned char> memory(sizeof(struct io_uring_probe) + ops*sizeof(struct io_uring_probe_op), 0);
+		struct io_uring_probe* probe = (struct io_uring_probe*)&memory[0];
+
+		if( syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, ops) < 0 )
+			return false;
+
+		return IORING_OP_READ < probe->ops_len && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0 &&
+		       IORING_OP_WRITE < probe->ops_len && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+
+	// handles the completions there are, waiting for one first if wait; false if waiting failed
+	bool reap( bool wait )
+	{
+		if( wait && __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) == *cqHead )
+		{
+			if( inFlight == 0 )
+				return false;
+
+			while( syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 )
+			{
+				if( errno != EINTR )
+					return false;
+			}
+		}
+
+		unsigned int head = *cqHead;
+
+		while( head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) )
+		{
+			struct io_uring_cqe* cqe = &cqes[head & cqMask];
+			AsyncRequest* request = (AsyncRequest*)(size_t)cqe->user_data;
+			int result = cqe->res;
+
+			__atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+			--inFlight;
+
+			if( result == -EINTR || result == -EAGAIN )
+			{
+				submit(request);
+				continue;
+			}
+
+			if( result > 0 )
+				request->done += (size_t)result;
+
+			// the rest of a long or short transfer goes in again, an error or the end of the file ends it
+			if( result > 0 && request->done < request->size )
+			{
+				submit(request);
+				continue;
+			}
+
+			closeRequest(request);
+			request->over = true;
+		}
+
+		return true;
+	}
+
+	int ring;
+	unsigned int inFlight;
+	unsigned int capacity;
+
+	void* sqMemory;
+	void* cqMemory;
+	void* sqeMemory;
+	size_t sqSize;
+	size_t cqSize;
+	size_t sqeSize;
+
+	unsigned int* sqTail;
+	unsigned int sqMask;
+	unsigned int* sqArray;
+	unsigned int* cqHead;
+	unsigned int* cqTail;
+	unsigned int cqMask;
+	struct io_uring_cqe* cqes;
+	struct io_uring_sqe* sqes;
+};
+
+#endif // ASYNC_URING
+
+AsyncFiles::AsyncFiles( size_t readBudget, size_t writeBudget, AsyncBackend backend )
+	: engine(NULL), readBudget(readBudget), writeBudget(writeBudget), readAhead(0), writesInFlight(0), nextTicket(1)
+{
+#ifdef ASYNC_URING
+	if( backend == AsyncUring )
+	{
+		UringEngine* uring = new UringEngine();
+
+		if( uring->start() )
+			engine = uring;
+		else
+			delete uring;
+	}
+#endif
+
+	if( engine == NULL )
+		engine = new ThreadEngine();
+}
+
+AsyncFiles::~AsyncFiles()
+{
+	for( size_t i = 0; i < writes.size(); ++i )
+	{
+		if( writes[i]->submitted )
+			engine->finished(writes[i], true);
+		delete writes[i];
+	}
+
+	for( size_t i = 0; i < reads.size(); ++i )
+	{
+		if( reads[i]->submitted )
+			engine->finished(reads[i], true);
+		else if( reads[i]->fd >= 0 )
+			closeFile(reads[i]->fd);
+		delete reads[i];
+	}
+
+	delete engine;
+}
+
+const char* AsyncFiles::backend() const
+{
+	return engine->name();
+}
+
+// opens the file of a read and takes its size, false if it cannot be read
+static bool openRead( AsyncRequest* request )
+{
+	request->fd = openFile(request->path.c_str(), false);
+
+	if( request->fd < 0 )
+		return false;
+
+	if( !regularFileSize(request->fd, &request->size) )
+	{
+		closeFile(request->fd);
+		request->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+void AsyncFiles::prefetch( const std::string& path )
+{
+	AsyncRequest* request = new AsyncRequest();
+
+	request->path = path;
+	reads.push_back(request);
+
+	issueReads();
+}
+
+void AsyncFiles::issueReads()
+{
+	for( size_t i = 0; i < reads.size(); ++i )
+	{
+		AsyncRequest* request = reads[i];
+
+		if( request->issued )
+			continue;
+
+		if( request->fd < 0 && !openRead(request) )
+		{
+			request->issued = request->over = true;
+			continue;
+		}
+
+		// the size is known once open, the read waits for room in the budget
+		if( readAhead > 0 && readAhead + request->size > readBudget )
+			return;
+
+		request->data.resize(request->size);
+		request->issued = request->submitted = true;
+		readAhead += request->size;
+
+		engine->submit(request);
+	}
+}
+
+bool AsyncFiles::take( const std::string& path, std::vector<unsigned char>& data )
+{
+	TRACE_SCOPE_DETAIL("take file", path.c_str());
+
+	size_t index = 0;
+
+	while( index < reads.size() && reads[index]->path != path )
+		++index;
+
+	if( index == reads.size() )
+		return false;
+
+	AsyncRequest* request = reads[index];
+
+	// taken before its turn in the budget; the reads queued before it keep theirs
+	if( !request->issued )
+	{
+		if( request->fd >= 0 || openRead(request) )
+		{
+			request->data.resize(request->size);
+			request->submitted = true;
+			readAhead += request->size;
+			engine->submit(request);
+		}
+		else
+			request->over = true;
+
+		request->issued = true;
+	}
+
+	if( request->submitted )
+	{
+		engine->finished(request, true);
+		readAhead -= request->size;
+	}
+
+	bool read = request->submitted && request->ok;
+
+	data.swap(request->data);
+
+	delete request;
+	reads.erase(reads.begin() + index);
+
+	issueReads();
+
+	return read;
+}
+
+void AsyncFiles::reserveWrite( size_t bytes )
+{
+	// writes that are over give their bytes back, whether or not they have been reported yet
+	for( size_t i = 0; i < writes.size(); ++i )
+	{
+		AsyncRequest* request = writes[i];
+
+		if( request->counted && (!request->submitted || engine->finished(request, false)) )
+		{
+			writesInFlight -= request->size;
+			request->counted = false;
+			std::vector<unsigned char>().swap(request->data);
+		}
+	}
+
+	for( size_t i = 0; i < writes.size() && writesInFlight > 0 && writesInFlight + bytes > writeBudget; ++i )
+	{
+		AsyncRequest* request = writes[i];
+
+		if( !request->counted )
+			continue;
+
+		engine->finished(request, true);
+
+		writesInFlight -= request->size;
+		request->counted = false;
+		std::vector<unsigned char>().swap(request->data);
+	}
+}
+
+unsigned long long AsyncFiles::write( const std::string& path, std::vector<unsigned char>& data )
+{
+	TRACE_SCOPE_DETAIL("queue write", path.c_str());
+
+	AsyncRequest* request = new AsyncRequest();
+
+	request->path = path;
+	request->data.swap(data);
+	request->size = request->data.size();
+	request->write = true;
+	request->ticket = nextTicket++;
+
+	reserveWrite(request->size);
+
+	request->fd = openFile(path.c_str(), true);
+	request->issued = true;
+
+	if( request->fd >= 0 )
+	{
+		request->submitted = request->counted = true;
+		writesInFlight += request->size;
+		engine->submit(request);
+	}
+	else
+		request->over = true;
+
+	writes.push_back(request);
+
+	return request->ticket;
+}
+
+bool AsyncFiles::finished( unsigned long long ticket, bool wait, bool* written )
+{
+	for( size_t i = 0; i < writes.size(); ++i )
+	{
+		AsyncRequest* request = writes[i];
+
+		if( request->ticket != ticket )
+			continue;
+
+		if( request->submitted && !engine->finished(request, wait) )
+			return false;
+
+		if( request->counted )
+			writesInFlight -= request->size;
+
+		*written = request->submitted && request->ok;
+
+		delete request;
+		writes.erase(writes.begin() + i);
+
+		return true;
+	}
+
+	*written = false;
+
+	return true;
+}
+
+const char* asyncBackendName( AsyncBackend backend )
+{
+	return backend == AsyncThreads ? "threads" : "uring";
+}
+
+bool findAsyncBackend( const char* name, AsyncBackend* backend )
+{
+	for( int b = 0; b < AsyncBackendCount; ++b )
+	{
+		if( strcmp(name, asyncBackendName((AsyncBackend)b)) == 0 )
+		{
+			*backend = (AsyncBackend)b;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,71 @@
+// Author: Jonathan Decker
+// Description: Whole files read ahead and written behind, so batch workers do not sit on slow storage
+//
+// Reads are issued in the order they were queued while the bytes read ahead and not yet taken fit the
+// read budget (one file at least), writes are queued until the bytes in flight would pass the write
+// budget. On Linux the transfers go through an io_uring of the process's own; where the kernel refuses
+// one (too old, disabled, a sandbox) or it is not wanted, a few threads do blocking reads and writes
+// instead. Opening a file and taking its size happen on the calling thread either way.
+
+#pragma once
+
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct AsyncRequest;
+class AsyncEngine;
+
+enum AsyncBackend
+{
+	AsyncUring,   // io_uring, falls back to threads where the kernel has none
+	AsyncThreads,
+	AsyncBackendCount
+};
+
+class AsyncFiles
+{
+public:
+	AsyncFiles( size_t readBudget, size_t writeBudget, AsyncBackend backend = AsyncUring );
+
+	// waits for the writes still in flight
+	~AsyncFiles();
+
+	// "io_uring" or "threads", what is actually used
+	const char* backend() const;
+
+	// queues the read of a whole file
+	void prefetch( const std::string& path );
+
+	// Waits for the read of path, the oldest one queued for it, and swaps its contents into data. Reads
+	// can be taken in any order. False if the file could not be opened or read
+	bool take( const std::string& path, std::vector<unsigned char>& data );
+
+	// Queues data, swapped out of the argument, to be written to path (created or truncated), first
+	// waiting while the writes in flight would go over the budget. Returns a ticket for finished
+	unsigned long long write( const std::string& path, std::vector<unsigned char>& data );
+
+	// Whether the write of ticket is over, waiting for it if wait; written tells if all of it reached
+	// the file. A ticket is forgotten once reported over
+	bool finished( unsigned long long ticket, bool wait, bool* written );
+
+private:
+	AsyncFiles( const AsyncFiles& );
+	AsyncFiles& operator=( const AsyncFiles& );
+
+	void issueReads();
+	void reserveWrite( size_t bytes );
+
+	AsyncEngine* engine;
+	std::deque<AsyncRequest*> reads;
+	std::deque<AsyncRequest*> writes;
+	size_t readBudget;
+	size_t writeBudget;
+	size_t readAhead;      // bytes of issued reads not taken yet
+	size_t writesInFlight; // bytes of writes not reported over yet
+	unsigned long long nextTicket;
+};
+
+const char* asyncBackendName( AsyncBackend backend );
+bool findAsyncBackend( const char* name, AsyncBackend* backend );
@@ -0,0 +1,1032 @@
+// Author: Jonathan Decker
+// Description: Resumable batch runs over a manifest of images (batch.h)
+//
+// Checkpoint log records, one per line with tab separated fields:
+//   E <seconds> <crc32 of the output> <output bytes> <input> <output>
+//   D <seconds> <decoded> <corrected symbols> <margin> <band agreement> <mean confidence> <weak bits> <input> <message>
+// The message has backslash, tab and line breaks escaped. A record is only written once its item is
+// finished, and a line without its newline (the run stopped while writing it) is ignored.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "batch.h"
+#include "arena.h"
+#include "asyncfiles.h"
+#include "imageio.h"
+#include "resultcache.h"
+#include "threadpool.h"
+#include "trace.h"
+
+extern "C"
+{
+	#include "dwt.h"
+}
+
+struct BatchItem
+{
+	std::string input;
+	std::string output;  // empty to decode
+};
+
+// an encode whose output is still being written behind
+struct PendingOutput
+{
+	unsigned long long ticket;
+	std::string partial;
+	std::string output;
+	std::string record;  // the whole log record
+	double seconds;
+	unsigned long long bytes;
+	std::vector<unsigned char> file;  // until it is queued
+};
+
+BatchStats::BatchStats()
+	: items(0), completed(0), resumed(0), failed(0), bytes(0), busySeconds(0), wallSeconds(0),
+	  memoryBudget(0), peakReserved(0), meanReserved(0), peakRunning(0), peakWaiting(0), backfilled(0), tooLarge(0)
+{
+}
+
+bool parseShard( const char* text, unsigned int* shard, unsigned int* shards )
+{
+	char extra;
+
+	return sscanf(text, "%u/%u%c", shard, shards, &extra) == 2 && *shards > 0 && *shard < *shards;
+}
+
+unsigned int shardOf( const char* input, unsigned int shards )
+{
+	// 32-bit FNV-1a
+	unsigned int hash = 2166136261u;
+
+	for( ; *input; ++input )
+		hash = (hash ^ (unsigned char)*input) * 16777619u;
+
+	return hash % shards;
+}
+
+void batchLogPath( char* path, const char* manifest, unsigned int shard, unsigned int shards )
+{
+	sprintf(path, "%s.%u-of-%u.log", manifest, shard, shards);
+}
+
+static double secondsSince( std::chrono::steady_clock::time_point start )
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// lines split at tabs, the line break removed
+static void splitFields( char* line, std::vector<char*>& fields )
+{
+	fields.clear();
+	line[strcspn(line, "\r\n")] = 0;
+
+	for( char* p = line; ; )
+	{
+		fields.push_back(p);
+		p = strchr(p, '\t');
+
+		if( p == NULL )
+			break;
+
+		*p++ = 0;
+	}
+}
+
+// reads a whole line of any length, false at the end of the file
+static bool readLine( FILE* fp, std::vector<char>& line )
+{
+	line.clear();
+
+	int c;
+	while( (c = fgetc(fp)) != EOF )
+	{
+		line.push_back((char)c);
+
+		if( c == '\n' )
+			break;
+	}
+
+	line.push_back(0);
+
+	return line.size() > 1;
+}
+
+static bool readManifest( const char* manifest, unsigned int shard, unsigned int shards, std::vector<BatchItem>& items )
+{
+	FILE* fp = fopen(manifest, "rb");
+
+	if( fp == NULL )
+		return false;
+
+	std::vector<char> line;
+	std::vector<char*> fields;
+
+	while( readLine(fp, line) )
+	{
+		splitFields(&line[0], fields);
+
+		if( fields[0][0] == 0 || fields[0][0] == '#' || shardOf(fields[0], shards) != shard )
+			continue;
+
+		BatchItem item;
+		item.input = fields[0];
+		item.output = fields.size() > 1 ? fields[1] : "";
+		items.push_back(item);
+	}
+
+	fclose(fp);
+
+	return true;
+}
+
+static void escapeMessage( const char* message, std::string& escaped )
+{
+	for( ; *message; ++message )
+	{
+		switch( *message )
+		{
+		case '\\': escaped += "\\\\"; break;
+		case '\t': escaped += "\\t"; break;
+		case '\n': escaped += "\\n"; break;
+		case '\r': escaped += "\\r"; break;
+		default:   escaped += *message; break;
+		}
+	}
+}
+
+// adds the records of a log to stats and done; a missing log is an empty one
+static void readLog( const char* log, std::unordered_set<std::string>& done, BatchStats* stats )
+{
+	FILE* fp = fopen(log, "rb");
+
+	if( fp == NULL )
+		return;
+
+	std::vector<char> line;
+	std::vector<char*> fields;
+
+	while( readLine(fp, line) )
+	{
+		// the last record may have been cut short
+		if( line.size() < 2 || line[line.size()-2] != '\n' )
+			break;
+
+		splitFields(&line[0], fields);
+
+		if( fields[0][0] == 'E' && fields[0][1] == 0 && fields.size() == 6 )
+		{
+			if( !done.insert(fields[4]).second )
+				continue;
+
+			stats->busySeconds += atof(fields[1]);
+			stats->bytes += strtoull(fields[3], NULL, 10);
+		}
+		else if( fields[0][0] == 'D' && fields[0][1] == 0 && fields.size() == 10 )
+		{
+			if( !done.insert(fields[8]).second )
+				continue;
+
+			DecodeResult* result = new DecodeResult();
+
+			result->decoded = atoi(fields[2]) != 0;
+			result->correctedSymbols = (unsigned int)strtoul(fields[3], NULL, 10);
+			result->margin = atoi(fields[4]);
+			result->bandAgreement = atof(fields[5]);
+			result->meanConfidence = atof(fields[6]);
+			result->weakBits = (unsigned int)strtoul(fields[7], NULL, 10);
+
+			stats->busySeconds += atof(fields[1]);
+			addDecodeResult(stats->decodes, *result);
+
+			delete result;
+		}
+		else
+		{
+			continue;
+		}
+
+		++stats->completed;
+	}
+
+	fclose(fp);
+}
+
+static bool fileChecksum( const char* path, unsigned long* crc, unsigned long long* bytes )
+{
+	FILE* fp = fopen(path, "rb");
+
+	if( fp == NULL )
+		return false;
+
+	std::vector<unsigned char> buffer(1 << 20);
+	size_t n;
+
+	*crc = crc32(0, NULL, 0);
+	*bytes = 0;
+
+	while( (n = fread(&buffer[0], 1, buffer.size(), fp)) > 0 )
+	{
+		*crc = crc32(*crc, &buffer[0], (uInt)n);
+		*bytes += n;
+	}
+
+	bool read = ferror(fp) == 0;
+	fclose(fp);
+
+	return read;
+}
+
+// the output's directory and extension with a name of its own, so nothing is ever seen half written
+static std::string partialPath( const std::string& output )
+{
+	size_t slash = output.find_last_of("/\\");
+	size_t name = slash == std::string::npos ? 0 : slash + 1;
+
+	char prefix[48];
+	sprintf(prefix, ".partial-%d-", (int)getpid());
+
+	return output.substr(0, name) + prefix + output.substr(name);
+}
+
+// the pixels of an input, from its read ahead if there is one; they may lie in buffer until released
+static unsigned int* loadItem( ImageBackend& images, const BatchItem& item, std::vector<unsigned char>& buffer, int* width, int* height )
+{
+	if( !buffer.empty() )
+	{
+		unsigned int* pixels = images.load(&buffer[0], buffer.size(), width, height);
+
+		if( pixels != NULL )
+			return pixels;
+	}
+
+	// a file that could not be read ahead gets the error of a plain load
+	return images.load(item.input.c_str(), width, height);
+}
+
+// gives a written partial file its final name, otherwise removes it
+static bool commitOutput( const std::string& partial, const std::string& output, bool written, bool complain )
+{
+#ifdef _WIN32
+	// rename does not replace a file here
+	if( written )
+		remove(output.c_str());
+#endif
+
+	if( !written || rename(partial.c_str(), output.c_str()) != 0 )
+	{
+		if( complain )
+			fprintf(stderr,"Error: could not write file %s\n", output.c_str());
+
+		remove(partial.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// buffer holds the input if it was read ahead. An output to write behind is left in pending for the caller
+static bool encodeItem( ThreadPool& pool, ImageBackend& images, const BatchOptions& options, const BatchItem& item, std::vector<unsigned char>& buffer, std::string& record, unsigned long long* bytes, PendingOutput* pending )
+{
+	TRACE_SCOPE_DETAIL("encode item", item.input.c_str());
+
+	int width, height;
+	unsigned int* pixels = loadItem(images, item, buffer, &width, &height);
+
+	if( pixels == NULL )
+	{
+		fprintf(stderr,"Error: could not open file %s\n", item.input.c_str());
+		return false;
+	}
+
+	std::string partial = partialPath(item.output);
+	std::string params;
+	unsigned long long key = 0;
+
+	// a cached output goes straight to the partial file and is checksummed like a new one
+	if( options.cache != NULL )
+	{
+		params = resultCacheParams(options.message, options.markStrength, options.codec, options.tiled, 0, 0, item.output.c_str(), images);
+		key = options.cache->key(pixels, width, height, params);
+	}
+
+	bool cached = options.cache != NULL && options.cache->findFile(key, params, partial.c_str());
+	bool marked = cached;
+
+	if( !cached && options.tiled )
+	{
+		marked = insertTiledWatermark(pool, pixels, options.mark, width, height, options.markStrength, options.codec);
+	}
+	else if( !cached )
+	{
+		unsigned int* output = NULL;
+		insertWatermark(pixels, &output, options.mark, &width, &height, true, options.markStrength, options.codec);
+		marked = output != NULL;
+	}
+
+	unsigned long crc = 0;
+	char fields[64];
+
+	// written behind: encoded and checksummed in memory, queued, renamed and logged by the caller
+	if( marked && !cached && options.files != NULL )
+	{
+		std::vector<unsigned char> file;
+		bool encoded = images.encodeFile(item.output.c_str(), pixels, width, height, file);
+
+		images.release(pixels);
+
+		if( !encoded )
+		{
+			fprintf(stderr,"Error: could not write file %s\n", item.output.c_str());
+			return false;
+		}
+
+		crc = crc32(0, NULL, 0);
+
+		for( size_t done = 0; done < file.size(); done += 1 << 30 )
+			crc = crc32(crc, &file[done], (uInt)std::min(file.size() - done, (size_t)1 << 30));
+
+		*bytes = file.size();
+
+		if( options.cache != NULL )
+			options.cache->store(key, params, &file[0], file.size());
+
+		sprintf(fields, "\t%08lx\t%llu\t", crc, *bytes);
+		record += fields + item.input + "\t" + item.output;
+
+		pending->partial = partial;
+		pending->output = item.output;
+		pending->bytes = *bytes;
+		pending->file.swap(file);
+
+		return true;
+	}
+
+	bool written = marked && (cached || images.save(partial.c_str(), pixels, width, height)) && fileChecksum(partial.c_str(), &crc, bytes);
+
+	if( written && !cached && options.cache != NULL )
+		options.cache->storeFile(key, params, partial.c_str());
+
+	images.release(pixels);
+
+	if( !commitOutput(partial, item.output, written, marked) )
+		return false;
+
+	sprintf(fields, "\t%08lx\t%llu\t", crc, *bytes);
+
+	record += fields + item.input + "\t" + item.output;
+
+	return true;
+}
+
+static bool decodeItem( ThreadPool& pool, ImageBackend& images, const BatchOptions& options, const BatchItem& item, std::vector<unsigned char>& buffer, unsigned char* mark, DecodeResult* result, std::string& record )
+{
+	TRACE_SCOPE_DETAIL("decode item", item.input.c_str());
+
+	int width, height;
+	unsigned int* pixels = loadItem(images, item, buffer, &width, &height);
+
+	if( pixels == NULL )
+	{
+		fprintf(stderr,"Error: could not open file %s\n", item.input.c_str());
+		return false;
+	}
+
+	std::string params;
+	unsigned long long key = 0;
+	std::vector<unsigned char> payload;
+
+	if( options.cache != NULL )
+	{
+		params = resultCacheParams(NULL, options.markStrength, options.codec, options.tiled, options.quorum, 0, NULL, images);
+		key = options.cache->key(pixels, width, height, params);
+	}
+
+	bool read = true;
+
+	if( options.cache != NULL && options.cache->find(key, params, payload) && payload.size() == sizeof(DecodeResult) )
+		memcpy(result, &payload[0], sizeof(DecodeResult));
+	else
+	{
+		if( options.tiled )
+			decodeTiledWatermark(pool, pixels, mark, width, height, options.markStrength, options.quorum, options.codec, result);
+		else
+			read = decodeWatermark(pixels, mark, width, height, options.markStrength, options.codec, result);
+
+		if( read && options.cache != NULL )
+			options.cache->store(key, params, result, sizeof(DecodeResult));
+	}
+
+	images.release(pixels);
+
+	// an image without a tile of the codec's size cannot be read at all, as opposed to failing the decode
+	if( !read )
+		return false;
+
+	char fields[128];
+	sprintf(fields, "\t%d\t%u\t%d\t%.4f\t%.4f\t%u\t", result->decoded ? 1 : 0, result->correctedSymbols, result->margin,
+	        result->bandAgreement, result->meanConfidence, result->weakBits);
+
+	record += fields + item.input + "\t";
+	escapeMessage(result->message, record);
+
+	return true;
+}
+
+// appends a finished item to the log and flushes it
+static bool appendRecord( FILE* fp, const char* log, char kind, double seconds, const std::string& fields )
+{
+	char prefix[32];
+	sprintf(prefix, "%c\t%.4f", kind, seconds);
+
+	std::string record = prefix + fields + "\n";
+
+	if( fwrite(record.data(), 1, record.size(), fp) != record.size() || fflush(fp) != 0 )
+	{
+		fprintf(stderr,"Error: could not write file %s\n", log);
+		return false;
+	}
+
+	return true;
+}
+
+// renames and logs the outputs whose writes are over, oldest first, up to the first still in flight
+// (every one if wait). False once the log cannot be written, the outputs are still renamed
+static bool finishOutputs( AsyncFiles& files, std::deque<PendingOutput>& pending, bool wait, FILE* fp, const char* log, BatchStats* stats )
+{
+	bool logged = true;
+	bool written;
+
+	while( !pending.empty() && files.finished(pending.front().ticket, wait, &written) )
+	{
+		const PendingOutput& output = pending.front();
+
+		if( !commitOutput(output.partial, output.output, written, true) )
+			++stats->failed;
+		else if( logged && (logged = appendRecord(fp, log, 'E', output.seconds, output.record)) )
+		{
+			++stats->completed;
+			stats->busySeconds += output.seconds;
+			stats->bytes += output.bytes;
+		}
+
+		pending.pop_front();
+	}
+
+	return logged;
+}
+
+// what a run keeps from item to item
+struct BatchRun
+{
+	const BatchOptions* options;
+	FILE* fp;
+	const char* log;
+	BatchStats* stats;
+	std::unordered_set<std::string> done;
+	std::deque<PendingOutput> pending;
+	bool logged;  // false once the log cannot be written, nothing more is started
+};
+
+// false if the item is done already or cannot be started
+static bool startItem( BatchRun& run, const BatchItem& item )
+{
+	if( run.done.count(item.input) > 0 )
+		return false;
+
+	if( run.options->mark != NULL && item.output.empty() )
+	{
+		fprintf(stderr,"Error: no output for %s in %s\n", item.input.c_str(), run.options->manifest);
+		++run.stats->failed;
+		return false;
+	}
+
+	return true;
+}
+
+// logs a finished item, or queues its output to be written behind and logs the ones written
+static void recordItem( BatchRun& run, const BatchItem& item, bool finished, double seconds, std::string& record, unsigned long long bytes, PendingOutput& output, const DecodeResult* result )
+{
+	const BatchOptions& options = *run.options;
+	bool encode = options.mark != NULL;
+
+	if( !finished )
+	{
+		++run.stats->failed;
+		return;
+	}
+
+	if( !output.partial.empty() )
+	{
+		output.ticket = options.files->write(output.partial, output.file);
+		output.record.swap(record);
+		output.seconds = seconds;
+		run.pending.push_back(PendingOutput());
+		std::swap(run.pending.back(), output);
+		run.done.insert(item.input);
+
+		run.logged = finishOutputs(*options.files, run.pending, false, run.fp, run.log, run.stats);
+		return;
+	}
+
+	if( !encode && options.json )
+		writeDecodeResultJson(stdout, item.input.c_str(), *result, false);
+
+	if( !appendRecord(run.fp, run.log, encode ? 'E' : 'D', seconds, record) )
+	{
+		run.logged = false;
+		return;
+	}
+
+	run.done.insert(item.input);
+
+	++run.stats->completed;
+	run.stats->busySeconds += seconds;
+	run.stats->bytes += bytes;
+
+	if( !encode )
+		addDecodeResult(run.stats->decodes, *result);
+}
+
+// An item run on a worker of its own under a memory budget, from its admission to its record
+struct BatchJob
+{
+	size_t item;
+	unsigned long long reserved;        // bytes admitted for it
+	std::vector<unsigned char> buffer;  // the input, if it was read ahead
+	std::vector<unsigned char> mark;
+	DecodeResult result;
+	std::string record;
+	unsigned long long bytes;
+	PendingOutput output;
+	bool finished;
+	double seconds;
+	long long kept;                     // change in the arena memory its worker keeps
+};
+
+// The memory an item is admitted with, from the size in its header: its arena, the filtered rows and the
+// file of an encode and the input read ahead. An item whose header cannot be read gets all of available
+static unsigned long long itemFootprint( const BatchOptions& options, const BatchItem& item, unsigned long long available )
+{
+	int width, height;
+	unsigned long long fileBytes;
+
+	if( !readImageSize(item.input.c_str(), &width, &height, &fileBytes) )
+		return available;
+
+	const unsigned long long pixels = (unsigned long long)width*height*4;
+	const unsigned long long coefficients = options.tiled ? 0 : workingSetSize(width, height, false, options.codec);
+
+	// stb gathers the compressed data in a buffer it doubles (up to twice the file), inflates it into
+	// rows with a filter byte each and unfilters those into the pixels. Only the last allocation of the
+	// arena is given back, so all three are still there under the coefficients
+	const unsigned long long load = 2*fileBytes + (pixels + height) + pixels;
+
+	return arenaFootprint((size_t)(load + coefficients)) + (options.mark != NULL ? 2*pixels : 0) + (options.files != NULL ? fileBytes : 0);
+}
+
+// Runs up to one item per pool worker side by side, each on a worker of its own, while the footprints of
+// the items running, the arena memory the workers keep and the tile planes of the pool fit the budget.
+// Items are admitted in manifest order; while the first one waiting does not fit, the ones after it that
+// do go first (backfilled), up to a lookahead of items so the large one is not put off for ever. An item
+// larger than the whole budget is refused
+static void runWithinBudget( ThreadPool& pool, ImageBackend& images, const std::vector<BatchItem>& items, BatchRun& run )
+{
+	const BatchOptions& options = *run.options;
+	BatchStats* stats = run.stats;
+	const bool encode = options.mark != NULL;
+	const unsigned int workers = pool.size();
+	const size_t lookahead = 4*workers;
+
+	// every pool worker keeps a tile plane in its arena in tiled mode
+	const unsigned long long resident = options.tiled ? workers*(unsigned long long)arenaFootprint(workingSetSize(0, 0, true, options.codec)) : 0;
+	const unsigned long long available = options.memoryBudget > resident ? options.memoryBudget - resident : 0;
+
+	// a worker keeps the arena of its last item for the next one while it is this small
+	const size_t keepArena = (size_t)(available / (4*workers));
+
+	ThreadPool itemPool(workers, dwtcleanup);
+	std::mutex mutex;
+	std::condition_variable jobDone;
+	std::vector<BatchJob*> finishedJobs;
+
+	// workers at and past the barrier of a trim
+	std::condition_variable barrier;
+	unsigned int arrived = 0, left = 0;
+
+	// footprints are read from the headers of the lookahead, once
+	static const unsigned long long unsized = ~0ULL;
+
+	std::deque<size_t> waiting;
+	std::vector<unsigned long long> footprints(items.size(), unsized);
+	unsigned long long reserved = 0;   // footprints of the items running
+	unsigned long long kept = 0;       // arena memory kept by idle workers
+	unsigned int running = 0;
+	size_t passed = 0;                 // items backfilled since the first one waiting arrived at the front
+
+	// a later line of an input is done once the first one is
+	std::unordered_set<std::string> queued;
+
+	for( size_t i = 0; i < items.size(); ++i )
+	{
+		if( startItem(run, items[i]) && queued.insert(items[i].input).second )
+			waiting.push_back(i);
+	}
+
+	// the bytes admitted over time, for their mean
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point changed = start;
+	double reservedSeconds = 0;
+
+	auto account = [&]{
+		reservedSeconds += (reserved + kept + resident)*secondsSince(changed);
+		changed = std::chrono::steady_clock::now();
+	};
+
+	stats->memoryBudget = options.memoryBudget;
+
+	for(;;)
+	{
+		for( size_t w = 0; w < waiting.size() && w < lookahead; ++w )
+		{
+			if( footprints[waiting[w]] == unsized )
+				footprints[waiting[w]] = itemFootprint(options, items[waiting[w]], available);
+		}
+
+		while( running < workers && !waiting.empty() && run.logged )
+		{
+			size_t chosen = waiting.size();
+
+			for( size_t w = 0; w < waiting.size() && w < lookahead && (w == 0 || passed < lookahead); ++w )
+			{
+				if( reserved + kept + footprints[waiting[w]] <= available )
+				{
+					chosen = w;
+					break;
+				}
+			}
+
+			if( chosen == waiting.size() )
+				break;
+
+			if( chosen > 0 )
+			{
+				++passed;
+				++stats->backfilled;
+			}
+			else
+				passed = 0;
+
+			BatchJob* job = new BatchJob();
+			job->item = waiting[chosen];
+			job->reserved = footprints[job->item];
+			job->bytes = 0;
+			job->finished = false;
+			job->seconds = 0;
+			job->kept = 0;
+			job->output.ticket = 0;
+
+			waiting.erase(waiting.begin() + chosen);
+
+			if( options.files != NULL )
+				options.files->take(items[job->item].input, job->buffer);
+
+			account();
+			reserved += job->reserved;
+			++running;
+
+			stats->peakRunning = std::max(stats->peakRunning, running);
+			stats->peakReserved = std::max(stats->peakReserved, reserved + kept + resident);
+
+			itemPool.enqueue([&, job]{
+				const BatchItem& item = items[job->item];
+				std::chrono::steady_clock::time_point begun = std::chrono::steady_clock::now();
+				Arena& arena = threadArena();
+				size_t before = arena.capacity();
+
+				if( encode )
+					job->finished = encodeItem(pool, images, options, item, job->buffer, job->record, &job->bytes, &job->output);
+				else
+				{
+					job->mark.resize(maxMarkLength);
+					job->finished = decodeItem(pool, images, options, item, job->buffer, &job->mark[0], &job->result, job->record);
+				}
+
+				std::vector<unsigned char>().swap(job->buffer);
+				job->seconds = secondsSince(begun);
+
+				// the memory of a large item goes back to the system instead of staying with the worker
+				if( arena.capacity() > keepArena )
+					arena.trim();
+				else
+					arena.reset();
+
+				job->kept = (long long)arena.capacity() - (long long)before;
+
+				std::unique_lock<std::mutex> lock(mutex);
+				finishedJobs.push_back(job);
+				jobDone.notify_one();
+			});
+		}
+
+		// the items held back for memory while a worker is free
+		if( running < workers && run.logged )
+			stats->peakWaiting = std::max(stats->peakWaiting, (unsigned int)std::min(waiting.size(), lookahead));
+
+		if( running == 0 )
+		{
+			if( waiting.empty() || !run.logged )
+				break;
+
+			const size_t item = waiting.front();
+
+			// only the arenas the idle workers keep are in the way: every worker gives its back
+			if( kept > 0 && footprints[item] <= available )
+			{
+				for( unsigned int w = 0; w < workers; ++w )
+				{
+					// each waits for the others so every worker takes exactly one
+					itemPool.enqueue([&]{
+						threadArena().trim();
+
+						std::unique_lock<std::mutex> lock(mutex);
+
+						++arrived;
+						barrier.notify_all();
+						barrier.wait(lock, [&]{ return arrived == workers; });
+
+						++left;
+						barrier.notify_all();
+					});
+				}
+
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					barrier.wait(lock, [&]{ return left == workers; });
+					arrived = left = 0;
+				}
+
+				account();
+				kept = 0;
+				continue;
+			}
+
+			fprintf(stderr,"Error: %s needs about %llu MB, more than the memory budget\n", items[item].input.c_str(), (footprints[item] + resident) >> 20);
+			++stats->failed;
+			++stats->tooLarge;
+
+			// its read ahead is given back
+			if( options.files != NULL )
+			{
+				std::vector<unsigned char> unused;
+				options.files->take(items[item].input, unused);
+			}
+
+			waiting.pop_front();
+			passed = 0;
+			continue;
+		}
+
+		std::vector<BatchJob*> jobs;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			jobDone.wait(lock, [&]{ return !finishedJobs.empty(); });
+			jobs.swap(finishedJobs);
+		}
+
+		account();
+
+		for( size_t j = 0; j < jobs.size(); ++j )
+		{
+			BatchJob* job = jobs[j];
+
+			reserved -= job->reserved;
+			kept += job->kept;
+			--running;
+
+			stats->peakReserved = std::max(stats->peakReserved, reserved + kept + resident);
+
+			recordItem(run, items[job->item], job->finished, job->seconds, job->record, job->bytes, job->output, &job->result);
+
+			delete job;
+		}
+	}
+
+	account();
+
+	double seconds = secondsSince(start);
+
+	stats->meanReserved = seconds > 0 ? reservedSeconds / seconds : 0;
+}
+
+bool readBatchStats( const char* manifest, const char* log, unsigned int shard, unsigned int shards, BatchStats* stats )
+{
+	std::vector<BatchItem> items;
+	std::unordered_set<std::string> done;
+
+	*stats = BatchStats();
+
+	if( !readManifest(manifest, shard, shards, items) )
+		return false;
+
+	readLog(log, done, stats);
+
+	stats->items = items.size();
+	stats->wallSeconds = stats->busySeconds;
+
+	return true;
+}
+
+bool runBatch( ThreadPool& pool, ImageBackend& images, const BatchOptions& options, BatchStats* stats )
+{
+	char defaultLog[4096];
+	const char* log = options.log;
+
+	if( log == NULL )
+	{
+		if( strlen(options.manifest) + 32 > sizeof(defaultLog) )
+			return false;
+
+		batchLogPath(defaultLog, options.manifest, options.shard, options.shards);
+		log = defaultLog;
+	}
+
+	std::vector<BatchItem> items;
+	std::unordered_set<std::string> done;
+
+	*stats = BatchStats();
+
+	if( !readManifest(options.manifest, options.shard, options.shards, items) )
+	{
+		fprintf(stderr,"Error: could not open file %s\n", options.manifest);
+		return false;
+	}
+
+	readLog(log, done, stats);
+
+	stats->items = items.size();
+	stats->resumed = stats->completed;
+
+	FILE* fp = fopen(log, "ab+");
+
+	if( fp == NULL )
+	{
+		fprintf(stderr,"Error: could not open file %s\n", log);
+		return false;
+	}
+
+	// a record cut short by an earlier run is ended, so the next one starts on a line of its own
+	bool cutShort = fseek(fp, -1, SEEK_END) == 0 && fgetc(fp) != '\n';
+
+	fseek(fp, 0, SEEK_END);
+
+	if( cutShort )
+		fputc('\n', fp);
+
+	BatchRun run;
+	run.options = &options;
+	run.fp = fp;
+	run.log = log;
+	run.stats = stats;
+	run.done.swap(done);
+	run.logged = true;
+
+	bool encode = options.mark != NULL;
+
+	// the inputs still to do are read ahead in the order they come, once each: a read that is never
+	// taken would keep its place in the budget
+	if( options.files != NULL )
+	{
+		std::unordered_set<std::string> prefetched;
+
+		for( size_t i = 0; i < items.size(); ++i )
+		{
+			if( run.done.count(items[i].input) == 0 && (!encode || !items[i].output.empty()) && prefetched.insert(items[i].input).second )
+				options.files->prefetch(items[i].input);
+		}
+	}
+
+	// the time of the items in the log, and of this run
+	const double resumedSeconds = stats->busySeconds;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if( options.memoryBudget > 0 )
+	{
+		runWithinBudget(pool, images, items, run);
+	}
+	else
+	{
+		// the decoders write into the mark, and the arena is rewound after every item
+		std::vector<unsigned char> mark(maxMarkLength);
+		DecodeResult* result = new DecodeResult();
+
+		for( size_t i = 0; i < items.size() && run.logged; ++i )
+		{
+			const BatchItem& item = items[i];
+
+			if( !startItem(run, item) )
+				continue;
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			std::vector<unsigned char> buffer;
+			std::string record;
+			unsigned long long bytes = 0;
+			PendingOutput output;
+			bool finished;
+
+			if( options.files != NULL )
+				options.files->take(item.input, buffer);
+
+			{
+				ArenaScope scope(threadArena());
+
+				if( encode )
+					finished = encodeItem(pool, images, options, item, buffer, record, &bytes, &output);
+				else
+					finished = decodeItem(pool, images, options, item, buffer, &mark[0], result, record);
+			}
+
+			recordItem(run, item, finished, secondsSince(start), record, bytes, output, result);
+		}
+
+		delete result;
+	}
+
+	if( !run.pending.empty() )
+		finishOutputs(*options.files, run.pending, true, fp, log, stats);
+
+	fclose(fp);
+
+	// items that ran side by side overlap
+	stats->wallSeconds = options.memoryBudget > 0 ? resumedSeconds + secondsSince(start) : stats->busySeconds;
+
+	return true;
+}
+
+void mergeBatchStats( BatchStats& stats, const BatchStats& other )
+{
+	stats.items += other.items;
+	stats.completed += other.completed;
+	stats.resumed += other.resumed;
+	stats.failed += other.failed;
+	stats.bytes += other.bytes;
+	stats.busySeconds += other.busySeconds;
+
+	// the shards run side by side
+	if( other.wallSeconds > stats.wallSeconds )
+		stats.wallSeconds = other.wallSeconds;
+
+	mergeDecodeAggregate(stats.decodes, other.decodes);
+
+	// and so do their budgets
+	stats.memoryBudget += other.memoryBudget;
+	stats.peakReserved += other.peakReserved;
+	stats.meanReserved += other.meanReserved;
+	stats.peakRunning += other.peakRunning;
+	stats.peakWaiting = std::max(stats.peakWaiting, other.peakWaiting);
+	stats.backfilled += other.backfilled;
+	stats.tooLarge += other.tooLarge;
+}
+
+void writeBatchStatsJson( FILE* file, const char* shard, const BatchStats& stats )
+{
+	double wall = stats.wallSeconds > 0 ? stats.wallSeconds : 1.0;
+
+	fprintf(file, "{\"shard\":\"%s\",\"items\":%llu,\"completed\":%llu,\"remaining\":%llu,\"resumed\":%llu,\"failed\":%llu",
+	        shard, stats.items, stats.completed, stats.items > stats.completed ? stats.items - stats.completed : 0, stats.resumed, stats.failed);
+	fprintf(file, ",\"busySeconds\":%.3f,\"wallSeconds\":%.3f,\"itemsPerSecond\":%.2f,\"outputMBPerSecond\":%.2f",
+	        stats.busySeconds, stats.wallSeconds, stats.completed / wall, stats.bytes / (1024.0*1024.0) / wall);
+
+	if( stats.memoryBudget > 0 )
+	{
+		fprintf(file, ",\"memory\":{\"budgetMB\":%.1f,\"peakMB\":%.1f,\"meanMB\":%.1f,\"peakRunning\":%u,\"peakWaiting\":%u,\"backfilled\":%llu,\"tooLarge\":%llu}",
+		        stats.memoryBudget / (1024.0*1024.0), stats.peakReserved / (1024.0*1024.0), stats.meanReserved / (1024.0*1024.0),
+		        stats.peakRunning, stats.peakWaiting, stats.backfilled, stats.tooLarge);
+	}
+
+	if( stats.decodes.images > 0 )
+	{
+		fprintf(file, ",\"decodes\":");
+		writeDecodeAggregateJson(file, stats.decodes, false);
+	}
+
+	fprintf(file, "}\n");
+}
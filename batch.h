@@ -0,0 +1,88 @@
+// Author: Jonathan Decker
+// Description: Resumable batch runs over a manifest of images, split into shards for several processes
+//
+// A manifest has one item per line: "input<TAB>output" to encode, or just "input" to decode. Blank lines
+// and lines starting with # are skipped. Each shard keeps an append-only checkpoint log of the items it
+// has finished, so a run that stops for any reason picks up where the log ends.
+
+#pragma once
+
+#include <stdio.h>
+
+#include "wavescribe.h"
+
+class ThreadPool;
+class ImageBackend;
+class ResultCache;
+class AsyncFiles;
+
+struct BatchOptions
+{
+	const char* manifest;
+	const char* log;          // NULL for batchLogPath(manifest, shard, shards)
+	unsigned int shard;       // 0 to shards - 1
+	unsigned int shards;
+	unsigned char* mark;      // NULL to decode
+	const char* message;      // the message of mark, for cache keys
+	double markStrength;
+	Codec codec;
+	bool tiled;
+	unsigned int quorum;      // tiled decodes
+	bool json;                // print every decode result
+	ResultCache* cache;       // optional
+	AsyncFiles* files;        // optional, reads the inputs ahead and writes the outputs behind
+
+	// bytes; 0 runs the items one after the other, otherwise up to one per pool worker side by side
+	// while the memory estimated from their headers fits
+	unsigned long long memoryBudget;
+};
+
+// what the checkpoint logs say about one shard, or about all of them once merged
+struct BatchStats
+{
+	BatchStats();
+
+	unsigned long long items;      // manifest items in the shard
+	unsigned long long completed;  // items in the log
+	unsigned long long resumed;    // of those, finished before this run and skipped by it
+	unsigned long long failed;     // items that failed in this run, they are tried again by the next
+	unsigned long long bytes;      // output file bytes of the completed encodes
+	double busySeconds;            // time spent on the completed items
+	double wallSeconds;            // busySeconds of the slowest shard once merged
+	DecodeAggregate decodes;       // every decode in the log
+
+	// runs with a memory budget, zero otherwise (the logs do not keep them)
+	unsigned long long memoryBudget;   // bytes
+	unsigned long long peakReserved;   // most bytes admitted at once: items running, arenas kept, tile planes
+	double meanReserved;               // bytes admitted, averaged over the run
+	unsigned int peakRunning;          // most items running at once
+	unsigned int peakWaiting;          // most items held back for memory while a worker was free
+	unsigned long long backfilled;     // items started ahead of one waiting for memory
+	unsigned long long tooLarge;       // items larger than the whole budget, counted as failed too
+};
+
+// "i/N" with i < N
+bool parseShard( const char* text, unsigned int* shard, unsigned int* shards );
+
+// The shard of an item is a hash of its input path, so it does not move when the manifest is reordered
+// or grows; the shards are only as even as the hash makes them
+unsigned int shardOf( const char* input, unsigned int shards );
+
+// "<manifest>.<shard>-of-<shards>.log", written to path (of at least strlen(manifest) + 32 bytes)
+void batchLogPath( char* path, const char* manifest, unsigned int shard, unsigned int shards );
+
+// Processes the items of one shard that are not in its log yet, one after the other (tiled items use
+// the pool). An output is written under a temporary name, then renamed, and its CRC-32 logged; the log
+// is flushed after every item. With files, the inputs are read ahead in manifest order and an output is
+// logged once its write behind is over, so the log only ever names complete files. With a memory budget
+// the items run side by side and are logged as they finish. Returns false if the manifest or the log
+// cannot be opened
+bool runBatch( ThreadPool& pool, ImageBackend& images, const BatchOptions& options, BatchStats* stats );
+
+// the stats of a shard from the manifest and its log, without running anything
+bool readBatchStats( const char* manifest, const char* log, unsigned int shard, unsigned int shards, BatchStats* stats );
+
+void mergeBatchStats( BatchStats& stats, const BatchStats& other );
+
+// one JSON object per line, shard is printed as given ("0/4", "all")
+void writeBatchStatsJson( FILE* file, const char* shard, const BatchStats& stats );
@@ -0,0 +1,70 @@
+// Author: Jonathan Decker
+// Description: Compile-time mark geometry and Reed-Solomon parameters of the codec presets
+
+#pragma once
+
+#include <cstddef>
+
+// A MarkSize x MarkSize mark is carried by the LH and HL bands of the Levels-th wavelet level,
+// one group of four coefficients per bit, and holds one RS(CodeLength, CodeLength-FecLength) codeword.
+// Everything the codec derives from these is a compile-time constant of the instantiation
+template<unsigned int MarkSize, unsigned int Levels, std::size_t CodeLength, std::size_t FecLength>
+struct CodecConfig
+{
+	static constexpr unsigned int markSize = MarkSize;
+	static constexpr unsigned int markLength = MarkSize*MarkSize;
+	static constexpr unsigned int levels = Levels;
+
+	// side of the LH/HL cell holding the mark, and of the tile whose transform produces that cell
+	static constexpr unsigned int levelSize = MarkSize*2;
+	static constexpr unsigned int tileSize = levelSize << Levels;
+
+	static constexpr std::size_t codeLength = CodeLength;
+	static constexpr std::size_t fecLength = FecLength;
+	static constexpr std::size_t dataLength = CodeLength - FecLength;
+
+	// bytes laid out in the mark by the zig-zag pattern, the codeword is zero padded up to it
+	static constexpr unsigned int matrixBytes = markLength/8;
+
+	// a tile agrees with the combined mark when it differs in no more bits than the code can always correct
+	static constexpr unsigned int agreeBits = (unsigned int)(FecLength/2);
+
+	// capacity mode: the LH/HL bands of the level below the mark hold four times its groups, and the
+	// bits of both levels carry capacityBlocks codewords interleaved symbol by symbol
+	static constexpr unsigned int capacityBits = 5*MarkSize*MarkSize;
+	static constexpr unsigned int capacityBlocks = (unsigned int)(capacityBits/8/CodeLength);
+
+	// identifies the code a cached mark was built with
+	static constexpr unsigned int codeId = (unsigned int)((MarkSize << 24) | (CodeLength << 12) | FecLength);
+
+	static_assert(MarkSize % 4 == 0, "the zig-zag layout works on 2x4 blocks of bits");
+	static_assert(CodeLength <= 255, "codewords are over GF(256)");
+	static_assert(FecLength < CodeLength, "a code needs data symbols");
+	static_assert(CodeLength <= markLength/8, "the codeword must fit in the mark");
+	static_assert(Levels >= 2, "capacity mode needs the level below the mark");
+};
+
+// definitions for when a constant is bound to a reference (C++11 has no inline variables)
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::markSize;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::markLength;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::levels;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::levelSize;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::tileSize;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr std::size_t CodecConfig<M,L,C,F>::codeLength;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr std::size_t CodecConfig<M,L,C,F>::fecLength;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr std::size_t CodecConfig<M,L,C,F>::dataLength;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::matrixBytes;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::agreeBits;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::capacityBits;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::capacityBlocks;
+template<unsigned int M, unsigned int L, std::size_t C, std::size_t F> constexpr unsigned int CodecConfig<M,L,C,F>::codeId;
+
+// 32 byte payload in a 512x512 tile, corrects up to 48 byte errors (the original codec)
+typedef CodecConfig<32, 3, 128, 96>  StandardCodec;
+
+// 64 byte payload in the same mark, corrects up to 32 byte errors
+typedef CodecConfig<32, 3, 128, 64>  LongCodec;
+
+// 128 byte payload in a 1024x1024 tile, corrects up to 64 byte errors. The codeword fills half
+// the 64x64 mark, the rest carries zero bits
+typedef CodecConfig<64, 3, 255, 127> LargeCodec;
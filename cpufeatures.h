@@ -0,0 +1,66 @@
+// Author: Jonathan Decker
+// Description: Run time checks for the x86 vector extensions used by the batched kernels
+//
+// The kernels for an extension are compiled with a target attribute, so a default build carries
+// them and picks the widest one the CPU (and the OS, for the wide registers) supports.
+// MSVC accepts the intrinsics in any function and checks CPUID directly.
+
+#pragma once
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+	#define CPU_X86
+	#define TARGET_SSSE3      __attribute__((target("ssse3")))
+	#define TARGET_AVX        __attribute__((target("avx")))
+	#define TARGET_AVX2       __attribute__((target("avx2")))
+	#define TARGET_AVX512VBMI __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+
+	static inline bool cpuHasSsse3()      { __builtin_cpu_init(); return __builtin_cpu_supports("ssse3") != 0; }
+	static inline bool cpuHasAvx()        { __builtin_cpu_init(); return __builtin_cpu_supports("avx") != 0; }
+	static inline bool cpuHasAvx2()       { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") != 0; }
+	static inline bool cpuHasAvx512Vbmi()
+	{
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi");
+	}
+
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+
+	#include <intrin.h>
+
+	#define CPU_X86
+	#define TARGET_SSSE3
+	#define TARGET_AVX
+	#define TARGET_AVX2
+	#define TARGET_AVX512VBMI
+
+	// register r (0-3 for eax-edx) of CPUID leaf, 0 when the leaf does not exist
+	static inline unsigned int cpuidRegister( int leaf, int r )
+	{
+		int info[4];
+
+		__cpuid(info, 0);
+		if( info[0] < leaf )
+			return 0;
+
+		__cpuidex(info, leaf, 0);
+		return (unsigned int)info[r];
+	}
+
+	// the OS saves every state component of mask on a context switch
+	static inline bool osSavesState( unsigned long long mask )
+	{
+		return (cpuidRegister(1, 2) & (1u << 27)) && (_xgetbv(0) & mask) == mask;
+	}
+
+	static inline bool cpuHasSsse3()      { return (cpuidRegister(1, 2) & (1u << 9)) != 0; }
+	static inline bool cpuHasAvx()        { return (cpuidRegister(1, 2) & (1u << 28)) && osSavesState(0x06); }
+	static inline bool cpuHasAvx2()       { return (cpuidRegister(7, 1) & (1u << 5)) && cpuHasAvx(); }
+	static inline bool cpuHasAvx512Vbmi()
+	{
+		const unsigned int foundationBw = (1u << 16) | (1u << 30);
+
+		return (cpuidRegister(7, 1) & foundationBw) == foundationBw && (cpuidRegister(7, 2) & (1u << 1)) && osSavesState(0xe6);
+	}
+
+#endif
@@ -0,0 +1,839 @@
+// Author: Jonathan Decker
+// Usage:  WaveScribeDifferential [image ...]
+// Description: Checks every fast path against the original scalar code kept in reference.cpp
+//
+// Everything has to match the reference bit for bit, except the fixed point YCbCr luma, which replaces
+// the original's double precision one:
+// - lumaRow is within 1/256 of an L unit of the BT.601 luma (scaled to 0..100) for every 24 bit colour
+// - setLumaRow leaves each channel within one level of the original conversion rounded to the nearest
+//   level, for the channels that conversion does not clamp
+// Inputs are random and adversarial: ties and flat groups (delta == 0) for the group kernels, denormal
+// and huge coefficients, saturated and flat images. Images given on the command line join the corpus.
+// Marks and decode results also have to be the same at every thread count
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <thread>
+#include <vector>
+
+#include "wavescribe.h"
+#include "threadpool.h"
+#include "quadsimd.h"
+#include "wavelet.h"
+#include "imageio.h"
+#include "ycbcr.h"
+#include "reference.h"
+
+extern "C"
+{
+	#include "dwt.h"
+}
+
+// the scalar sort of the group kernels, in wavescribe.cpp
+void sortVec4( double* c, unsigned int* i );
+
+static int failures = 0;
+
+static void check( bool condition, const char* name )
+{
+	printf("%s : %s\n", condition ? "PASS" : "FAIL", name);
+
+	if( !condition )
+		++failures;
+}
+
+static bool sameBits( const double* a, const double* b, size_t count )
+{
+	return memcmp(a, b, sizeof(double)*count) == 0;
+}
+
+// Groups of four coefficients: every pattern of ties among 0, 1 and 2, signed zeros, flat groups,
+// denormals, huge values and random ones
+static std::vector<double> testGroups()
+{
+	static const double small[] = { 0.0, 1.0, 2.0 };
+	std::vector<double> groups;
+
+	for( unsigned int t = 0; t < 81; ++t )
+		for( unsigned int k = 0, d = t; k < 4; ++k, d /= 3 )
+			groups.push_back(small[d % 3]);
+
+	const double special[][4] = { { 0.0, -0.0, 0.0, -0.0 }, { -0.0, 1.0, -0.0, 1.0 }, { 7.5, 7.5, 7.5, 7.5 },
+	                              { -3.25, -3.25, -3.25, -3.25 }, { DBL_MIN, 0.0, DBL_MIN/4, -DBL_MIN },
+	                              { 4.9e-324, 0.0, 9.9e-324, 0.0 }, { 1e150, -1e150, 3e149, 0.0 },
+	                              { 1e-300, 2e-300, 3e-300, 4e-300 }, { 100.0, 0.0, 100.0, 0.0 } };
+
+	for( size_t s = 0; s < sizeof(special)/sizeof(special[0]); ++s )
+		groups.insert(groups.end(), special[s], special[s] + 4);
+
+	srand(49);
+
+	for( unsigned int g = 0; g < 4000; ++g )
+	{
+		for( unsigned int k = 0; k < 4; ++k )
+		{
+			switch( g % 4 )
+			{
+			case 0:  groups.push_back((rand() - RAND_MAX/2) / 1000.0); break;
+			case 1:  groups.push_back((double)(rand() % 4) - 1.5); break;
+			case 2:  groups.push_back(k == 3 ? (rand() % 1000) / 7.0 : 1.0); break;
+			default: groups.push_back(ldexp((double)(rand() % 64), (rand() % 200) - 100)); break;
+			}
+		}
+	}
+
+	return groups;
+}
+
+static const double testStrengths[] = { 0.01, 0.05, 0.5, 1.0, 2.0, 10.0 };
+
+static void checkSortVec4()
+{
+	std::vector<double> groups = testGroups();
+	bool same = true;
+
+	// every order of four distinct values as well
+	for( unsigned int p = 0; p < 256; ++p )
+	{
+		unsigned int a = p & 3, b = (p >> 2) & 3, c = (p >> 4) & 3, d = (p >> 6) & 3;
+
+		if( a != b && a != c && a != d && b != c && b != d && c != d )
+		{
+			groups.push_back(a);
+			groups.push_back(b);
+			groups.push_back(c);
+			groups.push_back(d);
+		}
+	}
+
+	for( size_t g = 0; g < groups.size(); g += 4 )
+	{
+		double v1[4], v2[4];
+		unsigned int i1[4], i2[4];
+
+		memcpy(v1, &groups[g], sizeof(v1));
+		memcpy(v2, &groups[g], sizeof(v2));
+
+		sortVec4(v1, i1);
+		referenceSortVec4(v2, i2);
+
+		same = same && sameBits(v1, v2, 4) && memcmp(i1, i2, sizeof(i1)) == 0;
+	}
+
+	check(same, "sortVec4 orders values and ties like the reference");
+}
+
+// the scalar and the batched group kernels against the reference, groups scattered through the plane
+static void checkGroupKernels()
+{
+	std::vector<double> groups = testGroups();
+	const unsigned int count = (unsigned int)(groups.size() / 4);
+
+	std::vector<double> reference(groups.size()), scalar(groups.size()), batched(groups.size());
+	std::vector<unsigned int> indices(groups.size());
+	std::vector<unsigned char> mark(count);
+	std::vector<double> distance1(count), distance2(count), distance3(count);
+
+	bool encodeSame = true, batchedEncodeSame = true, distanceSame = true, batchedDistanceSame = true;
+
+	for( unsigned int g = 0; g < count; ++g )
+	{
+		for( unsigned int k = 0; k < 4; ++k )
+			indices[g*4+k] = k*count + g;
+
+		mark[g] = (g / 3) & 1;
+	}
+
+	for( size_t s = 0; s < sizeof(testStrengths)/sizeof(testStrengths[0]); ++s )
+	{
+		const double strength = testStrengths[s];
+
+		for( unsigned int g = 0; g < count; ++g )
+			for( unsigned int k = 0; k < 4; ++k )
+				reference[indices[g*4+k]] = groups[g*4+k];
+
+		scalar = batched = reference;
+
+		unsigned int done = encodeQuadsBatched(&batched[0], &indices[0], &mark[0], count, strength);
+
+		for( unsigned int g = 0; g < count; ++g )
+		{
+			double v1[4], v2[4];
+			unsigned int i1[4], i2[4];
+
+			for( unsigned int k = 0; k < 4; ++k )
+				v1[k] = v2[k] = reference[indices[g*4+k]];
+
+			referenceEncodeBit(v1, i1, mark[g], strength);
+			encodeBit(v2, i2, mark[g], strength);
+
+			encodeSame = encodeSame && sameBits(v1, v2, 4) && memcmp(i1, i2, sizeof(i1)) == 0;
+
+			for( unsigned int k = 0; k < 4; ++k )
+				reference[indices[g*4+i1[k]]] = v1[k];
+
+			// the groups past the last whole batch are left to the scalar kernel
+			if( g >= done )
+				for( unsigned int k = 0; k < 4; ++k )
+					batched[indices[g*4+k]] = reference[indices[g*4+k]];
+		}
+
+		batchedEncodeSame = batchedEncodeSame && sameBits(&reference[0], &batched[0], reference.size());
+
+		// distances of the marked groups and of the original ones
+		for( int pass = 0; pass < 2; ++pass )
+		{
+			if( pass == 1 )
+				for( unsigned int g = 0; g < count; ++g )
+					for( unsigned int k = 0; k < 4; ++k )
+						reference[indices[g*4+k]] = groups[g*4+k];
+
+			done = quadDistancesBatched(&reference[0], &indices[0], &distance3[0], count, strength);
+
+			for( unsigned int g = 0; g < count; ++g )
+			{
+				double v1[4], v2[4];
+
+				for( unsigned int k = 0; k < 4; ++k )
+					v1[k] = v2[k] = reference[indices[g*4+k]];
+
+				distance1[g] = referenceGetDistance(v1, strength);
+				distance2[g] = getDistance(v2, strength);
+
+				if( g >= done )
+					distance3[g] = distance1[g];
+			}
+
+			distanceSame = distanceSame && sameBits(&distance1[0], &distance2[0], count);
+			batchedDistanceSame = batchedDistanceSame && sameBits(&distance1[0], &distance3[0], count);
+		}
+	}
+
+	check(encodeSame, "encodeBit matches the reference");
+	check(batchedEncodeSame, "batched encodeBit matches the reference");
+	check(distanceSame, "getDistance matches the reference");
+	check(batchedDistanceSame, "batched getDistance matches the reference");
+
+	// distances on and halfway between integers, where the rounding of the vote decides
+	const unsigned int distances = 4096;
+	std::vector<double> first(distances), second(distances), soft1(distances), soft2(distances), soft3(distances);
+	std::vector<unsigned char> bits1(distances), bits3(distances);
+
+	for( unsigned int i = 0; i < distances; ++i )
+	{
+		switch( i % 4 )
+		{
+		case 0:  first[i] = (int)(i % 81) - 40 + 0.5; break;
+		case 1:  first[i] = (int)(i % 81) - 40; break;
+		case 2:  first[i] = i % 8 < 4 ? 0.0 : -0.0; break;
+		default: first[i] = (rand() - RAND_MAX/2) / (RAND_MAX/80.0); break;
+		}
+
+		second[distances - 1 - i] = first[i];
+	}
+
+	unsigned int done = fuzzyMeanBatched(&first[0], &second[0], &bits3[0], &soft3[0], distances);
+
+	for( unsigned int i = 0; i < distances; ++i )
+	{
+		soft1[i] = referenceFuzzyMean(first[i], second[i]);
+		soft2[i] = fuzzyMean(first[i], second[i]);
+		bits1[i] = soft1[i] < 0 ? 0 : 1;
+
+		if( i >= done )
+		{
+			soft3[i] = soft1[i];
+			bits3[i] = bits1[i];
+		}
+	}
+
+	check(sameBits(&soft1[0], &soft2[0], distances), "fuzzy mean matches the reference");
+	check(sameBits(&soft1[0], &soft3[0], distances) && bits1 == bits3, "batched fuzzy mean matches the reference");
+}
+
+// three levels of the CDF 9/7 policy against fwt97 and iwt97 rows then columns
+static void checkTransform()
+{
+	const unsigned int sizes[][2] = { { 512, 512 }, { 64, 32 }, { 32, 256 } };
+	bool forwardSame = true, inverseSame = true;
+
+	srand(97);
+
+	for( size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s )
+	{
+		const unsigned int width = sizes[s][0], height = sizes[s][1];
+		std::vector<double> plane(width*height), reference, scratch(Cdf97Wavelet::scratchSize(width, height));
+
+		for( int kind = 0; kind < 5; ++kind )
+		{
+			for( unsigned int i = 0; i < width*height; ++i )
+			{
+				unsigned int x = i % width, y = i / width;
+
+				switch( kind )
+				{
+				case 0:  plane[i] = (rand() % 10001) / 100.0; break;            // luminance noise
+				case 1:  plane[i] = 42.0; break;                                 // flat
+				case 2:  plane[i] = i == width*height/2 + width/2 ? 100.0 : 0.0; break; // impulse
+				case 3:  plane[i] = (x + y) & 1 ? 100.0 : -100.0; break;        // checkerboard
+				default: plane[i] = 1e6 * x - 3e5 * y; break;                    // steep ramp
+				}
+			}
+
+			reference = plane;
+
+			for( unsigned int k = 0; k < 3; ++k )
+				Cdf97Wavelet::forward(&plane[0], &scratch[0], width >> k, height >> k, width);
+
+			referenceDecompose(&reference[0], 3, width, height);
+			forwardSame = forwardSame && sameBits(&plane[0], &reference[0], plane.size());
+
+			for( unsigned int k = 3; k > 0; --k )
+				Cdf97Wavelet::inverse(&plane[0], &scratch[0], width >> (k-1), height >> (k-1), width);
+
+			referenceReconstruct(&reference[0], 3, width, height);
+			inverseSame = inverseSame && sameBits(&plane[0], &reference[0], plane.size());
+		}
+	}
+
+	check(forwardSame, "CDF 9/7 forward transform matches the reference");
+	check(inverseSame, "CDF 9/7 inverse transform matches the reference");
+}
+
+static void checkYCbCrTolerance()
+{
+	const unsigned int row = 4096;
+	std::vector<unsigned int> pixels(row);
+	std::vector<int> luma(row);
+	double worst = 0;
+
+	for( unsigned int base = 0; base < (1u << 24); base += row )
+	{
+		for( unsigned int i = 0; i < row; ++i )
+			pixels[i] = (base + i) | 0xff000000u;
+
+		lumaRow(&pixels[0], row, &luma[0]);
+
+		for( unsigned int i = 0; i < row; ++i )
+		{
+			double error = fabs(luma[i] / (double)(1 << lumaFractionBits) - referenceYCbCrLuma(pixels[i]) * 100.0/255.0);
+
+			if( error > worst )
+				worst = error;
+		}
+	}
+
+	printf("     largest luma error %.5f\n", worst);
+	check(worst <= 1.0/256, "fixed point luma within 1/256 of the reference for every colour");
+
+	// lumas up to 20 L units either way of the current one
+	std::vector<unsigned int> written(row);
+	std::vector<int> target(row);
+	int farthest = 0;
+
+	srand(601);
+
+	for( unsigned int pass = 0; pass < 256; ++pass )
+	{
+		for( unsigned int i = 0; i < row; ++i )
+			pixels[i] = ((((unsigned int)rand() << 12) ^ (unsigned int)rand()) & 0xffffff) | ((unsigned int)(rand() & 0xff) << 24);
+
+		lumaRow(&pixels[0], row, &luma[0]);
+
+		for( unsigned int i = 0; i < row; ++i )
+			target[i] = luma[i] + (int)(rand() % (40 << lumaFractionBits)) - (20 << lumaFractionBits);
+
+		written = pixels;
+		setLumaRow(&written[0], row, &target[0]);
+
+		for( unsigned int i = 0; i < row; ++i )
+		{
+			unsigned int expected = referenceSetYCbCrLuma(pixels[i], target[i] / (double)(1 << lumaFractionBits) * 255.0/100.0);
+
+			if( (written[i] >> 24) != (pixels[i] >> 24) )
+				farthest = 256;
+
+			for( unsigned int c = 0; c < 24; c += 8 )
+			{
+				int a = (written[i] >> c) & 0xff, b = (expected >> c) & 0xff;
+
+				if( b != 0 && b != 255 && abs(a - b) > farthest )
+					farthest = abs(a - b);
+			}
+		}
+	}
+
+	check(farthest <= 1, "fixed point luma write back within one level of the reference, alpha kept");
+}
+
+static const char* testMessages[] = { "", "A", "Hello WaveScribe", "0123456789abcdefghijklmnopqrstuv",
+                                      "                                ", "~~~~~~~~", "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}" };
+
+static void checkMessages()
+{
+	const unsigned int messages = sizeof(testMessages)/sizeof(testMessages[0]);
+	bool encodeSame = true, decodeSame = true;
+
+	srand(128);
+
+	for( unsigned int m = 0; m < messages; ++m )
+	{
+		unsigned char reference[32*32], cached[32*32], original[32*32];
+
+		referenceEncodeMessage(testMessages[m], reference);
+		encodeMessageMark(testMessages[m], cached);
+		encodeStringIntoBinaryMatrix(testMessages[m], original, 32, 32);
+
+		encodeSame = encodeSame && memcmp(reference, cached, sizeof(cached)) == 0 && memcmp(reference, original, sizeof(original)) == 0;
+
+		// up to the 48 symbols RS(128,96) corrects and beyond, the failures on purpose are not reported
+		setDecodeFailureReports(false);
+
+		for( unsigned int flips = 0; flips <= 640; flips += 16 )
+		{
+			unsigned char corrupted[32*32];
+			char text1[33], text2[maxPayloadLength+1];
+
+			memcpy(corrupted, reference, sizeof(corrupted));
+
+			for( unsigned int f = 0; f < flips; ++f )
+				corrupted[rand() % (32*32)] ^= 1;
+
+			bool decoded1 = referenceDecodeMessage(corrupted, text1);
+			bool decoded2 = decodeMessageMark(corrupted, text2);
+
+			decodeSame = decodeSame && decoded1 == decoded2 && strcmp(text1, text2) == 0;
+		}
+
+		setDecodeFailureReports(true);
+	}
+
+	check(encodeSame, "message marks match the reference");
+	check(decodeSame, "messages read from corrupted marks match the reference");
+}
+
+struct TestImage
+{
+	TestImage() : name(""), width(0), height(0), lossesKnown(false) {}
+
+	const char* name;
+	int width;
+	int height;
+	std::vector<unsigned int> pixels;
+
+	// the codecs whose tiled marks at strength 0.5 do not survive 8-bit rounding on this image,
+	// known for the generated images only; every other codec has to read its message back
+	bool lossesKnown;
+	std::vector<Codec> lost;
+};
+
+static bool isLost( const TestImage& image, const Codec& codec )
+{
+	for( size_t l = 0; l < image.lost.size(); ++l )
+		if( image.lost[l].preset == codec.preset && image.lost[l].wavelet == codec.wavelet && image.lost[l].space == codec.space )
+			return true;
+
+	return false;
+}
+
+static unsigned int rgba( unsigned int r, unsigned int g, unsigned int b, unsigned int a = 255 )
+{
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+// Generated images of one tile: textures, noise, flat and saturated areas, images padded to the tile
+static std::vector<TestImage> generatedImages()
+{
+	std::vector<TestImage> images;
+	const char* names[] = { "textured", "noise", "flat grey", "black", "white", "checkerboard", "gradient", "textured 512x384", "noise 384x512", "random alpha" };
+
+	srand(512);
+
+	for( int kind = 0; kind < 10; ++kind )
+	{
+		TestImage image;
+		image.name = names[kind];
+		image.width = kind == 8 ? 384 : 512;
+		image.height = kind == 7 ? 384 : 512;
+		image.pixels.resize(image.width*image.height);
+
+		for( int y = 0; y < image.height; ++y )
+		{
+			for( int x = 0; x < image.width; ++x )
+			{
+				unsigned int& p = image.pixels[y*image.width + x];
+
+				switch( kind )
+				{
+				case 0: case 7:
+					p = rgba((unsigned int)(128 + 60*sin(x/5.0)*cos(y/3.7) + 30*sin(x*y/900.0)), (unsigned int)(128 + 50*sin((x+y)/31.0)), (unsigned int)(120 + 80*sin(x/41.0 + y/29.0)));
+					break;
+				case 1: case 8: p = rgba(rand() & 0xff, rand() & 0xff, rand() & 0xff); break;
+				case 2: p = rgba(128, 128, 128); break;
+				case 3: p = rgba(0, 0, 0); break;
+				case 4: p = rgba(255, 255, 255); break;
+				case 5: p = ((x / 8) + (y / 8)) & 1 ? rgba(255, 255, 255) : rgba(0, 0, 0); break;
+				case 6: p = rgba(x / 2, y / 2, (x + y) / 4); break;
+				default: p = rgba(rand() & 0xff, (x*y) & 0xff, 200, rand() & 0xff); break;
+				}
+			}
+		}
+
+		images.push_back(image);
+	}
+
+	return images;
+}
+
+// the top left tile of an image read from a file, the whole image for the tiled checks
+static bool loadImage( const char* path, TestImage& image )
+{
+	ImageBackend* backend = createStbBackend();
+	unsigned int* pixels = backend->load(path, &image.width, &image.height);
+
+	if( pixels != NULL )
+	{
+		image.name = path;
+		image.pixels.assign(pixels, pixels + (size_t)image.width*image.height);
+		backend->release(pixels);
+	}
+
+	delete backend;
+
+	return pixels != NULL;
+}
+
+static TestImage topLeftTile( const TestImage& image )
+{
+	TestImage tile;
+	tile.name = image.name;
+	tile.width = image.width < 512 ? image.width : 512;
+	tile.height = image.height < 512 ? image.height : 512;
+
+	for( int y = 0; y < tile.height; ++y )
+		tile.pixels.insert(tile.pixels.end(), &image.pixels[(size_t)y*image.width], &image.pixels[(size_t)y*image.width] + tile.width);
+
+	return tile;
+}
+
+// Encodes and decodes images of one tile like the original: the marked pixels, the bits read back and the message
+static void checkSingleTile( const std::vector<TestImage>& images )
+{
+	const double strengths[] = { 0.2, 0.5, 2.0 };
+
+	unsigned char mark[32*32];
+	encodeMessageMark("Hello WaveScribe", mark);
+
+	for( size_t m = 0; m < images.size(); ++m )
+	{
+		TestImage image = topLeftTile(images[m]);
+
+		if( image.width != 512 && image.height != 512 )
+			continue;
+
+		bool pixelsSame = true, bitsSame = true, messageSame = true;
+
+		for( size_t s = 0; s < sizeof(strengths)/sizeof(strengths[0]); ++s )
+		{
+			std::vector<unsigned int> reference = image.pixels, fast = image.pixels;
+			int width = image.width, height = image.height;
+			unsigned int* output;
+
+			referenceInsertWatermark(&reference[0], mark, width, height, strengths[s]);
+			insertWatermark(&fast[0], &output, mark, &width, &height, true, strengths[s]);
+
+			pixelsSame = pixelsSame && reference == fast;
+
+			// unmarked images too, with their flat groups; they do not decode
+			setDecodeFailureReports(false);
+
+			for( int marked = 0; marked < 2; ++marked )
+			{
+				const unsigned int* pixels = marked ? &reference[0] : &image.pixels[0];
+				unsigned char bits1[32*32], bits2[32*32];
+				char text1[33], text2[maxPayloadLength+1];
+
+				referenceDecodeWatermark(pixels, bits1, width, height, strengths[s]);
+				decodeWatermark((unsigned int*)pixels, bits2, width, height, strengths[s]);
+
+				bitsSame = bitsSame && memcmp(bits1, bits2, sizeof(bits1)) == 0;
+
+				bool decoded1 = referenceDecodeMessage(bits1, text1);
+				bool decoded2 = decodeMessageMark(bits2, text2);
+
+				messageSame = messageSame && decoded1 == decoded2 && strcmp(text1, text2) == 0;
+			}
+
+			setDecodeFailureReports(true);
+		}
+
+		char name[160];
+
+		snprintf(name, sizeof(name), "%s: marked pixels match the reference", image.name);
+		check(pixelsSame, name);
+		snprintf(name, sizeof(name), "%s: bits and message read match the reference", image.name);
+		check(bitsSame && messageSame, name);
+	}
+}
+
+// the thread counts checked: one, a few, more than there are cores
+static std::vector<unsigned int> threadCounts()
+{
+	unsigned int hardware = std::thread::hardware_concurrency();
+	unsigned int counts[] = { 1, 2, 3, 4, 8, hardware, 2*hardware + 1 };
+	std::vector<unsigned int> unique;
+
+	for( size_t c = 0; c < sizeof(counts)/sizeof(counts[0]); ++c )
+	{
+		bool seen = counts[c] == 0;
+
+		for( size_t u = 0; u < unique.size(); ++u )
+			seen = seen || unique[u] == counts[c];
+
+		if( !seen )
+			unique.push_back(counts[c]);
+	}
+
+	return unique;
+}
+
+static bool sameDecode( const DecodeResult& a, const DecodeResult& b )
+{
+	return memcmp(&a, &b, sizeof(DecodeResult)) == 0;
+}
+
+// Tiled marks of every codec, their decode and the alignment search are the same at every thread count;
+// every tile of the standard codec is marked as the reference marks it alone
+static void checkThreadCounts( const std::vector<TestImage>& images )
+{
+	const std::vector<unsigned int> counts = threadCounts();
+	static DecodeResult result1, result2;
+
+	printf("     thread counts");
+	for( size_t c = 0; c < counts.size(); ++c )
+		printf(" %u", counts[c]);
+	printf("\n");
+
+	for( size_t m = 0; m < images.size(); ++m )
+	{
+		const TestImage& image = images[m];
+
+		if( countFullTiles(image.width, image.height) == 0 )
+			continue;
+
+		bool marksSame = true, decodesSame = true, searchSame = true, tilesSame = true, keptRead = true, lostFail = true;
+
+		for( int p = 0; p < CodecPresetCount; ++p )
+		{
+			for( int w = 0; w < WaveletKindCount; ++w )
+			{
+				for( int s = 0; s < ColorSpaceCount; ++s )
+				{
+					const Codec codec((CodecPreset)p, (WaveletKind)w, (ColorSpace)s);
+					const CodecInfo& info = codecInfo(codec.preset);
+
+					if( countFullTiles(image.width, image.height, codec.preset) == 0 )
+						continue;
+
+					unsigned char mark[maxMarkLength], bits1[maxMarkLength], bits2[maxMarkLength];
+					encodeMessageMark("threads", mark, codec.preset);
+
+					std::vector<unsigned int> first;
+					bool lost = isLost(image, codec);
+
+					// the integer wavelets in Lab are the slowest, they get the ends of the range only
+					bool slow = codec.space == ColorLab && !(codec.preset == CodecStandard && codec.wavelet == WaveletCdf97);
+
+					for( size_t c = 0; c < counts.size(); ++c )
+					{
+						if( slow && c != 0 && c + 1 != counts.size() )
+							continue;
+
+						ThreadPool pool(counts[c], dwtcleanup);
+						std::vector<unsigned int> marked = image.pixels;
+
+						insertTiledWatermark(pool, &marked[0], mark, image.width, image.height, 0.5, codec);
+
+						DecodeResult& result = c == 0 ? result1 : result2;
+						unsigned char* bits = c == 0 ? bits1 : bits2;
+						memset(&result, 0, sizeof(result));
+
+						// a codec listed as lost fails to decode on purpose
+						setDecodeFailureReports(!lost);
+						decodeTiledWatermark(pool, &marked[0], bits, image.width, image.height, 0.5, 0, codec, &result);
+						setDecodeFailureReports(true);
+
+						if( image.lossesKnown && lost )
+							lostFail = lostFail && !result.decoded;
+						else if( image.lossesKnown )
+							keptRead = keptRead && result.decoded && strncmp(result.message, "threads", 7) == 0;
+
+						if( c == 0 )
+						{
+							first = marked;
+							continue;
+						}
+
+						marksSame = marksSame && marked == first;
+						decodesSame = decodesSame && memcmp(bits1, bits2, info.markSize*info.markSize) == 0 && sameDecode(result1, result2);
+					}
+
+					if( codec.preset != CodecStandard || codec.space != ColorLab || codec.wavelet != WaveletCdf97 )
+						continue;
+
+					// each full tile as the reference marks it on its own
+					for( int ty = 0; ty + 512 <= image.height; ty += 512 )
+					{
+						for( int tx = 0; tx + 512 <= image.width; tx += 512 )
+						{
+							std::vector<unsigned int> tile;
+
+							for( int y = 0; y < 512; ++y )
+								tile.insert(tile.end(), &image.pixels[(size_t)(ty + y)*image.width + tx], &image.pixels[(size_t)(ty + y)*image.width + tx] + 512);
+
+							referenceInsertWatermark(&tile[0], mark, 512, 512, 0.5);
+
+							for( int y = 0; y < 512; ++y )
+								tilesSame = tilesSame && memcmp(&tile[y*512], &first[(size_t)(ty + y)*image.width + tx], 512*sizeof(unsigned int)) == 0;
+						}
+					}
+
+					// the marked image cropped a few pixels up and left of the tile at (512, 512)
+					const int cropX = 512 - 5, cropY = 512 - 7, cropSize = 512 + 24;
+
+					if( image.width < cropX + cropSize || image.height < cropY + cropSize )
+						continue;
+
+					std::vector<unsigned int> cropped;
+
+					for( int y = 0; y < cropSize; ++y )
+						cropped.insert(cropped.end(), &first[(size_t)(cropY + y)*image.width + cropX], &first[(size_t)(cropY + y)*image.width + cropX] + cropSize);
+
+					for( size_t c = 0; c < counts.size(); ++c )
+					{
+						ThreadPool pool(counts[c], dwtcleanup);
+						DecodeResult& result = c == 0 ? result1 : result2;
+						unsigned char* bits = c == 0 ? bits1 : bits2;
+						memset(&result, 0, sizeof(result));
+
+						searchWatermark(pool, &cropped[0], bits, cropSize, cropSize, 16, 0.5, codec, &result);
+
+						if( c == 0 )
+							searchSame = searchSame && result1.decoded && result1.offsetX == 5 && result1.offsetY == 7;
+						else
+							searchSame = searchSame && memcmp(bits1, bits2, 32*32) == 0 && sameDecode(result1, result2);
+					}
+				}
+			}
+		}
+
+		char name[160];
+
+		snprintf(name, sizeof(name), "%s: tiled marks of every codec are the same at every thread count", image.name);
+		check(marksSame, name);
+		snprintf(name, sizeof(name), "%s: tiled decodes are the same at every thread count", image.name);
+		check(decodesSame, name);
+
+		if( image.lossesKnown )
+		{
+			snprintf(name, sizeof(name), "%s: every codec not listed as lost reads its message back", image.name);
+			check(keptRead, name);
+			snprintf(name, sizeof(name), "%s: the codecs listed as lost do not decode", image.name);
+			check(lostFail, name);
+		}
+
+		snprintf(name, sizeof(name), "%s: alignment search is the same at every thread count", image.name);
+		check(searchSame, name);
+		snprintf(name, sizeof(name), "%s: every tile is marked like the reference marks it alone", image.name);
+		check(tilesSame, name);
+	}
+
+	// capacity mode corrects its codewords on the pool
+	std::vector<TestImage> tiles = generatedImages();
+	const char* payload = "a capacity payload longer than a message, corrected on the pool";
+	std::vector<unsigned int> first;
+	static PayloadResult payload1, payload2;
+	bool payloadSame = true;
+
+	for( size_t c = 0; c < counts.size(); ++c )
+	{
+		ThreadPool pool(counts[c], dwtcleanup);
+		std::vector<unsigned int> marked = tiles[0].pixels;
+		PayloadResult& result = c == 0 ? payload1 : payload2;
+		memset(&result, 0, sizeof(result));
+
+		insertPayload(pool, &marked[0], 512, 512, (const unsigned char*)payload, (unsigned int)strlen(payload), 1.0);
+		decodePayload(pool, &marked[0], 512, 512, 1.0, Codec(), &result);
+
+		if( c == 0 )
+			first = marked;
+		else
+			payloadSame = payloadSame && marked == first && memcmp(&payload1, &payload2, sizeof(PayloadResult)) == 0;
+	}
+
+	check(payloadSame && payload1.decoded, "capacity payloads are the same at every thread count");
+}
+
+// a textured image of several standard tiles, one large tile and a partial border
+static TestImage tiledImage()
+{
+	TestImage image;
+	image.name = "textured 1100x1060";
+	image.width = 1100;
+	image.height = 1060;
+	image.pixels.resize(image.width*image.height);
+
+	srand(1100);
+
+	for( int y = 0; y < image.height; ++y )
+		for( int x = 0; x < image.width; ++x )
+			image.pixels[y*image.width + x] = rgba((unsigned int)(128 + 60*sin(x/5.0)*cos(y/3.7)) ^ (rand() & 7), (unsigned int)(128 + 50*sin((x+y)/31.0)), (unsigned int)(120 + 80*sin(x/41.0 + y/29.0)));
+
+	// the large tiles of every wavelet and two long codecs in YCbCr lose their mark here
+	image.lossesKnown = true;
+	image.lost.push_back(Codec(CodecLong, WaveletCdf97, ColorYCbCr));
+	image.lost.push_back(Codec(CodecLong, WaveletInteger97, ColorYCbCr));
+
+	for( int w = 0; w < WaveletKindCount; ++w )
+		for( int s = 0; s < ColorSpaceCount; ++s )
+			image.lost.push_back(Codec(CodecLarge, (WaveletKind)w, (ColorSpace)s));
+
+	return image;
+}
+
+int main( int argc, char** argv )
+{
+	std::vector<TestImage> images = generatedImages();
+	std::vector<TestImage> tiled(1, tiledImage());
+
+	for( int a = 1; a < argc; ++a )
+	{
+		TestImage image;
+
+		if( !loadImage(argv[a], image) )
+		{
+			fprintf(stderr,"Error: could not open file %s\n", argv[a]);
+			return 1;
+		}
+
+		images.push_back(image);
+		tiled.push_back(image);
+	}
+
+	checkSortVec4();
+	checkGroupKernels();
+	checkTransform();
+	checkYCbCrTolerance();
+	checkMessages();
+	checkSingleTile(images);
+	checkThreadCounts(tiled);
+
+	dwtcleanup();
+
+	printf("%d failure(s)\n", failures);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -4,4 +4,5 @@ void fwt97(double* x, int n);
 
 void iwt97(double* x,int n);
 
-void dwtcleanup();
\ No newline at end of file
+// frees the packing buffer of the calling thread
+void dwtcleanup();
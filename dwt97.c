@@ -8,7 +8,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-double *tempbank=0;
+// each thread packs into its own scratch so transforms can run concurrently
+#if defined(_MSC_VER)
+	#define DWT_THREAD_LOCAL __declspec(thread)
+#else
+	#define DWT_THREAD_LOCAL __thread
+#endif
+
+DWT_THREAD_LOCAL double *tempbank=0;
+DWT_THREAD_LOCAL int tempbanksize=0;
+
+static void reservetempbank(int n)
+{
+	if( tempbank == 0 || tempbanksize < n )
+	{
+		free(tempbank);
+		tempbank=(double *)malloc(n*sizeof(double));
+		tempbanksize=n;
+	}
+}
 
 /**
  *  fwt97 - Forward biorthogonal 9/7 wavelet transform (lifting implementation)
@@ -61,8 +79,7 @@ void fwt97(double* x,int n) {
   }
 
   // Pack
-  if (tempbank==0) 
-	  tempbank=(double *)malloc(n*sizeof(double));
+  reservetempbank(n);
 
   for (i=0;i<n;i++) {
     if (i%2==0) tempbank[i/2]=x[i];
@@ -83,8 +100,7 @@ void iwt97(double* x,int n) {
   int i;
 
   // Unpack
-  if (tempbank==0) 
-	  tempbank=(double *)malloc(n*sizeof(double));
+  reservetempbank(n);
 
   for (i=0;i<n/2;i++) {
     tempbank[i*2]=x[i];
@@ -134,6 +150,7 @@ void dwtcleanup()
 	{
 		free(tempbank);
 		tempbank=0;
+		tempbanksize=0;
 	}
 }
 
@@ -0,0 +1,305 @@
+// Author: Jonathan Decker
+// Description: Watermarks a stream of raw video frames (as extracted by ffmpeg -f rawvideo) in order
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "framestream.h"
+#include "threadpool.h"
+#include "trace.h"
+
+static FILE* openStream( const char* path, bool forWrite )
+{
+	if( strcmp(path,"-") == 0 )
+	{
+#ifdef _WIN32
+		_setmode(_fileno(forWrite ? stdout : stdin), _O_BINARY);
+#endif
+		return forWrite ? stdout : stdin;
+	}
+
+	return fopen(path, forWrite ? "wb" : "rb");
+}
+
+static void closeStream( FILE* fp )
+{
+	if( fp != NULL && fp != stdin && fp != stdout )
+		fclose(fp);
+}
+
+enum FrameState
+{
+	FrameFree,    // may be filled by the reader
+	FrameMarking, // tiles are on the pool
+	FrameReady    // waiting for the writer
+};
+
+// one frame buffer, allocated once and reused for every inFlight-th frame
+struct FrameSlot
+{
+	std::vector<unsigned int> pixels;   // packed RGBA, rgba frames are read and written from here directly
+	std::vector<unsigned char> packed;  // the raw frame of rgb streams
+	std::atomic<unsigned int> tilesLeft;
+	FrameState state;
+};
+
+class FrameQueue
+{
+public:
+	FrameQueue( unsigned int count, size_t pixels, unsigned int channels )
+		: slots(count), framesRead(0), readDone(false), writeFailed(false)
+	{
+		for( unsigned int i = 0; i < count; ++i )
+		{
+			FrameSlot& slot = slots[i];
+
+			slot.pixels.resize(pixels);
+			if( channels != 4 )
+				slot.packed.resize(pixels*channels);
+			slot.tilesLeft = 0;
+			slot.state = FrameFree;
+		}
+	}
+
+	FrameSlot& slot( unsigned long long frame ) { return slots[frame % slots.size()]; }
+
+	// blocks until the frame's slot has been written out, false if the writer has given up
+	bool acquire( unsigned long long frame )
+	{
+		TRACE_SCOPE("wait free slot");
+
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]{ return writeFailed || slot(frame).state == FrameFree; });
+		slot(frame).state = FrameMarking;
+		return !writeFailed;
+	}
+
+	void markReady( FrameSlot& frameSlot )
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			frameSlot.state = FrameReady;
+		}
+		changed.notify_all();
+	}
+
+	// blocks until the frame is marked, false once the reader has finished before reaching it
+	bool waitReady( unsigned long long frame )
+	{
+		TRACE_SCOPE("wait marked frame");
+
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]{ return slot(frame).state == FrameReady || (readDone && frame >= framesRead); });
+		return slot(frame).state == FrameReady;
+	}
+
+	void release( unsigned long long frame, bool failed )
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			slot(frame).state = FrameFree;
+			writeFailed = writeFailed || failed;
+		}
+		changed.notify_all();
+	}
+
+	void finishReading( unsigned long long frames )
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			framesRead = frames;
+			readDone = true;
+		}
+		changed.notify_all();
+	}
+
+	bool failed()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		return writeFailed;
+	}
+
+private:
+	std::vector<FrameSlot> slots;
+	std::mutex mutex;
+	std::condition_variable changed;
+	unsigned long long framesRead;
+	bool readDone;
+	bool writeFailed;
+};
+
+static void unpackFrame( FrameSlot& slot, unsigned int channels )
+{
+	const unsigned char* p1 = &slot.packed[0];
+	unsigned char* p2 = (unsigned char*)&slot.pixels[0];
+
+	for( size_t i = 0; i < slot.pixels.size(); ++i, p1 += channels, p2 += 4 )
+	{
+		p2[0] = p1[0];
+		p2[1] = p1[1];
+		p2[2] = p1[2];
+		p2[3] = 255;
+	}
+}
+
+static void packFrame( FrameSlot& slot, unsigned int channels )
+{
+	const unsigned char* p1 = (const unsigned char*)&slot.pixels[0];
+	unsigned char* p2 = &slot.packed[0];
+
+	for( size_t i = 0; i < slot.pixels.size(); ++i, p1 += 4, p2 += channels )
+	{
+		p2[0] = p1[0];
+		p2[1] = p1[1];
+		p2[2] = p1[2];
+	}
+}
+
+bool streamFrames( ThreadPool& pool, const char* input, const char* output, int width, int height, unsigned int channels,
+                   unsigned int inFlight, unsigned char* mark, double markStrength, Codec codec, FrameStreamStats* stats )
+{
+	const unsigned int tiles = countFullTiles(width, height, codec.preset);
+	const int tileSize = codecInfo(codec.preset).tileSize;
+	const size_t pixels = (size_t)width*height;
+	const size_t frameBytes = pixels*channels;
+
+	stats->frames = 0;
+	stats->seconds = 0;
+
+	if( tiles == 0 )
+	{
+		fprintf(stderr,"Error: Stream mode expects frames of at least %dx%d\n", tileSize, tileSize);
+		return false;
+	}
+
+	if( channels != 3 && channels != 4 )
+		return false;
+
+	// enough queued tiles to keep every worker busy twice over, plus the frame being written
+	if( inFlight == 0 )
+		inFlight = (2*pool.size() + tiles - 1) / tiles + 1;
+
+	FILE* in = openStream(input, false);
+	FILE* out = openStream(output, true);
+
+	if( in == NULL || out == NULL )
+	{
+		fprintf(stderr,"Error: could not open %s\n", in == NULL ? input : output);
+		closeStream(in);
+		closeStream(out);
+		return false;
+	}
+
+	FrameQueue queue(inFlight, pixels, channels);
+	bool truncated = false;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// frames leave in the order they came in, whichever finishes marking first
+	std::thread writer([&]{
+		traceThreadName("writer");
+
+		bool failed = false;
+
+		for( unsigned long long frame = 0; queue.waitReady(frame); ++frame )
+		{
+			FrameSlot& slot = queue.slot(frame);
+			const void* data = channels == 4 ? (const void*)&slot.pixels[0] : (const void*)&slot.packed[0];
+
+			bool written;
+
+			{
+				TRACE_SCOPE("write frame");
+				written = failed || fwrite(data, 1, frameBytes, out) == frameBytes;
+			}
+
+			if( !written )
+			{
+				fprintf(stderr,"Error: could not write frame %llu\n", frame);
+				failed = true;
+			}
+
+			if( !failed )
+				stats->frames = frame + 1;
+
+			queue.release(frame, failed);
+		}
+
+		fflush(out);
+	});
+
+	unsigned long long frame = 0;
+
+	for( ;; ++frame )
+	{
+		if( !queue.acquire(frame) )
+			break;
+
+		FrameSlot& slot = queue.slot(frame);
+		void* data = channels == 4 ? (void*)&slot.pixels[0] : (void*)&slot.packed[0];
+		size_t read;
+
+		{
+			TRACE_SCOPE("read frame");
+			read = fread(data, 1, frameBytes, in);
+		}
+
+		if( read != frameBytes )
+		{
+			truncated = read != 0;
+			if( truncated )
+				fprintf(stderr,"Error: truncated frame %llu (%zu of %zu bytes)\n", frame, read, frameBytes);
+			break;
+		}
+
+		slot.tilesLeft = tiles;
+
+		FrameSlot* frameSlot = &slot;
+		ThreadPool* workers = &pool;
+
+		pool.enqueue([=,&queue]{
+			if( channels != 4 )
+				unpackFrame(*frameSlot, channels);
+
+			// the last tile to finish hands the frame to the writer
+			for( unsigned int t = 0; t < tiles; ++t )
+			{
+				workers->enqueue([=,&queue]{
+					insertWatermarkTile(&frameSlot->pixels[0], mark, width, height, t, markStrength, codec);
+
+					if( --frameSlot->tilesLeft == 0 )
+					{
+						if( channels != 4 )
+							packFrame(*frameSlot, channels);
+
+						queue.markReady(*frameSlot);
+					}
+				});
+			}
+		});
+	}
+
+	queue.finishReading(frame);
+	writer.join();
+	pool.wait();
+
+	stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	bool failed = queue.failed() || ferror(in);
+
+	closeStream(in);
+	closeStream(out);
+
+	return !failed && !truncated;
+}
@@ -0,0 +1,23 @@
+// Author: Jonathan Decker
+// Description: Watermarks a stream of raw video frames (as extracted by ffmpeg -f rawvideo) in order
+
+#pragma once
+
+#include "wavescribe.h"
+
+class ThreadPool;
+
+struct FrameStreamStats
+{
+	unsigned long long frames;  // frames written
+	double seconds;             // wall time from the first read to the last write
+};
+
+// Reads frames of width x height pixels with channels bytes each (4 for rgba, 3 for rgb) from input
+// and writes every frame, marked in tiled mode, to output in the same order ("-" for stdin/stdout).
+// The tiles of up to inFlight frames are on the pool at once; reading blocks while every frame buffer
+// is waiting to be marked or written, so memory stays at inFlight frames whatever the input rate.
+// inFlight 0 picks enough frames to keep every worker busy. Returns false on an I/O error or a
+// truncated last frame
+bool streamFrames( ThreadPool& pool, const char* input, const char* output, int width, int height, unsigned int channels,
+                   unsigned int inFlight, unsigned char* mark, double markStrength, Codec codec, FrameStreamStats* stats );
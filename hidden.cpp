@@ -1,133 +1,355 @@
 // Author: Jonathan Decker
-// Usage:  hidden.exe bits input.png [hidden.png] output.png
+// Usage:  hidden.exe [--strips] [--png-level n] [--png-filter name] bits input.png [hidden.png] output.png
 // Description: Places images into the lower bits of a image
 // or normalizes the lower bit of an image to reveal an encoded image
+//
+// The kernels work on the RGBA bytes directly, a whole vector of bytes at a time when SSE2 or AVX2 is
+// compiled in, and leave alpha untouched. Each image is split into bands of pixels across the threads.
+// With --strips the images are read and the result written a strip of rows at a time (rowio.h), so
+// memory grows with the width rather than the area; the output is the same file byte for byte.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <vector>
 
-extern "C"
-{
-	#define STBI_ONLY_PNG
-	#define STB_IMAGE_IMPLEMENTATION
-	#include "stb_image.h"
-	#define STB_IMAGE_WRITE_IMPLEMENTATION
-	#include "stb_image_write.h"
-}
+#include "threadpool.h"
+#include "rowio.h"
+#include "imageio.h"
 
-typedef union charbits
-{
-    struct
-    {
-        unsigned char hh : 2;
-        unsigned char lh : 2;
-        unsigned char hl : 2;
-        unsigned char ll : 2;
-    };
-    unsigned char c;
-}charbits;
 
-void removeHiddenAny(unsigned int* pData, unsigned int width, unsigned int height, unsigned char bits)
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define HIDDEN_SIMD 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define HIDDEN_SIMD 16
+#endif
+
+// byte masks of one pixel, the low three bytes are red, green and blue
+static const unsigned int colourBytes = 0x00ffffff;
+static const unsigned int alphaBytes  = 0xff000000;
+
+// the per-byte work of one bit count
+struct LowBits
 {
-	ccpng_color tempColor;
+	unsigned char keep;            // bits of the image kept when hiding
+	unsigned char take;            // bits the hidden image's top bits land in
+	unsigned int  shift;           // 8 - bits
+	unsigned char normalize[256];  // a byte's low bits stretched to 0..255
+
+	// normalize[x] == (((x & take)*scale*magic) >> 16) >> magicShift for every byte x when exactMagic is set
+	unsigned short scale;
+	unsigned short magic;
+	unsigned int  magicShift;
+	bool          exactMagic;
+};
+
+static bool stretchesExactly( const LowBits& low )
+{
+	for( unsigned int x = 0; x <= low.take; ++x )
+	{
+		if( ((x*low.scale*low.magic >> 16) >> low.magicShift) != low.normalize[x] )
+			return false;
+	}
+
+	return true;
+}
 
+static void initLowBits( LowBits& low, unsigned char bits )
+{
 	if( bits == 0 ) bits = 1;
 	if( bits > 7 ) bits = 7;
 
-	unsigned char mask = 0xff >> (8-bits);
+	low.take = 0xff >> (8-bits);
+	low.keep = ~low.take;
+	low.shift = 8 - bits;
 
 	float divisor = pow(2.0f,bits)-1.0f;
 
-	unsigned int size = width*height;
-	for(unsigned int i = 0; i < size; ++i)
+	for( unsigned int v = 0; v < 256; ++v )
+		low.normalize[v] = (unsigned char)(255.0f * (v & low.take) / divisor);
+
+	// the vector kernels divide by multiplying. Divisors of 255 only scale (the magic 256 undoes the shift
+	// that keeps the product in the high half), the others take the first magic multiplier that rounds
+	// every value the way the table does
+	low.magicShift = 0;
+
+	if( 255 % low.take == 0 )
 	{
-		tempColor.c = pData[i];
+		low.scale = (unsigned short)(255 / low.take * 256);
+		low.magic = 256;
+		low.exactMagic = stretchesExactly(low);
+		return;
+	}
 
-		tempColor.r = (unsigned char)(255.0f * (tempColor.r & mask) / divisor);
-		tempColor.g = (unsigned char)(255.0f * (tempColor.g & mask) / divisor);
-		tempColor.b = (unsigned char)(255.0f * (tempColor.b & mask) / divisor);
+	low.scale = 255;
+	low.exactMagic = false;
 
-		pData[i] = tempColor.c;
+	for( unsigned int shift = 0; shift < 16 && !low.exactMagic; ++shift )
+	{
+		unsigned int magic = ((1u << (16 + shift)) + low.take - 1) / low.take;
+
+		if( magic > 0xffff )
+			break;
+
+		low.magic = (unsigned short)magic;
+		low.magicShift = shift;
+		low.exactMagic = stretchesExactly(low);
 	}
 }
 
-void addHiddenAny(unsigned int* pImage, unsigned int* pHidden, unsigned int width, unsigned int height, unsigned char bits)
+#ifdef HIDDEN_SIMD
+
+#if HIDDEN_SIMD == 32
+
+typedef __m256i vbytes;
+
+static inline vbytes vload( const unsigned int* p )             { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void   vstore( unsigned int* p, vbytes a )        { _mm256_storeu_si256((__m256i*)p,a); }
+static inline vbytes vset8( unsigned char x )                   { return _mm256_set1_epi8((char)x); }
+static inline vbytes vset16( unsigned short x )                 { return _mm256_set1_epi16((short)x); }
+static inline vbytes vset32( unsigned int x )                   { return _mm256_set1_epi32((int)x); }
+static inline vbytes vzero()                                    { return _mm256_setzero_si256(); }
+static inline vbytes vand( vbytes a, vbytes b )                 { return _mm256_and_si256(a,b); }
+static inline vbytes vor( vbytes a, vbytes b )                  { return _mm256_or_si256(a,b); }
+static inline vbytes vsrl16( vbytes a, unsigned int n )         { return _mm256_srl_epi16(a,_mm_cvtsi32_si128((int)n)); }
+static inline vbytes vmullo16( vbytes a, vbytes b )             { return _mm256_mullo_epi16(a,b); }
+static inline vbytes vmulhi16( vbytes a, vbytes b )             { return _mm256_mulhi_epu16(a,b); }
+static inline vbytes vunpacklo8( vbytes a, vbytes b )           { return _mm256_unpacklo_epi8(a,b); }
+static inline vbytes vunpackhi8( vbytes a, vbytes b )           { return _mm256_unpackhi_epi8(a,b); }
+static inline vbytes vpack16( vbytes a, vbytes b )              { return _mm256_packus_epi16(a,b); }
+
+#else
+
+typedef __m128i vbytes;
+
+static inline vbytes vload( const unsigned int* p )             { return _mm_loadu_si128((const __m128i*)p); }
+static inline void   vstore( unsigned int* p, vbytes a )        { _mm_storeu_si128((__m128i*)p,a); }
+static inline vbytes vset8( unsigned char x )                   { return _mm_set1_epi8((char)x); }
+static inline vbytes vset16( unsigned short x )                 { return _mm_set1_epi16((short)x); }
+static inline vbytes vset32( unsigned int x )                   { return _mm_set1_epi32((int)x); }
+static inline vbytes vzero()                                    { return _mm_setzero_si128(); }
+static inline vbytes vand( vbytes a, vbytes b )                 { return _mm_and_si128(a,b); }
+static inline vbytes vor( vbytes a, vbytes b )                  { return _mm_or_si128(a,b); }
+static inline vbytes vsrl16( vbytes a, unsigned int n )         { return _mm_srl_epi16(a,_mm_cvtsi32_si128((int)n)); }
+static inline vbytes vmullo16( vbytes a, vbytes b )             { return _mm_mullo_epi16(a,b); }
+static inline vbytes vmulhi16( vbytes a, vbytes b )             { return _mm_mulhi_epu16(a,b); }
+static inline vbytes vunpacklo8( vbytes a, vbytes b )           { return _mm_unpacklo_epi8(a,b); }
+static inline vbytes vunpackhi8( vbytes a, vbytes b )           { return _mm_unpackhi_epi8(a,b); }
+static inline vbytes vpack16( vbytes a, vbytes b )              { return _mm_packus_epi16(a,b); }
+
+#endif
+
+static const unsigned int vectorPixels = HIDDEN_SIMD / 4;
+
+// the 16-bit shift drags the neighbouring byte's low bits into the top of each byte, take masks them off again
+static unsigned int addHiddenVector( unsigned int* pImage, const unsigned int* pHidden, unsigned int count, const LowBits& low )
 {
-	ccpng_color temp1Color;
-	ccpng_color temp2Color;
+	const vbytes keep = vor(vand(vset8(low.keep), vset32(colourBytes)), vset32(alphaBytes));
+	const vbytes take = vand(vset8(low.take), vset32(colourBytes));
 
-	if( bits == 0 ) bits = 1;
-	if( bits > 7 ) bits = 7;
+	unsigned int i;
+
+	for( i = 0; i + vectorPixels <= count; i += vectorPixels )
+	{
+		vbytes image = vload(pImage + i);
+		vbytes hidden = vsrl16(vload(pHidden + i), low.shift);
+
+		vstore(pImage + i, vor(vand(image, keep), vand(hidden, take)));
+	}
+
+	return i;
+}
+
+// x*scale fits 16 bits for every x, so the division is one multiply-high per half of the bytes
+static unsigned int removeHiddenVector( unsigned int* pData, unsigned int count, const LowBits& low )
+{
+	if( !low.exactMagic )
+		return 0;
 
-	unsigned char mask1 = 0xff >> (8-bits);
-	unsigned char mask2 = ~mask1;
+	const vbytes take = vset8(low.take);
+	const vbytes colour = vset32(colourBytes);
+	const vbytes alpha = vset32(alphaBytes);
+	const vbytes scale = vset16(low.scale);
+	const vbytes magic = vset16(low.magic);
+	const vbytes zero = vzero();
 
-	unsigned int size = width*height;
-	for(unsigned int i = 0; i < size; ++i)
+	unsigned int i;
+
+	for( i = 0; i + vectorPixels <= count; i += vectorPixels )
 	{
-		temp1Color.c = pImage[i];
-		temp2Color.c = pHidden[i];
+		vbytes v = vload(pData + i);
+		vbytes x = vand(v, take);
 
-		temp1Color.r = (temp1Color.r & mask2) | (temp2Color.r >> (8-bits) & mask1);
-		temp1Color.g = (temp1Color.g & mask2) | (temp2Color.g >> (8-bits) & mask1);
-		temp1Color.b = (temp1Color.b & mask2) | (temp2Color.b >> (8-bits) & mask1);
+		vbytes lo = vsrl16(vmulhi16(vmullo16(vunpacklo8(x, zero), scale), magic), low.magicShift);
+		vbytes hi = vsrl16(vmulhi16(vmullo16(vunpackhi8(x, zero), scale), magic), low.magicShift);
 
-		pImage[i] = temp1Color.c;
+		vstore(pData + i, vor(vand(vpack16(lo, hi), colour), vand(v, alpha)));
 	}
+
+	return i;
 }
 
-void removeHidden(unsigned int* pData, unsigned int width, unsigned int height)
+#else // no SIMD, the byte loops do all the work
+
+static unsigned int addHiddenVector( unsigned int* pImage, const unsigned int* pHidden, unsigned int count, const LowBits& low )
 {
-	ccpng_color tempColor;
-	charbits  tempChannel;
+	return 0;
+}
 
-	unsigned char v[4] = {0,85,170,255};
+static unsigned int removeHiddenVector( unsigned int* pData, unsigned int count, const LowBits& low )
+{
+	return 0;
+}
+
+#endif
+
+static void addHiddenBytes( unsigned int* pImage, const unsigned int* pHidden, unsigned int count, const LowBits& low )
+{
+	unsigned int i = addHiddenVector(pImage, pHidden, count, low);
 
-	unsigned int size = width*height;
-	for(unsigned int i = 0; i < size; ++i)
+	unsigned char* p1 = (unsigned char*)(pImage + i);
+	const unsigned char* p2 = (const unsigned char*)(pHidden + i);
+
+	for( ; i < count; ++i, p1 += 4, p2 += 4 )
 	{
-		tempColor.c = pData[i];
+		p1[0] = (p1[0] & low.keep) | (p2[0] >> low.shift & low.take);
+		p1[1] = (p1[1] & low.keep) | (p2[1] >> low.shift & low.take);
+		p1[2] = (p1[2] & low.keep) | (p2[2] >> low.shift & low.take);
+	}
+}
 
-		tempChannel.c = (unsigned char)tempColor.r;
-		tempColor.r = v[tempChannel.hh];
+static void removeHiddenBytes( unsigned int* pData, unsigned int count, const LowBits& low )
+{
+	unsigned int i = removeHiddenVector(pData, count, low);
+
+	unsigned char* p = (unsigned char*)(pData + i);
+
+	for( ; i < count; ++i, p += 4 )
+	{
+		p[0] = low.normalize[p[0]];
+		p[1] = low.normalize[p[1]];
+		p[2] = low.normalize[p[2]];
+	}
+}
+
+static ThreadPool& workers()
+{
+	static ThreadPool pool;
+	return pool;
+}
 
-		tempChannel.c = (unsigned char)tempColor.g;
-		tempColor.g = v[tempChannel.hh];
+// runs kernel(first, count) over bands of the size pixels, a few per worker so they even out
+template<class Kernel>
+static void forEachBand( unsigned int size, Kernel kernel )
+{
+	ThreadPool& pool = workers();
 
-		tempChannel.c = (unsigned char)tempColor.b;
-		tempColor.b = v[tempChannel.hh];
+	const unsigned int bands = 4*pool.size();
+	const unsigned int bandSize = ((size + bands - 1) / bands + 7) & ~7u;
 
-		pData[i] = tempColor.c;
+	for( unsigned int first = 0; first < size; first += bandSize )
+	{
+		unsigned int count = size - first < bandSize ? size - first : bandSize;
+		pool.enqueue([=]{ kernel(first, count); });
 	}
+
+	pool.wait();
 }
 
+void removeHiddenAny(unsigned int* pData, unsigned int width, unsigned int height, unsigned char bits)
+{
+	LowBits low;
+	initLowBits(low, bits);
+
+	forEachBand(width*height, [&]( unsigned int first, unsigned int count ){ removeHiddenBytes(pData + first, count, low); });
+}
+
+void addHiddenAny(unsigned int* pImage, unsigned int* pHidden, unsigned int width, unsigned int height, unsigned char bits)
+{
+	LowBits low;
+	initLowBits(low, bits);
+
+	forEachBand(width*height, [&]( unsigned int first, unsigned int count ){ addHiddenBytes(pImage + first, pHidden + first, count, low); });
+}
+
+// the two lowest bits stretched to 0, 85, 170 and 255
+void removeHidden(unsigned int* pData, unsigned int width, unsigned int height)
+{
+	removeHiddenAny(pData, width, height, 2);
+}
+
+// the top two bits of the hidden image in the two lowest bits of the image
 void addHidden(unsigned int* pImage, unsigned int* pHidden, unsigned int width, unsigned int height)
 {
-	ccpng_color temp1Color;
-	ccpng_color temp2Color;
-	charbits  tempChannel;
+	addHiddenAny(pImage, pHidden, width, height, 2);
+}
+
+// rows per strip in --strips mode, enough to give every worker a band
+static const int stripRows = 64;
 
-	unsigned int size = width*height;
-	for(unsigned int i = 0; i < size; ++i)
+static bool streamHidden( int bits, const char* input, const char* hiddenPath, const char* output )
+{
+	RowReader* image = openRowReader(input);
+	RowReader* hidden = hiddenPath != NULL ? openRowReader(hiddenPath) : NULL;
+	RowWriter* writer = NULL;
+	bool done = false;
+
+	if( image == NULL )
+	{
+		printf("Error: Bad Source Image (needs to be PNG or binary PGM/PPM)\n");
+	}
+	else if( hiddenPath != NULL && (hidden == NULL || hidden->width() != image->width() || hidden->height() != image->height()) )
+	{
+		printf("Error: Bad Hidden Image (needs to be the same size as source image)\n");
+	}
+	else if( (writer = openRowWriter(output, image->width(), image->height())) == NULL )
+	{
+		printf("Error: could not open %s\n", output);
+	}
+	else
 	{
-		temp1Color.c = pImage[i];
-		temp2Color.c = pHidden[i];
+		const int width = image->width();
+		const int height = image->height();
+
+		std::vector<unsigned int> strip((size_t)width*stripRows);
+		std::vector<unsigned int> hiddenStrip(hidden != NULL ? strip.size() : 0);
 
-		tempChannel.c = (unsigned char)temp1Color.r;
-		tempChannel.hh = temp2Color.r >> 6;
-		temp1Color.r = (unsigned int)tempChannel.c;
+		done = true;
 
-		tempChannel.c = (unsigned char)temp1Color.g;
-		tempChannel.hh = temp2Color.g >> 6;
-		temp1Color.g = (unsigned int)tempChannel.c;
+		for( int y = 0; y < height && done; y += stripRows )
+		{
+			int rows = height - y < stripRows ? height - y : stripRows;
 
-		tempChannel.c = (unsigned char)temp1Color.b;
-		tempChannel.hh = temp2Color.b >> 6;
-		temp1Color.b = (unsigned int)tempChannel.c;
+			done = image->readRows(&strip[0], rows) && (hidden == NULL || hidden->readRows(&hiddenStrip[0], rows));
 
-		pImage[i] = temp1Color.c;
+			if( !done )
+			{
+				printf("Error: could not read rows %d to %d\n", y, y + rows - 1);
+				break;
+			}
+
+			if( hidden != NULL )
+				addHiddenAny(&strip[0], &hiddenStrip[0], width, rows, bits);
+			else
+				removeHiddenAny(&strip[0], width, rows, bits);
+
+			done = writer->writeRows(&strip[0], rows);
+		}
+
+		done = done && writer->finish();
+
+		if( !done )
+			printf("Error: could not write %s\n", output);
 	}
+
+	delete writer;
+	delete hidden;
+	delete image;
+
+	return done;
 }
 
 int main( int argc, char** argv )
@@ -136,62 +358,100 @@ int main( int argc, char** argv )
 	int height1;
 	int width2;
 	int height2;
-	int channels1;
-	int channels2;
 	unsigned int* pData1;
 	unsigned int* pData2;
 
-	CCPNGInit();
-	if( argc > 3 )
+	bool strips = false;
+	bool zlibPng = false;
+	PngOptions pngOptions;
+
+	// options come before the bit count
+	while( argc > 1 && strncmp(argv[1],"--",2) == 0 )
+	{
+		if( strcmp(argv[1],"--strips") == 0 )
+			strips = true;
+		else if( strcmp(argv[1],"--png-level") == 0 && argc > 2 )
+		{
+			pngOptions.level = atoi(argv[2]);
+			zlibPng = true;
+			--argc;
+			++argv;
+		}
+		else if( strcmp(argv[1],"--png-filter") == 0 && argc > 2 && findPngFilter(argv[2], &pngOptions.filter) )
+		{
+			zlibPng = true;
+			--argc;
+			++argv;
+		}
+		else
+			break;
+
+		--argc;
+		++argv;
+	}
+
+	if( argc > 3 && strips )
+	{
+		int bits = atoi(argv[1]);
+
+		if( argc > 4 )
+			printf("Placing %s into the lower bits of %s and saving the result to %s\n", argv[3], argv[2], argv[4]);
+		else
+			printf("Normalizing the lower bits of %s and saving the result to %s\n", argv[2], argv[3]);
+
+		return streamHidden(bits, argv[2], argc > 4 ? argv[3] : NULL, argv[argc > 4 ? 4 : 3]) ? 0 : 1;
+	}
+	else if( argc > 3 )
 	{
 		int bits = atoi(argv[1]);
 
-        pData1 = (unsigned int*)stbi_load( argv[2], &width1, &height1, &channels1, 4 );
-		//pData1 = CCPNGReadFile(argv[2], &width1, &height1);
+		// the zlib encoder shares the kernels' workers
+		ImageBackend* images = zlibPng ? createZlibBackend(pngOptions, &workers()) : createStbBackend();
+
+		pData1 = images->load( argv[2], &width1, &height1 );
 
 		if( pData1 != NULL )
 		{
 			if( argc > 4 )
 			{
-				pData2 = (unsigned int*)stbi_load( argv[3], &width2, &height2, &channels2, 4 );
-				//pData2 = CCPNGReadFile(argv[3], &width2, &height2);
+				pData2 = images->load( argv[3], &width2, &height2 );
 
 				if( pData2 != NULL && width1 == width2 && height1 == height2 )
 				{
-					printf("Placing %s into the lower bits of %s and saving the result to %s\n", argv[2], argv[3], argv[4]);
+					printf("Placing %s into the lower bits of %s and saving the result to %s\n", argv[3], argv[2], argv[4]);
 					addHiddenAny(pData1,pData2,width1,height1,bits);
 
-					stbi_write_png( argv[4], width1, height1, channels1, pData1, 4*width);
-					//CCPNGWriteFile(argv[4], pData1, width1, height1, 0, 1);
-					free(pData2);
+					images->save( argv[4], pData1, width1, height1 );
 				}
 				else
 				{
 					printf("Error: Bad Hidden Image (needs to be the same size as source image)\n");
 				}
+
+				if( pData2 != NULL )
+					images->release(pData2);
 			}
 			else
 			{
 				printf("Normalizing the lower bits of %s and saving the result to %s\n", argv[2], argv[3]);
 				removeHiddenAny(pData1,width1,height1,bits);
 
-				stbi_write_png( argv[3], width1, height1, channels, pData1, 4*width);
-				//CCPNGWriteFile(argv[3], pData1, width1, height1, 0, 1);
+				images->save( argv[3], pData1, width1, height1 );
 			}
-			
-			free(pData1);
+
+			images->release(pData1);
 		}
 		else
 		{
 			printf("Error: Bad Source Image (needs to be the same size as source image)\n");
 		}
+
+		delete images;
 	}
 	else
 	{
-		printf("   usage: bits source.png [hidden.png] output.png\n");
+		printf("   usage: [--strips] [--png-level n] [--png-filter adaptive|none|sub|up|average|paeth] bits source.png [hidden.png] output.png\n");
 	}
 
-	//CCPNGDestroy();
-
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,822 @@
+// Author: Jonathan Decker
+// Description: Uncompressed and QOI images for ImageBackend (imageio.h)
+//
+// Files are mapped instead of read. An input mapping is private (copy-on-write): PAM RGB_ALPHA and RGBA
+// pixels are handed out where they lie, so marking them in place only copies the pages it writes and the
+// file itself never changes. An output file is sized up front, mapped shared and filled directly.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "imageio.h"
+#include "trace.h"
+
+// RGBA dump: magic, then width and height as little endian 32-bit values, then the pixels
+static const char rgbaMagic[8] = { 'W', 'S', 'R', 'G', 'B', 'A', '0', '1' };
+static const size_t rgbaHeaderSize = 16;
+
+static const size_t qoiHeaderSize = 14;
+static const unsigned char qoiEnd[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+// an image of more than 2^30 pixels is refused, as stb does
+static const size_t maxPixels = (size_t)1 << 30;
+
+bool mapForReading( const char* path, FileMapping* mapping )
+{
+	memset(mapping, 0, sizeof(*mapping));
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+
+	if( file == INVALID_HANDLE_VALUE )
+		return false;
+
+	HANDLE view = GetFileSizeEx(file, &size) && size.QuadPart > 0 ? CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+	void* data = view != NULL ? MapViewOfFile(view, FILE_MAP_COPY, 0, 0, 0) : NULL;
+
+	if( data == NULL )
+	{
+		if( view != NULL )
+			CloseHandle(view);
+		CloseHandle(file);
+		return false;
+	}
+
+	mapping->data = (unsigned char*)data;
+	mapping->length = (size_t)size.QuadPart;
+	mapping->file = file;
+	mapping->view = view;
+#else
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+
+	if( fd < 0 )
+		return false;
+
+	void* data = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 ? mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+	// the mapping holds its own reference to the file
+	close(fd);
+
+	if( data == MAP_FAILED )
+		return false;
+
+	mapping->data = (unsigned char*)data;
+	mapping->length = (size_t)info.st_size;
+#endif
+
+	return true;
+}
+
+bool mapForWriting( const char* path, size_t length, FileMapping* mapping )
+{
+	memset(mapping, 0, sizeof(*mapping));
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if( file == INVALID_HANDLE_VALUE )
+		return false;
+
+	HANDLE view = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)length >> 32), (DWORD)length, NULL);
+	void* data = view != NULL ? MapViewOfFile(view, FILE_MAP_WRITE, 0, 0, length) : NULL;
+
+	if( data == NULL )
+	{
+		if( view != NULL )
+			CloseHandle(view);
+		CloseHandle(file);
+		return false;
+	}
+
+	mapping->file = file;
+	mapping->view = view;
+#else
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+	if( fd < 0 )
+		return false;
+
+	void* data = ftruncate(fd, (off_t)length) == 0 ? mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+	close(fd);
+
+	if( data == MAP_FAILED )
+		return false;
+#endif
+
+	mapping->data = (unsigned char*)data;
+	mapping->length = length;
+
+	return true;
+}
+
+void unmap( FileMapping* mapping )
+{
+	if( mapping->data == NULL )
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(mapping->data);
+	CloseHandle((HANDLE)mapping->view);
+	CloseHandle((HANDLE)mapping->file);
+#else
+	munmap(mapping->data, mapping->length);
+#endif
+
+	mapping->data = NULL;
+}
+
+static bool hasExtension( const char* path, const char* ext )
+{
+	size_t n = strlen(path);
+	size_t e = strlen(ext);
+
+	if( n < e )
+		return false;
+
+	for( size_t i = 0; i < e; ++i )
+		if( tolower((unsigned char)path[n-e+i]) != ext[i] )
+			return false;
+
+	return true;
+}
+
+ImageFormat imageFormatOf( const char* path )
+{
+	if( hasExtension(path, ".ppm") ) return ImageFormatPpm;
+	if( hasExtension(path, ".pam") ) return ImageFormatPam;
+	if( hasExtension(path, ".rgba") ) return ImageFormatRgba;
+	if( hasExtension(path, ".qoi") ) return ImageFormatQoi;
+
+	return ImageFormatPng;
+}
+
+static unsigned int readBigEndian( const unsigned char* p )
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void writeBigEndian( unsigned char* p, unsigned int v )
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static unsigned int readLittleEndian( const unsigned char* p )
+{
+	return p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void writeLittleEndian( unsigned char* p, unsigned int v )
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static bool validSize( unsigned int width, unsigned int height )
+{
+	return width > 0 && height > 0 && width <= 0x7fffffff && height <= 0x7fffffff && (size_t)width*height <= maxPixels;
+}
+
+// one whitespace separated netpbm header value, skipping # comments; p is left after the single
+// whitespace character that ends it
+static bool readNetpbmValue( const unsigned char*& p, const unsigned char* end, int* value )
+{
+	for(;;)
+	{
+		while( p < end && isspace(*p) )
+			++p;
+
+		if( p == end || *p != '#' )
+			break;
+
+		while( p < end && *p != '\n' )
+			++p;
+	}
+
+	if( p == end || !isdigit(*p) )
+		return false;
+
+	*value = 0;
+	while( p < end && isdigit(*p) && *value < 100000000 )
+		*value = *value*10 + (*p++ - '0');
+
+	return p < end && isspace(*p++);
+}
+
+// PAM header lines up to and including ENDHDR; p is left on the first byte of the pixels
+static bool readPamHeader( const unsigned char*& p, const unsigned char* end, int* width, int* height, int* depth, int* maxval )
+{
+	*width = *height = *depth = *maxval = 0;
+
+	for(;;)
+	{
+		const unsigned char* eol = (const unsigned char*)memchr(p, '\n', end - p);
+
+		if( eol == NULL )
+			return false;
+
+		char line[80];
+		size_t length = eol - p < (ptrdiff_t)sizeof(line) - 1 ? eol - p : sizeof(line) - 1;
+
+		memcpy(line, p, length);
+		line[length] = 0;
+		p = eol + 1;
+
+		if( strncmp(line, "ENDHDR", 6) == 0 )
+			return true;
+
+		if( sscanf(line, "WIDTH %d", width) == 1 || sscanf(line, "HEIGHT %d", height) == 1 || sscanf(line, "DEPTH %d", depth) == 1 || sscanf(line, "MAXVAL %d", maxval) == 1 )
+			continue;
+
+		// TUPLTYPE only names what DEPTH already says, comments and blank lines are skipped
+	}
+}
+
+// netpbm samples of 1 (gray), 2 (gray, alpha), 3 (RGB) or 4 (RGBA) bytes to packed RGBA
+static void expandSamples( const unsigned char* src, int depth, size_t count, unsigned int* dst )
+{
+	unsigned char* out = (unsigned char*)dst;
+
+	for( size_t i = 0; i < count; ++i, src += depth, out += 4 )
+	{
+		out[0] = src[0];
+		out[1] = src[depth < 3 ? 0 : 1];
+		out[2] = src[depth < 3 ? 0 : 2];
+		out[3] = depth == 2 ? src[1] : depth == 4 ? src[3] : 255;
+	}
+}
+
+static unsigned int qoiHash( const unsigned char* px )
+{
+	return (px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) % 64;
+}
+
+static unsigned int* decodeQoi( const unsigned char* data, size_t length, int* width, int* height )
+{
+	if( length < qoiHeaderSize + sizeof(qoiEnd) || memcmp(data, "qoif", 4) != 0 )
+		return NULL;
+
+	unsigned int w = readBigEndian(data + 4);
+	unsigned int h = readBigEndian(data + 8);
+
+	if( !validSize(w, h) || data[12] < 3 || data[12] > 4 )
+		return NULL;
+
+	const size_t count = (size_t)w*h;
+	unsigned int* pixels = (unsigned int*)malloc(count*4);
+
+	if( pixels == NULL )
+		return NULL;
+
+	unsigned char index[64*4];
+	unsigned char px[4] = { 0, 0, 0, 255 };
+	unsigned int run = 0;
+
+	memset(index, 0, sizeof(index));
+
+	const unsigned char* p = data + qoiHeaderSize;
+	const unsigned char* end = data + length - sizeof(qoiEnd);
+	unsigned char* out = (unsigned char*)pixels;
+
+	for( size_t i = 0; i < count; ++i, out += 4 )
+	{
+		if( run > 0 )
+		{
+			--run;
+		}
+		else if( p < end )
+		{
+			unsigned int b1 = *p++;
+
+			if( b1 == 0xfe && end - p >= 3 )
+			{
+				px[0] = p[0]; px[1] = p[1]; px[2] = p[2];
+				p += 3;
+			}
+			else if( b1 == 0xff && end - p >= 4 )
+			{
+				px[0] = p[0]; px[1] = p[1]; px[2] = p[2]; px[3] = p[3];
+				p += 4;
+			}
+			else if( (b1 & 0xc0) == 0x00 )
+			{
+				memcpy(px, index + 4*b1, 4);
+			}
+			else if( (b1 & 0xc0) == 0x40 )
+			{
+				px[0] += ((b1 >> 4) & 3) - 2;
+				px[1] += ((b1 >> 2) & 3) - 2;
+				px[2] += (b1 & 3) - 2;
+			}
+			else if( (b1 & 0xc0) == 0x80 && p < end )
+			{
+				unsigned int b2 = *p++;
+				int green = (int)(b1 & 0x3f) - 32;
+
+				px[0] += green - 8 + ((b2 >> 4) & 0x0f);
+				px[1] += green;
+				px[2] += green - 8 + (b2 & 0x0f);
+			}
+			else if( (b1 & 0xc0) == 0xc0 )
+			{
+				run = b1 & 0x3f;
+			}
+
+			memcpy(index + 4*qoiHash(px), px, 4);
+		}
+
+		memcpy(out, px, 4);
+	}
+
+	*width = (int)w;
+	*height = (int)h;
+
+	return pixels;
+}
+
+static void encodeQoi( const unsigned int* pixels, int width, int height, std::vector<unsigned char>& qoi )
+{
+	const size_t count = (size_t)width*height;
+
+	// the worst case is a tag and four bytes for every pixel
+	qoi.resize(qoiHeaderSize + count*5 + sizeof(qoiEnd));
+
+	unsigned char* out = &qoi[0];
+
+	memcpy(out, "qoif", 4);
+	writeBigEndian(out + 4, width);
+	writeBigEndian(out + 8, height);
+	out[12] = 4;   // RGBA
+	out[13] = 0;   // sRGB with linear alpha
+	out += qoiHeaderSize;
+
+	unsigned char index[64*4];
+	unsigned char prev[4] = { 0, 0, 0, 255 };
+	unsigned int run = 0;
+
+	memset(index, 0, sizeof(index));
+
+	const unsigned char* px = (const unsigned char*)pixels;
+
+	for( size_t i = 0; i < count; ++i, px += 4 )
+	{
+		if( memcmp(px, prev, 4) == 0 )
+		{
+			if( ++run == 62 || i == count - 1 )
+			{
+				*out++ = (unsigned char)(0xc0 | (run - 1));
+				run = 0;
+			}
+
+			continue;
+		}
+
+		if( run > 0 )
+		{
+			*out++ = (unsigned char)(0xc0 | (run - 1));
+			run = 0;
+		}
+
+		unsigned int hash = qoiHash(px);
+
+		if( memcmp(index + 4*hash, px, 4) == 0 )
+		{
+			*out++ = (unsigned char)hash;
+		}
+		else
+		{
+			memcpy(index + 4*hash, px, 4);
+
+			if( px[3] == prev[3] )
+			{
+				int red = (signed char)(px[0] - prev[0]);
+				int green = (signed char)(px[1] - prev[1]);
+				int blue = (signed char)(px[2] - prev[2]);
+				int redGreen = red - green;
+				int blueGreen = blue - green;
+
+				if( red > -3 && red < 2 && green > -3 && green < 2 && blue > -3 && blue < 2 )
+				{
+					*out++ = (unsigned char)(0x40 | (red + 2) << 4 | (green + 2) << 2 | (blue + 2));
+				}
+				else if( redGreen > -9 && redGreen < 8 && green > -33 && green < 32 && blueGreen > -9 && blueGreen < 8 )
+				{
+					*out++ = (unsigned char)(0x80 | (green + 32));
+					*out++ = (unsigned char)((redGreen + 8) << 4 | (blueGreen + 8));
+				}
+				else
+				{
+					*out++ = 0xfe;
+					*out++ = px[0]; *out++ = px[1]; *out++ = px[2];
+				}
+			}
+			else
+			{
+				*out++ = 0xff;
+				*out++ = px[0]; *out++ = px[1]; *out++ = px[2]; *out++ = px[3];
+			}
+		}
+
+		memcpy(prev, px, 4);
+	}
+
+	memcpy(out, qoiEnd, sizeof(qoiEnd));
+	out += sizeof(qoiEnd);
+
+	qoi.resize(out - &qoi[0]);
+}
+
+// pixels of a netpbm, RGBA or QOI file, either where they lie in data (inPlace set) or in a malloc'd copy
+static unsigned int* decodeBytes( const unsigned char* data, size_t length, int* width, int* height, bool* inPlace )
+{
+	const unsigned char* p = data;
+	const unsigned char* end = p + length;
+
+	*inPlace = false;
+
+	if( length >= rgbaHeaderSize && memcmp(p, rgbaMagic, sizeof(rgbaMagic)) == 0 )
+	{
+		unsigned int w = readLittleEndian(p + 8);
+		unsigned int h = readLittleEndian(p + 12);
+
+		if( !validSize(w, h) || (size_t)(end - p) - rgbaHeaderSize < (size_t)w*h*4 )
+			return NULL;
+
+		*width = (int)w;
+		*height = (int)h;
+		*inPlace = true;
+
+		return (unsigned int*)(p + rgbaHeaderSize);
+	}
+
+	if( length >= 4 && memcmp(p, "qoif", 4) == 0 )
+		return decodeQoi(p, length, width, height);
+
+	if( length < 3 || p[0] != 'P' || (p[1] != '5' && p[1] != '6' && p[1] != '7') )
+		return NULL;
+
+	int kind = p[1];
+	int w, h, depth, maxval;
+
+	p += 2;
+
+	if( kind == '7' )
+	{
+		if( !readPamHeader(p, end, &w, &h, &depth, &maxval) || depth < 1 || depth > 4 )
+			return NULL;
+	}
+	else
+	{
+		depth = kind == '5' ? 1 : 3;
+
+		if( !readNetpbmValue(p, end, &w) || !readNetpbmValue(p, end, &h) || !readNetpbmValue(p, end, &maxval) )
+			return NULL;
+	}
+
+	// only 8-bit samples
+	if( maxval != 255 || !validSize(w, h) || (size_t)(end - p) < (size_t)w*h*depth )
+		return NULL;
+
+	*width = w;
+	*height = h;
+
+	if( depth == 4 && ((size_t)p & 3) == 0 )
+	{
+		*inPlace = true;
+		return (unsigned int*)p;
+	}
+
+	unsigned int* pixels = (unsigned int*)malloc((size_t)w*h*4);
+
+	if( pixels != NULL )
+		expandSamples(p, depth, (size_t)w*h, pixels);
+
+	return pixels;
+}
+
+bool readImageSize( const char* path, int* width, int* height, unsigned long long* fileBytes )
+{
+	FILE* fp = fopen(path, "rb");
+
+	if( fp == NULL )
+		return false;
+
+	// a netpbm header with comments fits many times over
+	unsigned char header[4096];
+	size_t length = fread(header, 1, sizeof(header), fp);
+
+	if( fileBytes != NULL )
+	{
+#ifdef _WIN32
+		*fileBytes = _fseeki64(fp, 0, SEEK_END) == 0 ? (unsigned long long)_ftelli64(fp) : length;
+#else
+		*fileBytes = fseeko(fp, 0, SEEK_END) == 0 ? (unsigned long long)ftello(fp) : length;
+#endif
+	}
+
+	fclose(fp);
+
+	static const unsigned char pngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+	const unsigned char* p = header;
+	const unsigned char* end = header + length;
+	unsigned int w = 0, h = 0;
+
+	if( length >= 24 && memcmp(p, pngSignature, 8) == 0 && memcmp(p + 12, "IHDR", 4) == 0 )
+	{
+		w = readBigEndian(p + 16);
+		h = readBigEndian(p + 20);
+	}
+	else if( length >= rgbaHeaderSize && memcmp(p, rgbaMagic, sizeof(rgbaMagic)) == 0 )
+	{
+		w = readLittleEndian(p + 8);
+		h = readLittleEndian(p + 12);
+	}
+	else if( length >= qoiHeaderSize && memcmp(p, "qoif", 4) == 0 )
+	{
+		w = readBigEndian(p + 4);
+		h = readBigEndian(p + 8);
+	}
+	else if( length >= 3 && p[0] == 'P' && (p[1] == '5' || p[1] == '6' || p[1] == '7') )
+	{
+		int kind = p[1], value[4];
+
+		p += 2;
+
+		if( kind == '7' ? !readPamHeader(p, end, &value[0], &value[1], &value[2], &value[3]) :
+		    !readNetpbmValue(p, end, &value[0]) || !readNetpbmValue(p, end, &value[1]) )
+			return false;
+
+		w = (unsigned int)value[0];
+		h = (unsigned int)value[1];
+	}
+
+	if( !validSize(w, h) )
+		return false;
+
+	*width = (int)w;
+	*height = (int)h;
+
+	return true;
+}
+
+ImageBackend::~ImageBackend()
+{
+	// images never released; the PNG ones belong to the derived backend, which is already gone
+	for( size_t i = 0; i < loaded.size(); ++i )
+	{
+		if( loaded[i].mapping.data != NULL )
+			unmap(&loaded[i].mapping);
+		else if( !loaded[i].png && !loaded[i].inBuffer )
+			free(loaded[i].pixels);
+	}
+}
+
+unsigned int* ImageBackend::load( const char* path, int* width, int* height )
+{
+	TRACE_SCOPE_DETAIL("load", path);
+
+	Loaded image;
+
+	memset(&image, 0, sizeof(image));
+
+	static const unsigned char pngSignature[4] = { 0x89, 'P', 'N', 'G' };
+
+	if( mapForReading(path, &image.mapping) && (image.mapping.length < 4 || memcmp(image.mapping.data, pngSignature, 4) != 0) )
+	{
+		bool inPlace;
+
+		image.pixels = decodeBytes(image.mapping.data, image.mapping.length, width, height, &inPlace);
+
+		// the mapping is only kept while pixels point into it
+		if( !inPlace )
+			unmap(&image.mapping);
+	}
+	else
+	{
+		unmap(&image.mapping);
+
+		image.pixels = loadPng(path, width, height);
+		image.png = true;
+	}
+
+	if( image.pixels != NULL )
+	{
+		std::lock_guard<std::mutex> lock(loadedMutex);
+		loaded.push_back(image);
+	}
+
+	return image.pixels;
+}
+
+unsigned int* ImageBackend::load( const unsigned char* data, size_t length, int* width, int* height )
+{
+	TRACE_SCOPE("load from memory");
+
+	Loaded image;
+
+	memset(&image, 0, sizeof(image));
+
+	static const unsigned char pngSignature[4] = { 0x89, 'P', 'N', 'G' };
+
+	if( length < 4 || memcmp(data, pngSignature, 4) != 0 )
+		image.pixels = decodeBytes(data, length, width, height, &image.inBuffer);
+	else
+	{
+		image.pixels = loadPngBytes(data, length, width, height);
+		image.png = true;
+	}
+
+	if( image.pixels != NULL )
+	{
+		std::lock_guard<std::mutex> lock(loadedMutex);
+		loaded.push_back(image);
+	}
+
+	return image.pixels;
+}
+
+void ImageBackend::release( unsigned int* pixels )
+{
+	std::lock_guard<std::mutex> lock(loadedMutex);
+
+	for( size_t i = 0; i < loaded.size(); ++i )
+	{
+		if( loaded[i].pixels != pixels )
+			continue;
+
+		if( loaded[i].png )
+			releasePng(pixels);
+		else if( loaded[i].mapping.data != NULL )
+			unmap(&loaded[i].mapping);
+		else if( !loaded[i].inBuffer )
+			free(pixels);
+
+		loaded.erase(loaded.begin() + i);
+		return;
+	}
+}
+
+static size_t pamHeader( char* header, int width, int height )
+{
+	char values[96];
+	int length = sprintf(values, "WIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+
+	// a comment pads the header to a multiple of four, so the pixels can be used in place when read back
+	int pad = (4 - (3 + length) % 4) % 4;
+
+	if( pad == 1 )
+		pad = 5;
+
+	sprintf(header, "P7\n");
+
+	if( pad > 0 )
+	{
+		memset(header + 3, ' ', pad);
+		header[3] = '#';
+		header[3 + pad - 1] = '\n';
+	}
+
+	memcpy(header + 3 + pad, values, length + 1);
+
+	return 3 + pad + length;
+}
+
+// The file of an image in format: a header, then either the pixels (converted) or an encoded body
+struct FileLayout
+{
+	char header[128];
+	size_t headerSize;
+	size_t dataSize;                     // pixel bytes after the header, 0 if encoded
+	std::vector<unsigned char> encoded;  // QOI or PNG
+
+	size_t size() const { return headerSize + dataSize + encoded.size(); }
+};
+
+bool ImageBackend::layOut( ImageFormat format, const unsigned int* pixels, int width, int height, FileLayout& layout )
+{
+	const size_t count = (size_t)width*height;
+
+	layout.headerSize = 0;
+	layout.dataSize = 0;
+
+	if( width <= 0 || height <= 0 )
+		return false;
+
+	switch( format )
+	{
+	case ImageFormatPpm:
+		layout.headerSize = sprintf(layout.header, "P6\n%d %d\n255\n", width, height);
+		layout.dataSize = count*3;
+		break;
+	case ImageFormatPam:
+		layout.headerSize = pamHeader(layout.header, width, height);
+		layout.dataSize = count*4;
+		break;
+	case ImageFormatRgba:
+		memcpy(layout.header, rgbaMagic, sizeof(rgbaMagic));
+		writeLittleEndian((unsigned char*)layout.header + 8, width);
+		writeLittleEndian((unsigned char*)layout.header + 12, height);
+		layout.headerSize = rgbaHeaderSize;
+		layout.dataSize = count*4;
+		break;
+	case ImageFormatQoi:
+		encodeQoi(pixels, width, height, layout.encoded);
+		break;
+	default:
+		if( !encodePng(pixels, width, height, layout.encoded) )
+			return false;
+		break;
+	}
+
+	return true;
+}
+
+// fills out, of layout.size() bytes
+static void writeLayout( const FileLayout& layout, ImageFormat format, const unsigned int* pixels, unsigned char* out )
+{
+	memcpy(out, layout.header, layout.headerSize);
+	out += layout.headerSize;
+
+	if( format == ImageFormatPpm )
+	{
+		const unsigned char* src = (const unsigned char*)pixels;
+		const size_t count = layout.dataSize/3;
+
+		for( size_t i = 0; i < count; ++i, src += 4, out += 3 )
+		{
+			out[0] = src[0];
+			out[1] = src[1];
+			out[2] = src[2];
+		}
+	}
+	else if( layout.dataSize > 0 )
+	{
+		memcpy(out, pixels, layout.dataSize);
+	}
+	else if( !layout.encoded.empty() )
+	{
+		memcpy(out, &layout.encoded[0], layout.encoded.size());
+	}
+}
+
+bool ImageBackend::save( const char* path, const unsigned int* pixels, int width, int height )
+{
+	TRACE_SCOPE_DETAIL("save", path);
+
+	ImageFormat format = imageFormatOf(path);
+	FileLayout layout;
+	FileMapping mapping;
+
+	if( !layOut(format, pixels, width, height, layout) || !mapForWriting(path, layout.size(), &mapping) )
+		return false;
+
+	writeLayout(layout, format, pixels, mapping.data);
+	unmap(&mapping);
+
+	return true;
+}
+
+bool ImageBackend::encodeFile( const char* path, const unsigned int* pixels, int width, int height, std::vector<unsigned char>& file )
+{
+	TRACE_SCOPE_DETAIL("encode file", path);
+
+	ImageFormat format = imageFormatOf(path);
+	FileLayout layout;
+
+	if( !layOut(format, pixels, width, height, layout) )
+		return false;
+
+	// a PNG or QOI body is the file, less its (empty) header
+	if( layout.headerSize == 0 && layout.dataSize == 0 )
+	{
+		file.swap(layout.encoded);
+		return true;
+	}
+
+	file.resize(layout.size());
+	writeLayout(layout, format, pixels, &file[0]);
+
+	return true;
+}
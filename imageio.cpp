@@ -0,0 +1,562 @@
+// Author: Jonathan Decker
+// Description: stb and zlib PNG backends (imageio.h), the other formats are in imageformats.cpp
+//
+// The zlib backend filters every row first, then cuts the filtered data into chunks of whole rows that
+// are deflated at the same time. Each chunk is a raw deflate stream primed with the 32K before it as a
+// dictionary and ended on a byte boundary with a sync flush, so the chunks concatenate into one zlib
+// stream; their Adler-32 checksums are combined rather than recomputed. Chunks have a fixed size, so
+// the file does not depend on the number of threads.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <zlib.h>
+
+#include "arena.h"
+#include "threadpool.h"
+#include "imageio.h"
+#include "trace.h"
+
+extern "C"
+{
+	// decoded images and the writer's buffers live in the thread arena
+	#define STBI_MALLOC(sz)        arenaMalloc(sz)
+	#define STBI_REALLOC(p,newsz)  arenaRealloc(p,newsz)
+	#define STBI_FREE(p)           arenaFree(p)
+	#define STBIW_MALLOC(sz)       arenaMalloc(sz)
+	#define STBIW_REALLOC(p,newsz) arenaRealloc(p,newsz)
+	#define STBIW_FREE(p)          arenaFree(p)
+
+	#define STBI_ONLY_PNG
+	#define STB_IMAGE_IMPLEMENTATION
+	#include "stb_image.h"
+	#define STB_IMAGE_WRITE_IMPLEMENTATION
+	#include "stb_image_write.h"
+}
+
+// filtered bytes deflated by one task, rounded to whole rows
+static const size_t chunkBytes = 256*1024;
+
+// the most a deflate stream can refer back
+static const size_t windowBytes = 32*1024;
+
+static void appendBytes( void* context, void* data, int size )
+{
+	std::vector<unsigned char>* png = (std::vector<unsigned char>*)context;
+	png->insert(png->end(), (unsigned char*)data, (unsigned char*)data + size);
+}
+
+class StbBackend : public ImageBackend
+{
+public:
+	const char* name() const { return "stb"; }
+
+	bool encodePng( const unsigned int* pixels, int width, int height, std::vector<unsigned char>& png )
+	{
+		TRACE_SCOPE("stbi_write_png");
+
+		png.clear();
+		// the same bytes stbi_write_png would put in a file
+		return stbi_write_png_to_func(appendBytes, &png, width, height, 4, pixels, 4*width) != 0;
+	}
+
+protected:
+	unsigned int* loadPng( const char* path, int* width, int* height )
+	{
+		TRACE_SCOPE("stbi_load");
+
+		int channels;
+		return (unsigned int*)stbi_load(path, width, height, &channels, 4);
+	}
+
+	unsigned int* loadPngBytes( const unsigned char* data, size_t length, int* width, int* height )
+	{
+		TRACE_SCOPE("stbi_load_from_memory");
+
+		int channels;
+		return length > 0x7fffffff ? NULL : (unsigned int*)stbi_load_from_memory(data, (int)length, width, height, &channels, 4);
+	}
+
+	void releasePng( unsigned int* pixels )
+	{
+		stbi_image_free(pixels);
+	}
+};
+
+static void writeBigEndian( unsigned char* p, unsigned int v )
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static unsigned char paeth( int a, int b, int c )
+{
+	int p = a + b - c;
+	int pa = abs(p-a);
+	int pb = abs(p-b);
+	int pc = abs(p-c);
+
+	if( pa <= pb && pa <= pc ) return (unsigned char)a;
+	if( pb <= pc ) return (unsigned char)b;
+	return (unsigned char)c;
+}
+
+// one RGBA row with PNG filter type 0 to 4, the type byte first
+static void filterRow( int type, const unsigned char* row, const unsigned char* prior, int n, unsigned char* out )
+{
+	*out++ = (unsigned char)type;
+
+	switch( type )
+	{
+	case 0:
+		memcpy(out, row, n);
+		break;
+	case 1:
+		for( int i = 0; i < 4; ++i ) out[i] = row[i];
+		for( int i = 4; i < n; ++i ) out[i] = (unsigned char)(row[i] - row[i-4]);
+		break;
+	case 2:
+		for( int i = 0; i < n; ++i ) out[i] = (unsigned char)(row[i] - prior[i]);
+		break;
+	case 3:
+		for( int i = 0; i < 4; ++i ) out[i] = (unsigned char)(row[i] - (prior[i] >> 1));
+		for( int i = 4; i < n; ++i ) out[i] = (unsigned char)(row[i] - ((row[i-4] + prior[i]) >> 1));
+		break;
+	default:
+		for( int i = 0; i < 4; ++i ) out[i] = (unsigned char)(row[i] - prior[i]);
+		for( int i = 4; i < n; ++i ) out[i] = (unsigned char)(row[i] - paeth(row[i-4], prior[i], prior[i-4]));
+		break;
+	}
+}
+
+static unsigned int filterCost( const unsigned char* filtered, int n )
+{
+	unsigned int cost = 0;
+
+	for( int i = 1; i <= n; ++i )
+		cost += abs((signed char)filtered[i]);
+
+	return cost;
+}
+
+class ZlibBackend : public StbBackend
+{
+public:
+	ZlibBackend( const PngOptions& png, ThreadPool* borrowed ) : options(png), pool(borrowed), ownedPool(NULL)
+	{
+		if( options.level < 0 ) options.level = 0;
+		if( options.level > 9 ) options.level = 9;
+
+		sprintf(settingsText, "zlib %d %s", options.level, pngFilterName(options.filter));
+
+		if( pool == NULL )
+			pool = ownedPool = new ThreadPool(options.threads);
+	}
+
+	~ZlibBackend()
+	{
+		delete ownedPool;
+	}
+
+	const char* name() const { return "zlib"; }
+	const char* settings() const { return settingsText; }
+
+	bool encodePng( const unsigned int* pixels, int width, int height, std::vector<unsigned char>& png )
+	{
+		if( width <= 0 || height <= 0 )
+			return false;
+
+		const size_t rowBytes = 4*(size_t)width;
+		const size_t stride = rowBytes + 1;
+		const int chunkRows = stride < chunkBytes ? (int)(chunkBytes / stride) : 1;
+		const int chunkCount = (height + chunkRows - 1) / chunkRows;
+
+		std::vector<unsigned char> filtered(stride*height);
+		std::vector<Chunk> chunks(chunkCount);
+		TaskGroup group;
+
+		// rows only depend on the pixels, so every chunk is filtered before any is deflated
+		for( int c = 0; c < chunkCount; ++c )
+		{
+			chunks[c].firstRow = c*chunkRows;
+			chunks[c].rows = height - c*chunkRows < chunkRows ? height - c*chunkRows : chunkRows;
+
+			Chunk* chunk = &chunks[c];
+			pool->enqueue([=, &filtered]{ filterChunk((const unsigned char*)pixels, width, *chunk, &filtered[0]); }, group);
+		}
+
+		pool->wait(group);
+
+		for( int c = 0; c < chunkCount; ++c )
+		{
+			Chunk* chunk = &chunks[c];
+			bool last = c == chunkCount - 1;
+			pool->enqueue([=, &filtered]{ deflateChunk(&filtered[0], stride, *chunk, c == 0, last); }, group);
+		}
+
+		pool->wait(group);
+
+		unsigned long adler = adler32(0, NULL, 0);
+		size_t total = 8 + 25 + 12;
+
+		for( int c = 0; c < chunkCount; ++c )
+		{
+			if( !chunks[c].deflated )
+				return false;
+
+			adler = adler32_combine(adler, chunks[c].adler, (z_off_t)(chunks[c].rows*stride));
+			total += 12 + chunks[c].data.size();
+		}
+
+		// the last chunk carries the checksum of the whole stream
+		Chunk& last = chunks[chunkCount-1];
+		unsigned char trailer[4];
+
+		writeBigEndian(trailer, (unsigned int)adler);
+		last.data.insert(last.data.end(), trailer, trailer + 4);
+		last.crc = crc32(last.crc, trailer, 4);
+
+		static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		unsigned char header[13];
+
+		writeBigEndian(header, width);
+		writeBigEndian(header + 4, height);
+		header[8] = 8;   // bit depth
+		header[9] = 6;   // RGBA
+		header[10] = header[11] = header[12] = 0;
+
+		png.clear();
+		png.reserve(total + 4);
+		png.insert(png.end(), signature, signature + 8);
+		appendChunk(png, "IHDR", header, 13, crc32(crc32(0, (const Bytef*)"IHDR", 4), header, 13));
+
+		for( int c = 0; c < chunkCount; ++c )
+			appendChunk(png, "IDAT", &chunks[c].data[0], (unsigned int)chunks[c].data.size(), chunks[c].crc);
+
+		appendChunk(png, "IEND", NULL, 0, crc32(0, (const Bytef*)"IEND", 4));
+
+		return true;
+	}
+
+private:
+	struct Chunk
+	{
+		int firstRow;
+		int rows;
+		std::vector<unsigned char> data;  // compressed, with the zlib header on the first chunk
+		unsigned long adler;              // of the filtered rows
+		unsigned long crc;                // of the IDAT tag and data
+		bool deflated;
+	};
+
+	void filterChunk( const unsigned char* pixels, int width, const Chunk& chunk, unsigned char* filtered ) const
+	{
+		TRACE_SCOPE("png filter");
+
+		const int n = 4*width;
+		std::vector<unsigned char> zeros(n, 0);
+		std::vector<unsigned char> trial(options.filter == PngFilterAdaptive ? 5*(n+1) : 0);
+
+		for( int y = chunk.firstRow; y < chunk.firstRow + chunk.rows; ++y )
+		{
+			const unsigned char* row = pixels + (size_t)y*n;
+			const unsigned char* prior = y > 0 ? row - n : &zeros[0];
+			unsigned char* out = filtered + (size_t)y*(n+1);
+
+			if( options.filter != PngFilterAdaptive )
+			{
+				filterRow(options.filter - PngFilterNone, row, prior, n, out);
+				continue;
+			}
+
+			int best = 0;
+			unsigned int bestCost = 0;
+
+			for( int type = 0; type < 5; ++type )
+			{
+				filterRow(type, row, prior, n, &trial[type*(n+1)]);
+
+				unsigned int cost = filterCost(&trial[type*(n+1)], n);
+
+				if( type == 0 || cost < bestCost )
+				{
+					best = type;
+					bestCost = cost;
+				}
+			}
+
+			memcpy(out, &trial[best*(n+1)], n+1);
+		}
+	}
+
+	void deflateChunk( const unsigned char* filtered, size_t stride, Chunk& chunk, bool first, bool last ) const
+	{
+		TRACE_SCOPE("deflate");
+
+		const unsigned char* src = filtered + chunk.firstRow*stride;
+		const size_t length = chunk.rows*stride;
+		const size_t start = first ? 2 : 0;
+
+		chunk.deflated = false;
+		chunk.adler = adler32(adler32(0, NULL, 0), src, (uInt)length);
+
+		z_stream z;
+		memset(&z, 0, sizeof(z));
+
+		if( deflateInit2(&z, options.level, Z_DEFLATED, -15, 8, options.filter == PngFilterNone ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK )
+			return;
+
+		size_t before = src - filtered;
+		size_t dictionary = before < windowBytes ? before : windowBytes;
+
+		if( dictionary > 0 && options.level > 0 )
+			deflateSetDictionary(&z, src - dictionary, (uInt)dictionary);
+
+		// a sync flush adds an empty stored block past deflateBound
+		chunk.data.resize(start + deflateBound(&z, (uLong)length) + 16);
+
+		if( first )
+		{
+			// 32K window, FLEVEL from the compression level and FCHECK making the pair a multiple of 31
+			unsigned int flags = options.level < 2 ? 0 : options.level < 6 ? 1 : options.level == 6 ? 2 : 3;
+			unsigned int header = (0x78 << 8) | (flags << 6);
+
+			header += 31 - header % 31;
+			chunk.data[0] = (unsigned char)(header >> 8);
+			chunk.data[1] = (unsigned char)header;
+		}
+
+		z.next_in = (Bytef*)src;
+		z.avail_in = (uInt)length;
+
+		const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+		int status = Z_OK;
+
+		for(;;)
+		{
+			size_t used = start + z.total_out;
+
+			if( used == chunk.data.size() )
+				chunk.data.resize(2*chunk.data.size());
+
+			z.next_out = &chunk.data[used];
+			z.avail_out = (uInt)(chunk.data.size() - used);
+
+			status = deflate(&z, flush);
+
+			if( status == Z_STREAM_END || (status != Z_OK && status != Z_BUF_ERROR) )
+				break;
+
+			// only a full output buffer needs another call, otherwise the sync flush is complete
+			if( z.avail_out > 0 )
+				break;
+		}
+
+		chunk.data.resize(start + z.total_out);
+		deflateEnd(&z);
+
+		if( last ? status != Z_STREAM_END : (status == Z_STREAM_ERROR || status == Z_MEM_ERROR || z.avail_in > 0) )
+			return;
+
+		chunk.crc = crc32(crc32(0, (const Bytef*)"IDAT", 4), &chunk.data[0], (uInt)chunk.data.size());
+		chunk.deflated = true;
+	}
+
+	static void appendChunk( std::vector<unsigned char>& png, const char* tag, const unsigned char* data, unsigned int length, unsigned long crc )
+	{
+		unsigned char bytes[4];
+
+		writeBigEndian(bytes, length);
+		png.insert(png.end(), bytes, bytes + 4);
+		png.insert(png.end(), tag, tag + 4);
+
+		if( length > 0 )
+			png.insert(png.end(), data, data + length);
+
+		writeBigEndian(bytes, (unsigned int)crc);
+		png.insert(png.end(), bytes, bytes + 4);
+	}
+
+	PngOptions options;
+	ThreadPool* pool;
+	ThreadPool* ownedPool;
+	char settingsText[32];
+};
+
+ImageBackend* createStbBackend()
+{
+	return new StbBackend();
+}
+
+ImageBackend* createZlibBackend( const PngOptions& options, ThreadPool* pool )
+{
+	return new ZlibBackend(options, pool);
+}
+
+const char* pngFilterName( PngFilter filter )
+{
+	static const char* names[PngFilterCount] = { "adaptive", "none", "sub", "up", "average", "paeth" };
+	return names[filter < PngFilterCount ? filter : PngFilterAdaptive];
+}
+
+bool findPngFilter( const char* name, PngFilter* filter )
+{
+	for( int f = 0; f < PngFilterCount; ++f )
+	{
+		if( strcmp(name, pngFilterName((PngFilter)f)) == 0 )
+		{
+			*filter = (PngFilter)f;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//#define IMAGEIO_STANDALONE
+#ifdef IMAGEIO_STANDALONE
+
+// PNG encode throughput of stb and of the zlib backend per level and filter, and save/load through each
+// file format, on an image given on the command line
+// build: g++ -std=c++11 -O2 -DIMAGEIO_STANDALONE -I<stb> imageio.cpp imageformats.cpp arena.cpp -lz -pthread
+
+#include <chrono>
+
+static double secondsSince( std::chrono::steady_clock::time_point start )
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps the reads of a mapped image from being optimised away
+static volatile unsigned int touched;
+
+static void measure( ImageBackend& backend, const char* setting, const unsigned int* pixels, int width, int height, int repeats )
+{
+	std::vector<unsigned char> png;
+	double best = 0;
+
+	for( int r = 0; r < repeats; ++r )
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		if( !backend.encodePng(pixels, width, height, png) )
+		{
+			printf("%-5s %-14s failed\n", backend.name(), setting);
+			return;
+		}
+
+		double seconds = secondsSince(start);
+
+		if( r == 0 || seconds < best )
+			best = seconds;
+
+		threadArena().reset();
+	}
+
+	double megabytes = 4.0*width*height / (1024*1024);
+
+	printf("%-5s %-14s %8.1f MB/s %10zu bytes (%.1f%% of raw)\n", backend.name(), setting, megabytes / best, png.size(), 100.0*png.size() / (4.0*width*height));
+}
+
+int main( int argc, char** argv )
+{
+	if( argc < 2 )
+	{
+		printf("usage: imageio image.png [repeats] [threads]\n");
+		return 1;
+	}
+
+	int repeats = argc > 2 ? atoi(argv[2]) : 3;
+	unsigned int threads = argc > 3 ? (unsigned int)atoi(argv[3]) : 0;
+	int width, height;
+
+	ImageBackend* stb = createStbBackend();
+	unsigned int* loaded = stb->load(argv[1], &width, &height);
+
+	if( loaded == NULL )
+	{
+		printf("Error: could not open file %s\n", argv[1]);
+		return 1;
+	}
+
+	// the arena is rewound between encodes, so keep the pixels elsewhere
+	std::vector<unsigned int> pixels(loaded, loaded + (size_t)width*height);
+	stb->release(loaded);
+	threadArena().reset();
+
+	printf("%s: %dx%d, %.1f MB of RGBA\n", argv[1], width, height, 4.0*width*height / (1024*1024));
+
+	measure(*stb, "default", &pixels[0], width, height, repeats);
+
+	// a save and load through each file format, including the page cache
+	static const char* files[] = { "imageio_bench.png", "imageio_bench.ppm", "imageio_bench.pam", "imageio_bench.rgba", "imageio_bench.qoi" };
+
+	for( size_t f = 0; f < sizeof(files)/sizeof(files[0]); ++f )
+	{
+		double saveBest = 0, loadBest = 0;
+		unsigned int checksum = 0;
+
+		for( int r = 0; r < repeats; ++r )
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			stb->save(files[f], &pixels[0], width, height);
+			double saveSeconds = secondsSince(start);
+
+			int w, h;
+			start = std::chrono::steady_clock::now();
+			unsigned int* read = stb->load(files[f], &w, &h);
+
+			// a mapped image is only read when it is used
+			for( size_t i = 0; read != NULL && i < (size_t)w*h; i += 1024 )
+				checksum += read[i];
+
+			stb->release(read);
+			double loadSeconds = secondsSince(start);
+
+			saveBest = r == 0 || saveSeconds < saveBest ? saveSeconds : saveBest;
+			loadBest = r == 0 || loadSeconds < loadBest ? loadSeconds : loadBest;
+			threadArena().reset();
+		}
+
+		FILE* fp = fopen(files[f], "rb");
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fclose(fp);
+		remove(files[f]);
+
+		double megabytes = 4.0*width*height / (1024*1024);
+		printf("%-20s save %8.1f MB/s  load %8.1f MB/s %10ld bytes\n", files[f] + 13, megabytes / saveBest, megabytes / loadBest, size);
+		touched = checksum;
+	}
+
+	static const int levels[] = { 0, 1, 3, 6, 9 };
+	static const PngFilter filters[] = { PngFilterNone, PngFilterUp, PngFilterPaeth, PngFilterAdaptive };
+
+	for( size_t f = 0; f < sizeof(filters)/sizeof(filters[0]); ++f )
+	{
+		for( size_t l = 0; l < sizeof(levels)/sizeof(levels[0]); ++l )
+		{
+			PngOptions options;
+			options.level = levels[l];
+			options.filter = filters[f];
+			options.threads = threads;
+
+			char setting[32];
+			sprintf(setting, "%d %s", levels[l], pngFilterName(filters[f]));
+
+			ImageBackend* backend = createZlibBackend(options);
+			measure(*backend, setting, &pixels[0], width, height, repeats);
+			delete backend;
+		}
+	}
+
+	delete stb;
+
+	return 0;
+}
+
+#endif // IMAGEIO_STANDALONE
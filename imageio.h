@@ -0,0 +1,129 @@
+// Author: Jonathan Decker
+// Description: Image reading and writing behind one interface, so the PNG encoder can be swapped
+//
+// Pixels are exchanged as packed RGBA (same layout as stbi_load with 4 components). The stb backend is
+// the default and writes exactly what stbi_write_png always has; the zlib backend trades its fixed
+// strategy for a chosen compression level and filter and deflates chunks of rows on every core.
+//
+// Between pipeline stages the uncompressed formats avoid PNG altogether: binary PGM/PPM, PAM and a
+// headered RGBA dump are mapped rather than read, and PAM/RGBA pixels are used where they lie in the
+// mapping. QOI is a lossless format that encodes and decodes many times faster than PNG.
+
+#pragma once
+
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+class ThreadPool;
+
+enum PngFilter
+{
+	PngFilterAdaptive,  // per row, the filter with the smallest sum of absolute differences
+	PngFilterNone,
+	PngFilterSub,
+	PngFilterUp,
+	PngFilterAverage,
+	PngFilterPaeth,
+	PngFilterCount
+};
+
+struct PngOptions
+{
+	int level;             // zlib level, 0 (stored) to 9
+	PngFilter filter;
+	unsigned int threads;  // 0 uses one per hardware thread
+
+	PngOptions() : level(6), filter(PngFilterAdaptive), threads(0) {}
+};
+
+// chosen by the extension of the output path, anything not listed is PNG
+enum ImageFormat
+{
+	ImageFormatPng,
+	ImageFormatPpm,   // .ppm, binary RGB
+	ImageFormatPam,   // .pam, RGB_ALPHA
+	ImageFormatRgba,  // .rgba, 16 byte header then the pixels
+	ImageFormatQoi,   // .qoi
+	ImageFormatCount
+};
+
+ImageFormat imageFormatOf( const char* path );
+
+// The size of an image from the first bytes of its file, without decoding it: PNG, QOI, RGBA and netpbm
+// files. fileBytes (optional) receives the length of the file. False for other formats or a bad header
+bool readImageSize( const char* path, int* width, int* height, unsigned long long* fileBytes = NULL );
+
+// a whole file in memory, copy-on-write when read so the pixels can be changed in place
+struct FileMapping
+{
+	unsigned char* data;
+	size_t length;
+	void* file;  // Windows handles
+	void* view;
+};
+
+// Maps a whole file copy-on-write (changes stay in memory), or creates a file of length bytes and maps it
+// for writing. False if the file cannot be opened or is empty
+bool mapForReading( const char* path, FileMapping* mapping );
+bool mapForWriting( const char* path, size_t length, FileMapping* mapping );
+void unmap( FileMapping* mapping );
+
+struct FileLayout;
+
+class ImageBackend
+{
+public:
+	virtual ~ImageBackend();
+
+	virtual const char* name() const = 0;
+
+	// the name and every option that changes the PNG files it writes
+	virtual const char* settings() const { return name(); }
+
+	// The format is recognised by its signature, PNG goes to the backend. Returns NULL if the file
+	// cannot be read, otherwise pixels to hand back to release. Loading and releasing can go on in
+	// several threads at once
+	unsigned int* load( const char* path, int* width, int* height );
+	void release( unsigned int* pixels );
+
+	// the same from a whole file in memory; the pixels may point into data, which has to outlive them
+	unsigned int* load( const unsigned char* data, size_t length, int* width, int* height );
+
+	// in the format of imageFormatOf(path)
+	bool save( const char* path, const unsigned int* pixels, int width, int height );
+
+	// the bytes save would write to path, in memory
+	bool encodeFile( const char* path, const unsigned int* pixels, int width, int height, std::vector<unsigned char>& file );
+
+	// a complete PNG file in memory
+	virtual bool encodePng( const unsigned int* pixels, int width, int height, std::vector<unsigned char>& png ) = 0;
+
+protected:
+	virtual unsigned int* loadPng( const char* path, int* width, int* height ) = 0;
+	virtual unsigned int* loadPngBytes( const unsigned char* data, size_t length, int* width, int* height ) = 0;
+	virtual void releasePng( unsigned int* pixels ) = 0;
+
+private:
+	struct Loaded
+	{
+		unsigned int* pixels;
+		FileMapping mapping;  // data is NULL unless the pixels are in the mapping
+		bool png;             // from loadPng, otherwise malloc'd or mapped
+		bool inBuffer;        // in the caller's buffer
+	};
+
+	bool layOut( ImageFormat format, const unsigned int* pixels, int width, int height, FileLayout& layout );
+
+	std::vector<Loaded> loaded;
+	std::mutex loadedMutex;
+};
+
+// both are owned by the caller
+ImageBackend* createStbBackend();
+
+// pool (optional) is borrowed for the row chunks, otherwise the backend starts options.threads workers
+ImageBackend* createZlibBackend( const PngOptions& options, ThreadPool* pool = NULL );
+
+const char* pngFilterName( PngFilter filter );
+bool findPngFilter( const char* name, PngFilter* filter );
@@ -0,0 +1,219 @@
+// Author: Jonathan Decker
+// Description: Shared LRU cache of encoded marks, keyed by message and Reed-Solomon parameters
+
+#pragma once
+
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+// Set associative cache of MarkLength bit marks for messages of up to MaxMessageLength bytes, one per codec
+// configuration. Lookups never take a lock: every slot is guarded by a sequence counter and readers retry
+// if a writer replaced the slot while they were copying it.
+// Inserts are serialized and evict the least recently used way of the message's set.
+template<unsigned int MaxMessageLength, unsigned int MarkLength>
+class MarkPlanCache
+{
+public:
+	static const unsigned int maxMessageLength = MaxMessageLength;
+	static const unsigned int markLength = MarkLength;
+	static const unsigned int ways = 8;
+
+	// capacity is sets*ways marks
+	explicit MarkPlanCache( unsigned int sets = 64 );
+	~MarkPlanCache();
+
+	// copies the cached mark of (message, codeId) into mark, false on a miss
+	bool lookup( const char* message, unsigned int codeId, unsigned char* mark );
+
+	void insert( const char* message, unsigned int codeId, const unsigned char* mark );
+
+	unsigned long long hits() const { return hitCount.load(std::memory_order_relaxed); }
+	unsigned long long misses() const { return missCount.load(std::memory_order_relaxed); }
+
+private:
+	static const unsigned int keyWords = (maxMessageLength + 7)/8 + 1;
+	static const unsigned int markWords = (markLength + 63)/64;
+
+	// plain atomics only, so a racing read is well defined and simply retried
+	struct Slot
+	{
+		std::atomic<unsigned int> sequence;
+		std::atomic<unsigned long long> lastUse;
+		std::atomic<unsigned long long> key[keyWords];
+		std::atomic<unsigned long long> bits[markWords];
+	};
+
+	static bool makeKey( const char* message, unsigned int codeId, unsigned long long* key );
+	unsigned int setOf( const unsigned long long* key ) const;
+
+	Slot* slots;
+	unsigned int setCount;
+	std::mutex writeMutex;
+	std::atomic<unsigned long long> clock;
+	std::atomic<unsigned long long> hitCount;
+	std::atomic<unsigned long long> missCount;
+
+	MarkPlanCache( const MarkPlanCache& );
+	MarkPlanCache& operator=( const MarkPlanCache& );
+};
+
+// templated, so the implementation lives in the header
+template<unsigned int MaxMessageLength, unsigned int MarkLength>
+MarkPlanCache<MaxMessageLength,MarkLength>::MarkPlanCache( unsigned int sets ) : setCount(sets == 0 ? 1 : sets), clock(1), hitCount(0), missCount(0)
+{
+	slots = new Slot[setCount*ways];
+
+	for( unsigned int s = 0; s < setCount*ways; ++s )
+	{
+		// key word 0 holds the message length and code, 0 never matches a real key
+		slots[s].sequence.store(0);
+		slots[s].lastUse.store(0);
+		for( unsigned int k = 0; k < keyWords; ++k )
+			slots[s].key[k].store(0);
+		for( unsigned int w = 0; w < markWords; ++w )
+			slots[s].bits[w].store(0);
+	}
+}
+
+template<unsigned int MaxMessageLength, unsigned int MarkLength>
+MarkPlanCache<MaxMessageLength,MarkLength>::~MarkPlanCache()
+{
+	delete [] slots;
+}
+
+// word 0: code id and length (+1 so an empty message is still a valid key), then the message bytes
+template<unsigned int MaxMessageLength, unsigned int MarkLength>
+bool MarkPlanCache<MaxMessageLength,MarkLength>::makeKey( const char* message, unsigned int codeId, unsigned long long* key )
+{
+	size_t length = strlen(message);
+
+	if( length > maxMessageLength )
+		return false;
+
+	key[0] = ((unsigned long long)codeId << 32) | (unsigned long long)(length + 1);
+	memset(&key[1], 0, sizeof(unsigned long long)*(keyWords - 1));
+	memcpy(&key[1], message, length);
+
+	return true;
+}
+
+template<unsigned int MaxMessageLength, unsigned int MarkLength>
+unsigned int MarkPlanCache<MaxMessageLength,MarkLength>::setOf( const unsigned long long* key ) const
+{
+	// FNV-1a over the key words
+	unsigned long long h = 14695981039346656037ULL;
+
+	for( unsigned int k = 0; k < keyWords; ++k )
+	{
+		h ^= key[k];
+		h *= 1099511628211ULL;
+	}
+
+	return (unsigned int)((h ^ (h >> 32)) % setCount);
+}
+
+template<unsigned int MaxMessageLength, unsigned int MarkLength>
+bool MarkPlanCache<MaxMessageLength,MarkLength>::lookup( const char* message, unsigned int codeId, unsigned char* mark )
+{
+	unsigned long long key[keyWords];
+
+	if( !makeKey(message, codeId, key) )
+		return false;
+
+	Slot* set = slots + setOf(key)*ways;
+
+	for( unsigned int w = 0; w < ways; ++w )
+	{
+		Slot& slot = set[w];
+		unsigned long long bits[markWords];
+
+		for(;;)
+		{
+			unsigned int before = slot.sequence.load(std::memory_order_acquire);
+
+			// a writer is in the middle of replacing this slot
+			if( before & 1 )
+				continue;
+
+			bool match = true;
+			for( unsigned int k = 0; k < keyWords && match; ++k )
+				match = slot.key[k].load(std::memory_order_relaxed) == key[k];
+
+			if( match )
+				for( unsigned int i = 0; i < markWords; ++i )
+					bits[i] = slot.bits[i].load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if( slot.sequence.load(std::memory_order_relaxed) != before )
+				continue;
+
+			if( !match )
+				break;
+
+			// only write the recency stamp when it changes so hits stay read-only
+			unsigned long long now = clock.load(std::memory_order_relaxed);
+			if( slot.lastUse.load(std::memory_order_relaxed) != now )
+				slot.lastUse.store(now, std::memory_order_relaxed);
+
+			for( unsigned int i = 0; i < markLength; ++i )
+				mark[i] = (unsigned char)((bits[i >> 6] >> (i & 63)) & 1);
+
+			hitCount.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	missCount.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+template<unsigned int MaxMessageLength, unsigned int MarkLength>
+void MarkPlanCache<MaxMessageLength,MarkLength>::insert( const char* message, unsigned int codeId, const unsigned char* mark )
+{
+	unsigned long long key[keyWords];
+
+	if( !makeKey(message, codeId, key) )
+		return;
+
+	unsigned long long bits[markWords];
+	memset(bits, 0, sizeof(bits));
+
+	for( unsigned int i = 0; i < markLength; ++i )
+		if( mark[i] )
+			bits[i >> 6] |= 1ULL << (i & 63);
+
+	std::unique_lock<std::mutex> lock(writeMutex);
+
+	Slot* set = slots + setOf(key)*ways;
+	Slot* victim = &set[0];
+
+	for( unsigned int w = 0; w < ways; ++w )
+	{
+		bool match = true;
+		for( unsigned int k = 0; k < keyWords && match; ++k )
+			match = set[w].key[k].load(std::memory_order_relaxed) == key[k];
+
+		// another thread inserted it first
+		if( match )
+			return;
+
+		if( set[w].lastUse.load(std::memory_order_relaxed) < victim->lastUse.load(std::memory_order_relaxed) )
+			victim = &set[w];
+	}
+
+	unsigned int sequence = victim->sequence.load(std::memory_order_relaxed);
+
+	victim->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for( unsigned int k = 0; k < keyWords; ++k )
+		victim->key[k].store(key[k], std::memory_order_relaxed);
+	for( unsigned int i = 0; i < markWords; ++i )
+		victim->bits[i].store(bits[i], std::memory_order_relaxed);
+
+	victim->lastUse.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	victim->sequence.store(sequence + 2, std::memory_order_release);
+}
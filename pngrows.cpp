@@ -0,0 +1,870 @@
+// Author: Jonathan Decker
+// Description: Row streaming for PNG images
+//
+// Rows are inflated with zlib as they are read and converted to RGBA the way stbi_load does. Rows are
+// written with stb_image_write's filter choice and its fixed-Huffman deflate, run over a sliding window
+// instead of the whole image, so a streamed file is the same, byte for byte, as stbi_write_png's.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#endif
+
+#include "pngrows.h"
+#include "trace.h"
+
+static void closePngStream( FILE* fp )
+{
+	if( fp != NULL && fp != stdin && fp != stdout )
+		fclose(fp);
+}
+
+static unsigned int readBigEndian( const unsigned char* p )
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void writeBigEndian( unsigned char* p, unsigned int v )
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static unsigned char paeth( int a, int b, int c )
+{
+	int p = a + b - c;
+	int pa = abs(p-a);
+	int pb = abs(p-b);
+	int pc = abs(p-c);
+
+	if( pa <= pb && pa <= pc ) return (unsigned char)a;
+	if( pb <= pc ) return (unsigned char)b;
+	return (unsigned char)c;
+}
+
+class PngRowReader : public RowReader
+{
+public:
+	PngRowReader( FILE* stream ) : fp(stream), ownsStream(false), chunkLeft(0), streamEnded(false), hasPalette(false), hasTransparency(false)
+	{
+		memset(&inflater, 0, sizeof(inflater));
+		inflateInit(&inflater);
+
+		for( int i = 0; i < 256; ++i )
+			palette[i] = 0xff000000;
+	}
+
+	~PngRowReader()
+	{
+		inflateEnd(&inflater);
+
+		if( ownsStream )
+			closePngStream(fp);
+	}
+
+	// reads the header chunks up to the first IDAT
+	bool readHeader()
+	{
+		static const unsigned char signature[7] = { 80,78,71,13,10,26,10 };
+		unsigned char header[13];
+		unsigned char tag[8];
+
+		if( fread(header, 1, 7, fp) != 7 || memcmp(header, signature, 7) != 0 )
+			return false;
+
+		if( fread(tag, 1, 8, fp) != 8 || readBigEndian(tag) != 13 || memcmp(tag+4, "IHDR", 4) != 0 || fread(header, 1, 13, fp) != 13 || !skip(4) )
+			return false;
+
+		imageWidth = (int)readBigEndian(header);
+		imageHeight = (int)readBigEndian(header+4);
+		depth = header[8];
+		colourType = header[9];
+
+		// interlaced rows come in seven passes over the whole image
+		if( imageWidth <= 0 || imageHeight <= 0 || header[10] != 0 || header[11] != 0 || header[12] != 0 )
+			return false;
+
+		switch( colourType )
+		{
+		case 0: samples = 1; break;
+		case 2: samples = 3; break;
+		case 3: samples = 1; break;
+		case 4: samples = 2; break;
+		case 6: samples = 4; break;
+		default: return false;
+		}
+
+		bool validDepth = depth == 8 || depth == 16 || ((colourType == 0 || colourType == 3) && (depth == 1 || depth == 2 || depth == 4));
+
+		if( !validDepth || (colourType == 3 && depth == 16) )
+			return false;
+
+		bytesPerPixel = depth < 8 ? 1 : samples*depth/8;
+		rowBytes = ((size_t)imageWidth*samples*depth + 7) / 8;
+		prior.assign(rowBytes, 0);
+		current.resize(rowBytes + 1);
+
+		for(;;)
+		{
+			if( fread(tag, 1, 8, fp) != 8 )
+				return false;
+
+			unsigned int length = readBigEndian(tag);
+
+			if( memcmp(tag+4, "IDAT", 4) == 0 )
+			{
+				chunkLeft = length;
+				ownsStream = colourType != 3 || hasPalette;
+				return ownsStream;
+			}
+
+			if( memcmp(tag+4, "IEND", 4) == 0 )
+				return false;
+
+			if( memcmp(tag+4, "PLTE", 4) == 0 && length <= 256*3 && length % 3 == 0 )
+			{
+				unsigned char entries[256*3];
+
+				if( fread(entries, 1, length, fp) != length || !skip(4) )
+					return false;
+
+				for( unsigned int i = 0; i < length/3; ++i )
+					palette[i] = 0xff000000 | entries[3*i] | (entries[3*i+1] << 8) | (entries[3*i+2] << 16);
+
+				hasPalette = true;
+			}
+			else if( memcmp(tag+4, "tRNS", 4) == 0 && length <= 256 )
+			{
+				unsigned char values[256];
+
+				if( fread(values, 1, length, fp) != length || !skip(4) )
+					return false;
+
+				if( colourType == 3 )
+				{
+					for( unsigned int i = 0; i < length; ++i )
+						palette[i] = (palette[i] & 0x00ffffff) | ((unsigned int)values[i] << 24);
+				}
+				else if( (colourType == 0 && length == 2) || (colourType == 2 && length == 6) )
+				{
+					for( unsigned int i = 0; i < length/2; ++i )
+						key[i] = (values[2*i] << 8) | values[2*i+1];
+
+					hasTransparency = true;
+				}
+			}
+			else if( !skip(length + 4) )
+			{
+				return false;
+			}
+		}
+	}
+
+	bool readRows( unsigned int* dst, int rows )
+	{
+		TRACE_SCOPE("read png rows");
+
+		for( int i = 0; i < rows; ++i, dst += imageWidth )
+		{
+			if( !inflateRow() || !unfilterRow() )
+				return false;
+
+			convertRow((unsigned char*)dst);
+			prior.assign(current.begin() + 1, current.end());
+		}
+
+		return true;
+	}
+
+private:
+	bool skip( unsigned int bytes )
+	{
+		unsigned char buffer[4096];
+
+		while( bytes > 0 )
+		{
+			unsigned int n = bytes < sizeof(buffer) ? bytes : (unsigned int)sizeof(buffer);
+
+			if( fread(buffer, 1, n, fp) != n )
+				return false;
+
+			bytes -= n;
+		}
+
+		return true;
+	}
+
+	// the next filter byte and row, across as many IDAT chunks as it takes
+	bool inflateRow()
+	{
+		inflater.next_out = &current[0];
+		inflater.avail_out = (uInt)current.size();
+
+		while( inflater.avail_out > 0 )
+		{
+			if( streamEnded )
+				return false;
+
+			if( inflater.avail_in == 0 )
+			{
+				while( chunkLeft == 0 )
+				{
+					unsigned char tag[8];
+
+					// the CRC of the chunk just finished, then the next one, which must be IDAT as well
+					if( !skip(4) || fread(tag, 1, 8, fp) != 8 || memcmp(tag+4, "IDAT", 4) != 0 )
+						return false;
+
+					chunkLeft = readBigEndian(tag);
+				}
+
+				size_t n = chunkLeft < sizeof(input) ? chunkLeft : sizeof(input);
+
+				if( fread(input, 1, n, fp) != n )
+					return false;
+
+				chunkLeft -= (unsigned int)n;
+				inflater.next_in = input;
+				inflater.avail_in = (uInt)n;
+			}
+
+			int status = inflate(&inflater, Z_NO_FLUSH);
+
+			if( status == Z_STREAM_END )
+				streamEnded = true;
+			else if( status != Z_OK && status != Z_BUF_ERROR )
+				return false;
+		}
+
+		return true;
+	}
+
+	bool unfilterRow()
+	{
+		unsigned char* x = &current[1];
+		const unsigned char* b = &prior[0];
+		const size_t n = rowBytes;
+		const size_t bpp = bytesPerPixel;
+		size_t i;
+
+		switch( current[0] )
+		{
+		case 0:
+			break;
+		case 1:
+			for( i = bpp; i < n; ++i ) x[i] += x[i-bpp];
+			break;
+		case 2:
+			for( i = 0; i < n; ++i ) x[i] += b[i];
+			break;
+		case 3:
+			for( i = 0; i < bpp; ++i ) x[i] += b[i] >> 1;
+			for( ; i < n; ++i ) x[i] += (x[i-bpp] + b[i]) >> 1;
+			break;
+		case 4:
+			for( i = 0; i < bpp; ++i ) x[i] += paeth(0, b[i], 0);
+			for( ; i < n; ++i ) x[i] += paeth(x[i-bpp], b[i], b[i-bpp]);
+			break;
+		default:
+			return false;
+		}
+
+		return true;
+	}
+
+	// sample s of the row as stored, the value transparency keys are compared with
+	unsigned int rawSample( size_t s ) const
+	{
+		const unsigned char* x = &current[1];
+
+		if( depth == 16 )
+			return (x[2*s] << 8) | x[2*s+1];
+		if( depth == 8 )
+			return x[s];
+
+		unsigned int perByte = 8 / depth;
+		unsigned int shift = 8 - depth*(1 + s % perByte);
+
+		return (x[s / perByte] >> shift) & ((1 << depth) - 1);
+	}
+
+	// a sample as stbi_load reports it: the high byte of 16-bit samples, low depths scaled up to
+	// 0..255 (palette indices are left alone)
+	unsigned char toByte( unsigned int raw ) const
+	{
+		if( depth == 16 )
+			return (unsigned char)(raw >> 8);
+		if( depth == 8 || colourType == 3 )
+			return (unsigned char)raw;
+
+		return (unsigned char)(raw * (depth == 1 ? 0xff : depth == 2 ? 0x55 : 0x11));
+	}
+
+	void convertRow( unsigned char* p ) const
+	{
+		for( int i = 0; i < imageWidth; ++i, p += 4 )
+		{
+			size_t s = (size_t)i*samples;
+
+			switch( colourType )
+			{
+			case 3:
+				{
+					unsigned int c = palette[rawSample(s)];
+					p[0] = (unsigned char)c;
+					p[1] = (unsigned char)(c >> 8);
+					p[2] = (unsigned char)(c >> 16);
+					p[3] = (unsigned char)(c >> 24);
+				}
+				break;
+			case 0:
+			case 4:
+				p[0] = p[1] = p[2] = toByte(rawSample(s));
+				p[3] = colourType == 4 ? toByte(rawSample(s+1)) : (hasTransparency && rawSample(s) == key[0] ? 0 : 255);
+				break;
+			default:
+				p[0] = toByte(rawSample(s));
+				p[1] = toByte(rawSample(s+1));
+				p[2] = toByte(rawSample(s+2));
+				p[3] = colourType == 6 ? toByte(rawSample(s+3))
+				     : (hasTransparency && rawSample(s) == key[0] && rawSample(s+1) == key[1] && rawSample(s+2) == key[2] ? 0 : 255);
+				break;
+			}
+		}
+	}
+
+	FILE* fp;
+	bool ownsStream;  // once the header has been read
+	z_stream inflater;
+	unsigned char input[65536];
+	unsigned int chunkLeft;
+	bool streamEnded;
+
+	int depth;
+	int colourType;
+	unsigned int samples;
+	size_t bytesPerPixel;
+	size_t rowBytes;
+	std::vector<unsigned char> prior;
+	std::vector<unsigned char> current;  // filter byte, then the row
+
+	unsigned int palette[256];           // RGBA as it sits in memory
+	bool hasPalette;
+	bool hasTransparency;
+	unsigned int key[3];
+};
+
+RowReader* openPngRowReader( FILE* fp )
+{
+	PngRowReader* reader = new PngRowReader(fp);
+
+	if( !reader->readHeader() )
+	{
+		delete reader;
+		return NULL;
+	}
+
+	return reader;
+}
+
+#ifdef _WIN32
+static long long tellStream( FILE* fp ) { return _ftelli64(fp); }
+static bool seekStream( FILE* fp, long long offset ) { return _fseeki64(fp, offset, SEEK_SET) == 0; }
+static bool truncateStream( FILE* fp, long long size ) { return fflush(fp) == 0 && _chsize_s(_fileno(fp), size) == 0; }
+#else
+static long long tellStream( FILE* fp ) { return (long long)ftello(fp); }
+static bool seekStream( FILE* fp, long long offset ) { return fseeko(fp, (off_t)offset, SEEK_SET) == 0; }
+static bool truncateStream( FILE* fp, long long size ) { return fflush(fp) == 0 && ftruncate(fileno(fp), (off_t)size) == 0; }
+#endif
+
+// stb_image_write's deflate: the whole image in one block of fixed Huffman codes, a hash of the next
+// three bytes keeping up to 2*quality recent positions per entry, and one step of lazy matching.
+// Positions are absolute, so only the last 32K window and the bytes one step looks ahead at are kept
+static const unsigned int deflateHashSize = 16384;
+static const unsigned int deflateQuality = 8;
+static const unsigned int deflateWindow = 32768;
+static const unsigned int deflateLookahead = 260;
+static const unsigned int deflateBufferSize = 1 << 17;
+
+static const unsigned short deflateLengthBase[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+static const unsigned char  deflateLengthExtra[] = { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short deflateDistanceBase[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+static const unsigned char  deflateDistanceExtra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static unsigned int reverseBits( unsigned int code, unsigned int bits )
+{
+	unsigned int reversed = 0;
+
+	while( bits-- )
+	{
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+
+	return reversed;
+}
+
+class StbDeflater
+{
+public:
+	StbDeflater()
+		: buffer(deflateBufferSize), chains((size_t)deflateHashSize*2*deflateQuality), chainLength(deflateHashSize, 0),
+		  total(0), next(0), bitBuffer(0), bitCount(0)
+	{
+		out.push_back(0x78);  // DEFLATE 32K window
+		out.push_back(0x5e);  // FLEVEL = 1
+		addBits(1,1);         // BFINAL
+		addBits(1,2);         // BTYPE = 1, fixed Huffman
+	}
+
+	// compresses as far as the lookahead allows; the codes are appended to out
+	void write( const unsigned char* data, size_t n )
+	{
+		while( n > 0 )
+		{
+			size_t kept = (size_t)(total - (next > deflateWindow ? next - deflateWindow : 0));
+			size_t count = n < deflateBufferSize - kept ? n : deflateBufferSize - kept;
+
+			for( size_t i = 0; i < count; ++i )
+				buffer[(total + i) & (deflateBufferSize - 1)] = data[i];
+
+			total += count;
+			data += count;
+			n -= count;
+
+			compress(false);
+		}
+	}
+
+	void finish()
+	{
+		compress(true);
+
+		for( ; next < total; ++next )
+			literal(byteAt(next));
+
+		huffman(256);
+
+		while( bitCount > 0 )
+			addBits(0,1);
+	}
+
+	std::vector<unsigned char> out;
+
+private:
+	unsigned char byteAt( unsigned long long position ) const
+	{
+		return buffer[position & (deflateBufferSize - 1)];
+	}
+
+	unsigned int hash( unsigned long long position ) const
+	{
+		unsigned int h = byteAt(position) + (byteAt(position+1) << 8) + (byteAt(position+2) << 16);
+
+		h ^= h << 3;
+		h += h >> 5;
+		h ^= h << 4;
+		h += h >> 17;
+		h ^= h << 25;
+		h += h >> 6;
+
+		return h & (deflateHashSize - 1);
+	}
+
+	unsigned int matchLength( unsigned long long from, unsigned long long position ) const
+	{
+		unsigned long long limit = total - position < 258 ? total - position : 258;
+		unsigned int n = 0;
+
+		while( n < limit && byteAt(from + n) == byteAt(position + n) )
+			++n;
+
+		return n;
+	}
+
+	// until the input is finished, only positions whose lazy step can see 258 bytes ahead are coded
+	void compress( bool final )
+	{
+		while( final ? next + 3 < total : next + deflateLookahead <= total )
+		{
+			const unsigned long long i = next;
+
+			unsigned int h = hash(i);
+			unsigned long long* chain = &chains[(size_t)h*2*deflateQuality];
+			unsigned int best = 3;
+			unsigned long long bestPosition = 0;
+			bool found = false;
+
+			for( unsigned int j = 0; j < chainLength[h]; ++j )
+			{
+				if( chain[j] + deflateWindow > i )
+				{
+					unsigned int d = matchLength(chain[j], i);
+
+					if( d >= best )
+					{
+						best = d;
+						bestPosition = chain[j];
+						found = true;
+					}
+				}
+			}
+
+			// a full entry drops its older half
+			if( chainLength[h] == 2*deflateQuality )
+			{
+				memmove(chain, chain + deflateQuality, sizeof(*chain)*deflateQuality);
+				chainLength[h] = deflateQuality;
+			}
+
+			chain[chainLength[h]++] = i;
+
+			// a longer match at the next byte codes this one as a literal
+			if( found )
+			{
+				h = hash(i+1);
+				chain = &chains[(size_t)h*2*deflateQuality];
+
+				for( unsigned int j = 0; j < chainLength[h]; ++j )
+				{
+					if( chain[j] + deflateWindow - 1 > i && matchLength(chain[j], i+1) > best )
+					{
+						found = false;
+						break;
+					}
+				}
+			}
+
+			if( found )
+			{
+				unsigned int distance = (unsigned int)(i - bestPosition);
+				unsigned int j;
+
+				for( j = 0; best > deflateLengthBase[j+1]-1u; ++j ) {}
+				huffman(j + 257);
+				if( deflateLengthExtra[j] )
+					addBits(best - deflateLengthBase[j], deflateLengthExtra[j]);
+
+				for( j = 0; distance > deflateDistanceBase[j+1]-1u; ++j ) {}
+				addBits(reverseBits(j,5), 5);
+				if( deflateDistanceExtra[j] )
+					addBits(distance - deflateDistanceBase[j], deflateDistanceExtra[j]);
+
+				next += best;
+			}
+			else
+			{
+				literal(byteAt(i));
+				++next;
+			}
+		}
+	}
+
+	void addBits( unsigned int code, unsigned int bits )
+	{
+		bitBuffer |= code << bitCount;
+		bitCount += bits;
+
+		while( bitCount >= 8 )
+		{
+			out.push_back((unsigned char)bitBuffer);
+			bitBuffer >>= 8;
+			bitCount -= 8;
+		}
+	}
+
+	void huffman( unsigned int symbol )
+	{
+		if( symbol <= 143 )
+			addBits(reverseBits(0x30 + symbol, 8), 8);
+		else if( symbol <= 255 )
+			addBits(reverseBits(0x190 + symbol - 144, 9), 9);
+		else if( symbol <= 279 )
+			addBits(reverseBits(symbol - 256, 7), 7);
+		else
+			addBits(reverseBits(0xc0 + symbol - 280, 8), 8);
+	}
+
+	void literal( unsigned char c )
+	{
+		huffman(c);
+	}
+
+	std::vector<unsigned char> buffer;        // ring of the last deflateBufferSize bytes
+	std::vector<unsigned long long> chains;   // 2*quality positions per hash entry
+	std::vector<unsigned char> chainLength;
+	unsigned long long total;                 // bytes written so far
+	unsigned long long next;                  // first byte not coded yet
+	unsigned int bitBuffer;
+	unsigned int bitCount;
+};
+
+class PngRowWriter : public RowWriter
+{
+public:
+	PngRowWriter( FILE* stream, int w, int h )
+		: fp(stream), width(w), height(h), rowsWritten(0), prior(4*(size_t)w), line(4*(size_t)w + 1), trial(4*(size_t)w),
+		  spill(NULL), adler(adler32(0, NULL, 0)), crc(0), idatLength(0), failed(false)
+	{
+	}
+
+	~PngRowWriter()
+	{
+		if( spill != NULL )
+			fclose(spill);
+		closePngStream(fp);
+	}
+
+	// the signature, the header and the start of the single IDAT chunk
+	bool begin()
+	{
+		static const unsigned char signature[8] = { 137,80,78,71,13,10,26,10 };
+		unsigned char header[13];
+
+		writeBigEndian(header, (unsigned int)width);
+		writeBigEndian(header+4, (unsigned int)height);
+		header[8] = 8;   // bits per sample
+		header[9] = 6;   // RGBA
+		header[10] = header[11] = header[12] = 0;
+
+		// the filtered rows, in case stored blocks turn out smaller than the deflated ones
+		spill = tmpfile();
+
+		if( spill == NULL || fwrite(signature, 1, 8, fp) != 8 || !writeChunk("IHDR", header, 13) )
+			return false;
+
+		lengthOffset = tellStream(fp);
+
+		return lengthOffset >= 0 && fwrite("\0\0\0\0IDAT", 1, 8, fp) == 8 && startData();
+	}
+
+	bool writeRows( const unsigned int* src, int rows )
+	{
+		TRACE_SCOPE("write png rows");
+
+		for( int i = 0; i < rows && !failed; ++i, src += width, ++rowsWritten )
+		{
+			const unsigned char* z = (const unsigned char*)src;
+
+			filterRow(z, rowsWritten == 0);
+			memcpy(&prior[0], z, prior.size());
+
+			adler = adler32(adler, &line[0], (uInt)line.size());
+			failed = fwrite(&line[0], 1, line.size(), spill) != line.size();
+
+			deflater.write(&line[0], line.size());
+			drain(deflater.out);
+		}
+
+		return !failed;
+	}
+
+	bool finish()
+	{
+		if( failed || rowsWritten != height )
+			return false;
+
+		deflater.finish();
+		drain(deflater.out);
+
+		// stb_image_write keeps the deflated data only if it is no larger than stored blocks would be
+		const unsigned long long dataLength = (unsigned long long)height*line.size();
+
+		if( idatLength > dataLength + 2 + ((dataLength + 32766) / 32767)*5 )
+			writeStored(dataLength);
+
+		unsigned char trailer[4];
+		writeBigEndian(trailer, adler);
+		drainBytes(trailer, 4);
+
+		if( failed || idatLength > 0x7fffffff )
+			return false;
+
+		writeBigEndian(trailer, crc);
+
+		if( fwrite(trailer, 1, 4, fp) != 4 || !writeChunk("IEND", NULL, 0) )
+			return false;
+
+		long long end = tellStream(fp);
+
+		writeBigEndian(trailer, (unsigned int)idatLength);
+
+		return end >= 0 && truncateStream(fp, end) && seekStream(fp, lengthOffset) && fwrite(trailer, 1, 4, fp) == 4 && fflush(fp) == 0;
+	}
+
+private:
+	bool writeChunk( const char* tag, const unsigned char* data, unsigned int length )
+	{
+		unsigned char bytes[4];
+		unsigned int chunkCrc = crc32(0, (const Bytef*)tag, 4);
+
+		// a NULL buffer would restart the CRC
+		if( length > 0 )
+			chunkCrc = crc32(chunkCrc, data, length);
+
+		writeBigEndian(bytes, length);
+		if( fwrite(bytes, 1, 4, fp) != 4 || fwrite(tag, 1, 4, fp) != 4 || (length > 0 && fwrite(data, 1, length, fp) != length) )
+			return false;
+
+		writeBigEndian(bytes, chunkCrc);
+		return fwrite(bytes, 1, 4, fp) == 4;
+	}
+
+	bool startData()
+	{
+		dataOffset = tellStream(fp);
+		crc = crc32(0, (const Bytef*)"IDAT", 4);
+		idatLength = 0;
+
+		return dataOffset >= 0;
+	}
+
+	void drainBytes( const unsigned char* data, size_t n )
+	{
+		if( n == 0 )
+			return;
+
+		crc = crc32(crc, data, (uInt)n);
+		idatLength += n;
+		failed = failed || fwrite(data, 1, n, fp) != n;
+	}
+
+	void drain( std::vector<unsigned char>& bytes )
+	{
+		drainBytes(bytes.empty() ? NULL : &bytes[0], bytes.size());
+		bytes.clear();
+	}
+
+	// the zlib stream again from the start, as stored blocks of the spilled rows
+	void writeStored( unsigned long long dataLength )
+	{
+		std::vector<unsigned char> block(5 + 32767);
+
+		if( !seekStream(fp, dataOffset) || !startData() || fseek(spill, 0, SEEK_SET) != 0 )
+		{
+			failed = true;
+			return;
+		}
+
+		block[0] = 0x78;
+		block[1] = 0x5e;
+		drainBytes(&block[0], 2);
+
+		for( unsigned long long j = 0; j < dataLength && !failed; )
+		{
+			unsigned int blockLength = dataLength - j > 32767 ? 32767 : (unsigned int)(dataLength - j);
+
+			block[0] = dataLength - j == blockLength;  // BFINAL, BTYPE = 0
+			block[1] = (unsigned char)blockLength;
+			block[2] = (unsigned char)(blockLength >> 8);
+			block[3] = (unsigned char)~blockLength;
+			block[4] = (unsigned char)(~blockLength >> 8);
+
+			failed = fread(&block[5], 1, blockLength, spill) != blockLength;
+			drainBytes(&block[0], 5 + blockLength);
+
+			j += blockLength;
+		}
+	}
+
+	// stb_image_write's filter choice: each of the five filters is tried and the smallest sum of the
+	// residuals as signed bytes wins, the first one on ties. On the first row Up is None and Average and
+	// Paeth see a zero row above, but the filter byte is still the one that was tried
+	void filterRow( const unsigned char* z, bool first )
+	{
+		int bestValue = 0x7fffffff;
+
+		for( int filter = 0; filter < 5; ++filter )
+		{
+			encodeRow(z, first, filter, &trial[0]);
+
+			int value = 0;
+			for( size_t i = 0; i < trial.size(); ++i )
+				value += abs((signed char)trial[i]);
+
+			if( value < bestValue )
+			{
+				bestValue = value;
+				line[0] = (unsigned char)filter;
+				memcpy(&line[1], &trial[0], trial.size());
+			}
+		}
+	}
+
+	void encodeRow( const unsigned char* z, bool first, int filter, unsigned char* dst ) const
+	{
+		static const int firstRowType[5] = { 0,1,0,5,6 };
+
+		const unsigned char* up = &prior[0];
+		const size_t n = prior.size();
+		const int type = first ? firstRowType[filter] : filter;
+		size_t i;
+
+		if( type == 0 )
+		{
+			memcpy(dst, z, n);
+			return;
+		}
+
+		for( i = 0; i < 4; ++i )
+		{
+			switch( type )
+			{
+			case 2: dst[i] = z[i] - up[i]; break;
+			case 3: dst[i] = z[i] - (up[i] >> 1); break;
+			case 4: dst[i] = z[i] - paeth(0, up[i], 0); break;
+			default: dst[i] = z[i]; break;
+			}
+		}
+
+		switch( type )
+		{
+		case 1: for( ; i < n; ++i ) dst[i] = z[i] - z[i-4]; break;
+		case 2: for( ; i < n; ++i ) dst[i] = z[i] - up[i]; break;
+		case 3: for( ; i < n; ++i ) dst[i] = z[i] - ((z[i-4] + up[i]) >> 1); break;
+		case 4: for( ; i < n; ++i ) dst[i] = z[i] - paeth(z[i-4], up[i], up[i-4]); break;
+		case 5: for( ; i < n; ++i ) dst[i] = z[i] - (z[i-4] >> 1); break;
+		case 6: for( ; i < n; ++i ) dst[i] = z[i] - paeth(z[i-4], 0, 0); break;
+		}
+	}
+
+	FILE* fp;
+	int width;
+	int height;
+	int rowsWritten;
+	std::vector<unsigned char> prior;  // the previous row as given
+	std::vector<unsigned char> line;   // filter byte and the filtered row
+	std::vector<unsigned char> trial;
+	StbDeflater deflater;
+	FILE* spill;
+	unsigned int adler;
+	unsigned int crc;                  // of the IDAT chunk so far
+	unsigned long long idatLength;
+	long long lengthOffset;
+	long long dataOffset;
+	bool failed;
+};
+
+RowWriter* openPngRowWriter( FILE* fp, int width, int height )
+{
+	PngRowWriter* writer = new PngRowWriter(fp, width, height);
+
+	if( !writer->begin() )
+	{
+		delete writer;
+		return NULL;
+	}
+
+	return writer;
+}
@@ -0,0 +1,16 @@
+// Author: Jonathan Decker
+// Description: Row streaming for PNG images, used by rowio.cpp
+
+#pragma once
+
+#include <stdio.h>
+
+#include "rowio.h"
+
+// fp is positioned just after the first byte of the signature. Returns NULL, leaving fp to the caller,
+// for interlaced images and anything else stbi_load would not read the same way row by row
+RowReader* openPngRowReader( FILE* fp );
+
+// Writes RGBA exactly as stbi_write_png does. fp must be seekable: the length of the image data is
+// filled in once the last row is written. The writer owns fp from then on
+RowWriter* openPngRowWriter( FILE* fp, int width, int height );
@@ -1,46 +1,131 @@
+newoption {
+   trigger     = "trace",
+   description = "Compile in the --trace timeline (WAVESCRIBE_TRACE)"
+}
+
 solution "WaveScribe"
    configurations { "Debug", "Release" }
 
    SchifraDir = "%SCHIFRADIR%"
    STBDir     = "%STBDIR%"
+   ZLibDir    = "%ZLIBDIR%"
+
+   -- shared by every project in the solution
+   configuration { "Debug", "macosx" }
+      defines { "_DEBUG","DEBUG" }
+      includedirs { "/usr/local/include", SchifraDir, STBDir }
+      libdirs { "/usr/local/lib" }
+      links { "z" }
+      buildoptions { "-std=c++11", "-ffp-contract=off" }
+      flags { "Symbols" }
+
+   configuration { "Release", "macosx" }
+      defines { }
+      includedirs { "/usr/local/include", SchifraDir, STBDir }
+      libdirs { "/usr/local/lib" }
+      links { "z" }
+      buildoptions { "-std=c++11", "-ffp-contract=off" }
+      flags { "Optimize" }
+
+   configuration { "Debug", "linux" }
+      defines { "_DEBUG","DEBUG" }
+      includedirs { SchifraDir, STBDir }
+      links { "pthread", "z" }
+      buildoptions { "-std=c++11", "-ffp-contract=off" }
+      flags { "Symbols" }
+
+   configuration { "Release", "linux" }
+      defines { }
+      includedirs { SchifraDir, STBDir }
+      links { "pthread", "z" }
+      buildoptions { "-std=c++11", "-ffp-contract=off" }
+      flags { "Optimize" }
+
+   configuration { "Debug", "windows" }
+      targetdir  "bin/Debug"
+      defines { "_DEBUG","DEBUG" }
+      includedirs { SchifraDir, STBDir, ZLibDir }
+      libdirs { ZLibDir }
+      links { "zlib" }
+      flags { "Symbols", "Unicode", "StaticRuntime" }
+
+   configuration { "Release", "windows" }
+      targetdir  "bin/Release"
+      defines { "WIN32","_WINDOWS","_UNICODE","UNICODE" }
+      includedirs { SchifraDir, STBDir, ZLibDir }
+      libdirs { ZLibDir }
+      links { "zlib" }
+      flags { "Optimize", "Unicode", "StaticRuntime" }
+
+   configuration { "trace" }
+      defines { "WAVESCRIBE_TRACE" }
+
+   -- sources shared by the application and the self checks
+   CoreFiles = { STBDir .. "/stb_image.h",
+                 STBDir .. "/stb_image_write.h",
+                 "arena.h",
+                 "arena.cpp",
+                 "asyncfiles.h",
+                 "asyncfiles.cpp",
+                 "batch.h",
+                 "batch.cpp",
+                 "codecconfig.h",
+                 "cpufeatures.h",
+                 "dwt.h",
+                 "dwt97.c",
+                 "framestream.h",
+                 "framestream.cpp",
+                 "imageio.h",
+                 "imageio.cpp",
+                 "imageformats.cpp",
+                 "markcache.h",
+                 "pngrows.h",
+                 "pngrows.cpp",
+                 "quadlanes.h",
+                 "quadsimd.h",
+                 "quadsimd.cpp",
+                 "resultcache.h",
+                 "resultcache.cpp",
+                 "rowio.h",
+                 "rowio.cpp",
+                 "rsbatch.h",
+                 "rsbatch.cpp",
+                 "rslanes.h",
+                 "sidecar.h",
+                 "sidecar.cpp",
+                 "threadpool.h",
+                 "trace.h",
+                 "trace.cpp",
+                 "wavelet.h",
+                 "wavelet.cpp",
+                 "wavescribe.h",
+                 "wavescribe.cpp",
+                 "ycbcr.h",
+                 "ycbcr.cpp"
+               }
 
    project "WaveScribe"
       kind "ConsoleApp"
       language "C++"
 
-      files { STBDir .. "/stb_image.h",
-              STBDir .. "/stb_image_write.h",
-              "dwt.h",
-              "dwt97.c",
-              "wavescribe.cpp"
-            }
- 
-      configuration { "Debug", "macosx" }
-         defines { "_DEBUG","DEBUG" }
-         includedirs { "/usr/local/include", SchifraDir, STBDir }
-         libdirs { "/usr/local/lib" }
-         links { }
-         flags { "Symbols" }
- 
-      configuration { "Release", "macosx" }
-         defines { }
-         includedirs { "/usr/local/include", SchifraDir, STBDir }
-         libdirs { "/usr/local/lib" }
-         links { }
-         flags { "Optimize" }
-
-      configuration { "Debug", "windows" }
-         targetdir  "bin/Debug"
-         defines { "_DEBUG","DEBUG" }
-         includedirs { SchifraDir, STBDir }
-         libdirs { }
-         links { }
-         flags { "Symbols", "Unicode", "StaticRuntime" }
-
-      configuration { "Release", "windows" }
-         targetdir  "bin/Release"
-         defines { "WIN32","_WINDOWS","_UNICODE","UNICODE" }
-         includedirs { SchifraDir, STBDir }
-         libdirs {  }
-         links { }
-         flags { "Optimize", "Unicode", "StaticRuntime" }
+      files { CoreFiles }
+
+   project "WaveScribeVerify"
+      kind "ConsoleApp"
+      language "C++"
+
+      files { CoreFiles, "verify.cpp" }
+      defines { "WAVESCRIBE_NO_MAIN" }
+
+   project "WaveScribeDifferential"
+      kind "ConsoleApp"
+      language "C++"
+
+      files { CoreFiles, "reference.h", "reference.cpp", "differential.cpp" }
+      defines { "WAVESCRIBE_NO_MAIN" }
+
+   project "Hidden"
+      kind "ConsoleApp"
+      language "C++"
+
+      files { STBDir .. "/stb_image.h", STBDir .. "/stb_image_write.h", "arena.h", "arena.cpp", "threadpool.h", "imageio.h", "imageio.cpp", "imageformats.cpp", "rowio.h", "rowio.cpp", "pngrows.h", "pngrows.cpp", "trace.h", "trace.cpp", "hidden.cpp" }
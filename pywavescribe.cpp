@@ -0,0 +1,495 @@
+// Author: Jonathan Decker
+// Description: Python module over the library interface (wavescribe.h), built by setup.py
+//
+// Images are C-contiguous buffers of packed RGBA pixels, such as NumPy arrays: height x width x 4 bytes,
+// height x width 32 bit values, or any flat buffer with width= and height= given. The pixels are used where
+// they lie: encode marks them in place and needs a writable buffer, decode and detect only read them.
+// The GIL is released while an image is transformed, so Python threads working on different images run
+// in parallel. Every library call is reentrant, working buffers are per thread (arena.h, dwt97.c).
+// Tiles go to worker pools that live as long as the module and are shared by every calling thread; the
+// buffers of the calling thread itself are given back before each call returns
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <limits.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+
+#include "arena.h"
+#include "threadpool.h"
+#include "wavescribe.h"
+
+extern "C"
+{
+	#include "dwt.h"
+}
+
+// The pixels of a buffer, held until the view is destroyed
+class PixelView
+{
+public:
+	PixelView() : pixels(NULL), width(0), height(0), held(false) {}
+
+	~PixelView()
+	{
+		if( held )
+			PyBuffer_Release(&view);
+	}
+
+	// false with an exception set if object does not hold width x height pixels (taken from its shape if 0)
+	bool open( PyObject* object, bool writable, int givenWidth, int givenHeight );
+
+	unsigned int* pixels;
+	int width;
+	int height;
+
+private:
+	PixelView( const PixelView& );
+	PixelView& operator=( const PixelView& );
+
+	Py_buffer view;
+	bool held;
+};
+
+bool PixelView::open( PyObject* object, bool writable, int givenWidth, int givenHeight )
+{
+	if( PyObject_GetBuffer(object, &view, PyBUF_C_CONTIGUOUS | (writable ? PyBUF_WRITABLE : 0)) != 0 )
+		return false;
+
+	held = true;
+
+	Py_ssize_t w = givenWidth;
+	Py_ssize_t h = givenHeight;
+
+	if( w == 0 && h == 0 )
+	{
+		if( view.ndim == 3 && view.shape[2] == 4 && view.itemsize == 1 )
+		{
+			h = view.shape[0];
+			w = view.shape[1];
+		}
+		else if( view.ndim == 2 && view.itemsize == 4 )
+		{
+			h = view.shape[0];
+			w = view.shape[1];
+		}
+	}
+
+	Py_ssize_t count = view.len / 4;
+
+	if( w <= 0 || h <= 0 || w > INT_MAX || h > INT_MAX || view.len % 4 != 0 || count % w != 0 || count / w != h )
+	{
+		PyErr_SetString(PyExc_ValueError, "expecting RGBA pixels: height x width x 4 bytes, height x width 32 bit values, or a flat buffer of width x height x 4 bytes with width= and height=");
+		return false;
+	}
+
+	if( ((size_t)view.buf & 3) != 0 )
+	{
+		PyErr_SetString(PyExc_ValueError, "the pixels have to be 4 byte aligned");
+		return false;
+	}
+
+	pixels = (unsigned int*)view.buf;
+	width = (int)w;
+	height = (int)h;
+
+	return true;
+}
+
+// One pool per number of threads asked for, the one of threads=0 made at import. Each call waits for its
+// own tasks only, so calls from several Python threads can share a pool
+static std::mutex poolsMutex;
+static std::map<unsigned int, ThreadPool*> pools;
+
+static ThreadPool* sharedPool( unsigned int threads )
+{
+	std::lock_guard<std::mutex> lock(poolsMutex);
+	ThreadPool*& pool = pools[threads];
+
+	if( pool == NULL )
+		pool = new ThreadPool(threads, dwtcleanup);
+
+	return pool;
+}
+
+// at interpreter exit, after the last call
+static void deletePools()
+{
+	for( std::map<unsigned int, ThreadPool*>::iterator p = pools.begin(); p != pools.end(); ++p )
+		delete p->second;
+
+	pools.clear();
+}
+
+// The calling thread belongs to Python and nothing would free its DWT buffers (dwt97.c) when it ends, so
+// they and its arena go before returning. The pool workers keep theirs
+static void releaseThreadState()
+{
+	threadArena().trim();
+	dwtcleanup();
+}
+
+static bool findCodec( const char* config, const char* wavelet, const char* space, Codec* codec )
+{
+	if( !findCodecPreset(config, &codec->preset) )
+	{
+		PyErr_Format(PyExc_ValueError, "unknown codec configuration %s (standard, long or large)", config);
+		return false;
+	}
+
+	if( !findWaveletKind(wavelet, &codec->wavelet) )
+	{
+		PyErr_Format(PyExc_ValueError, "unknown wavelet %s (cdf97, legall53 or int97)", wavelet);
+		return false;
+	}
+
+	if( !findColorSpace(space, &codec->space) )
+	{
+		PyErr_Format(PyExc_ValueError, "unknown colour space %s (lab or ycbcr)", space);
+		return false;
+	}
+
+	return true;
+}
+
+static unsigned int nextPow2( unsigned int n )
+{
+	unsigned int temp = 1;
+	while( n > temp ) temp <<= 1;
+	return temp;
+}
+
+// the size check of insertWatermark and decodeWatermark, without their message on stderr
+static bool fitsTile( int width, int height, CodecPreset preset )
+{
+	unsigned int tileSize = codecInfo(preset).tileSize;
+
+	return nextPow2(width) == tileSize || nextPow2(height) == tileSize;
+}
+
+// how a mark is read, the same for every codec tried
+struct ReadOptions
+{
+	double strength;
+	bool tiled;
+	unsigned int quorum;
+	unsigned int search;
+};
+
+// Reads the mark of codec, without the GIL; false if the image has nothing to read it from. pool is only
+// used in tiled mode and by the search
+static bool readMark( ThreadPool* pool, const PixelView& image, const ReadOptions& options, Codec codec, unsigned char* mark, DecodeResult* result )
+{
+	const CodecInfo& info = codecInfo(codec.preset);
+
+	if( options.tiled )
+	{
+		if( countFullTiles(image.width, image.height, codec.preset) == 0 )
+			return false;
+
+		decodeTiledWatermark(*pool, image.pixels, mark, image.width, image.height, options.strength, options.quorum, codec, result);
+	}
+	else if( options.search > 0 )
+	{
+		if( options.search > info.tileSize/2 )
+			return false;
+
+		searchWatermark(*pool, image.pixels, mark, image.width, image.height, options.search, options.strength, codec, result);
+	}
+	else if( !fitsTile(image.width, image.height, codec.preset) || !decodeWatermark(image.pixels, mark, image.width, image.height, options.strength, codec, result) )
+	{
+		return false;
+	}
+
+	return true;
+}
+
+// a size x size matrix over a copy of data, for NumPy and memoryview alike
+static PyObject* matrixView( const void* data, unsigned int size, size_t itemSize, const char* format )
+{
+	PyObject* bytes = PyBytes_FromStringAndSize((const char*)data, (Py_ssize_t)(size*size*itemSize));
+
+	if( bytes == NULL )
+		return NULL;
+
+	PyObject* flat = PyMemoryView_FromObject(bytes);
+	Py_DECREF(bytes);
+
+	if( flat == NULL )
+		return NULL;
+
+	PyObject* matrix = PyObject_CallMethod(flat, "cast", "s(II)", format, size, size);
+	Py_DECREF(flat);
+
+	return matrix;
+}
+
+// stores value, stolen, under key; false if value is NULL or could not be stored
+static bool setItem( PyObject* dict, const char* key, PyObject* value )
+{
+	if( value == NULL )
+		return false;
+
+	int failed = PyDict_SetItemString(dict, key, value);
+	Py_DECREF(value);
+
+	return failed == 0;
+}
+
+// The decode result as a dict with the names of the --json output, plus the bits read as "mark". The
+// confidence and the mark are markSize x markSize memoryviews of float and unsigned char
+static PyObject* decodeResultDict( const DecodeResult& result, const unsigned char* mark )
+{
+	PyObject* dict = PyDict_New();
+
+	if( dict == NULL )
+		return NULL;
+
+	bool stored = setItem(dict, "config", PyUnicode_FromString(codecInfo(result.preset).name)) &&
+	              setItem(dict, "wavelet", PyUnicode_FromString(waveletName(result.wavelet))) &&
+	              setItem(dict, "space", PyUnicode_FromString(colorSpaceName(result.space))) &&
+	              setItem(dict, "decoded", PyBool_FromLong(result.decoded)) &&
+	              setItem(dict, "message", PyUnicode_FromString(result.message)) &&
+	              setItem(dict, "correctedSymbols", PyLong_FromUnsignedLong(result.correctedSymbols)) &&
+	              setItem(dict, "correctableSymbols", PyLong_FromUnsignedLong(result.correctableSymbols)) &&
+	              setItem(dict, "margin", PyLong_FromLong(result.margin)) &&
+	              setItem(dict, "bandAgreement", PyFloat_FromDouble(result.bandAgreement)) &&
+	              setItem(dict, "meanConfidence", PyFloat_FromDouble(result.meanConfidence)) &&
+	              setItem(dict, "minConfidence", PyFloat_FromDouble(result.minConfidence)) &&
+	              setItem(dict, "weakBits", PyLong_FromUnsignedLong(result.weakBits)) &&
+	              setItem(dict, "tilesRead", PyLong_FromUnsignedLong(result.tilesRead)) &&
+	              setItem(dict, "offset", Py_BuildValue("(ii)", result.offsetX, result.offsetY)) &&
+	              setItem(dict, "confidence", matrixView(result.confidence, result.markSize, sizeof(float), "f")) &&
+	              setItem(dict, "mark", matrixView(mark, result.markSize, 1, "B"));
+
+	if( !stored )
+	{
+		Py_DECREF(dict);
+		return NULL;
+	}
+
+	return dict;
+}
+
+static PyObject* encode( PyObject* self, PyObject* args, PyObject* keywords )
+{
+	static const char* names[] = { "image", "message", "strength", "tiled", "config", "wavelet", "space", "threads", "width", "height", NULL };
+
+	PyObject* object;
+	const char* message;
+	Py_ssize_t length;
+	double strength = 0.5;
+	int tiled = 0;
+	const char* config = "standard";
+	const char* wavelet = "cdf97";
+	const char* space = "lab";
+	unsigned int threads = 0;
+	int width = 0;
+	int height = 0;
+
+	if( !PyArg_ParseTupleAndKeywords(args, keywords, "Os#|d$psssIii", (char**)names, &object, &message, &length, &strength, &tiled, &config, &wavelet, &space, &threads, &width, &height) )
+		return NULL;
+
+	Codec codec;
+	PixelView image;
+
+	if( !findCodec(config, wavelet, space, &codec) || !image.open(object, true, width, height) )
+		return NULL;
+
+	const CodecInfo& info = codecInfo(codec.preset);
+
+	if( (size_t)length > info.payloadLength || strlen(message) != (size_t)length )
+	{
+		PyErr_Format(PyExc_ValueError, "the %s configuration takes messages of up to %u bytes, without NUL", info.name, info.payloadLength);
+		return NULL;
+	}
+
+	unsigned char mark[maxMarkLength];
+	bool marked = false;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	encodeMessageMark(message, mark, codec.preset);
+
+	if( tiled )
+	{
+		marked = insertTiledWatermark(*sharedPool(threads), image.pixels, mark, image.width, image.height, strength, codec);
+	}
+	else if( fitsTile(image.width, image.height, codec.preset) )
+	{
+		unsigned int* output = NULL;
+
+		insertWatermark(image.pixels, &output, mark, &image.width, &image.height, true, strength, codec);
+		marked = output != NULL;
+	}
+
+	releaseThreadState();
+
+	Py_END_ALLOW_THREADS
+
+	if( !marked )
+	{
+		if( tiled )
+			PyErr_Format(PyExc_ValueError, "tiled mode expects an image of at least %ux%u", info.tileSize, info.tileSize);
+		else
+			PyErr_Format(PyExc_ValueError, "expecting a %ux%u image", info.tileSize, info.tileSize);
+
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject* decode( PyObject* self, PyObject* args, PyObject* keywords )
+{
+	static const char* names[] = { "image", "strength", "tiled", "quorum", "search", "config", "wavelet", "space", "threads", "width", "height", NULL };
+
+	PyObject* object;
+	double strength = 0.5;
+	int tiled = 0;
+	unsigned int quorum = 0;
+	unsigned int search = 0;
+	const char* config = "standard";
+	const char* wavelet = "cdf97";
+	const char* space = "lab";
+	unsigned int threads = 0;
+	int width = 0;
+	int height = 0;
+
+	if( !PyArg_ParseTupleAndKeywords(args, keywords, "O|d$pIIsssIii", (char**)names, &object, &strength, &tiled, &quorum, &search, &config, &wavelet, &space, &threads, &width, &height) )
+		return NULL;
+
+	Codec codec;
+	PixelView image;
+
+	if( !findCodec(config, wavelet, space, &codec) || !image.open(object, false, width, height) )
+		return NULL;
+
+	const CodecInfo& info = codecInfo(codec.preset);
+
+	if( search > info.tileSize/2 )
+	{
+		PyErr_Format(PyExc_ValueError, "the alignment search reaches at most %u pixels", info.tileSize/2);
+		return NULL;
+	}
+
+	ReadOptions options = { strength, tiled != 0, quorum, search };
+	unsigned char mark[maxMarkLength];
+	DecodeResult result;
+	bool read;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	ThreadPool* pool = options.tiled || options.search > 0 ? sharedPool(threads) : NULL;
+
+	read = readMark(pool, image, options, codec, mark, &result);
+
+	releaseThreadState();
+
+	Py_END_ALLOW_THREADS
+
+	if( !read )
+	{
+		if( options.tiled )
+			PyErr_Format(PyExc_ValueError, "tiled mode expects an image of at least %ux%u", info.tileSize, info.tileSize);
+		else
+			PyErr_Format(PyExc_ValueError, "expecting a %ux%u image", info.tileSize, info.tileSize);
+
+		return NULL;
+	}
+
+	return decodeResultDict(result, mark);
+}
+
+// Every configuration, wavelet and colour space in turn until one decodes: the result of that one, or None
+static PyObject* detect( PyObject* self, PyObject* args, PyObject* keywords )
+{
+	static const char* names[] = { "image", "strength", "tiled", "quorum", "search", "threads", "width", "height", NULL };
+
+	PyObject* object;
+	double strength = 0.5;
+	int tiled = 0;
+	unsigned int quorum = 0;
+	unsigned int search = 0;
+	unsigned int threads = 0;
+	int width = 0;
+	int height = 0;
+
+	if( !PyArg_ParseTupleAndKeywords(args, keywords, "O|d$pIIIii", (char**)names, &object, &strength, &tiled, &quorum, &search, &threads, &width, &height) )
+		return NULL;
+
+	PixelView image;
+
+	if( !image.open(object, false, width, height) )
+		return NULL;
+
+	ReadOptions options = { strength, tiled != 0, quorum, search };
+	unsigned char mark[maxMarkLength];
+	DecodeResult result;
+	bool found = false;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	ThreadPool* pool = options.tiled || options.search > 0 ? sharedPool(threads) : NULL;
+
+	for( int p = 0; p < CodecPresetCount && !found; ++p )
+	{
+		for( int w = 0; w < WaveletKindCount && !found; ++w )
+		{
+			for( int s = 0; s < ColorSpaceCount && !found; ++s )
+			{
+				Codec codec((CodecPreset)p, (WaveletKind)w, (ColorSpace)s);
+
+				found = readMark(pool, image, options, codec, mark, &result) && result.decoded;
+			}
+		}
+	}
+
+	releaseThreadState();
+
+	Py_END_ALLOW_THREADS
+
+	if( !found )
+		Py_RETURN_NONE;
+
+	return decodeResultDict(result, mark);
+}
+
+static PyMethodDef methods[] =
+{
+	{ "encode", (PyCFunction)(void(*)(void))encode, METH_VARARGS | METH_KEYWORDS,
+	  "encode(image, message, strength=0.5, *, tiled=False, config='standard', wavelet='cdf97', space='lab', threads=0, width=0, height=0)\n\n"
+	  "Marks image, a writable buffer of RGBA pixels, in place with message." },
+	{ "decode", (PyCFunction)(void(*)(void))decode, METH_VARARGS | METH_KEYWORDS,
+	  "decode(image, strength=0.5, *, tiled=False, quorum=0, search=0, config='standard', wavelet='cdf97', space='lab', threads=0, width=0, height=0)\n\n"
+	  "Reads the mark of image and returns the decode result as a dict, with the names of the --json output." },
+	{ "detect", (PyCFunction)(void(*)(void))detect, METH_VARARGS | METH_KEYWORDS,
+	  "detect(image, strength=0.5, *, tiled=False, quorum=0, search=0, threads=0, width=0, height=0)\n\n"
+	  "Decodes image with every configuration, wavelet and colour space in turn and returns the result of the\n"
+	  "first one that decodes, or None." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef module =
+{
+	PyModuleDef_HEAD_INIT,
+	"wavescribe",
+	"Wavelet-based blind watermarks in RGBA pixel buffers",
+	-1,
+	methods
+};
+
+PyMODINIT_FUNC PyInit_wavescribe()
+{
+	PyObject* created = PyModule_Create(&module);
+
+	if( created != NULL && pools.empty() )
+	{
+		sharedPool(0);
+		Py_AtExit(deletePools);
+	}
+
+	return created;
+}
@@ -0,0 +1,260 @@
+// Author: Jonathan Decker
+// Description: Lane kernels of quadsimd.cpp, included once per vector width
+//
+// Defines the struct QUAD_KERNELS with the batched kernels for QUAD_LANES groups at a time,
+// every function compiled with QUAD_TARGET.
+
+struct QUAD_KERNELS
+{
+	static const unsigned int lanes = QUAD_LANES;
+
+#if QUAD_LANES == 4
+
+	typedef __m256d vdouble;
+
+	static QUAD_TARGET inline vdouble vset1( double x )                       { return _mm256_set1_pd(x); }
+	static QUAD_TARGET inline vdouble vload( const double* p )                { return _mm256_loadu_pd(p); }
+	static QUAD_TARGET inline void    vstore( double* p, vdouble a )          { _mm256_storeu_pd(p,a); }
+	static QUAD_TARGET inline vdouble vadd( vdouble a, vdouble b )            { return _mm256_add_pd(a,b); }
+	static QUAD_TARGET inline vdouble vsub( vdouble a, vdouble b )            { return _mm256_sub_pd(a,b); }
+	static QUAD_TARGET inline vdouble vmul( vdouble a, vdouble b )            { return _mm256_mul_pd(a,b); }
+	static QUAD_TARGET inline vdouble vdiv( vdouble a, vdouble b )            { return _mm256_div_pd(a,b); }
+	static QUAD_TARGET inline vdouble vand( vdouble a, vdouble b )            { return _mm256_and_pd(a,b); }
+	static QUAD_TARGET inline vdouble vandnot( vdouble m, vdouble a )         { return _mm256_andnot_pd(m,a); }
+	static QUAD_TARGET inline vdouble vxor( vdouble a, vdouble b )            { return _mm256_xor_pd(a,b); }
+	static QUAD_TARGET inline vdouble vgt( vdouble a, vdouble b )             { return _mm256_cmp_pd(a,b,_CMP_GT_OQ); }
+	static QUAD_TARGET inline vdouble vge( vdouble a, vdouble b )             { return _mm256_cmp_pd(a,b,_CMP_GE_OQ); }
+	static QUAD_TARGET inline vdouble veq( vdouble a, vdouble b )             { return _mm256_cmp_pd(a,b,_CMP_EQ_OQ); }
+	static QUAD_TARGET inline vdouble vneq( vdouble a, vdouble b )            { return _mm256_cmp_pd(a,b,_CMP_NEQ_UQ); }
+	static QUAD_TARGET inline vdouble vlt( vdouble a, vdouble b )             { return _mm256_cmp_pd(a,b,_CMP_LT_OQ); }
+	// masks are all ones or all zeros per lane; not blendv, which GCC 12 splits into a branch per lane
+	static QUAD_TARGET inline vdouble vblend( vdouble a, vdouble b, vdouble m ) { return _mm256_or_pd(_mm256_andnot_pd(m,a), _mm256_and_pd(m,b)); }
+	static QUAD_TARGET inline vdouble vfloor( vdouble a )                     { return _mm256_floor_pd(a); }
+
+#else
+
+	typedef __m128d vdouble;
+
+	static QUAD_TARGET inline vdouble vset1( double x )                       { return _mm_set1_pd(x); }
+	static QUAD_TARGET inline vdouble vload( const double* p )                { return _mm_loadu_pd(p); }
+	static QUAD_TARGET inline void    vstore( double* p, vdouble a )          { _mm_storeu_pd(p,a); }
+	static QUAD_TARGET inline vdouble vadd( vdouble a, vdouble b )            { return _mm_add_pd(a,b); }
+	static QUAD_TARGET inline vdouble vsub( vdouble a, vdouble b )            { return _mm_sub_pd(a,b); }
+	static QUAD_TARGET inline vdouble vmul( vdouble a, vdouble b )            { return _mm_mul_pd(a,b); }
+	static QUAD_TARGET inline vdouble vdiv( vdouble a, vdouble b )            { return _mm_div_pd(a,b); }
+	static QUAD_TARGET inline vdouble vand( vdouble a, vdouble b )            { return _mm_and_pd(a,b); }
+	static QUAD_TARGET inline vdouble vandnot( vdouble m, vdouble a )         { return _mm_andnot_pd(m,a); }
+	static QUAD_TARGET inline vdouble vxor( vdouble a, vdouble b )            { return _mm_xor_pd(a,b); }
+	static QUAD_TARGET inline vdouble vgt( vdouble a, vdouble b )             { return _mm_cmpgt_pd(a,b); }
+	static QUAD_TARGET inline vdouble vge( vdouble a, vdouble b )             { return _mm_cmpge_pd(a,b); }
+	static QUAD_TARGET inline vdouble veq( vdouble a, vdouble b )             { return _mm_cmpeq_pd(a,b); }
+	static QUAD_TARGET inline vdouble vneq( vdouble a, vdouble b )            { return _mm_cmpneq_pd(a,b); }
+	static QUAD_TARGET inline vdouble vlt( vdouble a, vdouble b )             { return _mm_cmplt_pd(a,b); }
+	static QUAD_TARGET inline vdouble vblend( vdouble a, vdouble b, vdouble m ) { return _mm_or_pd(_mm_andnot_pd(m,a), _mm_and_pd(m,b)); }
+
+#if defined(__SSE4_1__)
+	static QUAD_TARGET inline vdouble vfloor( vdouble a )                     { return _mm_floor_pd(a); }
+#else
+	// exact floor: adding and removing 2^52 rounds to an integer, then step down if that rounded up
+	// (values of 2^52 and beyond are already integers)
+	static QUAD_TARGET inline vdouble vfloor( vdouble a )
+	{
+		const vdouble big = vset1(4503599627370496.0);
+		const vdouble sign = vset1(-0.0);
+
+		vdouble magnitude = vandnot(sign, a);
+		vdouble r = vsub(vadd(magnitude, big), big);
+		r = vxor(r, vand(a, sign));
+		r = vsub(r, vand(vgt(r, a), vset1(1.0)));
+
+		return vblend(r, a, vge(magnitude, big));
+	}
+#endif
+
+#endif
+
+	// swaps lanes of (a,b) and their indices where a > b, same as one step of sortVec4
+	static QUAD_TARGET inline void compareExchange( vdouble& a, vdouble& b, vdouble& ia, vdouble& ib )
+	{
+		vdouble swap = vgt(a, b);
+
+		vdouble lo = vblend(a, b, swap);
+		vdouble hi = vblend(b, a, swap);
+		vdouble ilo = vblend(ia, ib, swap);
+		vdouble ihi = vblend(ib, ia, swap);
+
+		a = lo; b = hi; ia = ilo; ib = ihi;
+	}
+
+	// sortVec4 on every lane: c[0..3] ascending, idx[k] holds the original position of c[k]
+	static QUAD_TARGET inline void sortLanes( vdouble c[4], vdouble idx[4] )
+	{
+		idx[0] = vset1(0.0); idx[1] = vset1(1.0); idx[2] = vset1(2.0); idx[3] = vset1(3.0);
+
+		compareExchange(c[0], c[1], idx[0], idx[1]); // sort left set
+		compareExchange(c[2], c[3], idx[2], idx[3]); // sort right set
+		compareExchange(c[0], c[2], idx[0], idx[2]); // sort lowest to front
+		compareExchange(c[1], c[3], idx[1], idx[3]); // sort highest to back
+		compareExchange(c[1], c[2], idx[1], idx[2]); // sort middle values
+	}
+
+	// transposes lanes groups (4 coefficients each) into one vector per coefficient
+	static QUAD_TARGET inline void gatherGroups( const double* freqs, const unsigned int* indices, vdouble c[4] )
+	{
+		double soa[4][lanes];
+
+		for( unsigned int l = 0; l < lanes; ++l )
+			for( unsigned int k = 0; k < 4; ++k )
+				soa[k][l] = freqs[indices[l*4+k]];
+
+		for( unsigned int k = 0; k < 4; ++k )
+			c[k] = vload(soa[k]);
+	}
+
+	// odd lanes of an integral value
+	static QUAD_TARGET inline vdouble isOdd( vdouble x )
+	{
+		vdouble half = vmul(x, vset1(0.5));
+		return vneq(half, vfloor(half));
+	}
+
+	// the scalar code's round(): half away from zero (floor(x + 0.5) with the Windows replacement)
+	static QUAD_TARGET inline vdouble roundLanes( vdouble x )
+	{
+#ifdef _WIN32
+		return vfloor(vadd(x, vset1(0.5)));
+#else
+		const vdouble sign = vset1(-0.0);
+
+		vdouble magnitude = vandnot(sign, x);
+		vdouble r = vfloor(magnitude);
+		r = vadd(r, vand(vge(vsub(magnitude, r), vset1(0.5)), vset1(1.0)));
+
+		return vxor(r, vand(x, sign));
+#endif
+	}
+
+	// the per-lane delta as in encodeBit/getDistance
+	static QUAD_TARGET inline vdouble laneDelta( const vdouble c[4], vdouble strength )
+	{
+		return vmul(vmul(vsub(c[3], c[0]), vset1(0.5)), strength);
+	}
+
+	// (c[2] - c[1]) / delta, 0 where delta is 0
+	static QUAD_TARGET inline vdouble laneDistance( const vdouble c[4], vdouble delta )
+	{
+		vdouble nonZero = vneq(delta, vset1(0.0));
+		return vand(nonZero, vdiv(vsub(c[2], c[1]), delta));
+	}
+
+	static QUAD_TARGET unsigned int encodeQuads( double* freqs, const unsigned int* indices, const unsigned char* mark, unsigned int count, double markStrength )
+	{
+		const vdouble strength = vset1(markStrength);
+		const vdouble one = vset1(1.0);
+		const vdouble half = vset1(0.5);
+
+		unsigned int b;
+
+		for( b = 0; b + lanes <= count; b += lanes, indices += 4*lanes )
+		{
+			vdouble c[4], idx[4];
+
+			gatherGroups(freqs, indices, c);
+			sortLanes(c, idx);
+
+			vdouble delta = laneDelta(c, strength);
+			vdouble distance = laneDistance(c, delta);
+			vdouble newDistance = vfloor(distance);
+
+			// step to the next integer when its parity does not match the bit
+			double bits[lanes];
+			for( unsigned int l = 0; l < lanes; ++l )
+				bits[l] = mark[b+l] == 1 ? 1.0 : (mark[b+l] == 0 ? 0.0 : -1.0);
+
+			vdouble bit = vload(bits);
+			vdouble odd = isOdd(newDistance);
+			vdouble step = vblend(veq(bit, one), veq(bit, vset1(0.0)), odd);
+			newDistance = vadd(newDistance, vand(step, one));
+
+			vdouble change = vmul(vmul(vsub(newDistance, distance), half), delta);
+
+			c[1] = vsub(c[1], change);
+			c[2] = vadd(c[2], change);
+
+			// place coefficents back into matrix in their original order
+			double values[4][lanes];
+			double order[4][lanes];
+
+			for( unsigned int k = 0; k < 4; ++k )
+			{
+				vstore(values[k], c[k]);
+				vstore(order[k], idx[k]);
+			}
+
+			for( unsigned int l = 0; l < lanes; ++l )
+				for( unsigned int k = 0; k < 4; ++k )
+					freqs[indices[l*4 + (unsigned int)order[k][l]]] = values[k][l];
+		}
+
+		return b;
+	}
+
+	static QUAD_TARGET unsigned int quadDistances( const double* freqs, const unsigned int* indices, double* distances, unsigned int count, double markStrength )
+	{
+		const vdouble strength = vset1(markStrength);
+
+		unsigned int b;
+
+		for( b = 0; b + lanes <= count; b += lanes, indices += 4*lanes )
+		{
+			vdouble c[4], idx[4];
+
+			gatherGroups(freqs, indices, c);
+			sortLanes(c, idx);
+
+			vstore(distances + b, laneDistance(c, laneDelta(c, strength)));
+		}
+
+		return b;
+	}
+
+	static QUAD_TARGET unsigned int fuzzyMean( const double* distances1, const double* distances2, unsigned char* mark, double* soft, unsigned int count )
+	{
+		const vdouble one = vset1(1.0);
+		const vdouble two = vset1(2.0);
+		const vdouble minusOne = vset1(-1.0);
+		const vdouble sign = vset1(-0.0);
+
+		unsigned int i;
+
+		for( i = 0; i + lanes <= count; i += lanes )
+		{
+			vdouble p1 = vload(distances1 + i);
+			vdouble p2 = vload(distances2 + i);
+
+			vdouble r1 = roundLanes(p1);
+			vdouble r2 = roundLanes(p2);
+
+			vdouble belief1 = vsub(one, vmul(two, vandnot(sign, vsub(p1, r1))));
+			vdouble belief2 = vsub(one, vmul(two, vandnot(sign, vsub(p2, r2))));
+
+			vdouble vote1 = vblend(minusOne, one, isOdd(r1));
+			vdouble vote2 = vblend(minusOne, one, isOdd(r2));
+
+			vdouble div = vadd(vmul(belief1, vote1), vmul(belief2, vote2));
+
+			double result[lanes];
+			vstore(result, div);
+
+			for( unsigned int l = 0; l < lanes; ++l )
+			{
+				mark[i+l] = result[l] < 0 ? 0 : 1;
+
+				if( soft != NULL )
+					soft[i+l] = result[l];
+			}
+		}
+
+		return i;
+	}
+};
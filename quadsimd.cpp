@@ -0,0 +1,132 @@
+// Author: Jonathan Decker
+// Description: Batched (SIMD) versions of the per-group mark kernels in wavescribe.cpp
+//
+// Groups are gathered into structure-of-arrays lanes (one vector per coefficient rank) and
+// sorted with the same five compare-exchanges as sortVec4, done with compare masks and blends.
+// Swapping only on a strict greater-than keeps the scalar tie order, so the same coefficient
+// positions receive the same values. Build with -ffp-contract=off so neither path gets fused.
+
+#include <math.h>
+
+#include "quadsimd.h"
+#include "cpufeatures.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#if defined(__SSE4_1__)
+		#include <smmintrin.h>
+	#endif
+	#define QUAD_SIMD
+
+	#define QUAD_LANES 2
+	#define QUAD_TARGET
+	#define QUAD_KERNELS Sse2Quads
+	#include "quadlanes.h"
+	#undef QUAD_LANES
+	#undef QUAD_TARGET
+	#undef QUAD_KERNELS
+
+	// AVX is not part of any baseline, it is compiled in with a target attribute and used if the CPU has it
+	#ifdef CPU_X86
+		#include <immintrin.h>
+		#define QUAD_AVX
+
+		#define QUAD_LANES 4
+		#define QUAD_TARGET TARGET_AVX
+		#define QUAD_KERNELS AvxQuads
+		#include "quadlanes.h"
+		#undef QUAD_LANES
+		#undef QUAD_TARGET
+		#undef QUAD_KERNELS
+	#endif
+#endif
+
+#ifdef QUAD_SIMD
+
+// the widest kernels the CPU runs
+struct QuadKernels
+{
+	unsigned int lanes;
+
+	unsigned int (*encodeQuads)( double* freqs, const unsigned int* indices, const unsigned char* mark, unsigned int count, double markStrength );
+	unsigned int (*quadDistances)( const double* freqs, const unsigned int* indices, double* distances, unsigned int count, double markStrength );
+	unsigned int (*fuzzyMean)( const double* distances1, const double* distances2, unsigned char* mark, double* soft, unsigned int count );
+};
+
+template<class Kernels>
+static QuadKernels quadKernelsOf()
+{
+	QuadKernels kernels = { Kernels::lanes, Kernels::encodeQuads, Kernels::quadDistances, Kernels::fuzzyMean };
+	return kernels;
+}
+
+static QuadKernels pickQuadKernels( unsigned int most )
+{
+#ifdef QUAD_AVX
+	if( most >= 4 && cpuHasAvx() )
+		return quadKernelsOf<AvxQuads>();
+#endif
+
+	return quadKernelsOf<Sse2Quads>();
+}
+
+static QuadKernels& quadKernels()
+{
+	static QuadKernels kernels = pickQuadKernels(4);
+	return kernels;
+}
+
+unsigned int quadBatchWidth()
+{
+	return quadKernels().lanes;
+}
+
+unsigned int limitQuadBatchWidth( unsigned int most )
+{
+	quadKernels() = pickQuadKernels(most);
+	return quadBatchWidth();
+}
+
+unsigned int encodeQuadsBatched( double* freqs, const unsigned int* indices, const unsigned char* mark, unsigned int count, double markStrength )
+{
+	return quadKernels().encodeQuads(freqs, indices, mark, count, markStrength);
+}
+
+unsigned int quadDistancesBatched( const double* freqs, const unsigned int* indices, double* distances, unsigned int count, double markStrength )
+{
+	return quadKernels().quadDistances(freqs, indices, distances, count, markStrength);
+}
+
+unsigned int fuzzyMeanBatched( const double* distances1, const double* distances2, unsigned char* mark, double* soft, unsigned int count )
+{
+	return quadKernels().fuzzyMean(distances1, distances2, mark, soft, count);
+}
+
+#else // no SIMD, the scalar kernels do all the work
+
+unsigned int quadBatchWidth()
+{
+	return 1;
+}
+
+unsigned int limitQuadBatchWidth( unsigned int )
+{
+	return 1;
+}
+
+unsigned int encodeQuadsBatched( double*, const unsigned int*, const unsigned char*, unsigned int, double )
+{
+	return 0;
+}
+
+unsigned int quadDistancesBatched( const double*, const unsigned int*, double*, unsigned int, double )
+{
+	return 0;
+}
+
+unsigned int fuzzyMeanBatched( const double*, const double*, unsigned char*, double*, unsigned int )
+{
+	return 0;
+}
+
+#endif
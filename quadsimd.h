@@ -0,0 +1,22 @@
+// Author: Jonathan Decker
+// Description: Batched (SIMD) versions of the per-group mark kernels in wavescribe.cpp
+
+#pragma once
+
+// Each call handles the groups in whole batches and returns how many it processed;
+// the caller finishes the remaining groups with the scalar kernels.
+// Results are bit-identical to encodeBit/getDistance and the fuzzy mean in decodeMark
+// (for distances that fit an int, where the scalar code is defined).
+
+// number of groups handled per batch by the kernels picked for this CPU, 1 when no SIMD path is compiled in
+unsigned int quadBatchWidth();
+
+// switches to the widest kernels of at most the given width (for tests, not while other threads
+// are marking) and returns the width now used
+unsigned int limitQuadBatchWidth( unsigned int most );
+
+unsigned int encodeQuadsBatched( double* freqs, const unsigned int* indices, const unsigned char* mark, unsigned int count, double markStrength );
+
+unsigned int quadDistancesBatched( const double* freqs, const unsigned int* indices, double* distances, unsigned int count, double markStrength );
+
+unsigned int fuzzyMeanBatched( const double* distances1, const double* distances2, unsigned char* mark, double* soft, unsigned int count );
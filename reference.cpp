@@ -0,0 +1,826 @@
+// Author: Jonathan Decker
+// Description: The original scalar encoder and decoder (reference.h)
+//
+// Kept as it was written, only renamed so it links next to the library. Do not speed it up
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <string>
+
+#include "schifra_galois_field.hpp"
+#include "schifra_galois_field_polynomial.hpp"
+#include "schifra_sequential_root_generator_polynomial_creator.hpp"
+#include "schifra_reed_solomon_encoder.hpp"
+#include "schifra_reed_solomon_decoder.hpp"
+#include "schifra_reed_solomon_block.hpp"
+#include "schifra_error_processes.hpp"
+
+#include "reference.h"
+
+extern "C"
+{
+	#include "dwt.h"
+}
+
+typedef union
+{
+    struct
+    {
+        unsigned int r : 8;  // Red:     0/255 to 255/255
+        unsigned int g : 8;  // Green:   0/255 to 255/255
+        unsigned int b : 8;  // Blue:    0/255 to 255/255
+        unsigned int a : 8;  // Alpha:   0/255 to 255/255
+    };
+    unsigned int c;
+}rgbacol;
+
+#ifdef _WIN32
+static inline double round(double val)
+{
+    return floor(val + 0.5);
+}
+#endif
+
+static double clamp( double x, double min, double max )
+{
+     return x < min ? min : (x > max ? max : x);
+}
+
+static unsigned int nextPow2( unsigned int n )
+{
+	unsigned int temp = 1;
+	while( n > temp ) temp <<= 1;
+	return temp;
+}
+
+static const double xyzMat[] = { 0.4124, 0.3576, 0.1805,
+                                 0.2126, 0.7152, 0.0722,
+                                 0.0193, 0.1192, 0.9505 };
+
+static const double rgbMat[] = { 3.2406, -1.5372, -0.4986,
+                                 -0.9689, 1.8758, 0.0415,
+                                 0.0557, -0.2040, 1.0570 };
+
+#define CIEXYZ_D65_X 0.95047
+#define CIEXYZ_D65_Y 1.00000
+#define CIEXYZ_D65_Z 1.08883
+
+static void RGBtoXYZ( double src[3], double dst[3] )
+{
+    // convert to sRGB form
+	if( src[0] > 0.04045 )
+		src[0] = pow((src[0] + 0.055)/1.055, 2.4);
+	else
+		src[0] = src[0]/12.92;
+
+	if( src[1] > 0.04045 )
+		src[1] = pow((src[1] + 0.055)/1.055, 2.4);
+	else
+		src[1] = src[1]/12.92;
+
+	if( src[2] > 0.04045 )
+		src[2] = pow((src[2] + 0.055)/1.055, 2.4);
+	else
+		src[2] = src[2]/12.92;
+
+	dst[0] = xyzMat[0] * src[0] + xyzMat[1] * src[1] + xyzMat[2] * src[2];
+	dst[1] = xyzMat[3] * src[0] + xyzMat[4] * src[1] + xyzMat[5] * src[2];
+	dst[2] = xyzMat[6] * src[0] + xyzMat[7] * src[1] + xyzMat[8] * src[2];
+}
+
+static void XYZtoRGB( double src[3], double dst[3] )
+{
+	dst[0] = rgbMat[0] * src[0] + rgbMat[1] * src[1] + rgbMat[2] * src[2];
+	dst[1] = rgbMat[3] * src[0] + rgbMat[4] * src[1] + rgbMat[5] * src[2];
+	dst[2] = rgbMat[6] * src[0] + rgbMat[7] * src[1] + rgbMat[8] * src[2];
+
+    for(int i=0; i<3; i++)
+	{
+		if( dst[i] > 0.0031308 )
+			dst[i] = 1.055 * (pow(dst[i], 1.0/2.4) - 0.055);
+		else
+			dst[i] = 12.92*dst[i];
+		dst[i] = clamp(dst[i],0.0,1.0);
+	}
+}
+
+static double f( double t )
+{
+	if( t > 0.008856451679035631 ) // (6/29)^2
+	{
+		return pow(t,1.0/3.0);
+	}
+	else
+	{
+		return 0.3333333333*0.008856451679035631*t + 0.13793103448275862;
+	}
+}
+
+static double inversef( double t )
+{
+	if( t > 0.20689655172413793 ) // 6/29
+	{
+		return t*t*t;
+	}
+	else
+	{
+		return 3 * 0.008856451679035631 * ( t - 0.13793103448275862); // 3 * (6/29)^2 * (t - 4/29.0)
+	}
+}
+
+static void XYZtoLab( double src[3], double dst[3] )
+{
+	double nx = f(src[0]/CIEXYZ_D65_X);
+	double ny = f(src[1]/CIEXYZ_D65_Y);
+	dst[0] = 116.0 * ny - 16.0;
+	dst[1] = 500.0 * (nx - ny);
+	dst[2] = 200.0 * (ny - f(src[2]/CIEXYZ_D65_Z));
+}
+
+static void LabtoXYZ( double src[3], double dst[3] )
+{
+	dst[1] = CIEXYZ_D65_Y * inversef( (src[0]+16.0)/116.0);
+	dst[0] = CIEXYZ_D65_X * inversef( (src[0]+16.0)/116.0 + src[1]/500.0);
+	dst[2] = CIEXYZ_D65_Z * inversef( (src[0]+16.0)/116.0 - src[2]/200.0);
+}
+
+static void RGBtoYCbCr( double src[3], double dst[3] )
+{
+	dst[0] =     0 +  0.299    * src[0] +  0.587    * src[1] +  0.114    * src[2];
+	dst[1] = 128.0 + -0.168736 * src[0] + -0.331264 * src[1] +  0.5      * src[2];
+	dst[2] = 128.0 +  0.5      * src[0] + -0.418688 * src[1] + -0.081312 * src[2];
+}
+
+static void YCbCrtoRGB( double src[3], double dst[3] )
+{
+	double cbTemp = src[1] - 128.0;
+	double crTemp = src[2] - 128.0;
+
+	dst[0] = src[0] +                      1.402   * crTemp;
+	dst[1] = src[0] + -0.34414 * cbTemp + -0.71414 * crTemp;
+	dst[2] = src[0] +  1.772   * cbTemp;
+}
+
+double referenceLabLuminance( unsigned int pixel )
+{
+	double tempColor1[3];
+	double tempColor2[3];
+
+	rgbacol temp;
+	temp.c = pixel;
+
+	tempColor1[0] = (double)temp.r / 255.0;
+	tempColor1[1] = (double)temp.g / 255.0;
+	tempColor1[2] = (double)temp.b / 255.0;
+
+	RGBtoXYZ(tempColor1,tempColor2);
+	XYZtoLab(tempColor2,tempColor1);
+
+	return tempColor1[0];
+}
+
+unsigned int referenceSetLabLuminance( unsigned int pixel, double luminance )
+{
+	double tempColor1[3];
+	double tempColor2[3];
+
+	rgbacol temp;
+	temp.c = pixel;
+
+	tempColor1[0] = (double)temp.r / 255.0;
+	tempColor1[1] = (double)temp.g / 255.0;
+	tempColor1[2] = (double)temp.b / 255.0;
+
+	RGBtoXYZ(tempColor1,tempColor2);
+	XYZtoLab(tempColor2,tempColor1);
+
+	tempColor1[0] = luminance;
+
+	LabtoXYZ(tempColor1,tempColor2);
+	XYZtoRGB(tempColor2,tempColor1);
+
+	temp.r = (unsigned char)(tempColor1[0] * 255.0);
+	temp.g = (unsigned char)(tempColor1[1] * 255.0);
+	temp.b = (unsigned char)(tempColor1[2] * 255.0);
+
+	return temp.c;
+}
+
+double referenceYCbCrLuma( unsigned int pixel )
+{
+	double tempColor1[3];
+	double tempColor2[3];
+
+	rgbacol temp;
+	temp.c = pixel;
+
+	tempColor1[0] = (double)temp.r;
+	tempColor1[1] = (double)temp.g;
+	tempColor1[2] = (double)temp.b;
+
+	RGBtoYCbCr(tempColor1,tempColor2);
+
+	return tempColor2[0];
+}
+
+unsigned int referenceSetYCbCrLuma( unsigned int pixel, double luma )
+{
+	double tempColor1[3];
+	double tempColor2[3];
+
+	rgbacol temp;
+	temp.c = pixel;
+
+	tempColor1[0] = (double)temp.r;
+	tempColor1[1] = (double)temp.g;
+	tempColor1[2] = (double)temp.b;
+
+	RGBtoYCbCr(tempColor1,tempColor2);
+
+	tempColor2[0] = luma;
+
+	YCbCrtoRGB(tempColor2,tempColor1);
+
+	temp.r = (unsigned char)clamp(floor(tempColor1[0] + 0.5), 0.0, 255.0);
+	temp.g = (unsigned char)clamp(floor(tempColor1[1] + 0.5), 0.0, 255.0);
+	temp.b = (unsigned char)clamp(floor(tempColor1[2] + 0.5), 0.0, 255.0);
+
+	return temp.c;
+}
+
+// encode byte into binary matrix using a zig-zagging pattern
+//
+//        upDir  !upDir
+//  X--    7 6    1 0
+//  |      5 4    3 2
+//  |      3 2    5 4
+//  |      1 0    7 6
+static void setByte( unsigned char* dst, const unsigned char c, int width, int, bool upDir )
+{
+	int step;
+
+	bool zag = true;
+
+	if( upDir )
+	{
+		dst += width*3+1;
+		step = -width + 1;
+	}
+	else
+	{
+		dst++;
+		step = width + 1;
+	}
+
+	for( int i = 0 ; i < 8; ++i )
+	{
+		*dst = ((1 << (7-i)) & c) ? 1 : 0;
+
+		dst += zag ? -1 : step;
+
+		zag = !zag;
+	}
+}
+
+// decode byte from binary matrix using a zig-zagging pattern
+static unsigned char getByte( const unsigned char* src, int width, int, bool upDir )
+{
+	int step;
+	unsigned char c = 0;
+
+	bool zag = true;
+
+	if( upDir )
+	{
+		src += width*3+1;
+		step = -width + 1;
+	}
+	else
+	{
+		src++;
+		step = width + 1;
+	}
+
+	for( int i = 0 ; i < 8; ++i )
+	{
+		c |= *src ? (1 << (7-i)) : 0;
+
+		src += zag ? -1 : step;
+
+		zag = !zag;
+	}
+
+	return c;
+}
+
+// converts 255 byte block 2D binary matrix
+// block is encoded in a zig-zagging pattern
+static void convertBufferToBinaryMatrix( const char* block, unsigned char* dst, unsigned int width, unsigned int height )
+{
+	int bw = width >> 1;
+	int bh = height >> 2;
+	int k = 0;
+
+	bool upDir = true;
+
+	memset(dst,0,sizeof(unsigned char)*width*height);
+
+	for( int i = bw-1; i >= 0 ; --i )
+	{
+		for( int j = bh-1; j >= 0; --j, ++k )
+		{
+			setByte(dst + j*4*width+i*2, block[k], width, height, upDir );
+		}
+
+		upDir = !upDir;
+	}
+}
+
+// 2D binary matrix into a 255 byte block
+static void convertBinaryMatrixToBuffer( char* block, const unsigned char* src, unsigned int width, unsigned int height )
+{
+	int bw = width >> 1;
+	int bh = height >> 2;
+	int k = 0;
+
+	bool upDir = true;
+
+	for( int i = bw-1; i >= 0 ; --i )
+	{
+		for( int j = bh-1; j >= 0; --j, ++k )
+		{
+			block[k] = (char)getByte(src + j*4*width+i*2, width, height, upDir );
+		}
+
+		upDir = !upDir;
+	}
+}
+
+/* Finite Field Parameters */
+static const std::size_t field_descriptor                 =   8;
+static const std::size_t generator_polynommial_index      = 120;
+static const std::size_t generator_polynommial_root_count =  96;
+
+/* Reed Solomon Code Parameters */
+static const std::size_t code_length = 128;
+static const std::size_t fec_length  =  96;
+static const std::size_t data_length = code_length - fec_length;
+
+void referenceEncodeMessage( const char* str, unsigned char* mark )
+{
+   /* Instantiate Finite Field and Generator Polynomials */
+   schifra::galois::field field(field_descriptor,
+                                schifra::galois::primitive_polynomial_size06,
+                                schifra::galois::primitive_polynomial06);
+
+   schifra::galois::field_polynomial generator_polynomial(field);
+
+   schifra::sequential_root_generator_polynomial_creator(field,
+                                                         generator_polynommial_index,
+                                                         generator_polynommial_root_count,
+                                                         generator_polynomial);
+
+   /* Instantiate Encoder and Decoder (Codec) */
+   schifra::reed_solomon::shortened_encoder<code_length,fec_length> encoder(field,generator_polynomial);
+
+   std::string message = str;
+               message = message + std::string(data_length - message.length(),static_cast<unsigned char>(0x00));
+
+   /* Instantiate RS Block For Codec */
+   schifra::reed_solomon::block<code_length,fec_length> block;
+
+   /* Transform message into Reed-Solomon encoded codeword */
+   if (!encoder.encode(message,block))
+   {
+	  memset(mark,0,sizeof(unsigned char)*32*32);
+      return;
+   }
+
+   std::string block_str;
+   std::string data_str(data_length,static_cast<unsigned char>(0x00));
+   std::string fec_str(fec_length,static_cast<unsigned char>(0x00));
+
+   block.data_to_string(data_str);
+   block.fec_to_string(fec_str);
+
+   block_str = data_str + fec_str;
+
+   convertBufferToBinaryMatrix(block_str.c_str(), mark, 32, 32);
+}
+
+bool referenceDecodeMessage( const unsigned char* mark, char* dst )
+{
+   /* Instantiate Finite Field and Generator Polynomials */
+   schifra::galois::field field(field_descriptor,
+                                schifra::galois::primitive_polynomial_size06,
+                                schifra::galois::primitive_polynomial06);
+
+   /* Instantiate Decoder (Codec) */
+   schifra::reed_solomon::shortened_decoder<code_length,fec_length> decoder(field,generator_polynommial_index);
+
+   char tempStr[128];
+
+   convertBinaryMatrixToBuffer(tempStr, mark, 32, 32);
+
+   /* Instantiate RS Block For Codec */
+   std::string data_str(32,0x00);
+   std::string fec_str(96,0x00);
+
+    for (std::size_t i = 0; i < 32; ++i)
+	{
+		data_str[i] = static_cast<char>(tempStr[i]);
+	}
+
+	for (std::size_t i = 0; i < 96; ++i)
+	{
+		fec_str[i] = static_cast<char>(tempStr[32+i]);
+	}
+
+   schifra::reed_solomon::block<code_length,fec_length> block(data_str,fec_str);
+
+   if(!decoder.decode(block))
+   {
+	  strcpy(dst,"ERROR");
+	  return false;
+   }
+
+   block.data_to_string(data_str);
+
+   memcpy(dst, data_str.c_str(), 32*sizeof(char));
+   dst[32] = 0;
+
+	for (std::size_t i = 0; i < 32; ++i)
+	{
+		unsigned char temp = static_cast<unsigned char>(dst[i]);
+		if( temp < 32 || temp > 126 ) // Replaced unexpected character range with space
+		{
+			dst[i] = (char)32U;
+		}
+	}
+
+	return true;
+}
+
+// accending order
+void referenceSortVec4( double* c, unsigned int* i )
+{
+	double dTemp;
+	unsigned int iTemp;
+
+	i[0] = 0; i[1] = 1; i[2] = 2; i[3] = 3;
+
+	// sort left set
+	if( c[0] > c[1] )
+	{
+		dTemp = c[0];
+		c[0] = c[1];
+		c[1] = dTemp;
+		iTemp = i[0];
+		i[0] = i[1];
+		i[1] = iTemp;
+	}
+
+	// sort right set
+	if( c[2] > c[3] )
+	{
+		dTemp = c[2];
+		c[2] = c[3];
+		c[3] = dTemp;
+		iTemp = i[2];
+		i[2] = i[3];
+		i[3] = iTemp;
+	}
+
+	// sort lowest to front
+	if( c[0] > c[2] )
+	{
+		dTemp = c[0];
+		c[0] = c[2];
+		c[2] = dTemp;
+		iTemp = i[0];
+		i[0] = i[2];
+		i[2] = iTemp;
+	}
+
+	// sort highest to back
+	if( c[1] > c[3] )
+	{
+		dTemp = c[3];
+		c[3] = c[1];
+		c[1] = dTemp;
+		iTemp = i[3];
+		i[3] = i[1];
+		i[1] = iTemp;
+	}
+
+	// sort middle values
+	if( c[1] > c[2] )
+	{
+		dTemp = c[1];
+		c[1] = c[2];
+		c[2] = dTemp;
+		iTemp = i[1];
+		i[1] = i[2];
+		i[2] = iTemp;
+	}
+}
+
+void referenceEncodeBit( double c[4], unsigned int i[4], unsigned char b, double markStrength )
+{
+	double delta,distance,newDistance,change;
+
+	referenceSortVec4(c,i);
+
+	delta = (c[3] - c[0]) * 0.5 * markStrength;
+
+	distance = 0;
+
+	if( delta != 0 )
+		distance = (c[2] - c[1]) / delta;
+
+	newDistance = floor(distance);
+
+	if( ((int)newDistance) % 2 == 0 )
+	{
+		if( b == 1 )
+			newDistance += 1.0;
+	}
+	else
+	{
+		if( b == 0 )
+			newDistance += 1.0;
+	}
+
+	change = (newDistance - distance) * 0.5 * delta;
+
+	c[1] = c[1] - change;
+	c[2] = c[2] + change;
+}
+
+double referenceGetDistance( double c[4], double markStrength )
+{
+	double delta;
+	unsigned int idx[4];
+
+	referenceSortVec4(c,idx);
+
+	delta = (c[3] - c[0]) * 0.5 * markStrength;
+
+	return delta != 0 ? (c[2] - c[1]) / delta : 0;
+}
+
+double referenceFuzzyMean( double distance1, double distance2 )
+{
+	double belief1 = 1 - 2 * fabs(distance1 - round(distance1));
+	double belief2 = 1 - 2 * fabs(distance2 - round(distance2));
+
+	double vote1 = ((int)round(distance1)) % 2 == 0 ? -1 : 1;
+	double vote2 = ((int)round(distance2)) % 2 == 0 ? -1 : 1;
+
+	return belief1 * vote1 + belief2 * vote2;
+}
+
+static void encodeMark( double* freqs, const unsigned char* mark, unsigned int width, unsigned int, unsigned int markSize, double markStrength )
+{
+	unsigned int vecInLine = markSize/2;
+	unsigned int levelSize = markSize*2;
+	unsigned int hl3Offset = levelSize;
+	unsigned int lh3Offset = width*levelSize;
+
+	unsigned int i,j,k;
+	double *p1;
+	const unsigned char *p2;
+
+	double v[4];
+	unsigned idx[4];
+
+	unsigned int size = 4*sizeof(double);
+
+	// LH3
+    for( i = 0, p1 = freqs+lh3Offset, p2 = mark; i < levelSize; ++i )
+    {
+		for( j = 0; j < vecInLine; ++j, p1+=4, ++p2 )
+		{
+			memcpy(v,p1,size);
+
+			referenceEncodeBit(v,idx,*p2,markStrength);
+
+			// place coefficents back into matrix in their original order
+			for( k = 0; k < 4; ++k )
+				p1[idx[k]] = v[k];
+		}
+
+		// skip to the next row of the lh3 cell
+		p1+=width-levelSize;
+	}
+
+	// HL3
+    for( i = 0, p1 = freqs+hl3Offset, p2 = mark; i < levelSize; ++i )
+    {
+		for( j = 0; j < vecInLine; ++j, ++p2 )
+		{
+			for( k = 0; k < 4; p1+=width, ++k )
+				v[k] = *p1;
+
+			referenceEncodeBit(v,idx,*p2,markStrength);
+
+			// place coefficents back into matrix in their original order
+			p1 -= 4*width;
+
+			for( k = 0; k < 4; ++k )
+				*(p1+width*idx[k]) = v[k];
+
+			p1 += 4*width;
+		}
+
+		// move to beginning of the next column
+		p1=freqs+hl3Offset+i+1;
+	}
+}
+
+static void decodeMark( double* freqs, unsigned char* mark, double* buffer1, double* buffer2, unsigned int width, unsigned int, unsigned int markSize, double markStrength )
+{
+	unsigned int vecInLine = markSize/2;
+	unsigned int levelSize = markSize*2;
+	unsigned int hl3Offset = levelSize;
+	unsigned int lh3Offset = width*levelSize;
+
+	unsigned int i,j,k;
+	double *p1;
+	double *p2;
+
+	unsigned char *p3;
+
+	double v[4];
+
+	unsigned int markLength = markSize*markSize;
+
+	unsigned int size = 4*sizeof(double);
+
+	// LH3
+    for( i = 0, p1 = freqs+lh3Offset, p2 = buffer1; i < levelSize; ++i )
+    {
+		// row
+		for( j = 0; j < vecInLine; ++j, p1+=4, ++p2 )
+		{
+			memcpy(v,p1,size);
+
+			*p2 = referenceGetDistance(v,markStrength);
+		}
+
+		// skip to the next row of the lh3 cell
+		p1+=width-levelSize;
+	}
+
+	// HL3
+    for( i = 0, p1 = freqs+hl3Offset, p2 = buffer2; i < levelSize; ++i )
+    {
+		// column
+		for( j = 0; j < vecInLine; ++j, ++p2 )
+		{
+			for( k = 0; k < 4; p1+=width, ++k )
+				v[k] = *p1;
+
+			*p2 = referenceGetDistance(v,markStrength);
+		}
+
+		// move to beginning of the next column
+		p1=freqs+hl3Offset+i+1;
+	}
+
+	// fuzzy mean
+	for( i = 0, p1 = buffer1, p2 = buffer2, p3 = mark; i < markLength; ++i, ++p1, ++p2, ++p3 )
+	{
+		*p3 = referenceFuzzyMean(*p1, *p2) < 0 ? 0 : 1;
+	}
+}
+
+void referenceDecompose( double* data, unsigned int levels, unsigned int width, unsigned int height )
+{
+	unsigned int i,j,k;
+	double       *p1;
+	double       *p2;
+
+	double* columnBuffer = (double*)malloc(sizeof(double)*height);
+
+	for( k = 0; k < levels; ++k )
+	{
+		// decompose rows
+		for( i = 0; i < height>>k; ++i )
+		{
+			fwt97(data+i*width, width>>k);
+		}
+
+		// decompose columns
+		for( j = 0; j < width>>k; ++j )
+		{
+			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>k; ++i, p1+=width, ++p2 )
+				*p2 = *p1;
+
+			fwt97(columnBuffer, height>>k);
+
+			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>k; ++i, p1+=width, ++p2 )
+				*p1 = *p2;
+		}
+	}
+
+	free(columnBuffer);
+}
+
+void referenceReconstruct( double* data, unsigned int levels, unsigned int width, unsigned int height )
+{
+	unsigned int i,j,k;
+	double       *p1;
+	double       *p2;
+
+	double* columnBuffer = (double*)malloc(sizeof(double)*height);
+
+	for( k = levels; k > 0; --k )
+	{
+		// decompose rows
+		for( i = 0; i < height>>(k-1); ++i )
+		{
+			iwt97(data+i*width, width>>(k-1));
+		}
+
+		// decompose columns
+		for( j = 0; j < width>>(k-1); ++j )
+		{
+			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>(k-1); ++i, p1+=width, ++p2 )
+				*p2 = *p1;
+
+			iwt97(columnBuffer, height>>(k-1));
+
+			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>(k-1); ++i, p1+=width, ++p2 )
+				*p1 = *p2;
+		}
+	}
+
+	free(columnBuffer);
+}
+
+// the luminance of the image zero padded to a power of two, decomposed by three levels; NULL if the
+// image does not pad to 512 pixels wide or high
+static double* decomposeLuminance( const unsigned int* src, int width, int height )
+{
+	int newWidth = nextPow2(width);
+	int newHeight = nextPow2(height);
+
+	if( newHeight != 512 && newWidth != 512 )
+		return NULL;
+
+	double *freqs = (double*)calloc((size_t)newWidth*newHeight, sizeof(double));
+
+	for( int i = 0; i < height; ++i )
+		for( int j = 0; j < width; ++j )
+			freqs[i*newWidth + j] = referenceLabLuminance(src[i*width + j]);
+
+	referenceDecompose(freqs,3,newWidth,newHeight);
+
+	return freqs;
+}
+
+void referenceInsertWatermark( unsigned int* src, const unsigned char* mark, int width, int height, double markStrength )
+{
+	int newWidth = nextPow2(width);
+	int newHeight = nextPow2(height);
+
+	double *freqs = decomposeLuminance(src, width, height);
+
+	if( freqs == NULL )
+		return;
+
+	// encode watermark boolean bits into coefficients
+	encodeMark(freqs, mark, newWidth, newHeight, 32, markStrength);
+
+	referenceReconstruct(freqs,3,newWidth,newHeight);
+
+	// replace luminance in image
+	for( int i = 0; i < height; ++i )
+		for( int j = 0; j < width; ++j )
+			src[i*width + j] = referenceSetLabLuminance(src[i*width + j], freqs[i*newWidth + j]);
+
+	free(freqs);
+}
+
+void referenceDecodeWatermark( const unsigned int* src, unsigned char* mark, int width, int height, double markStrength )
+{
+	int newWidth = nextPow2(width);
+	int newHeight = nextPow2(height);
+
+	double *freqs = decomposeLuminance(src, width, height);
+
+	if( freqs == NULL )
+	{
+		memset(mark,0,32*32);
+		return;
+	}
+
+	double markBuffer1[32*32];
+	double markBuffer2[32*32];
+
+	decodeMark(freqs, mark, markBuffer1, markBuffer2, newWidth, newHeight, 32, markStrength);
+
+	free(freqs);
+}
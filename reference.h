@@ -0,0 +1,41 @@
+// Author: Jonathan Decker
+// Description: The original scalar encoder and decoder, kept as the reference for the fast paths (differential.cpp)
+//
+// The code of wavescribe.cpp as it was before tiling, the arena, the caches, the batched kernels and the
+// wavelet policies: Lab luminance in double precision, three levels of fwt97 rows then columns on a plane
+// zero padded to a power of two, one group of four coefficients at a time, Schifra for every message.
+// Only the standard configuration: 32x32 marks, RS(128,96), 512x512 images. The application never uses it
+
+#pragma once
+
+// ascending order of c, i receives the original position of each value
+void referenceSortVec4( double* c, unsigned int* i );
+
+void referenceEncodeBit( double c[4], unsigned int i[4], unsigned char b, double markStrength );
+double referenceGetDistance( double c[4], double markStrength );
+
+// the vote of the LH3 and HL3 distances of one bit, negative reads as 0
+double referenceFuzzyMean( double distance1, double distance2 );
+
+// Lab L of a packed pixel, and the pixel with its L replaced
+double referenceLabLuminance( unsigned int pixel );
+unsigned int referenceSetLabLuminance( unsigned int pixel, double luminance );
+
+// BT.601 luma (0 to 255) of the original's YCbCr path, and the pixel with its luma replaced. The original
+// truncated the channels without clamping, these round to the nearest level and clamp
+double referenceYCbCrLuma( unsigned int pixel );
+unsigned int referenceSetYCbCrLuma( unsigned int pixel, double luma );
+
+// levels levels of fwt97 and iwt97 on a width x height plane
+void referenceDecompose( double* data, unsigned int levels, unsigned int width, unsigned int height );
+void referenceReconstruct( double* data, unsigned int levels, unsigned int width, unsigned int height );
+
+// A message of up to 32 characters into a 32x32 mark and back; decoding writes 32 characters and a
+// terminator, or "ERROR" and returns false
+void referenceEncodeMessage( const char* str, unsigned char* mark );
+bool referenceDecodeMessage( const unsigned char* mark, char* dst );
+
+// Marks an image that pads to 512 pixels wide or high in place, or reads the mark of one. The original
+// read at the image width instead of the padded plane width, the same for 512x512 images
+void referenceInsertWatermark( unsigned int* src, const unsigned char* mark, int width, int height, double markStrength );
+void referenceDecodeWatermark( const unsigned int* src, unsigned char* mark, int width, int height, double markStrength );
@@ -0,0 +1,420 @@
+// Author: Jonathan Decker
+// Description: On-disk result cache (resultcache.h)
+//
+// Entry file "<16 hex digits of the key>.wsc":
+//   "WSCACHE1", params length (4 bytes LE), params, payload
+// Temporary files end in ".tmp" and are never read; ones left behind by a process that died are
+// removed by the next eviction once they are an hour old.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#include <sys/utime.h>
+#define getpid _getpid
+#define utime _utime
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include "resultcache.h"
+#include "imageio.h"
+#include "trace.h"
+
+static const char entryMagic[8] = { 'W','S','C','A','C','H','E','1' };
+
+static const unsigned long long prime1 = 11400714785074694791ULL;
+static const unsigned long long prime2 = 14029467366897019727ULL;
+static const unsigned long long prime3 = 1609587929392839161ULL;
+static const unsigned long long prime4 = 9650029242287828579ULL;
+static const unsigned long long prime5 = 2870177450012600261ULL;
+
+static inline unsigned long long rotateLeft( unsigned long long x, int bits )
+{
+	return (x << bits) | (x >> (64 - bits));
+}
+
+static inline unsigned long long read64( const unsigned char* p )
+{
+	unsigned long long v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline unsigned int read32( const unsigned char* p )
+{
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline unsigned long long hashRound( unsigned long long acc, unsigned long long input )
+{
+	acc += input * prime2;
+	return rotateLeft(acc, 31) * prime1;
+}
+
+static inline unsigned long long hashMerge( unsigned long long acc, unsigned long long lane )
+{
+	acc ^= hashRound(0, lane);
+	return acc * prime1 + prime4;
+}
+
+unsigned long long hashBytes64( const void* data, size_t size, unsigned long long seed )
+{
+	// four independent lanes over 32 byte stripes, several bytes per cycle (little-endian reads)
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* end = p + size;
+	unsigned long long h;
+
+	if( size >= 32 )
+	{
+		unsigned long long v1 = seed + prime1 + prime2;
+		unsigned long long v2 = seed + prime2;
+		unsigned long long v3 = seed;
+		unsigned long long v4 = seed - prime1;
+
+		for( ; p + 32 <= end; p += 32 )
+		{
+			v1 = hashRound(v1, read64(p));
+			v2 = hashRound(v2, read64(p + 8));
+			v3 = hashRound(v3, read64(p + 16));
+			v4 = hashRound(v4, read64(p + 24));
+		}
+
+		h = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+		h = hashMerge(h, v1);
+		h = hashMerge(h, v2);
+		h = hashMerge(h, v3);
+		h = hashMerge(h, v4);
+	}
+	else
+	{
+		h = seed + prime5;
+	}
+
+	h += size;
+
+	for( ; p + 8 <= end; p += 8 )
+		h = rotateLeft(h ^ hashRound(0, read64(p)), 27) * prime1 + prime4;
+
+	if( p + 4 <= end )
+	{
+		h = rotateLeft(h ^ (read32(p) * prime1), 23) * prime2 + prime3;
+		p += 4;
+	}
+
+	for( ; p < end; ++p )
+		h = rotateLeft(h ^ (*p * prime5), 11) * prime1;
+
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	h *= prime3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+std::string resultCacheParams( const char* message, double markStrength, Codec codec, bool tiled, unsigned int quorum,
+                               unsigned int searchRange, const char* output, const ImageBackend& images )
+{
+	static const char* formatNames[ImageFormatCount] = { "png", "ppm", "pam", "rgba", "qoi" };
+
+	char text[256];
+	std::string params;
+
+	// the layout of a cached DecodeResult is part of the key, a rebuilt program with another one misses
+	sprintf(text, "%s strength=%.17g config=%s wavelet=%s space=%s tiled=%d", message != NULL ? "encode" : "decode",
+	        markStrength, codecInfo(codec.preset).name, waveletName(codec.wavelet), colorSpaceName(codec.space), tiled ? 1 : 0);
+	params = text;
+
+	if( message != NULL )
+	{
+		ImageFormat format = imageFormatOf(output);
+
+		sprintf(text, " output=%s", formatNames[format]);
+		params += text;
+
+		if( format == ImageFormatPng )
+			params += std::string(" png=") + images.settings();
+
+		params += " message=";
+		params += message;
+	}
+	else
+	{
+		sprintf(text, " quorum=%u search=%u result=%u", tiled ? quorum : 0, tiled ? 0 : searchRange, (unsigned int)sizeof(DecodeResult));
+		params += text;
+	}
+
+	return params;
+}
+
+ResultCache::ResultCache( const char* directory, unsigned long long maxBytes )
+	: dir(directory), limit(maxBytes), total(0), count(0), hitCount(0), missCount(0), written(0)
+{
+#ifdef _WIN32
+	_mkdir(directory);
+#else
+	mkdir(directory, 0777);
+#endif
+
+	// measured once here, then kept up to date with what this process writes
+	total = limit;
+	evict();
+}
+
+unsigned long long ResultCache::key( const unsigned int* pixels, int width, int height, const std::string& params ) const
+{
+	int size[2] = { width, height };
+
+	unsigned long long seed = hashBytes64(params.data(), params.size(), hashBytes64(size, sizeof(size), 0));
+
+	return hashBytes64(pixels, 4*(size_t)width*height, seed);
+}
+
+std::string ResultCache::entryPath( unsigned long long key ) const
+{
+	char name[32];
+	sprintf(name, "/%016llx.wsc", key);
+
+	return dir + name;
+}
+
+bool ResultCache::find( unsigned long long key, const std::string& params, std::vector<unsigned char>& payload )
+{
+	TRACE_SCOPE("cache find");
+
+	std::string path = entryPath(key);
+	FILE* fp = fopen(path.c_str(), "rb");
+
+	if( fp == NULL )
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		++missCount;
+		return false;
+	}
+
+	// the whole entry in one read, the file is never changed once it has its name
+	std::vector<unsigned char> entry;
+	unsigned char buffer[1 << 16];
+	size_t n;
+
+	while( (n = fread(buffer, 1, sizeof(buffer), fp)) > 0 )
+		entry.insert(entry.end(), buffer, buffer + n);
+
+	bool read = ferror(fp) == 0;
+	fclose(fp);
+
+	size_t header = sizeof(entryMagic) + 4;
+	unsigned int length = entry.size() >= header ? read32(&entry[sizeof(entryMagic)]) : 0;
+
+	if( !read || entry.size() < header + length || memcmp(&entry[0], entryMagic, sizeof(entryMagic)) != 0 ||
+	    params.size() != length || memcmp(&entry[header], params.data(), length) != 0 )
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		++missCount;
+		return false;
+	}
+
+	payload.assign(entry.begin() + header + length, entry.end());
+
+	// most recently used
+	utime(path.c_str(), NULL);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	++hitCount;
+	return true;
+}
+
+void ResultCache::store( unsigned long long key, const std::string& params, const void* payload, size_t size )
+{
+	TRACE_SCOPE("cache store");
+
+	std::string path = entryPath(key);
+
+	char suffix[48];
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		sprintf(suffix, ".%d-%u.tmp", (int)getpid(), written++);
+	}
+
+	std::string temporary = path + suffix;
+	FILE* fp = fopen(temporary.c_str(), "wb");
+
+	if( fp == NULL )
+		return;
+
+	unsigned char length[4];
+	unsigned int n = (unsigned int)params.size();
+
+	for( int i = 0; i < 4; ++i )
+		length[i] = (unsigned char)(n >> (8*i));
+
+	bool complete = fwrite(entryMagic, 1, sizeof(entryMagic), fp) == sizeof(entryMagic) &&
+	                fwrite(length, 1, 4, fp) == 4 &&
+	                fwrite(params.data(), 1, n, fp) == n &&
+	                fwrite(payload, 1, size, fp) == size;
+
+	complete = fclose(fp) == 0 && complete;
+
+	// On Windows rename does not replace a file, so the first of several processes storing the same
+	// entry keeps it; their payloads are the same
+	complete = complete && rename(temporary.c_str(), path.c_str()) == 0;
+
+	if( !complete )
+	{
+		remove(temporary.c_str());
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	total += sizeof(entryMagic) + 4 + n + size;
+	++count;
+
+	if( total > limit )
+		evict();
+}
+
+bool ResultCache::findFile( unsigned long long key, const std::string& params, const char* path )
+{
+	std::vector<unsigned char> payload;
+
+	if( !find(key, params, payload) )
+		return false;
+
+	FILE* fp = fopen(path, "wb");
+
+	if( fp == NULL )
+		return false;
+
+	bool complete = payload.empty() || fwrite(&payload[0], 1, payload.size(), fp) == payload.size();
+
+	return fclose(fp) == 0 && complete;
+}
+
+void ResultCache::storeFile( unsigned long long key, const std::string& params, const char* path )
+{
+	FILE* fp = fopen(path, "rb");
+
+	if( fp == NULL )
+		return;
+
+	std::vector<unsigned char> payload;
+	unsigned char buffer[1 << 16];
+	size_t n;
+
+	while( (n = fread(buffer, 1, sizeof(buffer), fp)) > 0 )
+		payload.insert(payload.end(), buffer, buffer + n);
+
+	bool read = ferror(fp) == 0;
+	fclose(fp);
+
+	if( read )
+		store(key, params, payload.empty() ? NULL : &payload[0], payload.size());
+}
+
+struct CacheEntry
+{
+	std::string name;
+	unsigned long long size;
+	time_t used;
+
+	bool operator<( const CacheEntry& other ) const { return used < other.used; }
+};
+
+static bool hasSuffix( const std::string& name, const char* suffix )
+{
+	size_t n = strlen(suffix);
+
+	return name.size() > n && name.compare(name.size() - n, n, suffix) == 0;
+}
+
+void ResultCache::evict()
+{
+	std::vector<CacheEntry> entries;
+	time_t now = time(NULL);
+
+	// every process sharing the directory may be evicting at the same time, a file that is already
+	// gone is simply not counted
+#ifdef _WIN32
+	struct _finddata_t found;
+	intptr_t search = _findfirst((dir + "/*").c_str(), &found);
+
+	if( search != -1 )
+	{
+		do
+		{
+			CacheEntry entry = { found.name, (unsigned long long)found.size, found.time_write };
+			entries.push_back(entry);
+		}
+		while( _findnext(search, &found) == 0 );
+
+		_findclose(search);
+	}
+#else
+	DIR* listing = opendir(dir.c_str());
+
+	if( listing != NULL )
+	{
+		struct dirent* found;
+		struct stat info;
+
+		while( (found = readdir(listing)) != NULL )
+		{
+			if( stat((dir + "/" + found->d_name).c_str(), &info) == 0 && S_ISREG(info.st_mode) )
+			{
+				CacheEntry entry = { found->d_name, (unsigned long long)info.st_size, info.st_mtime };
+				entries.push_back(entry);
+			}
+		}
+
+		closedir(listing);
+	}
+#endif
+
+	total = 0;
+	size_t kept = 0;
+
+	for( size_t i = 0; i < entries.size(); ++i )
+	{
+		if( hasSuffix(entries[i].name, ".tmp") && now - entries[i].used > 3600 )
+			remove((dir + "/" + entries[i].name).c_str());
+		else if( hasSuffix(entries[i].name, ".wsc") )
+		{
+			total += entries[i].size;
+			entries[kept++] = entries[i];
+		}
+	}
+
+	entries.resize(kept);
+	count = kept;
+
+	if( total <= limit )
+		return;
+
+	// oldest first, down to 90% so the next few stores do not evict again
+	std::sort(entries.begin(), entries.end());
+
+	unsigned long long target = limit / 10 * 9;
+
+	for( size_t i = 0; i < entries.size() && total > target; ++i )
+	{
+		remove((dir + "/" + entries[i].name).c_str());
+		total -= entries[i].size;
+		--count;
+	}
+}
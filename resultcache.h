@@ -0,0 +1,68 @@
+// Author: Jonathan Decker
+// Description: On-disk cache of encode outputs and decode results, keyed by a hash of the decoded pixels
+//
+// An entry is one file named after its 64-bit key. It keeps the parameters it was made with (message,
+// strength, codec, output format...) next to the result, so a hit needs the pixels to collide on all
+// 64 bits to return a wrong result. Entries are written under a temporary name and renamed, so any
+// number of processes can share a directory; the least recently used ones are removed when the
+// directory grows past its limit.
+
+#pragma once
+
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "wavescribe.h"
+
+// 64-bit XXH64 of size bytes
+unsigned long long hashBytes64( const void* data, size_t size, unsigned long long seed );
+
+class ImageBackend;
+
+// everything besides the pixels that decides a result. message and output are NULL for a decode; the
+// format of output and, for PNG, the settings of images decide the bytes of an encode
+std::string resultCacheParams( const char* message, double markStrength, Codec codec, bool tiled, unsigned int quorum,
+                               unsigned int searchRange, const char* output, const ImageBackend& images );
+
+// find and store can be called from several threads at once
+class ResultCache
+{
+public:
+	// maxBytes is the size the directory is kept under, counting this process's writes and
+	// re-measured whenever it evicts
+	ResultCache( const char* directory, unsigned long long maxBytes );
+
+	unsigned long long key( const unsigned int* pixels, int width, int height, const std::string& params ) const;
+
+	// a hit marks the entry as recently used
+	bool find( unsigned long long key, const std::string& params, std::vector<unsigned char>& payload );
+	void store( unsigned long long key, const std::string& params, const void* payload, size_t size );
+
+	// the same with the payload in a file: a hit is written to path, a stored entry is read from it
+	bool findFile( unsigned long long key, const std::string& params, const char* path );
+	void storeFile( unsigned long long key, const std::string& params, const char* path );
+
+	unsigned long long hits() const { return hitCount; }
+	unsigned long long misses() const { return missCount; }
+
+	// entries and bytes in the directory as far as this process knows
+	unsigned long long entries() const { return count; }
+	unsigned long long bytes() const { return total; }
+
+private:
+	std::string entryPath( unsigned long long key ) const;
+
+	// removes the oldest entries until the directory is back under 90% of the limit
+	void evict();
+
+	std::string dir;
+	unsigned long long limit;
+	unsigned long long total;   // bytes in the directory as far as this process knows
+	unsigned long long count;   // entries likewise
+	unsigned long long hitCount;
+	unsigned long long missCount;
+	unsigned int written;       // numbers this process's temporary files
+	std::mutex mutex;           // the counts above and evicting
+};
@@ -0,0 +1,246 @@
+// Author: Jonathan Decker
+// Description: Row streaming for binary netpbm images (P5 graymap, P6 pixmap) and PNG (pngrows.cpp)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "rowio.h"
+#include "pngrows.h"
+#include "trace.h"
+
+typedef union
+{
+    struct
+    {
+        unsigned int r : 8;
+        unsigned int g : 8;
+        unsigned int b : 8;
+        unsigned int a : 8;
+    };
+    unsigned int c;
+}rowcol;
+
+static FILE* openStream( const char* path, bool forWrite )
+{
+	if( strcmp(path,"-") == 0 )
+	{
+#ifdef _WIN32
+		_setmode(_fileno(forWrite ? stdout : stdin), _O_BINARY);
+#endif
+		return forWrite ? stdout : stdin;
+	}
+
+	return fopen(path, forWrite ? "wb" : "rb");
+}
+
+static void closeStream( FILE* fp )
+{
+	if( fp != NULL && fp != stdin && fp != stdout )
+		fclose(fp);
+}
+
+// reads one whitespace separated header value, skipping # comments
+static bool readHeaderValue( FILE* fp, int* value )
+{
+	int c = fgetc(fp);
+
+	for(;;)
+	{
+		while( c != EOF && isspace(c) )
+			c = fgetc(fp);
+
+		if( c != '#' )
+			break;
+
+		while( c != EOF && c != '\n' )
+			c = fgetc(fp);
+	}
+
+	if( c == EOF || !isdigit(c) )
+		return false;
+
+	*value = 0;
+	while( c != EOF && isdigit(c) )
+	{
+		*value = *value*10 + (c - '0');
+		c = fgetc(fp);
+	}
+
+	// a single whitespace character ends the header
+	return c != EOF && isspace(c);
+}
+
+class PnmRowReader : public RowReader
+{
+public:
+	PnmRowReader( FILE* stream, int w, int h, int comps ) : fp(stream), channels(comps), line(w*comps)
+	{
+		imageWidth = w;
+		imageHeight = h;
+	}
+
+	~PnmRowReader()
+	{
+		closeStream(fp);
+	}
+
+	bool readRows( unsigned int* dst, int rows )
+	{
+		TRACE_SCOPE("read rows");
+
+		rowcol temp;
+
+		for( int i = 0; i < rows; ++i )
+		{
+			if( fread(&line[0], 1, line.size(), fp) != line.size() )
+				return false;
+
+			const unsigned char* p = &line[0];
+			for( int j = 0; j < imageWidth; ++j, p += channels, ++dst )
+			{
+				temp.r = p[0];
+				temp.g = p[channels == 1 ? 0 : 1];
+				temp.b = p[channels == 1 ? 0 : 2];
+				temp.a = 255;
+				*dst = temp.c;
+			}
+		}
+
+		return true;
+	}
+
+private:
+	FILE* fp;
+	int channels;
+	std::vector<unsigned char> line;
+};
+
+class PnmRowWriter : public RowWriter
+{
+public:
+	PnmRowWriter( FILE* stream, int w ) : fp(stream), width(w), line(w*3) {}
+
+	~PnmRowWriter()
+	{
+		closeStream(fp);
+	}
+
+	bool writeRows( const unsigned int* src, int rows )
+	{
+		TRACE_SCOPE("write rows");
+
+		rowcol temp;
+
+		for( int i = 0; i < rows; ++i )
+		{
+			unsigned char* p = &line[0];
+			for( int j = 0; j < width; ++j, p += 3, ++src )
+			{
+				temp.c = *src;
+				p[0] = (unsigned char)temp.r;
+				p[1] = (unsigned char)temp.g;
+				p[2] = (unsigned char)temp.b;
+			}
+
+			if( fwrite(&line[0], 1, line.size(), fp) != line.size() )
+				return false;
+		}
+
+		return true;
+	}
+
+	bool finish()
+	{
+		return fflush(fp) == 0;
+	}
+
+private:
+	FILE* fp;
+	int width;
+	std::vector<unsigned char> line;
+};
+
+static bool hasExtension( const char* path, const char* ext )
+{
+	size_t n = strlen(path);
+	size_t e = strlen(ext);
+
+	if( n < e )
+		return false;
+
+	for( size_t i = 0; i < e; ++i )
+		if( tolower((unsigned char)path[n-e+i]) != ext[i] )
+			return false;
+
+	return true;
+}
+
+bool isRowStreamable( const char* path )
+{
+	return strcmp(path,"-") == 0 || hasExtension(path,".ppm") || hasExtension(path,".pgm") || hasExtension(path,".pnm") || hasExtension(path,".png");
+}
+
+RowReader* openRowReader( const char* path )
+{
+	FILE* fp = openStream(path, false);
+
+	if( fp == NULL )
+		return NULL;
+
+	int w, h, maxval;
+	int first = fgetc(fp);
+
+	if( first == 0x89 )
+	{
+		RowReader* reader = openPngRowReader(fp);
+
+		if( reader == NULL )
+		{
+			fprintf(stderr,"Error: only non-interlaced PNG can be streamed\n");
+			closeStream(fp);
+		}
+
+		return reader;
+	}
+
+	if( first != 'P' )
+	{
+		closeStream(fp);
+		return NULL;
+	}
+
+	int kind = fgetc(fp);
+
+	if( (kind != '5' && kind != '6') || !readHeaderValue(fp,&w) || !readHeaderValue(fp,&h) || !readHeaderValue(fp,&maxval) || maxval != 255 || w <= 0 || h <= 0 )
+	{
+		fprintf(stderr,"Error: only 8-bit binary PGM/PPM can be streamed\n");
+		closeStream(fp);
+		return NULL;
+	}
+
+	return new PnmRowReader(fp, w, h, kind == '5' ? 1 : 3);
+}
+
+RowWriter* openRowWriter( const char* path, int width, int height )
+{
+	FILE* fp = openStream(path, true);
+
+	if( fp == NULL )
+		return NULL;
+
+	// PNG is written as RGBA and needs to seek back to the length of its data, so never to stdout
+	if( fp != stdout && hasExtension(path,".png") )
+		return openPngRowWriter(fp, width, height);
+
+	fprintf(fp, "P6\n%d %d\n255\n", width, height);
+
+	return new PnmRowWriter(fp, width);
+}
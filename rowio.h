@@ -0,0 +1,44 @@
+// Author: Jonathan Decker
+// Description: Row-by-row image readers and writers so large images never have to be held whole
+
+#pragma once
+
+// Pixels are exchanged as packed RGBA (same layout as stbi_load with 4 components)
+class RowReader
+{
+public:
+	virtual ~RowReader() {}
+
+	int width() const { return imageWidth; }
+	int height() const { return imageHeight; }
+
+	// reads the next rows of the image into dst (rows*width pixels)
+	virtual bool readRows( unsigned int* dst, int rows ) = 0;
+
+protected:
+	RowReader() : imageWidth(0), imageHeight(0) {}
+
+	int imageWidth;
+	int imageHeight;
+};
+
+class RowWriter
+{
+public:
+	virtual ~RowWriter() {}
+
+	// appends rows (rows*width pixels) to the image
+	virtual bool writeRows( const unsigned int* src, int rows ) = 0;
+
+	// flushes the output once every row has been written
+	virtual bool finish() = 0;
+};
+
+// path "-" reads from stdin / writes to stdout
+// returns NULL if the file cannot be opened or its format is not supported
+// Readers take binary PGM/PPM or PNG; writers write PNG for a .png path and binary PPM otherwise
+RowReader* openRowReader( const char* path );
+RowWriter* openRowWriter( const char* path, int width, int height );
+
+// true if the path names a format that can be streamed by rows
+bool isRowStreamable( const char* path );
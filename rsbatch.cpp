@@ -0,0 +1,407 @@
+// Author: Jonathan Decker
+// Description: Batched Reed-Solomon encoder and syndrome check over GF(2^8)
+//
+// A product by a constant c is linear over GF(2), so c*x = c*(x & 0x0f) ^ c*(x & 0xf0): two 16 entry
+// tables per constant, looked up for every lane at once with a byte shuffle (PSHUFB). With AVX-512 VBMI
+// a two-register byte permute (VPERMI2B) looks up 128 entries, so c*x = c*(x & 0x7f) ^ c*(x & 0x80).
+// The kernels are picked by what the CPU supports when the first batch runs.
+
+#include <string.h>
+
+#include "rsbatch.h"
+#include "cpufeatures.h"
+
+#ifdef CPU_X86
+	#include <immintrin.h>
+
+	#define RS_LANES 16
+	#define RS_TARGET TARGET_SSSE3
+	#define RS_KERNELS Ssse3Lanes
+	#include "rslanes.h"
+	#undef RS_LANES
+	#undef RS_TARGET
+	#undef RS_KERNELS
+
+	#define RS_LANES 32
+	#define RS_TARGET TARGET_AVX2
+	#define RS_KERNELS Avx2Lanes
+	#include "rslanes.h"
+	#undef RS_LANES
+	#undef RS_TARGET
+	#undef RS_KERNELS
+
+	#define RS_LANES 64
+	#define RS_TARGET TARGET_AVX512VBMI
+	#define RS_KERNELS Avx512VbmiLanes
+	#include "rslanes.h"
+	#undef RS_LANES
+	#undef RS_TARGET
+	#undef RS_KERNELS
+#endif
+
+// the most lanes of any kernel, sizes the transposed groups
+static const unsigned int maxLanes = 64;
+
+// exp and log tables of the field of primitive_polynomial06
+struct GaloisTables
+{
+	unsigned char exp[512];
+	unsigned char log[256];
+
+	GaloisTables()
+	{
+		unsigned int x = 1;
+
+		for( unsigned int i = 0; i < 255; ++i )
+		{
+			exp[i] = exp[i+255] = (unsigned char)x;
+			log[x] = (unsigned char)i;
+
+			x <<= 1;
+			if( x & 0x100 )
+				x ^= 0x11d;
+		}
+
+		exp[510] = exp[511] = exp[0];
+		log[0] = 0;
+	}
+};
+
+static const GaloisTables& galoisTables()
+{
+	static const GaloisTables tables;
+	return tables;
+}
+
+static unsigned char gfMul( unsigned char a, unsigned char b )
+{
+	const GaloisTables& gf = galoisTables();
+
+	return (a && b) ? gf.exp[gf.log[a] + gf.log[b]] : 0;
+}
+
+static void buildProducts( unsigned char c, unsigned char* products, unsigned char* nibbles )
+{
+	for( unsigned int x = 0; x < 256; ++x )
+		products[x] = gfMul(c, (unsigned char)x);
+
+	for( unsigned int x = 0; x < 16; ++x )
+	{
+		nibbles[x] = products[x];
+		nibbles[16+x] = products[x << 4];
+	}
+}
+
+ReedSolomonBatch::ReedSolomonBatch( unsigned int codeLength, unsigned int fecLength, unsigned int firstRoot )
+	: n(codeLength), fec(fecLength)
+{
+	const GaloisTables& gf = galoisTables();
+
+	// g(x) = (x - alpha^firstRoot)(x - alpha^(firstRoot+1)) ... lowest power first
+	std::vector<unsigned char> g(1, 1);
+
+	roots.resize(fec);
+
+	for( unsigned int i = 0; i < fec; ++i )
+	{
+		unsigned char root = gf.exp[(firstRoot + i) % 255];
+		std::vector<unsigned char> next(g.size() + 1, 0);
+
+		for( size_t k = 0; k < g.size(); ++k )
+		{
+			next[k+1] ^= g[k];
+			next[k] ^= gfMul(g[k], root);
+		}
+
+		g.swap(next);
+		roots[i] = root;
+	}
+
+	generator.assign(g.begin(), g.begin() + fec);
+
+	// parity register i takes the feedback times the coefficient of x^(fec-1-i)
+	generatorProducts.resize(fec*256);
+	generatorNibbles.resize(fec*32);
+	rootProducts.resize(fec*256);
+	rootNibbles.resize(fec*32);
+
+	for( unsigned int i = 0; i < fec; ++i )
+	{
+		buildProducts(generator[fec-1-i], &generatorProducts[i*256], &generatorNibbles[i*32]);
+		buildProducts(roots[i], &rootProducts[i*256], &rootNibbles[i*32]);
+	}
+}
+
+// the widest lane kernels the CPU runs, lanes is 1 (and the functions NULL) when there are none
+struct LaneKernels
+{
+	unsigned int lanes;
+	unsigned int tableSize; // 32 for the nibble tables, 256 for the product tables
+
+	void (*encode)( unsigned char* transposed, unsigned int n, unsigned int fec, const unsigned char* tables );
+	void (*syndromes)( const unsigned char* transposed, unsigned char* clean, unsigned int n, unsigned int fec, const unsigned char* tables );
+};
+
+template<class Kernels>
+static LaneKernels laneKernelsOf()
+{
+	LaneKernels kernels = { Kernels::lanes, Kernels::tableSize, Kernels::encode, Kernels::syndromes };
+	return kernels;
+}
+
+static LaneKernels pickLaneKernels( unsigned int most )
+{
+#ifdef CPU_X86
+	if( most >= 64 && cpuHasAvx512Vbmi() )
+		return laneKernelsOf<Avx512VbmiLanes>();
+	if( most >= 32 && cpuHasAvx2() )
+		return laneKernelsOf<Avx2Lanes>();
+	if( most >= 16 && cpuHasSsse3() )
+		return laneKernelsOf<Ssse3Lanes>();
+#endif
+
+	LaneKernels scalar = { 1, 0, NULL, NULL };
+	return scalar;
+}
+
+static LaneKernels& laneKernels()
+{
+	static LaneKernels kernels = pickLaneKernels(maxLanes);
+	return kernels;
+}
+
+unsigned int ReedSolomonBatch::lanes()
+{
+	return laneKernels().lanes;
+}
+
+unsigned int ReedSolomonBatch::limitLanes( unsigned int most )
+{
+	laneKernels() = pickLaneKernels(most);
+	return lanes();
+}
+
+// systematic encode with a linear feedback shift register, parity = data(x)*x^fec mod g(x)
+void ReedSolomonBatch::encodeScalar( unsigned char* codeword ) const
+{
+	unsigned char r[255];
+	unsigned int k = n - fec;
+
+	memset(r, 0, fec);
+
+	for( unsigned int j = 0; j < k; ++j )
+	{
+		const unsigned char* products = &generatorProducts[0];
+		unsigned char fb = codeword[j] ^ r[0];
+
+		for( unsigned int i = 0; i + 1 < fec; ++i, products += 256 )
+			r[i] = r[i+1] ^ products[fb];
+
+		r[fec-1] = products[fb];
+	}
+
+	memcpy(codeword + k, r, fec);
+}
+
+// the codeword evaluated at every root of the generator
+bool ReedSolomonBatch::isCleanScalar( const unsigned char* codeword ) const
+{
+	for( unsigned int i = 0; i < fec; ++i )
+	{
+		const unsigned char* products = &rootProducts[i*256];
+		unsigned char s = 0;
+
+		for( unsigned int j = 0; j < n; ++j )
+			s = products[s] ^ codeword[j];
+
+		if( s != 0 )
+			return false;
+	}
+
+	return true;
+}
+
+// groups with fewer codewords than this go through the scalar path instead of padding the lanes
+static unsigned int minimumGroup( unsigned int lanes )
+{
+	return lanes / 4 + 1;
+}
+
+void ReedSolomonBatch::encode( unsigned char* codewords, unsigned int count ) const
+{
+	const LaneKernels& kernels = laneKernels();
+	const unsigned int lanes = kernels.lanes;
+	unsigned int base = 0;
+
+	if( kernels.encode != NULL )
+	{
+		const unsigned char* tables = kernels.tableSize == 256 ? &generatorProducts[0] : &generatorNibbles[0];
+		unsigned char transposed[255*maxLanes];
+		unsigned int k = n - fec;
+
+		unsigned int group;
+
+		for( ; count - base >= minimumGroup(lanes); base += group )
+		{
+			group = count - base < lanes ? count - base : lanes;
+
+			// missing lanes encode an all zero message
+			for( unsigned int j = 0; j < k; ++j )
+				for( unsigned int c = 0; c < lanes; ++c )
+					transposed[j*lanes + c] = c < group ? codewords[(base+c)*n + j] : 0;
+
+			kernels.encode(transposed, n, fec, tables);
+
+			for( unsigned int i = k; i < n; ++i )
+				for( unsigned int c = 0; c < group; ++c )
+					codewords[(base+c)*n + i] = transposed[i*lanes + c];
+		}
+	}
+
+	for( ; base < count; ++base )
+		encodeScalar(codewords + base*n);
+}
+
+unsigned int ReedSolomonBatch::checkSyndromes( const unsigned char* codewords, unsigned char* clean, unsigned int count ) const
+{
+	const LaneKernels& kernels = laneKernels();
+	const unsigned int lanes = kernels.lanes;
+	unsigned int base = 0;
+	unsigned int cleanCount = 0;
+
+	if( kernels.syndromes != NULL )
+	{
+		const unsigned char* tables = kernels.tableSize == 256 ? &rootProducts[0] : &rootNibbles[0];
+		unsigned char transposed[255*maxLanes];
+		unsigned char laneClean[maxLanes];
+
+		unsigned int group;
+
+		for( ; count - base >= minimumGroup(lanes); base += group )
+		{
+			group = count - base < lanes ? count - base : lanes;
+
+			for( unsigned int j = 0; j < n; ++j )
+				for( unsigned int c = 0; c < lanes; ++c )
+					transposed[j*lanes + c] = c < group ? codewords[(base+c)*n + j] : 0;
+
+			kernels.syndromes(transposed, laneClean, n, fec, tables);
+
+			for( unsigned int c = 0; c < group; ++c )
+				cleanCount += clean[base+c] = laneClean[c];
+		}
+	}
+
+	for( ; base < count; ++base )
+		cleanCount += clean[base] = isCleanScalar(codewords + base*n) ? 1 : 0;
+
+	return cleanCount;
+}
+
+//#define RSBATCH_STANDALONE
+#ifdef RSBATCH_STANDALONE
+
+// Throughput of the batched kernels against Schifra on the standard RS(128,96) code
+// build: g++ -std=c++11 -O2 -DRSBATCH_STANDALONE -I<schifra> rsbatch.cpp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "schifra_galois_field.hpp"
+#include "schifra_galois_field_polynomial.hpp"
+#include "schifra_sequential_root_generator_polynomial_creator.hpp"
+#include "schifra_reed_solomon_encoder.hpp"
+#include "schifra_reed_solomon_decoder.hpp"
+#include "schifra_reed_solomon_block.hpp"
+
+static double secondsSince( std::chrono::steady_clock::time_point start )
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main( int argc, char** argv )
+{
+	const std::size_t code_length = 128;
+	const std::size_t fec_length = 96;
+	const std::size_t data_length = code_length - fec_length;
+
+	unsigned int count = argc > 1 ? (unsigned int)atoi(argv[1]) : 100000;
+
+	schifra::galois::field field(8, schifra::galois::primitive_polynomial_size06, schifra::galois::primitive_polynomial06);
+	schifra::galois::field_polynomial generator(field);
+	schifra::sequential_root_generator_polynomial_creator(field, 120, fec_length, generator);
+	schifra::reed_solomon::shortened_encoder<code_length,fec_length> encoder(field, generator);
+	schifra::reed_solomon::shortened_decoder<code_length,fec_length> decoder(field, 120);
+
+	ReedSolomonBatch batch(code_length, fec_length, 120);
+
+	std::vector<unsigned char> expected(count*code_length), codewords(count*code_length);
+	std::vector<unsigned char> clean(count);
+
+	srand(1);
+	for( size_t i = 0; i < codewords.size(); ++i )
+		codewords[i] = (i % code_length) < data_length ? (unsigned char)(32 + rand() % 95) : 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for( unsigned int c = 0; c < count; ++c )
+	{
+		schifra::reed_solomon::block<code_length,fec_length> block;
+
+		for( std::size_t i = 0; i < data_length; ++i )
+			block.data[i] = codewords[c*code_length + i];
+
+		encoder.encode(block);
+
+		for( std::size_t i = 0; i < code_length; ++i )
+			expected[c*code_length + i] = (unsigned char)block.data[i];
+	}
+
+	double schifraEncode = secondsSince(start);
+
+	start = std::chrono::steady_clock::now();
+
+	for( unsigned int c = 0; c < count; ++c )
+	{
+		schifra::reed_solomon::block<code_length,fec_length> block;
+
+		for( std::size_t i = 0; i < code_length; ++i )
+			block.data[i] = expected[c*code_length + i];
+
+		decoder.decode(block);
+	}
+
+	double schifraDecode = secondsSince(start);
+	double mb = (double)count*code_length / (1024.0*1024.0);
+	bool same = true;
+
+	printf("RS(%u,%u), %u codewords\n", (unsigned int)code_length, (unsigned int)fec_length, count);
+	printf("  Schifra           encode %8.2f MB/s   decode    %8.2f MB/s\n", mb/schifraEncode, mb/schifraDecode);
+
+	// every kernel this CPU runs, widest first
+	for( unsigned int lanes = ReedSolomonBatch::lanes(); ; lanes = ReedSolomonBatch::limitLanes(lanes/2) )
+	{
+		std::vector<unsigned char> encoded(codewords);
+
+		start = std::chrono::steady_clock::now();
+		batch.encode(&encoded[0], count);
+		double batchEncode = secondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		unsigned int cleanCount = batch.checkSyndromes(&encoded[0], &clean[0], count);
+		double batchCheck = secondsSince(start);
+
+		same = same && encoded == expected && cleanCount == count;
+
+		printf("  batched %2u lanes  encode %8.2f MB/s   syndromes %8.2f MB/s (clean codewords)  %s\n", lanes,
+			mb/batchEncode, mb/batchCheck, encoded == expected && cleanCount == count ? "match" : "MISMATCH");
+
+		if( lanes == 1 )
+			break;
+	}
+
+	return same ? 0 : 1;
+}
+
+#endif // RSBATCH_STANDALONE
@@ -0,0 +1,56 @@
+// Author: Jonathan Decker
+// Description: Batched Reed-Solomon encoder and syndrome check over GF(2^8)
+//
+// Codes over the field of primitive_polynomial06 (x^8+x^4+x^3+x^2+1) whose generator has fecLength
+// consecutive roots starting at alpha^firstRoot, with the data symbols first and the first symbol of
+// a codeword the highest power. Codewords are transposed so each vector lane holds one codeword and
+// products by the generator coefficients and roots are split-nibble table shuffles.
+// Only clean codewords are decided here: correcting errors is left to the per-codeword decoder.
+
+#pragma once
+
+#include <vector>
+
+class ReedSolomonBatch
+{
+public:
+	ReedSolomonBatch( unsigned int codeLength, unsigned int fecLength, unsigned int firstRoot );
+
+	// codewords handled per vector by the kernels picked for this CPU, 1 when it has none
+	static unsigned int lanes();
+
+	// switches to the widest kernels of at most the given lanes (for tests and benchmarks, not while
+	// other threads are batching) and returns the lanes now used
+	static unsigned int limitLanes( unsigned int most );
+
+	unsigned int codeLength() const { return n; }
+	unsigned int fecLength() const { return fec; }
+	unsigned int dataLength() const { return n - fec; }
+
+	// codewords holds count codewords of codeLength bytes back to back, with the data filled in;
+	// writes the parity symbols after the data of each one
+	void encode( unsigned char* codewords, unsigned int count ) const;
+
+	// sets clean[c] to 1 if every syndrome of codeword c is zero (0 otherwise) and returns the number of clean codewords
+	unsigned int checkSyndromes( const unsigned char* codewords, unsigned char* clean, unsigned int count ) const;
+
+	// one codeword at a time with 256 entry product tables, the reference for the batched kernels
+	void encodeScalar( unsigned char* codeword ) const;
+	bool isCleanScalar( const unsigned char* codeword ) const;
+
+private:
+	unsigned int n;
+	unsigned int fec;
+
+	// generator coefficients of x^0 .. x^(fec-1) (the polynomial is monic) and the roots alpha^(firstRoot+i)
+	std::vector<unsigned char> generator;
+	std::vector<unsigned char> roots;
+
+	// product tables, 256 bytes per constant
+	std::vector<unsigned char> generatorProducts;
+	std::vector<unsigned char> rootProducts;
+
+	// split-nibble tables, 32 bytes per constant: products of the low nibbles, then of the high nibbles
+	std::vector<unsigned char> generatorNibbles;
+	std::vector<unsigned char> rootNibbles;
+};
@@ -0,0 +1,137 @@
+// Author: Jonathan Decker
+// Description: Lane kernels of rsbatch.cpp, included once per vector width
+//
+// Defines the struct RS_KERNELS with encode/syndromes for RS_LANES codewords at a time, each
+// function compiled with RS_TARGET. 16 and 32 lanes use the split-nibble tables (PSHUFB),
+// 64 lanes looks up the low seven bits in the 256 byte product tables with VPERMI2B.
+
+struct RS_KERNELS
+{
+	static const unsigned int lanes = RS_LANES;
+
+#if RS_LANES == 64
+
+	// bytes per constant of the tables the kernels take
+	static const unsigned int tableSize = 256;
+
+	typedef __m512i vbyte;
+
+	static RS_TARGET inline vbyte vzero()                             { return _mm512_setzero_si512(); }
+	static RS_TARGET inline vbyte vload( const unsigned char* p )     { return _mm512_loadu_si512((const void*)p); }
+	static RS_TARGET inline void  vstore( unsigned char* p, vbyte a ) { _mm512_storeu_si512((void*)p,a); }
+	static RS_TARGET inline vbyte vxor( vbyte a, vbyte b )            { return _mm512_xor_si512(a,b); }
+	static RS_TARGET inline vbyte vor( vbyte a, vbyte b )             { return _mm512_or_si512(a,b); }
+
+	// c*x = c*(x & 0x7f) ^ c*(x & 0x80): one two-register permute and the top bit's product where it is set
+	static RS_TARGET inline vbyte vgfmul( vbyte x, const unsigned char* products )
+	{
+		vbyte low = _mm512_permutex2var_epi8(vload(products), x, vload(products+64));
+		vbyte top = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(x), _mm512_set1_epi8((char)products[128]));
+
+		return vxor(low, top);
+	}
+
+#elif RS_LANES == 32
+
+	static const unsigned int tableSize = 32;
+
+	typedef __m256i vbyte;
+
+	static RS_TARGET inline vbyte vzero()                             { return _mm256_setzero_si256(); }
+	static RS_TARGET inline vbyte vload( const unsigned char* p )     { return _mm256_loadu_si256((const __m256i*)p); }
+	static RS_TARGET inline void  vstore( unsigned char* p, vbyte a ) { _mm256_storeu_si256((__m256i*)p,a); }
+	static RS_TARGET inline vbyte vxor( vbyte a, vbyte b )            { return _mm256_xor_si256(a,b); }
+	static RS_TARGET inline vbyte vor( vbyte a, vbyte b )             { return _mm256_or_si256(a,b); }
+
+	// product of every lane by the constant whose nibble tables are given
+	static RS_TARGET inline vbyte vgfmul( vbyte x, const unsigned char* nibbles )
+	{
+		const vbyte mask = _mm256_set1_epi8(0x0f);
+		vbyte lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)nibbles));
+		vbyte hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(nibbles+16)));
+
+		lo = _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask));
+		hi = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+
+		return _mm256_xor_si256(lo, hi);
+	}
+
+#else
+
+	static const unsigned int tableSize = 32;
+
+	typedef __m128i vbyte;
+
+	static RS_TARGET inline vbyte vzero()                             { return _mm_setzero_si128(); }
+	static RS_TARGET inline vbyte vload( const unsigned char* p )     { return _mm_loadu_si128((const __m128i*)p); }
+	static RS_TARGET inline void  vstore( unsigned char* p, vbyte a ) { _mm_storeu_si128((__m128i*)p,a); }
+	static RS_TARGET inline vbyte vxor( vbyte a, vbyte b )            { return _mm_xor_si128(a,b); }
+	static RS_TARGET inline vbyte vor( vbyte a, vbyte b )             { return _mm_or_si128(a,b); }
+
+	static RS_TARGET inline vbyte vgfmul( vbyte x, const unsigned char* nibbles )
+	{
+		const vbyte mask = _mm_set1_epi8(0x0f);
+		vbyte lo = _mm_loadu_si128((const __m128i*)nibbles);
+		vbyte hi = _mm_loadu_si128((const __m128i*)(nibbles+16));
+
+		lo = _mm_shuffle_epi8(lo, _mm_and_si128(x, mask));
+		hi = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+
+		return _mm_xor_si128(lo, hi);
+	}
+
+#endif
+
+	// transposed holds symbol j of every lane at j*lanes, the parity is written after the data;
+	// tables holds the generator coefficients' tables in register order
+	static RS_TARGET void encode( unsigned char* transposed, unsigned int n, unsigned int fec, const unsigned char* tables )
+	{
+		vbyte r[255];
+		unsigned int k = n - fec;
+
+		for( unsigned int i = 0; i < fec; ++i )
+			r[i] = vzero();
+
+		for( unsigned int j = 0; j < k; ++j )
+		{
+			const unsigned char* table = tables;
+			vbyte fb = vxor(vload(transposed + j*lanes), r[0]);
+
+			for( unsigned int i = 0; i + 1 < fec; ++i, table += tableSize )
+				r[i] = vxor(r[i+1], vgfmul(fb, table));
+
+			r[fec-1] = vgfmul(fb, table);
+		}
+
+		for( unsigned int i = 0; i < fec; ++i )
+			vstore(transposed + (k+i)*lanes, r[i]);
+	}
+
+	// tables holds the roots' tables
+	static RS_TARGET void syndromes( const unsigned char* transposed, unsigned char* clean, unsigned int n, unsigned int fec, const unsigned char* tables )
+	{
+		vbyte s[255];
+		vbyte any = vzero();
+		unsigned char bytes[lanes];
+
+		for( unsigned int i = 0; i < fec; ++i )
+			s[i] = vzero();
+
+		for( unsigned int j = 0; j < n; ++j )
+		{
+			const unsigned char* table = tables;
+			vbyte symbol = vload(transposed + j*lanes);
+
+			for( unsigned int i = 0; i < fec; ++i, table += tableSize )
+				s[i] = vxor(vgfmul(s[i], table), symbol);
+		}
+
+		for( unsigned int i = 0; i < fec; ++i )
+			any = vor(any, s[i]);
+
+		vstore(bytes, any);
+
+		for( unsigned int c = 0; c < lanes; ++c )
+			clean[c] = bytes[c] == 0;
+	}
+};
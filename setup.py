@@ -0,0 +1,63 @@
+# Builds the wavescribe Python module (pywavescribe.cpp) with the library sources,
+# finding Schifra and stb like premake4.lua does:
+#
+#   SCHIFRADIR=... STBDIR=... python setup.py build_ext --inplace
+#
+# On Windows ZLIBDIR names the zlib headers and library as well.
+
+import os
+from setuptools import setup, Extension
+from setuptools.command.build_ext import build_ext
+
+sources = [ "arena.cpp",
+            "asyncfiles.cpp",
+            "batch.cpp",
+            "dwt97.c",
+            "framestream.cpp",
+            "imageio.cpp",
+            "imageformats.cpp",
+            "pngrows.cpp",
+            "quadsimd.cpp",
+            "resultcache.cpp",
+            "rowio.cpp",
+            "rsbatch.cpp",
+            "sidecar.cpp",
+            "trace.cpp",
+            "wavelet.cpp",
+            "wavescribe.cpp",
+            "ycbcr.cpp",
+            "pywavescribe.cpp" ]
+
+includeDirs = [ os.environ.get("SCHIFRADIR", "."), os.environ.get("STBDIR", ".") ]
+libraryDirs = []
+
+if os.name == "nt":
+    includeDirs.append(os.environ.get("ZLIBDIR", "."))
+    libraryDirs.append(os.environ.get("ZLIBDIR", "."))
+    libraries = [ "zlib" ]
+else:
+    libraries = [ "z", "pthread" ]
+
+class BuildExt(build_ext):
+    # the flags of premake4.lua, -std=c++11 for the C++ sources only
+    def build_extensions(self):
+        if self.compiler.compiler_type == "unix":
+            compileSource = self.compiler._compile
+
+            def compileWithFlags(obj, src, ext, cc_args, extra_postargs, pp_opts):
+                flags = [ "-ffp-contract=off" ] + ([] if src.endswith(".c") else [ "-std=c++11" ])
+                compileSource(obj, src, ext, cc_args, extra_postargs + flags, pp_opts)
+
+            self.compiler._compile = compileWithFlags
+
+        build_ext.build_extensions(self)
+
+setup(name = "wavescribe",
+      description = "Wavelet-based blind watermarks in RGBA pixel buffers",
+      ext_modules = [ Extension("wavescribe",
+                                sources = sources,
+                                define_macros = [ ("WAVESCRIBE_NO_MAIN", None) ],
+                                include_dirs = includeDirs,
+                                library_dirs = libraryDirs,
+                                libraries = libraries) ],
+      cmdclass = { "build_ext": BuildExt })
@@ -0,0 +1,266 @@
+// Author: Jonathan Decker
+// Description: Sidecar files of prepared images (sidecar.h)
+//
+// Layout, in the byte order of the machine that prepared it (a sidecar is a local cache; one from the
+// other byte order fails the version check):
+//   header, sidecarHeaderSize bytes
+//   pixels: width*height packed RGBA, padded to a multiple of 64 bytes
+//   planes: one per region, tileSize*tileSize coefficients of coefficientSize bytes each
+//   chroma: one per region, tileSize*tileSize slots of chromaSize bytes (the a and b of Lab, none for YCbCr)
+// The checksum covers everything after the header. Bump sidecarVersion whenever the layout or anything
+// that changes the planes (the colour conversion, a wavelet) changes.
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "sidecar.h"
+#include "resultcache.h"
+#include "threadpool.h"
+#include "trace.h"
+
+static const char sidecarMagic[8] = { 'W','S','P','R','E','P','\r','\n' };
+static const unsigned int sidecarVersion = 3;
+static const size_t sidecarHeaderSize = 128;
+
+struct SidecarHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int headerSize;
+	unsigned int width;
+	unsigned int height;
+	unsigned int preset;
+	unsigned int wavelet;
+	unsigned int space;
+	unsigned int tiled;
+	unsigned int regions;
+	unsigned int tileSize;
+	unsigned int coefficientSize;
+	unsigned int chromaSize;
+	unsigned long long sourceSize;
+	unsigned long long sourceHash;     // XXH64 of the master file
+	unsigned long long payloadSize;    // bytes after the header
+	unsigned long long payloadHash;    // XXH64 of them
+};
+
+static_assert(sizeof(SidecarHeader) <= sidecarHeaderSize, "the sidecar header has outgrown its space");
+
+static size_t pixelBytes( unsigned int width, unsigned int height )
+{
+	return ((4*(size_t)width*height + 63) / 64) * 64;
+}
+
+// bytes of the planes or the chroma, slotSize bytes per coefficient of every region
+static size_t regionBytes( unsigned int regions, unsigned int tileSize, size_t slotSize )
+{
+	return (size_t)regions*tileSize*tileSize*slotSize;
+}
+
+bool hashFile( const char* path, unsigned long long* size, unsigned long long* hash )
+{
+	FileMapping mapping;
+
+	if( !mapForReading(path, &mapping) )
+		return false;
+
+	*size = mapping.length;
+	*hash = hashBytes64(mapping.data, mapping.length, 0);
+
+	unmap(&mapping);
+
+	return true;
+}
+
+bool prepareSidecar( ThreadPool& pool, const char* path, const char* source, const unsigned int* pixels, int width, int height, bool tiled, Codec codec )
+{
+	TRACE_SCOPE_DETAIL("prepare", path);
+
+	const CodecInfo& info = codecInfo(codec.preset);
+	const unsigned int regions = preparedRegions(width, height, tiled, codec.preset);
+
+	if( regions == 0 )
+	{
+		if( tiled )
+			fprintf(stderr,"Error: Tiled mode expects an image of at least %ux%u\n", info.tileSize, info.tileSize);
+		else
+			fprintf(stderr,"Error: Expecting %ux%u source image\n", info.tileSize, info.tileSize);
+		return false;
+	}
+
+	SidecarHeader header;
+	memset(&header, 0, sizeof(header));
+
+	if( !hashFile(source, &header.sourceSize, &header.sourceHash) )
+	{
+		fprintf(stderr,"Error: could not open file %s\n", source);
+		return false;
+	}
+
+	const size_t coefficientSize = preparedCoefficientSize(codec.wavelet);
+	const size_t chromaSize = preparedChromaSize(codec.space);
+	const size_t planeBytes = regionBytes(regions, info.tileSize, coefficientSize);
+	const size_t chromaBytes = regionBytes(regions, info.tileSize, chromaSize);
+	const size_t imageBytes = pixelBytes(width, height);
+
+	memcpy(header.magic, sidecarMagic, sizeof(sidecarMagic));
+	header.version = sidecarVersion;
+	header.headerSize = (unsigned int)sidecarHeaderSize;
+	header.width = width;
+	header.height = height;
+	header.preset = codec.preset;
+	header.wavelet = codec.wavelet;
+	header.space = codec.space;
+	header.tiled = tiled ? 1 : 0;
+	header.regions = regions;
+	header.tileSize = info.tileSize;
+	header.coefficientSize = (unsigned int)coefficientSize;
+	header.chromaSize = (unsigned int)chromaSize;
+	header.payloadSize = imageBytes + planeBytes + chromaBytes;
+
+	char suffix[32];
+	sprintf(suffix, ".%d.tmp", (int)getpid());
+
+	std::string temporary = std::string(path) + suffix;
+	FileMapping mapping;
+
+	if( !mapForWriting(temporary.c_str(), sidecarHeaderSize + header.payloadSize, &mapping) )
+	{
+		fprintf(stderr,"Error: could not write file %s\n", path);
+		return false;
+	}
+
+	unsigned char* payload = mapping.data + sidecarHeaderSize;
+
+	// the planes and chroma are written straight into the file; slots outside the image stay zero
+	memset(mapping.data, 0, sidecarHeaderSize);
+	memcpy(payload, pixels, 4*(size_t)width*height);
+	memset(payload + 4*(size_t)width*height, 0, imageBytes - 4*(size_t)width*height);
+	memset(payload + imageBytes + planeBytes, 0, chromaBytes);
+
+	decomposePrepared(pool, (const unsigned int*)payload, width, height, tiled, payload + imageBytes,
+	                  chromaBytes != 0 ? payload + imageBytes + planeBytes : NULL, codec);
+
+	header.payloadHash = hashBytes64(payload, header.payloadSize, 0);
+	memcpy(mapping.data, &header, sizeof(header));
+
+	unmap(&mapping);
+
+#ifdef _WIN32
+	// rename does not replace a file on Windows
+	remove(path);
+#endif
+
+	if( rename(temporary.c_str(), path) != 0 )
+	{
+		remove(temporary.c_str());
+		fprintf(stderr,"Error: could not write file %s\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+PreparedImage::PreparedImage()
+	: imagePixels(NULL), planes(NULL), chroma(NULL), imageWidth(0), imageHeight(0), tiled(false), applied(false)
+{
+	memset(&mapping, 0, sizeof(mapping));
+}
+
+PreparedImage::~PreparedImage()
+{
+	close();
+}
+
+void PreparedImage::close()
+{
+	unmap(&mapping);
+
+	imagePixels = NULL;
+	planes = NULL;
+	chroma = NULL;
+	imageWidth = imageHeight = 0;
+}
+
+bool PreparedImage::open( const char* path, const char* source, bool tiledMode, Codec sidecarCodec )
+{
+	TRACE_SCOPE_DETAIL("open prepared", path);
+
+	close();
+
+	if( !mapForReading(path, &mapping) )
+	{
+		fprintf(stderr,"Error: could not open file %s\n", path);
+		return false;
+	}
+
+	SidecarHeader header;
+	memset(&header, 0, sizeof(header));
+
+	if( mapping.length >= sidecarHeaderSize )
+		memcpy(&header, mapping.data, sizeof(header));
+
+	const CodecInfo& info = codecInfo(sidecarCodec.preset);
+	const char* refused = NULL;
+
+	unsigned long long sourceSize = 0;
+	unsigned long long sourceHash = 0;
+
+	// every field is checked against what this build would have written, so a sidecar of another
+	// version, codec or build is refused rather than misread
+	if( mapping.length < sidecarHeaderSize || memcmp(header.magic, sidecarMagic, sizeof(sidecarMagic)) != 0 )
+		refused = "is not a sidecar";
+	else if( header.version != sidecarVersion || header.headerSize != sidecarHeaderSize )
+		refused = "was written by another version";
+	else if( header.preset != (unsigned int)sidecarCodec.preset || header.wavelet != (unsigned int)sidecarCodec.wavelet ||
+	         header.space != (unsigned int)sidecarCodec.space ||
+	         header.tiled != (tiledMode ? 1u : 0u) || header.tileSize != info.tileSize ||
+	         header.coefficientSize != preparedCoefficientSize(sidecarCodec.wavelet) ||
+	         header.chromaSize != preparedChromaSize(sidecarCodec.space) )
+		refused = "was prepared with other --config, --wavelet, --space or --tiled options";
+	else if( header.regions == 0 || header.regions != preparedRegions(header.width, header.height, tiledMode, sidecarCodec.preset) ||
+	         header.payloadSize != pixelBytes(header.width, header.height) + (unsigned long long)regionBytes(header.regions, info.tileSize, header.coefficientSize + header.chromaSize) ||
+	         header.payloadSize != mapping.length - sidecarHeaderSize ||
+	         hashBytes64(mapping.data + sidecarHeaderSize, (size_t)header.payloadSize, 0) != header.payloadHash )
+		refused = "is damaged";
+	else if( !hashFile(source, &sourceSize, &sourceHash) )
+		refused = "has no master to check against";
+	else if( sourceSize != header.sourceSize || sourceHash != header.sourceHash )
+		refused = "is stale, its master has changed";
+
+	if( refused != NULL )
+	{
+		fprintf(stderr,"Error: %s %s\n", path, refused);
+		close();
+		return false;
+	}
+
+	imagePixels = (unsigned int*)(mapping.data + sidecarHeaderSize);
+	planes = mapping.data + sidecarHeaderSize + pixelBytes(header.width, header.height);
+	chroma = header.chromaSize != 0 ? (unsigned char*)planes + regionBytes(header.regions, info.tileSize, header.coefficientSize) : NULL;
+	imageWidth = (int)header.width;
+	imageHeight = (int)header.height;
+	tiled = tiledMode;
+	codec = sidecarCodec;
+	applied = false;
+
+	return true;
+}
+
+bool PreparedImage::apply( ThreadPool& pool, const unsigned char* mark, double markStrength )
+{
+	// marking changes the planes, a second mark would go on top of the first
+	if( imagePixels == NULL || applied )
+		return false;
+
+	applied = true;
+
+	return markPrepared(pool, imagePixels, imageWidth, imageHeight, tiled, planes, chroma, mark, markStrength, codec);
+}
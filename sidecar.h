@@ -0,0 +1,58 @@
+// Author: Jonathan Decker
+// Description: Sidecar files of prepared images, so masters marked again and again skip the work that
+// does not depend on the message
+//
+// prepareSidecar stores the decoded pixels of a master, the decomposed luminance planes of its regions and,
+// for Lab, the chroma of their pixels (wavescribe.h). A PreparedImage maps the sidecar copy-on-write, checks
+// it, and marks the planes into the mapped pixels: no PNG decode, conversion to Lab or forward transform, and
+// the output is the same, byte for byte, as an encode of the master with the same options.
+
+#pragma once
+
+#include "wavescribe.h"
+#include "imageio.h"
+
+class ThreadPool;
+
+// XXH64 of a whole file and its size, false if it cannot be read
+bool hashFile( const char* path, unsigned long long* size, unsigned long long* hash );
+
+// Decomposes pixels, decoded from the master file source, and writes the sidecar to path under a
+// temporary name that is renamed once complete. False if the image has no region or the file cannot
+// be written
+bool prepareSidecar( ThreadPool& pool, const char* path, const char* source, const unsigned int* pixels, int width, int height, bool tiled, Codec codec );
+
+class PreparedImage
+{
+public:
+	PreparedImage();
+	~PreparedImage();
+
+	// Maps a sidecar and checks it: its version, that it was prepared with codec and tiled, its checksum
+	// and that the master file source still has the size and hash it was prepared from. Prints why a
+	// sidecar is refused
+	bool open( const char* path, const char* source, bool tiled, Codec codec );
+
+	// marks the mapped pixels, once per open; the sidecar file does not change
+	bool apply( ThreadPool& pool, const unsigned char* mark, double markStrength );
+
+	unsigned int* pixels() const { return imagePixels; }
+	int width() const { return imageWidth; }
+	int height() const { return imageHeight; }
+
+private:
+	PreparedImage( const PreparedImage& );
+	PreparedImage& operator=( const PreparedImage& );
+
+	void close();
+
+	FileMapping mapping;
+	unsigned int* imagePixels;
+	void* planes;
+	void* chroma;
+	int imageWidth;
+	int imageHeight;
+	bool tiled;
+	bool applied;
+	Codec codec;
+};
@@ -0,0 +1,154 @@
+// Author: Jonathan Decker
+// Description: Minimal fixed-size worker pool used to spread tiles and images across cores
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "trace.h"
+
+// the tasks of one call, so it can wait for them alone while other callers share the pool
+class TaskGroup
+{
+public:
+	TaskGroup() : pending(0) {}
+
+private:
+	friend class ThreadPool;
+
+	TaskGroup( const TaskGroup& );
+	TaskGroup& operator=( const TaskGroup& );
+
+	unsigned int pending;   // guarded by the pool's queueMutex
+};
+
+class ThreadPool
+{
+public:
+	// threads == 0 uses one worker per hardware thread
+	// threadExit (optional) runs on each worker before it terminates
+	explicit ThreadPool( unsigned int threads = 0, void (*threadExit)() = NULL )
+		: pending(0), stopping(false), exitHook(threadExit)
+	{
+		if( threads == 0 )
+			threads = std::thread::hardware_concurrency();
+		if( threads == 0 )
+			threads = 1;
+
+		for( unsigned int i = 0; i < threads; ++i )
+			workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			stopping = true;
+		}
+		taskReady.notify_all();
+
+		for( size_t i = 0; i < workers.size(); ++i )
+			workers[i].join();
+	}
+
+	void enqueue( const std::function<void()>& task )
+	{
+		enqueue(task, NULL);
+	}
+
+	void enqueue( const std::function<void()>& task, TaskGroup& group )
+	{
+		enqueue(task, &group);
+	}
+
+	// blocks until every queued task has finished
+	void wait()
+	{
+		TRACE_SCOPE("pool wait");
+
+		std::unique_lock<std::mutex> lock(queueMutex);
+		allDone.wait(lock, [this]{ return pending == 0; });
+	}
+
+	// blocks until the tasks of group have finished, whatever else the pool is running
+	void wait( TaskGroup& group )
+	{
+		TRACE_SCOPE("pool wait");
+
+		std::unique_lock<std::mutex> lock(queueMutex);
+		allDone.wait(lock, [&group]{ return group.pending == 0; });
+	}
+
+	unsigned int size() const
+	{
+		return (unsigned int)workers.size();
+	}
+
+private:
+	struct Task
+	{
+		std::function<void()> run;
+		TaskGroup* group;
+	};
+
+	void enqueue( const std::function<void()>& task, TaskGroup* group )
+	{
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			Task queued = { task, group };
+			tasks.push(queued);
+			++pending;
+
+			if( group != NULL )
+				++group->pending;
+		}
+		taskReady.notify_one();
+	}
+
+	void workerLoop()
+	{
+		traceThreadName("worker");
+
+		for(;;)
+		{
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				taskReady.wait(lock, [this]{ return stopping || !tasks.empty(); });
+
+				if( tasks.empty() )
+					break;
+
+				task = tasks.front();
+				tasks.pop();
+			}
+
+			task.run();
+
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				bool groupDone = task.group != NULL && --task.group->pending == 0;
+
+				if( --pending == 0 || groupDone )
+					allDone.notify_all();
+			}
+		}
+
+		if( exitHook != NULL )
+			exitHook();
+	}
+
+	std::vector<std::thread> workers;
+	std::queue<Task> tasks;
+	std::mutex queueMutex;
+	std::condition_variable taskReady;
+	std::condition_variable allDone;
+	unsigned int pending;
+	bool stopping;
+	void (*exitHook)();
+};
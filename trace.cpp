@@ -0,0 +1,206 @@
+// Author: Jonathan Decker
+// Description: Per-thread span rings and the Chrome trace writer (trace.h)
+//
+// A ring belongs to the thread that made it, which is the only one writing it: the event is stored
+// first, then the count of events is published with a release store, so the writer sees whole events.
+// Rings are kept until the program ends, the threads of a pool are usually gone when the trace is written.
+
+#include <stdio.h>
+
+#include "trace.h"
+
+#ifdef WAVESCRIBE_TRACE
+
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent
+{
+	const char* name;
+	long long start;     // ns since traceStart
+	long long duration;  // ns
+	char detail[40];     // the end of the detail, empty if none
+};
+
+// 4 MB per thread that records anything
+static const unsigned int traceRingSize = 1 << 16;
+
+struct TraceRing
+{
+	TraceRing( unsigned int id, const char* name ) : written(0), id(id), name(name) {}
+
+	TraceEvent events[traceRingSize];
+	std::atomic<unsigned long long> written;
+	unsigned int id;
+	const char* name;
+};
+
+static std::atomic<bool> tracing(false);
+static std::chrono::steady_clock::time_point origin;
+
+static std::mutex ringsMutex;
+static std::vector<TraceRing*> rings;
+
+static thread_local TraceRing* threadRing = NULL;
+static thread_local const char* threadName = "thread";
+
+static long long traceNow()
+{
+	return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+static TraceRing* currentRing()
+{
+	if( threadRing == NULL )
+	{
+		std::unique_lock<std::mutex> lock(ringsMutex);
+		threadRing = new TraceRing((unsigned int)rings.size(), threadName);
+		rings.push_back(threadRing);
+	}
+
+	return threadRing;
+}
+
+TraceScope::TraceScope( const char* name, const char* detail )
+	: name(name), detail(detail), start(tracing.load(std::memory_order_relaxed) ? traceNow() : -1)
+{
+}
+
+TraceScope::~TraceScope()
+{
+	if( start < 0 )
+		return;
+
+	long long end = traceNow();
+	TraceRing* ring = currentRing();
+	unsigned long long n = ring->written.load(std::memory_order_relaxed);
+	TraceEvent& event = ring->events[n % traceRingSize];
+
+	event.name = name;
+	event.start = start;
+	event.duration = end - start;
+
+	if( detail != NULL )
+	{
+		size_t length = strlen(detail);
+		size_t skip = length >= sizeof(event.detail) ? length - sizeof(event.detail) + 1 : 0;
+
+		memcpy(event.detail, detail + skip, length - skip + 1);
+	}
+	else
+		event.detail[0] = 0;
+
+	ring->written.store(n + 1, std::memory_order_release);
+}
+
+bool traceStart()
+{
+	origin = std::chrono::steady_clock::now();
+	tracing.store(true);
+
+	return true;
+}
+
+void traceThreadName( const char* name )
+{
+	threadName = name;
+
+	if( threadRing != NULL )
+	{
+		std::unique_lock<std::mutex> lock(ringsMutex);
+		threadRing->name = name;
+	}
+}
+
+static void writeJsonString( FILE* file, const char* str )
+{
+	fputc('"', file);
+
+	for( ; *str; ++str )
+	{
+		unsigned char c = (unsigned char)*str;
+
+		if( c == '"' || c == '\\' )
+			fprintf(file, "\\%c", c);
+		else if( c < 0x20 )
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+
+	fputc('"', file);
+}
+
+bool traceWrite( const char* path )
+{
+	tracing.store(false);
+
+	FILE* fp = fopen(path, "w");
+
+	if( fp == NULL )
+		return false;
+
+	std::unique_lock<std::mutex> lock(ringsMutex);
+	unsigned long long dropped = 0;
+	bool first = true;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for( size_t r = 0; r < rings.size(); ++r )
+	{
+		const TraceRing& ring = *rings[r];
+		unsigned long long n = ring.written.load(std::memory_order_acquire);
+		unsigned long long oldest = n > traceRingSize ? n - traceRingSize : 0;
+
+		dropped += oldest;
+
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}", first ? "" : ",", ring.id, ring.name, ring.id);
+		fprintf(fp, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"sort_index\":%u}}", ring.id, ring.id);
+		first = false;
+
+		// Chrome wants microseconds
+		for( unsigned long long i = oldest; i < n; ++i )
+		{
+			const TraceEvent& event = ring.events[i % traceRingSize];
+
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", event.name, ring.id, event.start / 1000.0, event.duration / 1000.0);
+
+			if( event.detail[0] != 0 )
+			{
+				fprintf(fp, ",\"args\":{\"detail\":");
+				writeJsonString(fp, event.detail);
+				fputc('}', fp);
+			}
+
+			fputc('}', fp);
+		}
+	}
+
+	fprintf(fp, "\n],\"otherData\":{\"threads\":\"%u\",\"dropped\":\"%llu\"}}\n", (unsigned int)rings.size(), dropped);
+
+	if( dropped > 0 )
+		fprintf(stderr, "Warning: the trace dropped the %llu oldest spans of threads that filled their ring\n", dropped);
+
+	return fclose(fp) == 0;
+}
+
+#else
+
+bool traceStart()
+{
+	return false;
+}
+
+bool traceWrite( const char* )
+{
+	return false;
+}
+
+void traceThreadName( const char* )
+{
+}
+
+#endif // WAVESCRIBE_TRACE
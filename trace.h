@@ -0,0 +1,50 @@
+// Author: Jonathan Decker
+// Description: Optional timeline of what every thread does, written as a Chrome trace
+//
+// Only compiled in with WAVESCRIBE_TRACE defined, otherwise TRACE_SCOPE is empty and traceStart fails.
+// Every thread records its spans into a ring of its own, with no lock and no atomic read-modify-write,
+// so a span costs two clock reads and a few stores. A ring that wraps drops its oldest spans; how many
+// were dropped is written with the trace. Open the file in chrome://tracing or ui.perfetto.dev.
+
+#pragma once
+
+// starts recording spans, false if the program was built without WAVESCRIBE_TRACE
+bool traceStart();
+
+// Stops recording and writes the spans of every thread that recorded any, including threads that have
+// ended, as Chrome trace event JSON. Call it once the work is done. False if path cannot be written
+bool traceWrite( const char* path );
+
+// names the calling thread's track in the trace ("main", "worker"...), the name must outlive the thread
+void traceThreadName( const char* name );
+
+#ifdef WAVESCRIBE_TRACE
+
+// records the time from its construction to its destruction on the calling thread. name must be a
+// literal; detail (a path...), if not NULL, is copied when the span ends, only its last 39 bytes if longer
+class TraceScope
+{
+public:
+	explicit TraceScope( const char* name, const char* detail = 0 );
+	~TraceScope();
+
+private:
+	TraceScope( const TraceScope& );
+	TraceScope& operator=( const TraceScope& );
+
+	const char* name;
+	const char* detail;
+	long long start;  // ns since traceStart, negative if not recording
+};
+
+#define TRACE_JOIN2(a,b) a##b
+#define TRACE_JOIN(a,b) TRACE_JOIN2(a,b)
+#define TRACE_SCOPE(name) TraceScope TRACE_JOIN(traceScope,__LINE__)(name)
+#define TRACE_SCOPE_DETAIL(name,detail) TraceScope TRACE_JOIN(traceScope,__LINE__)(name,detail)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_DETAIL(name,detail)
+
+#endif
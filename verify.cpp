@@ -0,0 +1,1508 @@
+// Author: Jonathan Decker
+// Usage:  WaveScribeVerify
+// Description: Self checks for internals that WaveScribeTest.py cannot observe from the command line
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "wavescribe.h"
+#include "arena.h"
+#include "asyncfiles.h"
+#include "threadpool.h"
+#include "markcache.h"
+#include "quadsimd.h"
+#include "rsbatch.h"
+#include "wavelet.h"
+#include "rowio.h"
+#include "imageio.h"
+#include "batch.h"
+#include "resultcache.h"
+#include "sidecar.h"
+#include "trace.h"
+#include "ycbcr.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#include <sys/utime.h>
+#define utime _utime
+#define utimbuf _utimbuf
+#define rmdir _rmdir
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+extern "C"
+{
+	#include "dwt.h"
+}
+
+// Every heap allocation made by the process is counted, including the ones inside C code
+static std::atomic<size_t> allocationCount(0);
+
+void* operator new( size_t n )
+{
+	++allocationCount;
+	void* p = malloc(n);
+	if( p == NULL )
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[]( size_t n )
+{
+	return operator new(n);
+}
+
+void operator delete( void* p ) noexcept
+{
+	free(p);
+}
+
+void operator delete[]( void* p ) noexcept
+{
+	free(p);
+}
+
+#ifdef __GLIBC__
+extern "C"
+{
+	void* __libc_malloc( size_t n );
+	void* __libc_calloc( size_t n, size_t size );
+	void* __libc_realloc( void* p, size_t n );
+	void  __libc_free( void* p );
+
+	void* malloc( size_t n )                { ++allocationCount; return __libc_malloc(n); }
+	void* calloc( size_t n, size_t size )   { ++allocationCount; return __libc_calloc(n,size); }
+	void* realloc( void* p, size_t n )      { ++allocationCount; return __libc_realloc(p,n); }
+	void  free( void* p )                   { __libc_free(p); }
+}
+#endif
+
+static int failures = 0;
+
+static void check( bool condition, const char* name )
+{
+	printf("%s : %s\n", condition ? "PASS" : "FAIL", name);
+
+	if( !condition )
+		++failures;
+}
+
+// textured test image, the mark needs mid frequency content to survive 8-bit rounding
+static void fillTestImage( unsigned int* pixels, int width, int height )
+{
+	for( int y = 0; y < height; ++y )
+	{
+		for( int x = 0; x < width; ++x )
+		{
+			unsigned int r = (unsigned int)(128 + 60*sin(x/5.0) * cos(y/3.7) + 30*sin(x*y/900.0));
+			unsigned int g = (unsigned int)(128 + 50*sin((x+y)/31.0));
+			unsigned int b = (unsigned int)(120 + 80*sin(x/41.0 + y/29.0));
+
+			pixels[y*width+x] = r | (g << 8) | (b << 16) | (255u << 24);
+		}
+	}
+}
+
+// After the first image has sized the thread arena, encoding and decoding a mark must not touch the heap
+static void checkSteadyStateAllocations()
+{
+	int width = 512;
+	int height = 512;
+
+	static unsigned int pixels[512*512];
+	unsigned char mark[32*32];
+	unsigned char decoded[32*32];
+	unsigned int* output = NULL;
+
+	encodeStringIntoBinaryMatrix("steady state", mark, 32, 32);
+
+	// warm up: sizes the arena and the per-thread transform buffer
+	for( int i = 0; i < 2; ++i )
+	{
+		fillTestImage(pixels, width, height);
+		insertWatermark(pixels, &output, mark, &width, &height, true, 0.5);
+		insertWatermark(pixels, &output, decoded, &width, &height, false, 0.5);
+		threadArena().reset();
+	}
+
+	size_t before = allocationCount;
+	size_t arenaBlocks = threadArena().systemAllocations();
+
+	for( int i = 0; i < 4; ++i )
+	{
+		fillTestImage(pixels, width, height);
+		insertWatermark(pixels, &output, mark, &width, &height, true, 0.5);
+		insertWatermark(pixels, &output, decoded, &width, &height, false, 0.5);
+		threadArena().reset();
+	}
+
+	size_t allocations = allocationCount - before;
+
+	printf("     %u heap allocations over 4 encode/decode pairs, arena capacity %u bytes\n", (unsigned int)allocations, (unsigned int)threadArena().capacity());
+
+	check(allocations == 0, "no heap allocations in steady state");
+	check(threadArena().systemAllocations() == arenaBlocks, "arena did not grow after warm up");
+	// the message comes back through the Reed-Solomon decode (not part of the counted window)
+	char message[33];
+	message[32] = 0;
+	decodeBinaryMatrixAsString(decoded, message, 32, 32);
+
+	check(strncmp(message, "steady state", 12) == 0, "message read back");
+}
+
+// A workload that spills into several blocks is merged into one block on reset
+static void checkArenaHighWater()
+{
+	Arena arena;
+
+	arena.alloc(3 << 20);
+	arena.alloc(5 << 20);
+	arena.reset();
+
+	size_t blocks = arena.systemAllocations();
+
+	{
+		ArenaScope scope(arena);
+		arena.alloc(3 << 20);
+		arena.alloc(5 << 20);
+	}
+
+	check(arena.systemAllocations() == blocks, "arena reuses its high-water block");
+
+	void* p = arena.alloc(100, 64);
+	check(((size_t)p & 63) == 0, "arena allocations are aligned");
+}
+
+// stb doubles its buffers by realloc: the last allocation grows in place, anything else is copied, and
+// a free of the last allocation is taken back. Runs on a thread of its own for an empty thread arena
+static void checkArenaRealloc()
+{
+	bool inPlace = true, copied = false, rolledBack = false;
+	size_t capacity = 0;
+
+	std::thread([&]{
+		unsigned char* p = (unsigned char*)arenaMalloc(4096);
+		memset(p, 7, 4096);
+
+		for( size_t size = 8192; size <= (512 << 10); size *= 2 )
+			inPlace = arenaRealloc(p, size) == p && inPlace;
+
+		inPlace = inPlace && p[0] == 7 && p[4095] == 7;
+		capacity = threadArena().capacity();
+
+		unsigned char* other = (unsigned char*)arenaMalloc(100);
+		unsigned char* q = (unsigned char*)arenaRealloc(p, 600 << 10);
+		copied = q != p && q[0] == 7 && q[4095] == 7;
+
+		arenaFree(q);
+		rolledBack = arenaMalloc(100) == q;
+		(void)other;
+	}).join();
+
+	check(inPlace && capacity == (1 << 20), "arena grows the last allocation in place");
+	check(copied && rolledBack, "arena copies other reallocs and takes back a free of the last allocation");
+}
+
+// Cached marks must match a fresh encode, even while other threads keep replacing slots
+static void checkMarkPlanCache()
+{
+	const int messages = 12;
+	char text[messages][16];
+	std::vector< std::vector<unsigned char> > expected(messages, std::vector<unsigned char>(32*32));
+
+	for( int m = 0; m < messages; ++m )
+	{
+		sprintf(text[m], "campaign %d", m);
+		encodeStringIntoBinaryMatrix(text[m], &expected[m][0], 32, 32);
+	}
+
+	// a single set of 8 ways, so 12 messages force evictions
+	MarkPlanCache<32, 32*32> cache(1);
+	unsigned char mark[32*32];
+
+	cache.insert(text[0], 1, &expected[0][0]);
+	check(cache.lookup(text[0], 1, mark) && memcmp(mark, &expected[0][0], sizeof(mark)) == 0, "mark plan cache hit");
+	check(!cache.lookup(text[0], 2, mark), "mark plan cache keys on the code");
+
+	std::atomic<bool> done(false);
+	std::atomic<int> wrong(0);
+	std::vector<std::thread> readers;
+
+	for( int r = 0; r < 4; ++r )
+	{
+		readers.push_back(std::thread([&,r]{
+			unsigned char found[32*32];
+			for( int i = 0; !done; ++i )
+			{
+				int m = (i + r) % messages;
+				if( cache.lookup(text[m], 1, found) && memcmp(found, &expected[m][0], sizeof(found)) != 0 )
+					++wrong;
+			}
+		}));
+	}
+
+	for( int i = 0; i < 20000; ++i )
+		cache.insert(text[i % messages], 1, &expected[i % messages][0]);
+
+	done = true;
+	for( size_t r = 0; r < readers.size(); ++r )
+		readers[r].join();
+
+	check(wrong == 0, "mark plan cache reads are consistent under concurrent inserts");
+}
+
+// random coefficients, optionally drawn from a tiny set so sortVec4 sees many ties
+static double testCoefficient( int kind )
+{
+	switch( kind )
+	{
+	case 0:  return (rand() - RAND_MAX/2) / 1000.0;
+	case 1:  return (double)(rand() % 3);
+	default: return 1.25; // flat region, delta == 0
+	}
+}
+
+// The batched kernels must reproduce the scalar kernels bit for bit
+static void checkBatchedQuadKernels()
+{
+	const unsigned int groups = 1024;
+	const double strengths[] = { 0.05, 0.5, 2.0 };
+	const unsigned int widest = quadBatchWidth();
+
+	std::vector<double> scalar(groups*4), batched(groups*4);
+	std::vector<unsigned int> indices(groups*4);
+	std::vector<unsigned char> mark(groups), bits1(groups), bits2(groups);
+	std::vector<double> dist1(groups), dist2(groups), soft1(groups), soft2(groups);
+
+	bool encodeSame = true, distanceSame = true, meanSame = true;
+
+	srand(7);
+
+	// every kernel width this CPU runs
+	for( unsigned int width = widest; ; )
+	{
+		for( int kind = 0; kind < 3; ++kind )
+		{
+			for( int s = 0; s < 3; ++s )
+			{
+				// groups are scattered through the plane like the HL3 columns
+				for( unsigned int g = 0; g < groups; ++g )
+					for( unsigned int k = 0; k < 4; ++k )
+						indices[g*4+k] = k*groups + g;
+
+				for( unsigned int i = 0; i < groups*4; ++i )
+					scalar[i] = batched[i] = testCoefficient(kind);
+				for( unsigned int g = 0; g < groups; ++g )
+					mark[g] = rand() & 1;
+
+				unsigned int done = encodeQuadsBatched(&batched[0], &indices[0], &mark[0], groups, strengths[s]);
+
+				for( unsigned int g = 0; g < groups; ++g )
+				{
+					double v[4];
+					unsigned int idx[4];
+
+					for( unsigned int k = 0; k < 4; ++k )
+						v[k] = scalar[indices[g*4+k]];
+
+					encodeBit(v, idx, mark[g], strengths[s]);
+
+					for( unsigned int k = 0; k < 4; ++k )
+						scalar[indices[g*4+idx[k]]] = v[k];
+
+					// let the scalar code finish what the batch did not cover
+					if( g >= done )
+						for( unsigned int k = 0; k < 4; ++k )
+							batched[indices[g*4+k]] = scalar[indices[g*4+k]];
+				}
+
+				encodeSame = encodeSame && memcmp(&scalar[0], &batched[0], sizeof(double)*groups*4) == 0;
+
+				done = quadDistancesBatched(&batched[0], &indices[0], &dist2[0], groups, strengths[s]);
+
+				for( unsigned int g = 0; g < groups; ++g )
+				{
+					double v[4];
+
+					for( unsigned int k = 0; k < 4; ++k )
+						v[k] = scalar[indices[g*4+k]];
+
+					dist1[g] = getDistance(v, strengths[s]);
+
+					if( g >= done )
+						dist2[g] = dist1[g];
+				}
+
+				distanceSame = distanceSame && memcmp(&dist1[0], &dist2[0], sizeof(double)*groups) == 0;
+
+				// half-integer distances exercise the rounding of the vote
+				for( unsigned int g = 0; g < groups; g += 5 )
+					dist1[g] = dist2[g] = (int)(g % 9) - 4 + 0.5;
+
+				std::vector<double> reversed(dist1.rbegin(), dist1.rend());
+
+				done = fuzzyMeanBatched(&dist1[0], &reversed[0], &bits2[0], &soft2[0], groups);
+
+				for( unsigned int g = 0; g < groups; ++g )
+				{
+					soft1[g] = fuzzyMean(dist1[g], reversed[g]);
+					bits1[g] = soft1[g] < 0 ? 0 : 1;
+
+					if( g >= done )
+					{
+						soft2[g] = soft1[g];
+						bits2[g] = bits1[g];
+					}
+				}
+
+				meanSame = meanSame && memcmp(&soft1[0], &soft2[0], sizeof(double)*groups) == 0 && bits1 == bits2;
+			}
+		}
+
+		printf("     batch width %u\n", width);
+
+		unsigned int narrower = limitQuadBatchWidth(width/2);
+		if( narrower == width )
+			break;
+
+		width = narrower;
+	}
+
+	limitQuadBatchWidth(widest);
+
+	check(encodeSame, "batched encodeBit matches the scalar kernel");
+	check(distanceSame, "batched getDistance matches the scalar kernel");
+	check(meanSame, "batched fuzzy mean matches the scalar kernel");
+}
+
+// The batched Reed-Solomon kernels must match their scalar reference, and the batched message
+// interface must read back what the per-message one wrote, through corrupted marks as well
+static void checkBatchedReedSolomon()
+{
+	const unsigned int count = 105;
+	const unsigned int widest = ReedSolomonBatch::lanes();
+	ReedSolomonBatch batch(128, 96, 120);
+	std::vector<unsigned char> codewords(count*128), expected;
+	std::vector<unsigned char> clean(count);
+	bool encodeSame = true, cleanSame = true;
+
+	srand(11);
+
+	// every kernel this CPU runs, down to the scalar tables
+	for( unsigned int lanes = widest; ; lanes = ReedSolomonBatch::limitLanes(lanes/2) )
+	{
+		for( unsigned int c = 0; c < count; ++c )
+			for( unsigned int i = 0; i < 32; ++i )
+				codewords[c*128 + i] = (unsigned char)rand();
+
+		expected = codewords;
+		batch.encode(&codewords[0], count);
+
+		for( unsigned int c = 0; c < count; ++c )
+			batch.encodeScalar(&expected[c*128]);
+
+		encodeSame = encodeSame && codewords == expected;
+
+		// corrupt every third codeword
+		for( unsigned int c = 0; c < count; c += 3 )
+			codewords[c*128 + rand() % 128] ^= (unsigned char)(1 + rand() % 255);
+
+		batch.checkSyndromes(&codewords[0], &clean[0], count);
+
+		for( unsigned int c = 0; c < count; ++c )
+			cleanSame = cleanSame && clean[c] == (batch.isCleanScalar(&codewords[c*128]) ? 1 : 0) && clean[c] == (c % 3 != 0);
+
+		printf("     RS batch lanes %u\n", lanes);
+
+		if( lanes == 1 )
+			break;
+	}
+
+	ReedSolomonBatch::limitLanes(widest);
+
+	check(encodeSame, "batched RS encode matches the scalar encoder");
+	check(cleanSame, "batched RS syndromes find exactly the corrupted codewords");
+
+	const unsigned int messages = 40;
+	char text[messages][32];
+	const char* strs[messages];
+	std::vector<unsigned char> marks(messages*32*32), single(32*32);
+	std::vector<char> decoded(messages*(maxPayloadLength+1));
+	bool marksSame = true, textSame = true;
+
+	for( unsigned int m = 0; m < messages; ++m )
+	{
+		sprintf(text[m], "fingerprint %u", m*7919);
+		strs[m] = text[m];
+	}
+
+	encodeMessageMarks(strs, &marks[0], messages);
+
+	for( unsigned int m = 0; m < messages; ++m )
+	{
+		encodeMessageMark(strs[m], &single[0]);
+		marksSame = marksSame && memcmp(&single[0], &marks[m*32*32], 32*32) == 0;
+	}
+
+	// flip bits in every other mark, well within what RS(128,96) corrects
+	for( unsigned int m = 0; m < messages; m += 2 )
+		for( int b = 0; b < 40; ++b )
+			marks[m*32*32 + rand() % (32*32)] ^= 1;
+
+	unsigned int read = decodeMessageMarks(&marks[0], &decoded[0], messages);
+
+	for( unsigned int m = 0; m < messages; ++m )
+	{
+		char padded[33];
+		snprintf(padded, sizeof(padded), "%-32.31s", text[m]);
+		textSame = textSame && strcmp(&decoded[m*(maxPayloadLength+1)], padded) == 0;
+	}
+
+	check(marksSame, "batched message encode matches the per-message marks");
+	check(read == messages && textSame, "batched message decode reads every message back");
+}
+
+// The decode diagnostics must describe the mark that was actually read
+static void checkDecodeDiagnostics()
+{
+	int width = 512;
+	int height = 512;
+
+	static unsigned int pixels[512*512];
+	static DecodeResult result;
+	unsigned char mark[32*32];
+	unsigned char decoded[32*32];
+	unsigned int* output = NULL;
+	bool signsMatch = true;
+
+	encodeMessageMark("diagnostics", mark);
+	fillTestImage(pixels, width, height);
+	insertWatermark(pixels, &output, mark, &width, &height, true, 0.5);
+
+	check(decodeWatermark(pixels, decoded, width, height, 0.5, CodecStandard, &result), "decode with diagnostics");
+
+	for( int i = 0; i < 32*32; ++i )
+		signsMatch = signsMatch && (result.confidence[i] < 0 ? 0 : 1) == decoded[i];
+
+	check(result.decoded && strncmp(result.message, "diagnostics", 11) == 0, "diagnostics carry the message");
+	check(signsMatch, "confidence signs are the decoded bits");
+	check(result.correctableSymbols == 48 && result.margin == 48 - (int)result.correctedSymbols, "margin is what the code has left");
+	check(result.bandAgreement > 0.5 && result.bandAgreement <= 1.0 && result.tilesRead == 1, "band agreement of a marked image");
+
+	DecodeAggregate total, shard;
+	addDecodeResult(total, result);
+	addDecodeResult(shard, result);
+	mergeDecodeAggregate(total, shard);
+
+	check(total.images == 2 && total.decoded == 2 && total.minMargin == result.margin, "aggregates merge");
+}
+
+// a binary payload of the full capacity goes into one tile and comes back, a short one uses one codeword
+static void checkCapacityPayload()
+{
+	const CodecInfo& info = codecInfo(CodecStandard);
+
+	static unsigned int pixels[512*512];
+	static PayloadResult result;
+	std::vector<unsigned char> payload(info.capacityLength + 1);
+	ThreadPool pool(2);
+
+	for( size_t i = 0; i < payload.size(); ++i )
+		payload[i] = (unsigned char)(i*37 + 11);
+
+	fillTestImage(pixels, 512, 512);
+
+	check(!insertPayload(pool, pixels, 512, 512, &payload[0], info.capacityLength + 1, 0.5), "capacity payload too long is refused");
+
+	bool inserted = insertPayload(pool, pixels, 512, 512, &payload[0], info.capacityLength, 0.5);
+	bool decoded = decodePayload(pool, pixels, 512, 512, 0.5, Codec(), &result);
+
+	check(inserted && decoded && result.decoded && result.length == info.capacityLength && result.blocks == info.capacityBlocks &&
+	      memcmp(result.payload, &payload[0], info.capacityLength) == 0, "capacity payload round trip");
+
+	fillTestImage(pixels, 512, 512);
+	insertPayload(pool, pixels, 512, 512, &payload[0], 20, 0.5);
+	decodePayload(pool, pixels, 512, 512, 0.5, Codec(), &result);
+
+	check(result.decoded && result.length == 20 && result.blocks == 1 && memcmp(result.payload, &payload[0], 20) == 0, "short payload uses one codeword");
+}
+
+// the integer wavelets must give back every coefficient of a plane, odd and negative values included
+template<class Wavelet>
+static bool reversesExactly( unsigned int levels )
+{
+	const unsigned int size = 128;
+
+	std::vector<int> plane(size*size);
+	std::vector<int> scratch(Wavelet::scratchSize(size, size));
+
+	srand(7);
+	for( size_t i = 0; i < plane.size(); ++i )
+		plane[i] = rand() % 12801 - 6400;
+
+	std::vector<int> original = plane;
+
+	for( unsigned int k = 0; k < levels; ++k )
+		Wavelet::forward(&plane[0], &scratch[0], size>>k, size>>k, size);
+
+	bool transformed = plane != original;
+
+	for( unsigned int k = levels; k > 0; --k )
+		Wavelet::inverse(&plane[0], &scratch[0], size>>(k-1), size>>(k-1), size);
+
+	return transformed && plane == original;
+}
+
+static void checkIntegerWavelets()
+{
+	check(reversesExactly<LeGall53Wavelet>(3), "LeGall 5/3 reconstructs exactly");
+	check(reversesExactly<Integer97Wavelet>(3), "integer 9/7 reconstructs exactly");
+
+	static unsigned int pixels[512*512];
+	static DecodeResult result;
+	unsigned char mark[32*32];
+	unsigned char decoded[32*32];
+
+	encodeMessageMark("integer planes", mark);
+
+	for( int w = 0; w < WaveletKindCount; ++w )
+	{
+		int width = 512;
+		int height = 512;
+		unsigned int* output = NULL;
+		char name[64];
+
+		fillTestImage(pixels, width, height);
+		insertWatermark(pixels, &output, mark, &width, &height, true, 0.5, Codec(CodecStandard, (WaveletKind)w));
+		decodeWatermark(pixels, decoded, width, height, 0.5, Codec(CodecStandard, (WaveletKind)w), &result);
+
+		snprintf(name, sizeof(name), "%s mark round trip", waveletName((WaveletKind)w));
+		check(result.decoded && result.wavelet == w && strncmp(result.message, "integer planes", 14) == 0, name);
+	}
+}
+
+// The SIMD luma kernels must match the scalar ones, and a mark in YCbCr must decode
+static void checkYCbCr()
+{
+	// an odd count leaves a scalar tail after the batches
+	const unsigned int count = 1003;
+
+	std::vector<unsigned int> pixels(count), scalar(count), batched(count);
+	std::vector<int> luma1(count), luma2(count), target(count);
+
+	srand(11);
+
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		pixels[i] = (unsigned int)(rand() & 0xffff) | ((unsigned int)(rand() & 0xffff) << 16);
+		// mostly small changes, some far out of range either way
+		target[i] = (i % 17 == 0) ? (rand() & 1 ? 0x7fffffff : -0x7fffffff) : (int)(rand() % (110 << lumaFractionBits)) - (5 << lumaFractionBits);
+	}
+
+	lumaRowScalar(&pixels[0], count, &luma1[0]);
+	lumaRow(&pixels[0], count, &luma2[0]);
+	check(luma1 == luma2, "SIMD luma matches the scalar kernel");
+
+	scalar = batched = pixels;
+	setLumaRowScalar(&scalar[0], count, &target[0]);
+	setLumaRow(&batched[0], count, &target[0]);
+	check(scalar == batched, "SIMD luma write back matches the scalar kernel");
+
+	// white is 100 like the Lab L, alpha is kept, and a luma that is reachable is reached within half a level
+	unsigned int white = 0x80ffffff;
+	int whiteLuma;
+	lumaRow(&white, 1, &whiteLuma);
+
+	bool reached = true;
+
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		int within = (int)(0.6 * 100.0/255.0 * (1 << lumaFractionBits));
+
+		if( (scalar[i] >> 24) != (pixels[i] >> 24) )
+			reached = false;
+		else if( i % 17 != 0 && abs(luma1[i] - target[i]) < (10 << lumaFractionBits) )
+		{
+			// shifting all channels by the same amount only keeps the target if none saturated
+			unsigned int c = scalar[i];
+			unsigned int lo = c & 0xff, mid = (c >> 8) & 0xff, hi = (c >> 16) & 0xff;
+
+			if( lo != 0 && lo != 255 && mid != 0 && mid != 255 && hi != 0 && hi != 255 )
+			{
+				int after;
+				lumaRow(&scalar[i], 1, &after);
+				reached = reached && abs(after - target[i]) <= within;
+			}
+		}
+	}
+
+	check(abs(whiteLuma - (100 << lumaFractionBits)) < (1 << (lumaFractionBits - 8)) && reached, "YCbCr luma scale, alpha and write back");
+
+	static unsigned int image[512*512];
+	static DecodeResult result;
+	unsigned char mark[32*32];
+	unsigned char decoded[32*32];
+
+	encodeMessageMark("fixed point luma", mark);
+
+	for( int w = 0; w < WaveletKindCount; ++w )
+	{
+		int width = 512;
+		int height = 512;
+		unsigned int* output = NULL;
+		char name[64];
+
+		fillTestImage(image, width, height);
+		insertWatermark(image, &output, mark, &width, &height, true, 0.5, Codec(CodecStandard, (WaveletKind)w, ColorYCbCr));
+		decodeWatermark(image, decoded, width, height, 0.5, Codec(CodecStandard, (WaveletKind)w, ColorYCbCr), &result);
+
+		snprintf(name, sizeof(name), "%s mark round trip in YCbCr", waveletName((WaveletKind)w));
+		check(result.decoded && result.space == ColorYCbCr && strncmp(result.message, "fixed point luma", 16) == 0, name);
+	}
+}
+
+// frame streams schedule the tiles of several frames themselves, one tile at a time
+static void checkTileByTile()
+{
+	const int width = 1024;
+	const int height = 600;
+
+	std::vector<unsigned int> tiled(width*height);
+	std::vector<unsigned int> single(width*height);
+	unsigned char mark[32*32];
+
+	encodeMessageMark("tile by tile", mark);
+	fillTestImage(&tiled[0], width, height);
+	single = tiled;
+
+	{
+		ThreadPool pool(2);
+		insertTiledWatermark(pool, &tiled[0], mark, width, height, 0.5);
+	}
+
+	check(countFullTiles(width, height) == 2, "full tiles of a frame");
+
+	for( unsigned int t = 0; t < countFullTiles(width, height); ++t )
+		insertWatermarkTile(&single[0], mark, width, height, t, 0.5);
+
+	check(tiled == single, "tile by tile encode matches tiled mode");
+}
+
+// a tiled encode waits for its own tiles only, not for what other callers have queued on the pool
+static void checkTaskGroups()
+{
+	const int width = 1024;
+	const int height = 512;
+
+	std::vector<unsigned int> pixels(width*height);
+	unsigned char mark[32*32];
+
+	encodeMessageMark("task groups", mark);
+	fillTestImage(&pixels[0], width, height);
+
+	ThreadPool pool(2);
+	std::atomic<bool> released(false), timedOut(false);
+
+	// holds one worker until the encode is back, or gives up after a few seconds
+	pool.enqueue([&]{
+		time_t start = time(NULL);
+
+		while( !released )
+		{
+			if( time(NULL) - start > 5 )
+			{
+				timedOut = true;
+				break;
+			}
+
+			std::this_thread::yield();
+		}
+	});
+
+	bool encoded = insertTiledWatermark(pool, &pixels[0], mark, width, height, 0.5);
+	released = true;
+	pool.wait();
+
+	check(encoded && !timedOut, "tiled encode waits only for its own tiles");
+}
+
+// a marked tile moved by (dx, dy) pixels: cropped where they are negative, grey padding where positive
+static bool findsShiftedMark( ThreadPool& pool, const std::vector<unsigned int>& marked, int dx, int dy )
+{
+	const int size = 512;
+	const int width = size + dx;
+	const int height = size + dy;
+
+	std::vector<unsigned int> shifted(width*height, 0xff808080);
+	unsigned char decoded[32*32];
+	DecodeResult result;
+
+	for( int y = dy < 0 ? 0 : dy; y < height; ++y )
+		for( int x = dx < 0 ? 0 : dx; x < width; ++x )
+			shifted[y*width + x] = marked[(y - dy)*size + x - dx];
+
+	searchWatermark(pool, &shifted[0], decoded, width, height, 32, 0.5, Codec(), &result);
+
+	return result.decoded && result.offsetX == dx && result.offsetY == dy && strncmp(result.message, "moved", 5) == 0;
+}
+
+static void checkAlignmentSearch()
+{
+	int width = 512;
+	int height = 512;
+
+	std::vector<unsigned int> marked(width*height);
+	unsigned char mark[32*32];
+	unsigned int* output = NULL;
+
+	encodeMessageMark("moved", mark);
+	fillTestImage(&marked[0], width, height);
+	insertWatermark(&marked[0], &output, mark, &width, &height, true, 0.5);
+
+	ThreadPool pool(2);
+
+	check(findsShiftedMark(pool, marked, 0, 0), "search finds an unshifted mark");
+	check(findsShiftedMark(pool, marked, -13, -21), "search finds a cropped mark");
+	check(findsShiftedMark(pool, marked, 7, -30), "search finds a padded mark");
+}
+
+static bool writePngRows( const char* path, const std::vector<unsigned int>& pixels, int width, int height, int strip )
+{
+	RowWriter* writer = openRowWriter(path, width, height);
+	bool written = writer != NULL;
+
+	for( int y = 0; y < height && written; y += strip )
+		written = writer->writeRows(&pixels[y*width], height - y < strip ? height - y : strip);
+
+	written = written && writer->finish();
+	delete writer;
+
+	return written;
+}
+
+static std::vector<unsigned char> readFile( const char* path )
+{
+	std::vector<unsigned char> bytes;
+	FILE* fp = fopen(path, "rb");
+
+	for( int c; fp != NULL && (c = fgetc(fp)) != EOF; )
+		bytes.push_back((unsigned char)c);
+
+	if( fp != NULL )
+		fclose(fp);
+
+	return bytes;
+}
+
+// streamed PNGs do not depend on how the rows arrive, are byte for byte what stbi_write_png writes
+// and read back exactly, including noise that both encoders store rather than deflate
+static void checkPngRows()
+{
+	const int width = 300;
+	const int height = 200;
+	const char* path1 = "WaveScribeVerify1.png";
+	const char* path2 = "WaveScribeVerify2.png";
+
+	std::vector<unsigned int> pixels(width*height);
+	std::vector<unsigned int> readBack(width*height);
+	ImageBackend* stb = createStbBackend();
+
+	for( int noise = 0; noise < 2; ++noise )
+	{
+		if( noise )
+		{
+			srand(11);
+			for( size_t i = 0; i < pixels.size(); ++i )
+				pixels[i] = (unsigned int)rand() ^ ((unsigned int)rand() << 16);
+		}
+		else
+		{
+			fillTestImage(&pixels[0], width, height);
+		}
+
+		bool written = writePngRows(path1, pixels, width, height, 1) && writePngRows(path2, pixels, width, height, 64);
+		std::vector<unsigned char> file = readFile(path1);
+		std::vector<unsigned char> expected;
+		bool encoded = stb->encodePng(&pixels[0], width, height, expected);
+
+		RowReader* reader = openRowReader(path1);
+		bool read = reader != NULL && reader->width() == width && reader->height() == height && reader->readRows(&readBack[0], height);
+		delete reader;
+
+		check(written && !file.empty() && file == readFile(path2), noise ? "streamed PNG of noise is the same for any strip size" : "streamed PNG is the same for any strip size");
+		check(encoded && file == expected, noise ? "streamed PNG of noise is stbi_write_png's byte for byte" : "streamed PNG is stbi_write_png's byte for byte");
+		check(read && readBack == pixels, noise ? "streamed PNG of noise reads back" : "streamed PNG reads back");
+
+		// signature, IHDR, the IDAT holding the zlib header, the filtered rows in stored blocks of
+		// at most 32767 bytes and the adler, then IEND
+		if( noise )
+		{
+			const size_t dataLength = (size_t)height*(1 + width*4);
+			const size_t storedLength = 8 + 25 + 12 + 2 + dataLength + ((dataLength + 32766) / 32767)*5 + 4 + 12;
+
+			check(file.size() == storedLength, "streamed PNG of noise falls back to stored blocks");
+		}
+	}
+
+	delete stb;
+
+	remove(path1);
+	remove(path2);
+}
+
+// the zlib backend's chunks are deflated on their own, so its file must not change with the thread count
+static void checkZlibBackend()
+{
+	const int width = 300;
+	const int height = 1000;
+	const char* path = "WaveScribeVerify1.png";
+
+	std::vector<unsigned int> pixels(width*height);
+	std::vector<unsigned int> readBack(width*height);
+
+	// smooth on top, noise below, so the rows span several chunks of both kinds
+	fillTestImage(&pixels[0], width, height/2);
+	srand(12);
+	for( size_t i = pixels.size()/2; i < pixels.size(); ++i )
+		pixels[i] = (unsigned int)rand() ^ ((unsigned int)rand() << 16);
+
+	static const int levels[] = { 0, 1, 9 };
+	bool same = true;
+	bool read = true;
+
+	ThreadPool one(1);
+	ThreadPool four(4);
+
+	for( int f = 0; f < PngFilterCount; ++f )
+	{
+		for( int l = 0; l < 3; ++l )
+		{
+			PngOptions options;
+			options.level = levels[l];
+			options.filter = (PngFilter)f;
+
+			ImageBackend* serial = createZlibBackend(options, &one);
+			ImageBackend* parallel = createZlibBackend(options, &four);
+
+			std::vector<unsigned char> png1, png4;
+			same = same && serial->encodePng(&pixels[0], width, height, png1) && parallel->encodePng(&pixels[0], width, height, png4) && png1 == png4;
+
+			read = read && parallel->save(path, &pixels[0], width, height);
+
+			RowReader* reader = read ? openRowReader(path) : NULL;
+			read = reader != NULL && reader->readRows(&readBack[0], height) && readBack == pixels;
+			delete reader;
+
+			delete serial;
+			delete parallel;
+		}
+	}
+
+	check(same, "zlib PNG backend writes the same file on any number of threads");
+	check(read, "zlib PNG backend reads back for every level and filter");
+
+	remove(path);
+}
+
+static void checkImageFormats()
+{
+	static const char* paths[] = { "WaveScribeVerify.ppm", "WaveScribeVerify.pam", "WaveScribeVerify.rgba", "WaveScribeVerify.qoi" };
+
+	// odd sizes, so the PAM header has to be padded for every line length
+	const int width = 301;
+	const int height = 67;
+
+	std::vector<unsigned int> pixels(width*height);
+
+	// runs, small and large steps and changing alpha for every QOI operation
+	fillTestImage(&pixels[0], width, height/2);
+	srand(13);
+	for( size_t i = pixels.size()/2; i < pixels.size(); ++i )
+		pixels[i] = rand() % 3 == 0 ? pixels[i-1] : (unsigned int)rand() ^ ((unsigned int)rand() << 16);
+
+	ImageBackend* images = createStbBackend();
+
+	for( size_t f = 0; f < sizeof(paths)/sizeof(paths[0]); ++f )
+	{
+		bool rgbOnly = imageFormatOf(paths[f]) == ImageFormatPpm;
+		int w = 0, h = 0;
+		bool same = images->save(paths[f], &pixels[0], width, height);
+		unsigned int* read = same ? images->load(paths[f], &w, &h) : NULL;
+
+		same = read != NULL && w == width && h == height;
+
+		for( int i = 0; same && i < width*height; ++i )
+			same = rgbOnly ? read[i] == ((pixels[i] & 0x00ffffff) | 0xff000000) : read[i] == pixels[i];
+
+		if( read != NULL )
+			images->release(read);
+
+		char name[96];
+		sprintf(name, "%s reads back what was saved", paths[f] + 16);
+		check(same, name);
+
+		remove(paths[f]);
+	}
+
+	delete images;
+}
+
+// two shards of one manifest cover every item once, and a rerun only does what its log is missing
+static void checkBatchShards()
+{
+	const int items = 6;
+	const char* manifest = "WaveScribeVerify.manifest";
+	char logs[2][64];
+
+	std::vector<unsigned int> pixels(512*512);
+	fillTestImage(&pixels[0], 512, 512);
+
+	ImageBackend* images = createStbBackend();
+	FILE* fp = fopen(manifest, "wb");
+
+	for( int i = 0; i < items; ++i )
+	{
+		char input[64];
+		sprintf(input, "WaveScribeVerifyIn%d.rgba", i);
+		images->save(input, &pixels[0], 512, 512);
+		fprintf(fp, "%s\tWaveScribeVerifyOut%d.rgba\n", input, i);
+	}
+
+	fclose(fp);
+
+	unsigned char mark[maxMarkLength];
+	encodeMessageMark("batch", mark);
+
+	BatchOptions options;
+	options.manifest = manifest;
+	options.log = NULL;
+	options.shards = 2;
+	options.mark = mark;
+	options.markStrength = 0.5;
+	options.tiled = false;
+	options.quorum = 0;
+	options.json = false;
+	options.message = "batch";
+	options.cache = NULL;
+	options.files = NULL;
+	options.memoryBudget = 0;
+
+	ThreadPool pool(1);
+	BatchStats stats[2], rerun;
+	bool ran = true;
+
+	for( unsigned int s = 0; s < 2; ++s )
+	{
+		options.shard = s;
+		batchLogPath(logs[s], manifest, s, 2);
+		remove(logs[s]);
+		ran = runBatch(pool, *images, options, &stats[s]) && ran;
+	}
+
+	bool cover = ran && stats[0].items + stats[1].items == items && stats[0].completed + stats[1].completed == items && stats[0].failed + stats[1].failed == 0;
+
+	check(cover, "batch shards cover every manifest item once");
+
+	// a record cut short by a crash is ignored and the item done again
+	fp = fopen(logs[1], "ab");
+	fprintf(fp, "E\t0.1\t0000");
+	fclose(fp);
+
+	options.shard = 1;
+	ran = runBatch(pool, *images, options, &rerun);
+
+	check(ran && rerun.resumed == stats[1].completed && rerun.completed == stats[1].completed && rerun.failed == 0, "batch rerun skips the items in its log");
+
+	int width = 0, height = 0;
+	unsigned int* marked = images->load("WaveScribeVerifyOut0.rgba", &width, &height);
+	DecodeResult* result = new DecodeResult();
+
+	check(marked != NULL && decodeWatermark(marked, mark, width, height, 0.5, Codec(), result) && strncmp(result->message, "batch", 5) == 0, "batch output decodes");
+
+	if( marked != NULL )
+		images->release(marked);
+
+	delete result;
+	delete images;
+
+	for( int i = 0; i < items; ++i )
+	{
+		char path[64];
+		sprintf(path, "WaveScribeVerifyIn%d.rgba", i);
+		remove(path);
+		sprintf(path, "WaveScribeVerifyOut%d.rgba", i);
+		remove(path);
+	}
+
+	remove(logs[0]);
+	remove(logs[1]);
+	remove(manifest);
+}
+
+// the hash is XXH64, and the cache returns what was stored for the same pixels and parameters only,
+// dropping the least recently used entries past its size
+// Reads ahead and writes behind move whole files on both engines, within their budgets, and a batch that
+// uses them writes the same outputs and log as one that does not
+static void checkAsyncFiles()
+{
+	const int files = 6;
+	char path[64];
+
+	for( int b = 0; b < AsyncBackendCount; ++b )
+	{
+		bool same = true;
+		bool written = true;
+		std::vector<std::vector<unsigned char> > contents(files);
+		std::string backend;
+
+		{
+			// budgets smaller than one file still let one through at a time
+			AsyncFiles async(1000, 1000, (AsyncBackend)b);
+			std::vector<unsigned long long> tickets;
+
+			backend = async.backend();
+
+			for( int i = 0; i < files; ++i )
+			{
+				contents[i].resize(i == 2 ? 0 : 50000*i + 777);
+
+				for( size_t k = 0; k < contents[i].size(); ++k )
+					contents[i][k] = (unsigned char)(k*7 + i);
+
+				std::vector<unsigned char> data = contents[i];
+				sprintf(path, "WaveScribeVerifyAsync%d.bin", i);
+				tickets.push_back(async.write(path, data));
+			}
+
+			for( int i = files - 1; i >= 0; --i )
+			{
+				bool ok = false;
+				written = async.finished(tickets[i], true, &ok) && ok && written;
+			}
+
+			for( int i = 0; i < files; ++i )
+			{
+				sprintf(path, "WaveScribeVerifyAsync%d.bin", i);
+				async.prefetch(path);
+			}
+
+			async.prefetch("WaveScribeVerifyAsyncMissing.bin");
+
+			// the second file is never taken, taking the third drops it
+			for( int i = 0; i < files; ++i )
+			{
+				std::vector<unsigned char> data;
+
+				if( i == 1 )
+					continue;
+
+				sprintf(path, "WaveScribeVerifyAsync%d.bin", i);
+				same = async.take(path, data) && data == contents[i] && same;
+			}
+
+			std::vector<unsigned char> data;
+			same = !async.take("WaveScribeVerifyAsyncMissing.bin", data) && same;
+		}
+
+		char name[96];
+		snprintf(name, sizeof(name), "%s engine writes behind and reads ahead whole files (asked for %s)", backend.c_str(), asyncBackendName((AsyncBackend)b));
+		check(written && same, name);
+
+		for( int i = 0; i < files; ++i )
+		{
+			sprintf(path, "WaveScribeVerifyAsync%d.bin", i);
+			remove(path);
+		}
+	}
+
+	const char* manifest = "WaveScribeVerifyAsync.manifest";
+	char log[96];
+
+	std::vector<unsigned int> pixels(512*512);
+	fillTestImage(&pixels[0], 512, 512);
+
+	ImageBackend* images = createStbBackend();
+	FILE* fp = fopen(manifest, "wb");
+
+	for( int i = 0; i < 4; ++i )
+	{
+		// PNG inputs go through the memory decoder, RGBA ones are used in the read buffer
+		sprintf(path, i % 2 ? "WaveScribeVerifyAsyncIn%d.png" : "WaveScribeVerifyAsyncIn%d.rgba", i);
+		pixels[i] ^= 0x010101;
+		images->save(path, &pixels[0], 512, 512);
+		fprintf(fp, "%s\tWaveScribeVerifyAsyncOut%d.png\n", path, i);
+	}
+
+	fclose(fp);
+
+	unsigned char mark[maxMarkLength];
+	encodeMessageMark("async", mark);
+
+	BatchOptions options;
+	options.manifest = manifest;
+	options.log = NULL;
+	options.shard = 0;
+	options.shards = 1;
+	options.mark = mark;
+	options.markStrength = 0.5;
+	options.tiled = false;
+	options.quorum = 0;
+	options.json = false;
+	options.message = "async";
+	options.cache = NULL;
+	options.files = NULL;
+	options.memoryBudget = 0;
+
+	ThreadPool pool(1);
+	std::vector<std::vector<unsigned char> > outputs[3];
+	std::vector<unsigned char> logs[3];
+	BatchStats stats[3];
+	bool ran = true;
+
+	batchLogPath(log, manifest, 0, 1);
+
+	for( int run = 0; run < 3; ++run )
+	{
+		AsyncFiles* async = run == 0 ? NULL : new AsyncFiles(300000, 300000, run == 1 ? AsyncUring : AsyncThreads);
+
+		options.files = async;
+		remove(log);
+		ran = runBatch(pool, *images, options, &stats[run]) && stats[run].completed == 4 && ran;
+		delete async;
+
+		for( int i = 0; i < 4; ++i )
+		{
+			sprintf(path, "WaveScribeVerifyAsyncOut%d.png", i);
+			outputs[run].push_back(readFile(path));
+			remove(path);
+		}
+
+		// the records less their timings
+		std::vector<unsigned char> records = readFile(log);
+		std::string text(records.begin(), records.end());
+
+		for( size_t at = 0; at < text.size(); at = text.find('\n', at) + 1 )
+		{
+			size_t seconds = text.find('\t', at);
+			logs[run].push_back(text[at]);
+			logs[run].insert(logs[run].end(), text.begin() + text.find('\t', seconds + 1), text.begin() + text.find('\n', at) + 1);
+		}
+	}
+
+	check(ran && outputs[1] == outputs[0] && outputs[2] == outputs[0] && logs[1] == logs[0] && logs[2] == logs[0], "batch with read ahead and write behind matches a synchronous one");
+
+	delete images;
+
+	for( int i = 0; i < 4; ++i )
+	{
+		sprintf(path, i % 2 ? "WaveScribeVerifyAsyncIn%d.png" : "WaveScribeVerifyAsyncIn%d.rgba", i);
+		remove(path);
+	}
+
+	remove(log);
+	remove(manifest);
+}
+
+// Items of a memory budget run side by side and write what one after the other writes; the smaller items
+// go around a large one that has to wait, and an item larger than the budget is refused
+static void checkBatchMemoryBudget()
+{
+	const char* manifest = "WaveScribeVerifyBudget.manifest";
+	const int sizes[] = { 4096, 4096, 512, 512, 512, 512 };
+	const int items = sizeof(sizes)/sizeof(sizes[0]);
+	char path[64], log[96];
+
+	std::vector<unsigned int> pixels(512*4096);
+	fillTestImage(&pixels[0], 512, 4096);
+
+	ImageBackend* images = createStbBackend();
+	FILE* fp = fopen(manifest, "wb");
+
+	for( int i = 0; i < items; ++i )
+	{
+		sprintf(path, "WaveScribeVerifyBudgetIn%d.rgba", i);
+		pixels[i] ^= 0x010101;
+		images->save(path, &pixels[0], 512, sizes[i]);
+		fprintf(fp, "%s\tWaveScribeVerifyBudgetOut%d.rgba\n", path, i);
+	}
+
+	fclose(fp);
+
+	int width = 0, height = 0;
+	unsigned long long fileBytes = 0;
+
+	check(readImageSize("WaveScribeVerifyBudgetIn0.rgba", &width, &height, &fileBytes) && width == 512 && height == 4096 && fileBytes == 16 + 512*4096*4,
+	      "image size read from the header");
+
+	unsigned char mark[maxMarkLength];
+	encodeMessageMark("budget", mark);
+
+	BatchOptions options;
+	options.manifest = manifest;
+	options.log = NULL;
+	options.shard = 0;
+	options.shards = 1;
+	options.mark = mark;
+	options.markStrength = 0.5;
+	options.tiled = false;
+	options.quorum = 0;
+	options.json = false;
+	options.message = "budget";
+	options.cache = NULL;
+	options.files = NULL;
+
+	// one after the other, room for a large item and a small one, too little for anything
+	const unsigned long long budgets[] = { 0, 100 << 20, 4 << 20 };
+
+	ThreadPool pool(2);
+	std::vector<std::vector<unsigned char> > outputs[3];
+	BatchStats stats[3];
+	bool ran = true;
+
+	batchLogPath(log, manifest, 0, 1);
+
+	for( int run = 0; run < 3; ++run )
+	{
+		options.memoryBudget = budgets[run];
+		remove(log);
+		ran = runBatch(pool, *images, options, &stats[run]) && ran;
+
+		for( int i = 0; i < items; ++i )
+		{
+			sprintf(path, "WaveScribeVerifyBudgetOut%d.rgba", i);
+			outputs[run].push_back(readFile(path));
+			remove(path);
+		}
+	}
+
+	check(ran && stats[0].completed == items && stats[1].completed == items && outputs[1] == outputs[0], "batch within a memory budget matches one after the other");
+	check(stats[1].peakRunning == 2 && stats[1].backfilled > 0 && stats[1].peakReserved <= budgets[1] && stats[1].peakReserved > 0,
+	      "memory budget packs small items around a large one and stays under the budget");
+	check(stats[2].completed == 0 && stats[2].failed == items && stats[2].tooLarge == items, "items larger than the memory budget are refused");
+
+	delete images;
+
+	for( int i = 0; i < items; ++i )
+	{
+		sprintf(path, "WaveScribeVerifyBudgetIn%d.rgba", i);
+		remove(path);
+	}
+
+	remove(log);
+	remove(manifest);
+}
+
+static void checkResultCache()
+{
+	const char* dir = "WaveScribeVerifyCache";
+	const char* abc = "abc";
+
+	check(hashBytes64("", 0, 0) == 0xef46db3751d8e999ULL && hashBytes64(abc, 3, 0) == 0x44bc2cf5ad770999ULL, "hashBytes64 matches XXH64");
+
+	std::vector<unsigned int> pixels(64*64);
+	fillTestImage(&pixels[0], 64, 64);
+
+	std::vector<unsigned char> payload(1000, 7), found;
+	ResultCache* cache = new ResultCache(dir, 2500);
+
+	unsigned long long first = cache->key(&pixels[0], 64, 64, "a");
+	pixels[100] ^= 1;
+	unsigned long long second = cache->key(&pixels[0], 64, 64, "a");
+
+	cache->store(first, "a", &payload[0], payload.size());
+
+	bool hit = cache->find(first, "a", found) && found == payload;
+	bool missed = !cache->find(first, "b", found) && !cache->find(second, "a", found);
+
+	check(first != second && hit && missed, "result cache keys on pixels and parameters");
+
+	// a hit only touches the entry, it is not written again
+	unsigned long long entries = cache->entries(), bytes = cache->bytes();
+	bool unchanged = true;
+
+	for( int i = 0; i < 4; ++i )
+		unchanged = cache->find(first, "a", found) && cache->entries() == entries && cache->bytes() == bytes && unchanged;
+
+	check(entries == 1 && unchanged, "result cache hits leave the entry count and size unchanged");
+
+	// the first entry becomes the most recently used, so the second goes when a third does not fit
+	cache->store(second, "a", &payload[0], payload.size());
+
+	struct utimbuf old = { time(NULL) - 60, time(NULL) - 60 };
+	char path[64];
+	sprintf(path, "%s/%016llx.wsc", dir, second);
+	utime(path, &old);
+
+	cache->store(second + 1, "a", &payload[0], payload.size());
+
+	check(cache->find(first, "a", found) && !cache->find(second, "a", found) && cache->find(second + 1, "a", found), "result cache evicts the least recently used entry");
+
+	delete cache;
+
+	remove(path);
+	sprintf(path, "%s/%016llx.wsc", dir, first);
+	remove(path);
+	sprintf(path, "%s/%016llx.wsc", dir, second + 1);
+	remove(path);
+	rmdir(dir);
+}
+
+// applying a sidecar gives the pixels of an encode of its master, and a sidecar whose master or options
+// have changed is refused
+static void checkPreparedImage()
+{
+	const char* master = "WaveScribeVerifyMaster.rgba";
+	const char* path = "WaveScribeVerify.wsp";
+
+	ThreadPool pool(2);
+	ImageBackend* images = createStbBackend();
+
+	unsigned char mark[32*32];
+	encodeMessageMark("prepared", mark);
+
+	// one tile with the float wavelet, two tiles with an integer one
+	for( int tiled = 0; tiled < 2; ++tiled )
+	{
+		const int width = tiled ? 1024 : 512;
+		const int height = 512;
+		const Codec codec(CodecStandard, tiled ? WaveletLeGall53 : WaveletCdf97);
+
+		std::vector<unsigned int> pixels(width*height);
+		fillTestImage(&pixels[0], width, height);
+
+		bool prepared = images->save(master, &pixels[0], width, height) &&
+		                prepareSidecar(pool, path, master, &pixels[0], width, height, tiled != 0, codec);
+
+		std::vector<unsigned int> expected(pixels);
+
+		if( tiled )
+			insertTiledWatermark(pool, &expected[0], mark, width, height, 0.5, codec);
+		else
+		{
+			unsigned int* dst;
+			int w = width, h = height;
+			insertWatermark(&expected[0], &dst, mark, &w, &h, true, 0.5, codec);
+		}
+
+		PreparedImage image;
+		bool same = prepared && image.open(path, master, tiled != 0, codec) && image.apply(pool, mark, 0.5) &&
+		            image.width() == width && image.height() == height &&
+		            memcmp(image.pixels(), &expected[0], 4*expected.size()) == 0;
+
+		check(same, tiled ? "applied tiled sidecar matches the encode" : "applied sidecar matches the encode");
+
+		// other options, then a changed master
+		PreparedImage other;
+		bool refused = prepared && !other.open(path, master, tiled == 0, codec) && !other.open(path, master, tiled != 0, Codec(CodecLong, codec.wavelet));
+
+		pixels[7] ^= 1;
+		refused = refused && images->save(master, &pixels[0], width, height) && !other.open(path, master, tiled != 0, codec);
+
+		check(refused, "sidecar of other options or a changed master is refused");
+	}
+
+	delete images;
+
+	remove(master);
+	remove(path);
+}
+
+#ifdef WAVESCRIBE_TRACE
+// spans of every thread reach the file, including threads that have ended, and a ring that wraps keeps
+// its newest spans
+static void checkTrace()
+{
+	const char* path = "WaveScribeVerifyTrace.json";
+
+	traceStart();
+
+	{
+		ThreadPool pool(2);
+
+		for( int i = 0; i < 4; ++i )
+			pool.enqueue([]{ TRACE_SCOPE_DETAIL("verify task", "a/long/path/to/an/image/that/is/cut/to/its/end.png"); });
+
+		pool.wait();
+	}
+
+	std::thread busy([]{
+		for( int i = 0; i < 70000; ++i )
+			TRACE_SCOPE("verify span");
+	});
+	busy.join();
+
+	bool written = traceWrite(path);
+
+	FILE* fp = fopen(path, "rb");
+	std::vector<char> text;
+	char buffer[1 << 16];
+	size_t n;
+
+	while( fp != NULL && (n = fread(buffer, 1, sizeof(buffer), fp)) > 0 )
+		text.insert(text.end(), buffer, buffer + n);
+
+	if( fp != NULL )
+		fclose(fp);
+
+	text.push_back(0);
+
+	// a worker only gets a track once it records a span
+	unsigned int tasks = 0, spans = 0, workers = 0;
+
+	// the detail is cut to its last 39 bytes
+	for( const char* p = &text[0]; (p = strstr(p, "\"args\":{\"detail\":\"/to/an/image/that/is/cut/to/its/end.png\"}")) != NULL; ++p )
+		++tasks;
+	for( const char* p = &text[0]; (p = strstr(p, "\"name\":\"verify span\"")) != NULL; ++p )
+		++spans;
+	for( const char* p = &text[0]; (p = strstr(p, "\"name\":\"worker ")) != NULL; ++p )
+		++workers;
+
+	check(written && tasks == 4 && workers >= 1, "trace keeps the spans of ended pool threads");
+	check(spans == 65536 && strstr(&text[0], "\"dropped\":\"4464\"") != NULL, "trace ring keeps the newest spans");
+
+	remove(path);
+}
+#endif
+
+int main()
+{
+	checkBatchedQuadKernels();
+	checkBatchedReedSolomon();
+	checkMarkPlanCache();
+	checkArenaHighWater();
+	checkArenaRealloc();
+	checkSteadyStateAllocations();
+	checkDecodeDiagnostics();
+	checkCapacityPayload();
+	checkIntegerWavelets();
+	checkYCbCr();
+	checkTileByTile();
+	checkTaskGroups();
+	checkAlignmentSearch();
+	checkPngRows();
+	checkZlibBackend();
+	checkImageFormats();
+	checkBatchShards();
+	checkAsyncFiles();
+	checkBatchMemoryBudget();
+	checkResultCache();
+	checkPreparedImage();
+#ifdef WAVESCRIBE_TRACE
+	checkTrace();
+#endif
+
+	dwtcleanup();
+
+	printf("%d failure(s)\n", failures);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+// Author: Jonathan Decker
+// Description: Wavelet policies for the 2D transform that carries the mark
+
+#include <string.h>
+
+#include "wavelet.h"
+
+extern "C"
+{
+	#include "dwt.h"
+}
+
+void Cdf97Wavelet::forward( double* data, double* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	unsigned int i,j;
+	double       *p1;
+	double       *p2;
+
+	// decompose rows
+	for( i = 0; i < height; ++i )
+	{
+		fwt97(data+i*stride, width);
+	}
+
+	// decompose columns
+	for( j = 0; j < width; ++j )
+	{
+		for( i = 0, p1 = data+j, p2 = scratch; i < height; ++i, p1+=stride, ++p2 )
+			*p2 = *p1;
+
+		fwt97(scratch, height);
+
+		for( i = 0, p1 = data+j, p2 = scratch; i < height; ++i, p1+=stride, ++p2 )
+			*p1 = *p2;
+	}
+}
+
+void Cdf97Wavelet::inverse( double* data, double* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	unsigned int i,j;
+	double       *p1;
+	double       *p2;
+
+	// reconstruct rows
+	for( i = 0; i < height; ++i )
+	{
+		iwt97(data+i*stride, width);
+	}
+
+	// reconstruct columns
+	for( j = 0; j < width; ++j )
+	{
+		for( i = 0, p1 = data+j, p2 = scratch; i < height; ++i, p1+=stride, ++p2 )
+			*p2 = *p1;
+
+		iwt97(scratch, height);
+
+		for( i = 0, p1 = data+j, p2 = scratch; i < height; ++i, p1+=stride, ++p2 )
+			*p1 = *p2;
+	}
+}
+
+// Steps alternate between predicting the odd samples from their even neighbours and updating the
+// even samples from their odd neighbours. Both ends mirror the signal, as fwt97 does
+static const IntegerWavelet::Step legall53Steps[] = { { -2, 2 }, { 1, 2 } };
+
+// -1.586134342, -0.05298011854, 0.8829110762, 0.4435068522 in units of 1/4096
+static const IntegerWavelet::Step integer97Steps[] = { { -6497, 12 }, { -217, 12 }, { 3616, 12 }, { 1817, 12 } };
+
+static inline int lift( const IntegerWavelet::Step& step, int neighbours )
+{
+	return (step.multiplier*neighbours + (1 << (step.shift-1))) >> step.shift;
+}
+
+// one lifting step along a contiguous signal of n samples, sign is 1 forward and -1 inverse
+static void liftSignal( int* x, unsigned int n, const IntegerWavelet::Step& step, bool predict, int sign )
+{
+	unsigned int i;
+
+	if( predict )
+	{
+		for( i = 1; i + 1 < n; i += 2 )
+			x[i] += sign*lift(step, x[i-1] + x[i+1]);
+
+		x[n-1] += sign*lift(step, 2*x[n-2]);
+	}
+	else
+	{
+		x[0] += sign*lift(step, 2*x[1]);
+
+		for( i = 2; i < n; i += 2 )
+			x[i] += sign*lift(step, x[i-1] + x[i+1]);
+	}
+}
+
+// the same step applied down the columns of a width x height block, one row of lanes at a time
+static void liftRows( int* data, unsigned int width, unsigned int height, unsigned int stride, const IntegerWavelet::Step& step, bool predict, int sign )
+{
+	unsigned int i,j;
+
+	for( i = predict ? 1 : 0; i < height; i += 2 )
+	{
+		int* row = data + i*stride;
+		const int* above = i > 0 ? row - stride : row + stride;
+		const int* below = i + 1 < height ? row + stride : row - stride;
+
+		for( j = 0; j < width; ++j )
+			row[j] += sign*lift(step, above[j] + below[j]);
+	}
+}
+
+template<unsigned int StepCount>
+static void forwardInteger( const IntegerWavelet::Step (&steps)[StepCount], int* data, int* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	unsigned int i,j,s;
+
+	if( width < 2 || height < 2 )
+		return;
+
+	// rows: lift, then pack the even samples before the odd ones
+	for( i = 0; i < height; ++i )
+	{
+		int* x = data + i*stride;
+
+		for( s = 0; s < StepCount; ++s )
+			liftSignal(x, width, steps[s], s % 2 == 0, 1);
+
+		for( j = 0; j < width/2; ++j )
+		{
+			scratch[j] = x[2*j];
+			scratch[width/2 + j] = x[2*j+1];
+		}
+
+		memcpy(x, scratch, sizeof(int)*width);
+	}
+
+	// columns: lift whole rows, then move the even rows above the odd ones
+	for( s = 0; s < StepCount; ++s )
+		liftRows(data, width, height, stride, steps[s], s % 2 == 0, 1);
+
+	for( i = 0; i < height/2; ++i )
+		memcpy(scratch + i*width, data + (2*i+1)*stride, sizeof(int)*width);
+
+	for( i = 1; i < height/2; ++i )
+		memcpy(data + i*stride, data + 2*i*stride, sizeof(int)*width);
+
+	for( i = 0; i < height/2; ++i )
+		memcpy(data + (height/2 + i)*stride, scratch + i*width, sizeof(int)*width);
+}
+
+template<unsigned int StepCount>
+static void inverseInteger( const IntegerWavelet::Step (&steps)[StepCount], int* data, int* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	unsigned int i,j,s;
+
+	if( width < 2 || height < 2 )
+		return;
+
+	// columns: interleave the rows again (from the bottom so no even row is overwritten early), then undo the steps
+	for( i = 0; i < height/2; ++i )
+		memcpy(scratch + i*width, data + (height/2 + i)*stride, sizeof(int)*width);
+
+	for( i = height/2; i-- > 1; )
+		memcpy(data + 2*i*stride, data + i*stride, sizeof(int)*width);
+
+	for( i = 0; i < height/2; ++i )
+		memcpy(data + (2*i+1)*stride, scratch + i*width, sizeof(int)*width);
+
+	for( s = StepCount; s-- > 0; )
+		liftRows(data, width, height, stride, steps[s], s % 2 == 0, -1);
+
+	// rows
+	for( i = 0; i < height; ++i )
+	{
+		int* x = data + i*stride;
+
+		for( j = 0; j < width/2; ++j )
+		{
+			scratch[2*j] = x[j];
+			scratch[2*j+1] = x[width/2 + j];
+		}
+
+		memcpy(x, scratch, sizeof(int)*width);
+
+		for( s = StepCount; s-- > 0; )
+			liftSignal(x, width, steps[s], s % 2 == 0, -1);
+	}
+}
+
+void LeGall53Wavelet::forward( int* data, int* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	forwardInteger(legall53Steps, data, scratch, width, height, stride);
+}
+
+void LeGall53Wavelet::inverse( int* data, int* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	inverseInteger(legall53Steps, data, scratch, width, height, stride);
+}
+
+void Integer97Wavelet::forward( int* data, int* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	forwardInteger(integer97Steps, data, scratch, width, height, stride);
+}
+
+void Integer97Wavelet::inverse( int* data, int* scratch, unsigned int width, unsigned int height, unsigned int stride )
+{
+	inverseInteger(integer97Steps, data, scratch, width, height, stride);
+}
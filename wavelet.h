@@ -0,0 +1,67 @@
+// Author: Jonathan Decker
+// Description: Wavelet policies for the 2D transform that carries the mark
+//
+// A policy transforms one level of the top-left width x height block of a plane whose rows are
+// stride coefficients apart: rows first, then columns, with the approximation ending up in the
+// top-left quarter and the details in the other three, the same layout as fwt97.
+// scratch must hold scratchSize(width, height) coefficients. Sizes are even: powers of two for tiles,
+// multiples of 8 in the alignment search.
+
+#pragma once
+
+// the floating point CDF 9/7 lifting of dwt97.c
+struct Cdf97Wavelet
+{
+	typedef double coefficient;
+
+	static const char* name() { return "cdf97"; }
+
+	static coefficient fromLuminance( double l ) { return l; }
+	static double toLuminance( coefficient c ) { return c; }
+
+	static unsigned int scratchSize( unsigned int, unsigned int height ) { return height; }
+
+	static void forward( coefficient* data, coefficient* scratch, unsigned int width, unsigned int height, unsigned int stride );
+	static void inverse( coefficient* data, coefficient* scratch, unsigned int width, unsigned int height, unsigned int stride );
+};
+
+// Integer policies keep the luminance in fixed point and are exactly reversible: every lifting step
+// adds a rounded integer function of the neighbouring samples, which the inverse subtracts again.
+// The columns are lifted a whole row at a time, so the inner loops run along contiguous int lanes
+struct IntegerWavelet
+{
+	typedef int coefficient;
+
+	// fractional bits of the luminance in the plane
+	static const int luminanceShift = 6;
+
+	static coefficient fromLuminance( double l ) { return (int)(l * (1 << luminanceShift) + (l < 0 ? -0.5 : 0.5)); }
+	static double toLuminance( coefficient c ) { return (double)c / (1 << luminanceShift); }
+
+	static unsigned int scratchSize( unsigned int width, unsigned int height ) { return (height/2)*width > width ? (height/2)*width : width; }
+
+	// one lifting step: x += (multiplier*(left + right) + 2^(shift-1)) >> shift
+	struct Step
+	{
+		int multiplier;
+		int shift;
+	};
+};
+
+// reversible LeGall 5/3, the JPEG 2000 lossless filter
+struct LeGall53Wavelet : IntegerWavelet
+{
+	static const char* name() { return "legall53"; }
+
+	static void forward( coefficient* data, coefficient* scratch, unsigned int width, unsigned int height, unsigned int stride );
+	static void inverse( coefficient* data, coefficient* scratch, unsigned int width, unsigned int height, unsigned int stride );
+};
+
+// reversible integer approximation of the CDF 9/7: its four lifting steps in 12 bit fixed point, without the final scaling
+struct Integer97Wavelet : IntegerWavelet
+{
+	static const char* name() { return "int97"; }
+
+	static void forward( coefficient* data, coefficient* scratch, unsigned int width, unsigned int height, unsigned int stride );
+	static void inverse( coefficient* data, coefficient* scratch, unsigned int width, unsigned int height, unsigned int stride );
+};
@@ -8,6 +8,11 @@
 #include <math.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
 
 #include "schifra_galois_field.hpp"
 #include "schifra_galois_field_polynomial.hpp"
@@ -17,19 +22,30 @@
 #include "schifra_reed_solomon_block.hpp"
 #include "schifra_error_processes.hpp"
 
+#include "wavescribe.h"
+#include "threadpool.h"
+#include "rowio.h"
+#include "arena.h"
+#include "codecconfig.h"
+#include "markcache.h"
+#include "quadsimd.h"
+#include "rsbatch.h"
+#include "wavelet.h"
+#include "framestream.h"
+#include "imageio.h"
+#include "asyncfiles.h"
+#include "batch.h"
+#include "resultcache.h"
+#include "sidecar.h"
+#include "trace.h"
+#include "ycbcr.h"
+
 #ifdef _DEBUG
 //#include <vld.h>
 #endif
 
-#define USE_LAB
-
 extern "C"
 {
-	#define STBI_ONLY_PNG
-	#define STB_IMAGE_IMPLEMENTATION
-	#include "stb_image.h"
-	#define STB_IMAGE_WRITE_IMPLEMENTATION
-	#include "stb_image_write.h"
 	#include "dwt.h"
 }
 
@@ -276,7 +292,8 @@ void convertBinaryImageInverse( unsigned char* src, unsigned int* dst, unsigned
 //  |      5 4    3 2
 //  |      3 2    5 4
 //  |      1 0    7 6
-void setByte( unsigned char* dst, const unsigned char c, int width, int height, bool upDir )
+template<int Width>
+void setByte( unsigned char* dst, const unsigned char c, bool upDir )
 {
 	int step;
 
@@ -284,13 +301,13 @@ void setByte( unsigned char* dst, const unsigned char c, int width, int height,
 
 	if( upDir )
 	{
-		dst += width*3+1;
-		step = -width + 1;
+		dst += Width*3+1;
+		step = -Width + 1;
 	}
 	else
 	{
 		dst++;
-		step = width + 1;
+		step = Width + 1;
 	}
 
 	for( int i = 0 ; i < 8; ++i )
@@ -310,7 +327,8 @@ void setByte( unsigned char* dst, const unsigned char c, int width, int height,
 //  |      5 4    3 2
 //  |      3 2    5 4
 //  |      1 0    7 6
-unsigned char getByte( unsigned char* src, int width, int height, bool upDir )
+template<int Width>
+unsigned char getByte( const unsigned char* src, bool upDir )
 {
 	int step;
 	unsigned char c = 0;
@@ -318,13 +336,13 @@ unsigned char getByte( unsigned char* src, int width, int height, bool upDir )
 
 	if( upDir )
 	{
-		src += width*3+1;
-		step = -width + 1;
+		src += Width*3+1;
+		step = -Width + 1;
 	}
 	else
 	{
 		src++;
-		step = width + 1;
+		step = Width + 1;
 	}
 
 	for( int i = 0 ; i < 8; ++i )
@@ -339,187 +357,524 @@ unsigned char getByte( unsigned char* src, int width, int height, bool upDir )
 	return c;
 }
 
-// converts 255 byte block 2D binary matrix
-// block is encoded in a zig-zagging pattern
+// converts a codeword into the configuration's 2D binary matrix
+// block is encoded in a zig-zagging pattern, bytes past the codeword are zero
 
-void convertBufferToBinaryMatrix( const char* block, unsigned char* dst, unsigned int width, unsigned int height )
+template<class Config>
+void convertBufferToBinaryMatrix( const unsigned char* block, unsigned char* dst )
 {
-	if( width % 2 != 0 || height % 4 != 0 )
-	{
-		memset(dst,0,sizeof(unsigned char)*width*height);
-		return;
-	}
-
-	int bw = width >> 1;
-	int bh = height >> 2;
-	int k = 0;
+	const int width = Config::markSize;
+	const int bw = width >> 1;
+	const int bh = width >> 2;
+	unsigned int k = 0;
 	bool upDir = true;
 
-	memset(dst,0,sizeof(unsigned char)*width*height);
-
+	// the blocks cover every bit of the matrix
 	for( int i = bw-1; i >= 0 ; --i )
 	{
 		for( int j = bh-1; j >= 0; --j, ++k )
 		{
-			setByte(dst + j*4*width+i*2, block[k], width, height, upDir );
+			setByte<width>(dst + j*4*width+i*2, k < Config::codeLength ? block[k] : 0, upDir );
 		}
 		upDir = !upDir;
 	}
 }
 
-// 2D binary matrix into a 255 byte block 
+// 2D binary matrix into a codeword
 // block is encoded in a zig-zagging pattern
 // each bit in each quadriant is vote of the final value of that bit in the result
 
-void convertBinaryMatrixToBuffer( char* block, unsigned char* src, unsigned int width, unsigned int height )
+template<class Config>
+void convertBinaryMatrixToBuffer( unsigned char* block, const unsigned char* src )
 {
-	if( width % 2 != 0 || height % 4 != 0 )
-	{
-		memset(src,0,sizeof(unsigned char)*width*height);
-		return;
-	}
-
-	int bw = width >> 1;
-	int bh = height >> 2;
-	int k = 0;
+	const int width = Config::markSize;
+	const int bw = width >> 1;
+	const int bh = width >> 2;
+	unsigned int k = 0;
 	bool upDir = true;
 
-	for( int i = bw-1; i >= 0 ; --i )
+	for( int i = bw-1; i >= 0 && k < Config::codeLength; --i )
 	{
-		for( int j = bh-1; j >= 0; --j, ++k )
+		for( int j = bh-1; j >= 0 && k < Config::codeLength; --j, ++k )
 		{
-			block[k] = (char)getByte(src + j*4*width+i*2, width, height, upDir );
+			block[k] = getByte<width>(src + j*4*width+i*2, upDir );
 		}
 		upDir = !upDir;
 	}
 }
 
-void encodeStringIntoBinaryMatrix( const char* str, unsigned char* dst, unsigned int width, unsigned int height )
+/* Finite Field Parameters */
+static const std::size_t field_descriptor                 =   8;
+static const std::size_t generator_polynommial_index      = 120;
+
+// Field, generator polynomial and codec of a configuration are built once and only read afterwards,
+// so every thread shares them instead of rebuilding the tables for each message
+template<class Config>
+struct ReedSolomonCodec
 {
+	typedef schifra::reed_solomon::block<Config::codeLength,Config::fecLength> block_type;
+
+	ReedSolomonCodec()
+		: field(field_descriptor,
+		        schifra::galois::primitive_polynomial_size06,
+		        schifra::galois::primitive_polynomial06),
+		  generator_polynomial(makeGenerator(field)),
+		  encoder(field,generator_polynomial),
+		  decoder(field,generator_polynommial_index),
+		  batch(Config::codeLength,Config::fecLength,generator_polynommial_index),
+		  batchMatches(checkBatch())
+	{
+	}
+
+	static schifra::galois::field_polynomial makeGenerator( const schifra::galois::field& field )
+	{
+		schifra::galois::field_polynomial generator(field);
+
+		// one root per parity symbol
+		schifra::sequential_root_generator_polynomial_creator(field,
+		                                                      generator_polynommial_index,
+		                                                      Config::fecLength,
+		                                                      generator);
+		return generator;
+	}
+
+	static const ReedSolomonCodec& instance()
+	{
+		static const ReedSolomonCodec codec;
+		return codec;
+	}
+
+	// fills in the parity of one codeword (data first)
+	bool encodeCodeword( unsigned char* codeword ) const
+	{
+		block_type block;
+
+		for (std::size_t i = 0; i < Config::dataLength; ++i)
+			block.data[i] = codeword[i];
+
+		if (!encoder.encode(block))
+			return false;
+
+		for (std::size_t i = Config::dataLength; i < Config::codeLength; ++i)
+			codeword[i] = static_cast<unsigned char>(block.data[i]);
+
+		return true;
+	}
 
-   /* Finite Field Parameters */
-   const std::size_t field_descriptor                 =   8;
-   const std::size_t generator_polynommial_index      = 120;
-   const std::size_t generator_polynommial_root_count =  96;
+	// corrects the data symbols of one codeword in place and counts the corrected symbols
+	bool decodeCodeword( unsigned char* codeword, unsigned int* corrected ) const
+	{
+		TRACE_SCOPE("rs correct");
+
+		block_type block;
+
+		for (std::size_t i = 0; i < Config::codeLength; ++i)
+			block.data[i] = codeword[i];
+
+		if (!decoder.decode(block))
+			return false;
+
+		for (std::size_t i = 0; i < Config::dataLength; ++i)
+			codeword[i] = static_cast<unsigned char>(block.data[i]);
+
+		*corrected = (unsigned int)block.errors_corrected;
+
+		return true;
+	}
+
+	// Schifra is the reference: the batched kernels are only used if they build the same codewords,
+	// find all of them clean and notice a corrupted one
+	bool checkBatch() const
+	{
+		const unsigned int count = 2*ReedSolomonBatch::lanes() + 3;
+		const unsigned int n = Config::codeLength;
+		std::vector<unsigned char> codewords(count*n), expected, clean(count);
+		unsigned int seed = 12345;
+
+		for( unsigned int c = 0; c < count; ++c )
+		{
+			for( unsigned int i = 0; i < Config::dataLength; ++i )
+			{
+				seed = seed*1103515245 + 12345;
+				codewords[c*n + i] = (unsigned char)(seed >> 24);
+			}
+		}
+
+		expected = codewords;
+		batch.encode(&codewords[0], count);
 
-   /* Reed Solomon Code Parameters */
-   const std::size_t code_length = 128;
-   const std::size_t fec_length  =  96;
-   const std::size_t data_length = code_length - fec_length;
+		for( unsigned int c = 0; c < count; ++c )
+			if( !encodeCodeword(&expected[c*n]) )
+				return false;
 
-   /* Instantiate Finite Field and Generator Polynomials */
-   schifra::galois::field field(field_descriptor,
-                                schifra::galois::primitive_polynomial_size06,
-                                schifra::galois::primitive_polynomial06);
+		if( codewords != expected || batch.checkSyndromes(&codewords[0], &clean[0], count) != count )
+			return false;
 
-   schifra::galois::field_polynomial generator_polynomial(field);
+		codewords[n + 3] ^= 0x5a;
 
-   schifra::sequential_root_generator_polynomial_creator(field,
-                                                         generator_polynommial_index,
-                                                         generator_polynommial_root_count,
-                                                         generator_polynomial);
+		return batch.checkSyndromes(&codewords[0], &clean[0], count) == count - 1 && !clean[1];
+	}
+
+	schifra::galois::field field;
+	schifra::galois::field_polynomial generator_polynomial;
+	schifra::reed_solomon::shortened_encoder<Config::codeLength,Config::fecLength> encoder;
+	schifra::reed_solomon::shortened_decoder<Config::codeLength,Config::fecLength> decoder;
+	ReedSolomonBatch batch;
+	bool batchMatches;
+};
+
+// codewords are encoded and checked this many at a time
+static const unsigned int codewordGroup = 256;
+
+// Reed-Solomon encodes count strings, each zero padded to the data length, into count marks back to back.
+// Returns the number of marks encoded, a mark that fails is all zero
+template<class Config>
+static unsigned int encodeMessages( const char* const* strs, unsigned char* marks, unsigned int count )
+{
+   TRACE_SCOPE("rs encode");
 
-   /* Instantiate Encoder and Decoder (Codec) */
-   schifra::reed_solomon::shortened_encoder<code_length,fec_length> encoder(field,generator_polynomial);
+   const ReedSolomonCodec<Config>& codec = ReedSolomonCodec<Config>::instance();
+   const unsigned int n = Config::codeLength;
+   unsigned int encoded = 0;
 
-   std::string message = str;
-               message = message + std::string(data_length - message.length(),static_cast<unsigned char>(0x00));
+   Arena& arena = threadArena();
+   ArenaScope scope(arena);
 
-   /* Instantiate RS Block For Codec */
-   schifra::reed_solomon::block<code_length,fec_length> block;
+   unsigned char* codewords = arena.allocArray<unsigned char>(codewordGroup*n);
 
-   /* Transform message into Reed-Solomon encoded codeword */
-   if (!encoder.encode(message,block))
+   for( unsigned int base = 0; base < count; base += codewordGroup )
    {
-      std::cout << "Error - Critical encoding failure!" << std::endl;
-	  memset(dst,0,sizeof(unsigned char)*width*height);
-      return;
+      unsigned int group = count - base < codewordGroup ? count - base : codewordGroup;
+
+      for( unsigned int c = 0; c < group; ++c )
+      {
+         std::size_t length = strlen(strs[base+c]);
+
+         for (std::size_t i = 0; i < Config::dataLength; ++i)
+            codewords[c*n + i] = i < length ? static_cast<unsigned char>(strs[base+c][i]) : 0x00;
+      }
+
+      /* Transform messages into Reed-Solomon encoded codewords */
+      if( codec.batchMatches )
+         codec.batch.encode(codewords, group);
+
+      for( unsigned int c = 0; c < group; ++c )
+      {
+         unsigned char* mark = marks + (size_t)(base+c)*Config::markLength;
+
+         if( !codec.batchMatches && !codec.encodeCodeword(codewords + c*n) )
+         {
+            std::cerr << "Error - Critical encoding failure!" << std::endl;
+            memset(mark,0,sizeof(unsigned char)*Config::markLength);
+            continue;
+         }
+
+         convertBufferToBinaryMatrix<Config>(codewords + c*n, mark);
+         ++encoded;
+      }
    }
-   
-   std::string block_str;
-   std::string data_str(data_length,static_cast<unsigned char>(0x00));
-   std::string fec_str(fec_length,static_cast<unsigned char>(0x00));
-   block.data_to_string(data_str);
-   block.fec_to_string(fec_str);
-   block_str = data_str + fec_str;
 
-   convertBufferToBinaryMatrix(block_str.c_str(), dst, width, height);
+   return encoded;
 }
 
-void decodeBinaryMatrixAsString( unsigned char* src, char* dst, unsigned int width, unsigned int height )
+// codewords that cannot be corrected are reported on stderr unless this is turned off
+static std::atomic<bool> decodeFailureReports(true);
+
+void setDecodeFailureReports( bool enabled )
+{
+	decodeFailureReports = enabled;
+}
+
+static void writeDecodeError( char* dst )
 {
-   /* Finite Field Parameters */
-   const std::size_t field_descriptor                 =   8;
-   const std::size_t generator_polynommial_index      = 120;
-   const std::size_t generator_polynommial_root_count =  96;
+#ifdef _WIN32
+	sprintf_s(dst,6,"ERROR");
+#else
+	sprintf(dst,"ERROR");
+#endif
+}
 
-   /* Reed Solomon Code Parameters */
-   const std::size_t code_length = 128;
-   const std::size_t fec_length  =  96;
-   const std::size_t data_length = code_length - fec_length;
+// Decodes count marks into dataLength characters each (terminated if terminate is set) stride bytes apart, or "ERROR".
+// Codewords whose syndromes are all zero are read directly, only the others go through the Schifra decoder.
+// If corrected is not NULL it receives the number of symbols corrected in each codeword.
+// Returns the number of marks decoded
+template<class Config>
+static unsigned int decodeMessages( const unsigned char* marks, char* dst, unsigned int stride, unsigned int count, bool terminate, unsigned int* corrected = NULL )
+{
+   TRACE_SCOPE("rs decode");
+
+   const ReedSolomonCodec<Config>& codec = ReedSolomonCodec<Config>::instance();
+   const unsigned int n = Config::codeLength;
+   unsigned int decoded = 0;
 
-   /* Instantiate Finite Field and Generator Polynomials */
-   schifra::galois::field field(field_descriptor,
-                                schifra::galois::primitive_polynomial_size06,
-                                schifra::galois::primitive_polynomial06);
+   Arena& arena = threadArena();
+   ArenaScope scope(arena);
 
-   schifra::galois::field_polynomial generator_polynomial(field);
+   unsigned char* codewords = arena.allocArray<unsigned char>(codewordGroup*n);
+   unsigned char* clean = arena.allocArray<unsigned char>(codewordGroup);
+
+   for( unsigned int base = 0; base < count; base += codewordGroup )
+   {
+      unsigned int group = count - base < codewordGroup ? count - base : codewordGroup;
+
+      for( unsigned int c = 0; c < group; ++c )
+         convertBinaryMatrixToBuffer<Config>(codewords + c*n, marks + (size_t)(base+c)*Config::markLength);
+
+      if( codec.batchMatches )
+         codec.batch.checkSyndromes(codewords, clean, group);
+      else
+         memset(clean, 0, group);
+
+      for( unsigned int c = 0; c < group; ++c )
+      {
+         char* str = dst + (size_t)(base+c)*stride;
+         unsigned int symbols = 0;
+
+         if( !clean[c] && !codec.decodeCodeword(codewords + c*n, &symbols) )
+         {
+            if( decodeFailureReports )
+               std::cerr << "Error - Critical decoding failure!" << std::endl;
+            writeDecodeError(str);
+            continue;
+         }
+
+         for (std::size_t i = 0; i < Config::dataLength; ++i)
+         {
+            unsigned char temp = codewords[c*n + i];
+            if( temp < 32 || temp > 126 ) // Replaced unexpected character range with space
+            {
+               temp = 32U;
+            }
+            str[i] = (char)temp;
+         }
+
+         if( terminate )
+            str[Config::dataLength] = 0;
+
+         if( corrected != NULL )
+            corrected[base+c] = symbols;
+
+         ++decoded;
+      }
+   }
 
-   schifra::sequential_root_generator_polynomial_creator(field,
-                                                         generator_polynommial_index,
-                                                         generator_polynommial_root_count,
-                                                         generator_polynomial);
+   return decoded;
+}
 
-   /* Instantiate Decoder (Codec) */
-   schifra::reed_solomon::shortened_decoder<code_length,fec_length> decoder(field,generator_polynommial_index);
+template<class Config>
+static bool encodeMessage( const char* str, unsigned char* mark )
+{
+	return encodeMessages<Config>(&str, mark, 1) == 1;
+}
 
-   char tempStr[128];
+template<class Config>
+static bool decodeMessage( const unsigned char* mark, char* dst )
+{
+	return decodeMessages<Config>(mark, dst, Config::dataLength, 1, false) == 1;
+}
 
-   convertBinaryMatrixToBuffer(tempStr, src, width, height);
+// the original interface, fixed to the standard configuration
+void encodeStringIntoBinaryMatrix( const char* str, unsigned char* dst, unsigned int width, unsigned int height )
+{
+	if( width != StandardCodec::markSize || height != StandardCodec::markSize )
+	{
+		memset(dst,0,sizeof(unsigned char)*width*height);
+		return;
+	}
 
-   /* Instantiate RS Block For Codec */
-   std::string data_str(32,0x00);
-   std::string fec_str(96,0x00);
+	encodeMessage<StandardCodec>(str, dst);
+}
 
-    for (std::size_t i = 0; i < 32; ++i)
+void decodeBinaryMatrixAsString( unsigned char* src, char* dst, unsigned int width, unsigned int height )
+{
+	if( width != StandardCodec::markSize || height != StandardCodec::markSize )
 	{
-		data_str[i] = static_cast<char>(tempStr[i]);
+		writeDecodeError(dst);
+		return;
 	}
 
-	for (std::size_t i = 0; i < 96; ++i)
+	decodeMessage<StandardCodec>(src, dst);
+}
+
+// calls the instantiation of a codec template for the preset selected at run time
+#define DISPATCH_CODEC( preset, function, arguments ) \
+	switch( preset ) \
+	{ \
+	case CodecLong:  return function<LongCodec> arguments; \
+	case CodecLarge: return function<LargeCodec> arguments; \
+	default:         return function<StandardCodec> arguments; \
+	}
+
+// the same for the functions templated on a configuration and a wavelet policy
+#define DISPATCH_PRESET( preset, wavelet, function, arguments ) \
+	switch( preset ) \
+	{ \
+	case CodecLong:  return function<LongCodec,wavelet> arguments; \
+	case CodecLarge: return function<LargeCodec,wavelet> arguments; \
+	default:         return function<StandardCodec,wavelet> arguments; \
+	}
+
+// A wavelet policy that also names the colour space whose luminance it transforms, so the colour
+// conversion is picked along with the rest of the region code
+template<class Wavelet, ColorSpace Space>
+struct SpaceWavelet : Wavelet
+{
+	static const ColorSpace space = Space;
+};
+
+typedef SpaceWavelet<Cdf97Wavelet,ColorLab> Cdf97Lab;
+typedef SpaceWavelet<LeGall53Wavelet,ColorLab> LeGall53Lab;
+typedef SpaceWavelet<Integer97Wavelet,ColorLab> Integer97Lab;
+typedef SpaceWavelet<Cdf97Wavelet,ColorYCbCr> Cdf97YCbCr;
+typedef SpaceWavelet<LeGall53Wavelet,ColorYCbCr> LeGall53YCbCr;
+typedef SpaceWavelet<Integer97Wavelet,ColorYCbCr> Integer97YCbCr;
+
+#define DISPATCH_WAVELET( codec, cdf97, legall53, int97, function, arguments ) \
+	switch( (codec).wavelet ) \
+	{ \
+	case WaveletLeGall53:  DISPATCH_PRESET((codec).preset, legall53, function, arguments) \
+	case WaveletInteger97: DISPATCH_PRESET((codec).preset, int97, function, arguments) \
+	default:               DISPATCH_PRESET((codec).preset, cdf97, function, arguments) \
+	}
+
+// the colour space, wavelet and preset of codec selected at run time
+#define DISPATCH_REGION( codec, function, arguments ) \
+	if( (codec).space == ColorYCbCr ) \
+	{ \
+		DISPATCH_WAVELET(codec, Cdf97YCbCr, LeGall53YCbCr, Integer97YCbCr, function, arguments) \
+	} \
+	DISPATCH_WAVELET(codec, Cdf97Lab, LeGall53Lab, Integer97Lab, function, arguments)
+
+// capacity mode payloads start with their length, two bytes little-endian
+static const unsigned int payloadHeaderLength = 2;
+
+static_assert(LargeCodec::markLength <= maxMarkLength && LargeCodec::dataLength <= maxPayloadLength, "buffer sizes in wavescribe.h are too small");
+static_assert(LargeCodec::capacityBlocks*LargeCodec::dataLength - payloadHeaderLength <= maxCapacityLength, "maxCapacityLength in wavescribe.h is too small");
+
+template<class Config>
+static CodecInfo makeCodecInfo( const char* name )
+{
+	CodecInfo info = { name, Config::markSize, Config::tileSize, (unsigned int)Config::codeLength, (unsigned int)Config::dataLength,
+	                   Config::capacityBlocks, (unsigned int)(Config::capacityBlocks*Config::dataLength) - payloadHeaderLength };
+	return info;
+}
+
+const CodecInfo& codecInfo( CodecPreset preset )
+{
+	static const CodecInfo presets[CodecPresetCount] = {
+		makeCodecInfo<StandardCodec>("standard"),
+		makeCodecInfo<LongCodec>("long"),
+		makeCodecInfo<LargeCodec>("large")
+	};
+
+	return presets[preset < CodecPresetCount ? preset : CodecStandard];
+}
+
+bool findCodecPreset( const char* name, CodecPreset* preset )
+{
+	for( int p = 0; p < CodecPresetCount; ++p )
 	{
-		fec_str[i] = static_cast<char>(tempStr[32+i]);
+		if( strcmp(name, codecInfo((CodecPreset)p).name) == 0 )
+		{
+			*preset = (CodecPreset)p;
+			return true;
+		}
 	}
 
-   schifra::reed_solomon::block<code_length,fec_length> block(data_str,fec_str);
+	return false;
+}
 
-   if(!decoder.decode(block))
-   {
-      std::cout << "Error - Critical decoding failure!" << std::endl;
-#ifdef _WIN32
-	  sprintf_s(dst,32,"ERROR");
-#else
-	  sprintf(dst,"ERROR");
-#endif
-   }
-   else
-   {
-	   block.data_to_string(data_str);
+const char* waveletName( WaveletKind wavelet )
+{
+	switch( wavelet )
+	{
+	case WaveletLeGall53:  return LeGall53Wavelet::name();
+	case WaveletInteger97: return Integer97Wavelet::name();
+	default:               return Cdf97Wavelet::name();
+	}
+}
+
+bool findWaveletKind( const char* name, WaveletKind* wavelet )
+{
+	for( int w = 0; w < WaveletKindCount; ++w )
+	{
+		if( strcmp(name, waveletName((WaveletKind)w)) == 0 )
+		{
+			*wavelet = (WaveletKind)w;
+			return true;
+		}
+	}
 
-	   bool badString = false;
+	return false;
+}
 
-	   memcpy(dst, data_str.c_str(), 32*sizeof(char));
+const char* colorSpaceName( ColorSpace space )
+{
+	return space == ColorYCbCr ? "ycbcr" : "lab";
+}
 
-		for (std::size_t i = 0; i < 32; ++i)
+bool findColorSpace( const char* name, ColorSpace* space )
+{
+	for( int c = 0; c < ColorSpaceCount; ++c )
+	{
+		if( strcmp(name, colorSpaceName((ColorSpace)c)) == 0 )
 		{
-			unsigned char temp = static_cast<unsigned char>(dst[i]);
-			if( temp < 32 || temp > 126 ) // Replaced unexpected character range with space
-			{
-				badString = true;
-				dst[i] = (char)32U;
-			}
+			*space = (ColorSpace)c;
+			return true;
 		}
-   }
+	}
+
+	return false;
+}
+
+// one cache of encoded marks per configuration
+template<class Config>
+static MarkPlanCache<Config::dataLength,Config::markLength>& markPlanCache()
+{
+	static MarkPlanCache<Config::dataLength,Config::markLength> cache;
+	return cache;
+}
+
+template<class Config>
+static void encodeMessageMarkFor( const char* str, unsigned char* mark )
+{
+	if( markPlanCache<Config>().lookup(str, Config::codeId, mark) )
+		return;
+
+	if( encodeMessage<Config>(str, mark) )
+		markPlanCache<Config>().insert(str, Config::codeId, mark);
+}
+
+void encodeMessageMark( const char* str, unsigned char* mark, CodecPreset preset )
+{
+	DISPATCH_CODEC(preset, encodeMessageMarkFor, (str, mark));
+}
+
+template<class Config>
+static bool decodeMessageMarkFor( unsigned char* mark, char* dst )
+{
+	return decodeMessages<Config>(mark, dst, Config::dataLength + 1, 1, true) == 1;
+}
+
+bool decodeMessageMark( unsigned char* mark, char* dst, CodecPreset preset )
+{
+	DISPATCH_CODEC(preset, decodeMessageMarkFor, (mark, dst));
+}
+
+unsigned int encodeMessageMarks( const char* const* strs, unsigned char* marks, unsigned int count, CodecPreset preset )
+{
+	DISPATCH_CODEC(preset, encodeMessages, (strs, marks, count));
+}
+
+template<class Config>
+static unsigned int decodeMessageMarksFor( unsigned char* marks, char* dst, unsigned int count )
+{
+	return decodeMessages<Config>(marks, dst, maxPayloadLength + 1, count, true);
+}
+
+unsigned int decodeMessageMarks( unsigned char* marks, char* dst, unsigned int count, CodecPreset preset )
+{
+	DISPATCH_CODEC(preset, decodeMessageMarksFor, (marks, dst, count));
 }
 
 // accending order
@@ -633,235 +988,364 @@ double getDistance( double c[4], double markStrength )
 	return delta != 0 ? (c[2] - c[1]) / delta : 0;
 }
 
-void encodeMark( double* freqs, unsigned char* mark, unsigned int width, unsigned int height, unsigned int markSize, double markStrength = 0.5 )
+// Offsets into the coefficient plane of the four coefficients behind each mark bit.
+// LH3 groups run along the rows of the cell and HL3 groups down its columns
+struct MarkLayout
+{
+	unsigned int width;
+	unsigned int markSize;
+	std::vector<unsigned int> lh3;
+	std::vector<unsigned int> hl3;
+};
+
+static MarkLayout* buildMarkLayout( unsigned int width, unsigned int markSize )
 {
 	unsigned int vecInLine = markSize/2;
 	unsigned int levelSize = markSize*2;
 	unsigned int hl3Offset = levelSize;
 	unsigned int lh3Offset = width*levelSize;
 
-	unsigned int i,j,k;
-	double *p1;
-	unsigned char *p2;
-
-	double v[4];
-	unsigned idx[4];
+	MarkLayout* layout = new MarkLayout;
+	layout->width = width;
+	layout->markSize = markSize;
+	layout->lh3.resize(markSize*markSize*4);
+	layout->hl3.resize(markSize*markSize*4);
 
-	unsigned int size = 4*sizeof(double);
+	unsigned int *q1 = &layout->lh3[0];
+	unsigned int *q2 = &layout->hl3[0];
 
-	// LH3 
-    for( i = 0, p1 = freqs+lh3Offset, p2 = mark; i < levelSize; ++i )
-    {
-		for( j = 0; j < vecInLine; ++j, p1+=4, ++p2 )
+	for( unsigned int i = 0; i < levelSize; ++i )
+	{
+		for( unsigned int j = 0; j < vecInLine; ++j )
 		{
-			memcpy(v,p1,size);
-
-			encodeBit(v,idx,*p2,markStrength);
-
-			// place coefficents back into matrix in their original order
-			for( k = 0; k < 4; ++k )
-				p1[idx[k]] = v[k];
+			for( unsigned int k = 0; k < 4; ++k )
+			{
+				*q1++ = lh3Offset + i*width + j*4 + k;
+				*q2++ = hl3Offset + (j*4 + k)*width + i;
+			}
 		}
-
-		// skip to the next row of the lh3 cell
-		p1+=width-levelSize;
 	}
 
-	// HL3 
-    for( i = 0, p1 = freqs+hl3Offset, p2 = mark; i < levelSize; ++i )
-    {
-		for( j = 0; j < vecInLine; ++j, ++p2 )
-		{
-			for( k = 0; k < 4; p1+=width, ++k )
-				v[k] = *p1;
+	return layout;
+}
 
-			encodeBit(v,idx,*p2,markStrength);
+// Layouts only depend on the plane width and mark size. Each one is built once, published
+// with a single atomic store and never freed, so lookups do not lock
+static const MarkLayout& markLayout( unsigned int width, unsigned int markSize )
+{
+	static const unsigned int maxLayouts = 64;
+	static std::atomic<const MarkLayout*> layouts[maxLayouts];
+	static std::mutex buildMutex;
 
-			// place coefficents back into matrix in their original order
-			p1 -= 4*width;
-			for( k = 0; k < 4; ++k )
-				*(p1+width*idx[k]) = v[k];
-			p1 += 4*width;
-		}
+	unsigned int n;
+
+	for( n = 0; n < maxLayouts; ++n )
+	{
+		const MarkLayout* layout = layouts[n].load(std::memory_order_acquire);
 
-		// move to beginning of the next column
-		p1=freqs+hl3Offset+i+1;
+		if( layout == NULL )
+			break;
+		if( layout->width == width && layout->markSize == markSize )
+			return *layout;
 	}
-}
 
-void decodeMark( double* freqs, unsigned char* mark, double* buffer1, double* buffer2, unsigned int width, unsigned int height, unsigned int markSize, double markStrength = 0.5 )
-{
-	unsigned int vecInLine = markSize/2;
-	unsigned int levelSize = markSize*2;
-	unsigned int hl3Offset = levelSize;
-	unsigned int lh3Offset = width*levelSize;
+	std::unique_lock<std::mutex> lock(buildMutex);
 
-	unsigned int i,j,k;
-	double *p1;
-	double *p2;
+	for( n = 0; n < maxLayouts && layouts[n].load(std::memory_order_acquire) != NULL; ++n )
+	{
+		const MarkLayout* layout = layouts[n].load(std::memory_order_acquire);
 
-	unsigned char *p3;
+		if( layout->width == width && layout->markSize == markSize )
+			return *layout;
+	}
 
-	double v[4];
+	MarkLayout* layout = buildMarkLayout(width, markSize);
 
-	unsigned int markLength = markSize*markSize;
+	// there are only as many layouts as power of two plane widths, keep the last slot for overflow
+	if( n == maxLayouts )
+		n = maxLayouts - 1;
 
-	unsigned int size = 4*sizeof(double);
+	layouts[n].store(layout, std::memory_order_release);
 
-	// LH3 
-    for( i = 0, p1 = freqs+lh3Offset, p2 = buffer1; i < levelSize; ++i )
-    {
-		// row
-		for( j = 0; j < vecInLine; ++j, p1+=4, ++p2 )
-		{
-			memcpy(v,p1,size);
-			*p2 = getDistance(v,markStrength);
-		}
+	return *layout;
+}
 
-		// skip to the next row of the lh3 cell
-		p1+=width-levelSize;
-	}
+// encodes one bit into each group of four coefficients listed in indices
+// whole batches go through the SIMD kernel, the scalar loop finishes the rest
+static void encodeQuads( double* freqs, const unsigned int* indices, const unsigned char* mark, unsigned int markLength, double markStrength )
+{
+	unsigned int b,k;
+	double v[4];
+	unsigned idx[4];
 
-	// HL3 
-    for( i = 0, p1 = freqs+hl3Offset, p2 = buffer2; i < levelSize; ++i )
-    {
-		// column
-		for( j = 0; j < vecInLine; ++j, ++p2 )
-		{
-			for( k = 0; k < 4; p1+=width, ++k )
-				v[k] = *p1;
+	b = encodeQuadsBatched(freqs, indices, mark, markLength, markStrength);
 
-			*p2 = getDistance(v,markStrength);
-		}
+	for( indices += 4*b; b < markLength; ++b, indices += 4 )
+	{
+		for( k = 0; k < 4; ++k )
+			v[k] = freqs[indices[k]];
+
+		encodeBit(v,idx,mark[b],markStrength);
 
-		// move to beginning of the next column
-		p1=freqs+hl3Offset+i+1;
+		// place coefficents back into matrix in their original order
+		for( k = 0; k < 4; ++k )
+			freqs[indices[idx[k]]] = v[k];
 	}
+}
 
-	// fuzzy mean
-	for( i = 0, p1 = buffer1, p2 = buffer2, p3 = mark; i < markLength; ++i, ++p1, ++p2, ++p3 )
-	{
-		double belief1 = 1 - 2 * fabs(*p1 - round(*p1));
-		double belief2 = 1 - 2 * fabs(*p2 - round(*p2));
+// reads the distance of each group of four coefficients listed in indices
+static void quadDistances( const double* freqs, const unsigned int* indices, double* distances, unsigned int markLength, double markStrength )
+{
+	unsigned int b,k;
+	double v[4];
 
-		double vote1 = ((int)round(*p1)) % 2 == 0 ? -1 : 1;
-		double vote2 = ((int)round(*p2)) % 2 == 0 ? -1 : 1;
+	b = quadDistancesBatched(freqs, indices, distances, markLength, markStrength);
 
-		double div = belief1 * vote1 + belief2 * vote2;
+	for( indices += 4*b; b < markLength; ++b, indices += 4 )
+	{
+		for( k = 0; k < 4; ++k )
+			v[k] = freqs[indices[k]];
 
-		*p3 = div < 0 ? 0 : 1;
+		distances[b] = getDistance(v,markStrength);
 	}
 }
-void decomposeImage( double* data, double* columnBuffer, unsigned int levels, unsigned int width, unsigned int height)
+
+// the same on the integer planes of the reversible wavelets, one group at a time in double precision
+// and rounded back onto the integer grid
+template<class T>
+static void encodeQuads( T* freqs, const unsigned int* indices, const unsigned char* mark, unsigned int markLength, double markStrength )
 {
-	unsigned int i,j,k;
-	double       *p1;
-	double       *p2;
+	unsigned int b,k;
+	double v[4];
+	unsigned idx[4];
 
-	for( k = 0; k < 3; ++k )
+	for( b = 0; b < markLength; ++b, indices += 4 )
 	{
-		// decompose rows
-		for( i = 0; i < height>>k; ++i )
-		{
-			fwt97(data+i*width, width>>k);
-		}
-
-		// decompose columns
-		for( j = 0; j < width>>k; ++j )
-		{
-			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>k; ++i, p1+=width, ++p2 )
-				*p2 = *p1;
+		for( k = 0; k < 4; ++k )
+			v[k] = (double)freqs[indices[k]];
 
-			fwt97(columnBuffer, height>>k);
+		encodeBit(v,idx,mark[b],markStrength);
 
-			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>k; ++i, p1+=width, ++p2 )
-				*p1 = *p2;
-		}
+		for( k = 0; k < 4; ++k )
+			freqs[indices[idx[k]]] = (T)floor(v[k] + 0.5);
 	}
 }
 
-
-void reconstructImage( double* data, double* columnBuffer, unsigned int levels, unsigned int width, unsigned int height)
+template<class T>
+static void quadDistances( const T* freqs, const unsigned int* indices, double* distances, unsigned int markLength, double markStrength )
 {
-	unsigned int i,j,k;
-	double       *p1;
-	double       *p2;
+	unsigned int b,k;
+	double v[4];
 
-	for( k = levels; k > 0; --k )
+	for( b = 0; b < markLength; ++b, indices += 4 )
 	{
-		// decompose rows
-		for( i = 0; i < height>>(k-1); ++i )
-		{
-			iwt97(data+i*width, width>>(k-1));
-		}
-
-		// decompose columns
-		for( j = 0; j < width>>(k-1); ++j )
-		{
-			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>(k-1); ++i, p1+=width, ++p2 )
-				*p2 = *p1;
-
-			iwt97(columnBuffer, height>>(k-1));
+		for( k = 0; k < 4; ++k )
+			v[k] = (double)freqs[indices[k]];
 
-			for( i = 0, p1 = data+j, p2 = columnBuffer; i < height>>(k-1); ++i, p1+=width, ++p2 )
-				*p1 = *p2;
-		}
+		distances[b] = getDistance(v,markStrength);
 	}
 }
 
-// if mark is NULL, attempts to remove watermark from LH3 and HL3 and store the recontruction in dst
-// otherwise it inserts the mark into the image stores the new image in dst
-void insertWatermark( unsigned int* src, unsigned int** dst, unsigned char* mark, int *width, int *height, bool isForward = true, double markStrength = 0.5 )
+// combines the LH3 and HL3 distances of one bit into a signed belief (negative reads as 0)
+double fuzzyMean( double distance1, double distance2 )
 {
-	unsigned int size = *width**height;
-	unsigned int newSize;
-	unsigned int n;
-    int i,j;
-	unsigned int *p1;
-	double       *p2;
+	double belief1 = 1 - 2 * fabs(distance1 - round(distance1));
+	double belief2 = 1 - 2 * fabs(distance2 - round(distance2));
 
-	double tempColor1[3];
-	double tempColor2[3];
+	double vote1 = ((int)round(distance1)) % 2 == 0 ? -1 : 1;
+	double vote2 = ((int)round(distance2)) % 2 == 0 ? -1 : 1;
 
-	int newWidth = nextPow2(*width);
-	int newHeight = nextPow2(*height);
+	return belief1 * vote1 + belief2 * vote2;
+}
 
-	newSize = newWidth*newHeight;
+template<class Config, class T>
+void encodeMark( T* freqs, unsigned char* mark, unsigned int width, double markStrength )
+{
+	TRACE_SCOPE("encodeMark");
 
-	n = newSize;
+	const MarkLayout& layout = markLayout(width, Config::markSize);
 
-	rgbacol temp;
+	// LH3 
+	encodeQuads(freqs, &layout.lh3[0], mark, Config::markLength, markStrength);
 
-	unsigned int markSize = 32;
+	// HL3 
+	encodeQuads(freqs, &layout.hl3[0], mark, Config::markLength, markStrength);
+}
 
-	// Only handles 512x512 image currently
-	if( newHeight != 512 && newWidth != 512 )
-	{
-		*dst = NULL;
-		fprintf(stderr,"Error: Expecting 512x512 source image");
-		return;
-	}
+// if soft is not NULL it receives the signed belief of each bit (negative reads as 0)
+// if agreeing is not NULL it receives the number of bits whose LH3 and HL3 readings vote the same way
+template<class Config, class T>
+void decodeMark( T* freqs, unsigned char* mark, double* buffer1, double* buffer2, unsigned int width, double markStrength, double* soft, unsigned int* agreeing )
+{
+	TRACE_SCOPE("decodeMark");
 
-	double * markBuffer1 = NULL;
-	double * markBuffer2 = NULL;
+	const MarkLayout& layout = markLayout(width, Config::markSize);
 
-	double *freqs = (double*)malloc(sizeof(double)*n);
-	double *freqTempColumn = (double*)malloc(sizeof(double)*newHeight);
+	unsigned int i;
+	double *p1;
+	double *p2;
 
-	if( !isForward )
-	{
-		markBuffer1 = (double*)malloc(sizeof(double)*markSize*markSize);
-		markBuffer2 = (double*)malloc(sizeof(double)*markSize*markSize);
-	}
+	unsigned char *p3;
 
-	// convert RGB to luminance
-    for( i = 0, p1 = src, p2 = freqs; i < *height; ++i )
+	const unsigned int markLength = Config::markLength;
+
+	// LH3 
+	quadDistances(freqs, &layout.lh3[0], buffer1, markLength, markStrength);
+
+	// HL3 
+	quadDistances(freqs, &layout.hl3[0], buffer2, markLength, markStrength);
+
+	// fuzzy mean
+	i = fuzzyMeanBatched(buffer1, buffer2, mark, soft, markLength);
+
+	for( p1 = buffer1+i, p2 = buffer2+i, p3 = mark+i; i < markLength; ++i, ++p1, ++p2, ++p3 )
+	{
+		double div = fuzzyMean(*p1, *p2);
+
+		*p3 = div < 0 ? 0 : 1;
+
+		if( soft != NULL )
+			soft[i] = div;
+	}
+
+	if( agreeing != NULL )
+	{
+		unsigned int same = 0;
+
+		for( i = 0; i < markLength; ++i )
+			same += ((((int)round(buffer1[i])) ^ ((int)round(buffer2[i]))) & 1) == 0;
+
+		*agreeing = same;
+	}
+}
+
+// transforms levels levels of a width x height plane with the wavelet policy, in place
+template<class Wavelet>
+static void decomposeImage( typename Wavelet::coefficient* data, typename Wavelet::coefficient* scratch, unsigned int levels, unsigned int width, unsigned int height)
+{
+	TRACE_SCOPE("decomposeImage");
+
+	for( unsigned int k = 0; k < levels; ++k )
+		Wavelet::forward(data, scratch, width>>k, height>>k, width);
+}
+
+template<class Wavelet>
+static void reconstructImage( typename Wavelet::coefficient* data, typename Wavelet::coefficient* scratch, unsigned int levels, unsigned int width, unsigned int height)
+{
+	TRACE_SCOPE("reconstructImage");
+
+	for( unsigned int k = levels; k > 0; --k )
+		Wavelet::inverse(data, scratch, width>>(k-1), height>>(k-1), width);
+}
+
+// Fills result from a mark read out of readings tiles: beliefs are the summed per-bit beliefs and
+// agreeing the number of bit readings on which LH3 and HL3 voted the same way
+template<class Config>
+static void describeDecode( const unsigned char* mark, const double* beliefs, unsigned int agreeing, unsigned int readings, DecodeResult* result )
+{
+	double scale = readings > 0 ? 1.0 / readings : 0.0;
+	double sum = 0;
+	double least = DBL_MAX;
+	unsigned int weak = 0;
+
+	for( unsigned int i = 0; i < Config::markLength; ++i )
+	{
+		double belief = beliefs[i]*scale;
+		double magnitude = fabs(belief);
+
+		result->confidence[i] = (float)belief;
+		sum += magnitude;
+		least = magnitude < least ? magnitude : least;
+		weak += magnitude < 0.5;
+	}
+
+	result->markSize = Config::markSize;
+	result->meanConfidence = sum / Config::markLength;
+	result->minConfidence = least;
+	result->weakBits = weak;
+	result->bandAgreement = readings > 0 ? (double)agreeing / ((double)readings*Config::markLength) : 0.0;
+	result->tilesRead = readings;
+	result->offsetX = 0;
+	result->offsetY = 0;
+
+	result->correctedSymbols = 0;
+	result->correctableSymbols = (unsigned int)(Config::fecLength/2);
+	result->decoded = decodeMessages<Config>(mark, result->message, 0, 1, true, &result->correctedSymbols) == 1;
+	result->margin = result->decoded ? (int)result->correctableSymbols - (int)result->correctedSymbols : -1;
+}
+
+// fixed point luma (ycbcr.h) to the coefficients of a plane and back. Far out of range coefficients
+// are cut, the channels saturate long before
+static inline void lumaToPlane( const int* luma, unsigned int count, double* plane )
+{
+	for( unsigned int i = 0; i < count; ++i )
+		plane[i] = luma[i] * (1.0 / (1 << lumaFractionBits));
+}
+
+static inline void lumaToPlane( const int* luma, unsigned int count, int* plane )
+{
+	const int shift = lumaFractionBits - IntegerWavelet::luminanceShift;
+
+	for( unsigned int i = 0; i < count; ++i )
+		plane[i] = (luma[i] + (1 << (shift-1))) >> shift;
+}
+
+static inline void planeToLuma( const double* plane, unsigned int count, int* luma )
+{
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		double l = plane[i];
+		l = !(l > -1000.0) ? -1000.0 : (l > 1000.0 ? 1000.0 : l);
+
+		luma[i] = (int)floor(l * (1 << lumaFractionBits) + 0.5);
+	}
+}
+
+static inline void planeToLuma( const int* plane, unsigned int count, int* luma )
+{
+	const int shift = lumaFractionBits - IntegerWavelet::luminanceShift;
+	const int limit = 1000 << IntegerWavelet::luminanceShift;
+
+	for( unsigned int i = 0; i < count; ++i )
+		luma[i] = (plane[i] < -limit ? -limit : (plane[i] > limit ? limit : plane[i])) * (1 << shift);
+}
+
+// writes the luminance of a width x height region whose rows are stride pixels apart into plane,
+// whose rows are planeWidth coefficients apart
+template<class Wavelet>
+static void readLuminance( const unsigned int* src, unsigned int stride, int width, int height, typename Wavelet::coefficient* plane, unsigned int planeWidth )
+{
+	TRACE_SCOPE("read luminance");
+
+	int i,j;
+	const unsigned int *p1;
+	typename Wavelet::coefficient *p2;
+
+	double tempColor1[3];
+	double tempColor2[3];
+
+	rgbacol temp;
+
+	if( Wavelet::space == ColorYCbCr )
+	{
+		Arena& arena = threadArena();
+		ArenaScope scope(arena);
+		int* luma = arena.allocArray<int>(width);
+
+		for( i = 0; i < height; ++i )
+		{
+			lumaRow(src + i*stride, width, luma);
+			lumaToPlane(luma, width, plane + i*planeWidth);
+		}
+		return;
+	}
+
+    for( i = 0; i < height; ++i )
     {
-		for( j = 0; j < *width; ++j, ++p1, ++p2 )
+		for( j = 0, p1 = src + i*stride, p2 = plane + i*planeWidth; j < width; ++j, ++p1, ++p2 )
 		{
     		temp.c = *p1;
 
-#ifdef USE_LAB
 			tempColor1[0] = (double)temp.r / 255.0;
 			tempColor1[1] = (double)temp.g / 255.0;
 			tempColor1[2] = (double)temp.b / 255.0;
@@ -869,185 +1353,2219 @@ void insertWatermark( unsigned int* src, unsigned int** dst, unsigned char* mark
 			RGBtoXYZ(tempColor1,tempColor2);
 			XYZtoLab(tempColor2,tempColor1);
 
-			*p2 = tempColor1[0];
-#else
-			tempColor1[0] = (double)temp.r;
-			tempColor1[1] = (double)temp.g;
-			tempColor1[2] = (double)temp.b;
+			*p2 = Wavelet::fromLuminance(tempColor1[0]);
+		}
+    }
+}
 
-			RGBtoYCbCr(tempColor1,tempColor2);
+// writes the a and b of Lab of a width x height region whose rows are stride pixels apart into chroma,
+// two doubles per pixel and planeWidth pixels per row: the values synthesizeRegion converts every pixel
+// to before it puts the new luminance in
+static void readChroma( const unsigned int* src, unsigned int stride, int width, int height, double* chroma, unsigned int planeWidth )
+{
+	TRACE_SCOPE("read chroma");
 
-			*p2 = tempColor2[0];
-#endif
+	double tempColor1[3];
+	double tempColor2[3];
+
+	rgbacol temp;
+
+	for( int i = 0; i < height; ++i )
+	{
+		const unsigned int* p1 = src + i*stride;
+		double* p2 = chroma + 2*(size_t)i*planeWidth;
+
+		for( int j = 0; j < width; ++j, ++p1, p2 += 2 )
+		{
+			temp.c = *p1;
+
+			tempColor1[0] = (double)temp.r / 255.0;
+			tempColor1[1] = (double)temp.g / 255.0;
+			tempColor1[2] = (double)temp.b / 255.0;
+
+			RGBtoXYZ(tempColor1,tempColor2);
+			XYZtoLab(tempColor2,tempColor1);
 
+			p2[0] = tempColor1[1];
+			p2[1] = tempColor1[2];
 		}
-		for( ; j < newWidth; ++j, ++p2 )
-			*p2 = 0;
-    }
-    for( ; i < newHeight; ++i )
+	}
+}
+
+// Writes the luminance of a width x height region whose rows are stride pixels apart into freqs, zero
+// padded to planeWidth x planeHeight, and transforms it by levels levels
+template<class Wavelet>
+static void analyzeRegion( const unsigned int* src, unsigned int stride, int width, int height, unsigned int levels, typename Wavelet::coefficient* freqs, typename Wavelet::coefficient* scratch, int planeWidth, int planeHeight )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+    int i,j;
+	coefficient  *p2;
+
+	// convert RGB to luminance
+	readLuminance<Wavelet>(src, stride, width, height, freqs, planeWidth);
+
+	for( i = 0, p2 = freqs; i < height; ++i, p2 += planeWidth )
+	{
+		for( j = width; j < planeWidth; ++j )
+			p2[j] = 0;
+	}
+    for( ; i < planeHeight; ++i )
     {
-		for( j = 0; j < newWidth; ++j, ++p2 )
+		for( j = 0; j < planeWidth; ++j, ++p2 )
 		{
 			*p2 = 0;
 		}
 	}
 
-	decomposeImage(freqs,freqTempColumn,3,newWidth,newHeight);
+	decomposeImage<Wavelet>(freqs,scratch,levels,planeWidth,planeHeight);
+}
+
+// transforms the coefficients of analyzeRegion back and replaces the luminance of the region with them;
+// chroma (Lab only, may be NULL) is what readChroma gave for the region's pixels, so they are not converted again
+template<class Wavelet>
+static void synthesizeRegion( unsigned int* src, unsigned int stride, int width, int height, unsigned int levels, typename Wavelet::coefficient* freqs, typename Wavelet::coefficient* scratch, int planeWidth, int planeHeight, const double* chroma = NULL )
+{
+	typedef typename Wavelet::coefficient coefficient;
 
-	if( isForward )
-	{
-		// encode watermark boolean bits into coefficients
-		encodeMark(freqs, mark, newWidth, newHeight, markSize, markStrength);
+    int i,j;
+	unsigned int *p1;
+	coefficient  *p2;
+
+	double tempColor1[3];
+	double tempColor2[3];
+
+	rgbacol temp;
 
-		// prepare to return the source image
-		*dst = src;
+	reconstructImage<Wavelet>(freqs,scratch,levels,planeWidth,planeHeight);
 
-		reconstructImage(freqs,freqTempColumn,3,newWidth,newHeight);
+	TRACE_SCOPE("write luminance");
 
-		// replace luminance in image
-		for( i = 0, p1 = *dst, p2 = freqs; i < *height; ++i )
+	if( Wavelet::space == ColorYCbCr )
+	{
+		Arena& arena = threadArena();
+		ArenaScope scope(arena);
+		int* luma = arena.allocArray<int>(width);
+
+		for( i = 0; i < height; ++i )
 		{
-			for( j = 0; j < *width; ++j, ++p1, ++p2 )
-			{
-    			temp.c = *p1;
+			planeToLuma(freqs + i*planeWidth, width, luma);
+			setLumaRow(src + i*stride, width, luma);
+		}
+		return;
+	}
+
+	// replace luminance in image
+	for( i = 0, p2 = freqs; i < height; ++i, p2 += planeWidth - width )
+	{
+		for( j = 0, p1 = src + i*stride; j < width; ++j, ++p1, ++p2 )
+		{
+			temp.c = *p1;
 
-#ifdef USE_LAB // Use Lab Color Space
+			if( chroma != NULL )
+			{
+				// the same conversion of the same pixel, done once when the chroma was read
+				tempColor1[1] = chroma[2*((size_t)i*planeWidth + j)];
+				tempColor1[2] = chroma[2*((size_t)i*planeWidth + j) + 1];
+			}
+			else
+			{
 				tempColor1[0] = (double)temp.r / 255.0;
 				tempColor1[1] = (double)temp.g / 255.0;
 				tempColor1[2] = (double)temp.b / 255.0;
 
 				RGBtoXYZ(tempColor1,tempColor2);
 				XYZtoLab(tempColor2,tempColor1);
+			}
 
-    			tempColor1[0] = *p2;
+			tempColor1[0] = Wavelet::toLuminance(*p2);
 
-				LabtoXYZ(tempColor1,tempColor2);
-				XYZtoRGB(tempColor2,tempColor1);
+			LabtoXYZ(tempColor1,tempColor2);
+			XYZtoRGB(tempColor2,tempColor1);
 
-				temp.r = (unsigned char)(tempColor1[0] * 255.0);
-				temp.g = (unsigned char)(tempColor1[1] * 255.0);
-				temp.b = (unsigned char)(tempColor1[2] * 255.0);
-#else // Use YCbCr Color Space
-				tempColor1[0] = (double)temp.r;
-				tempColor1[1] = (double)temp.g;
-				tempColor1[2] = (double)temp.b;
+			temp.r = (unsigned char)(tempColor1[0] * 255.0);
+			temp.g = (unsigned char)(tempColor1[1] * 255.0);
+			temp.b = (unsigned char)(tempColor1[2] * 255.0);
 
-				RGBtoYCbCr(tempColor1,tempColor2);
+			*p1 = temp.c;
+		}
+	}
+}
 
-				tempColor2[0] = *p2;
+// Transforms a width x height region whose rows are stride pixels apart by levels levels and calls
+// step(freqs, planeWidth) on its coefficients; if isForward, the changed coefficients are transformed back
+// and replace the luminance of the region. The region is zero padded to the next power of two
+template<class Wavelet, class Step>
+static void transformRegion( unsigned int* src, unsigned int stride, int width, int height, unsigned int levels, bool isForward, const Step& step )
+{
+	typedef typename Wavelet::coefficient coefficient;
 
-				YCbCrtoRGB(tempColor2,tempColor1);
+	int newWidth = nextPow2(width);
+	int newHeight = nextPow2(height);
 
-				temp.r = (unsigned char)tempColor1[0];
-				temp.g = (unsigned char)tempColor1[1];
-				temp.b = (unsigned char)tempColor1[2];
-#endif
+	// working buffers come from the thread arena and are released when the region is done
+	Arena& arena = threadArena();
+	ArenaScope scope(arena);
 
-				*p1 = temp.c;
-			}
-		}
-	}
-	else
+	coefficient *freqs = arena.allocArray<coefficient>((size_t)newWidth*newHeight);
+	coefficient *scratch = arena.allocArray<coefficient>(Wavelet::scratchSize(newWidth, newHeight));
+
+	analyzeRegion<Wavelet>(src, stride, width, height, levels, freqs, scratch, newWidth, newHeight);
+
+	step(freqs, (unsigned int)newWidth);
+
+	if( isForward )
+		synthesizeRegion<Wavelet>(src, stride, width, height, levels, freqs, scratch, newWidth, newHeight);
+}
+
+// Applies the mark to (isForward) or reads the mark from a width x height region whose rows are stride pixels apart
+// On decode, soft and agreeing (if not NULL) receive the per-bit beliefs and the number of bits both bands agree on
+template<class Config, class Wavelet>
+static void watermarkRegion( unsigned int* src, unsigned int stride, unsigned char* mark, double* soft, unsigned int* agreeing, int width, int height, bool isForward, double markStrength )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	if( isForward )
 	{
-		decodeMark(freqs, mark, markBuffer1, markBuffer2, *width, *height, markSize, markStrength);
+		// encode watermark boolean bits into coefficients
+		transformRegion<Wavelet>(src, stride, width, height, Config::levels, true, [&]( coefficient* freqs, unsigned int planeWidth ) {
+			encodeMark<Config>(freqs, mark, planeWidth, markStrength);
+		});
 
-		*dst = NULL;
+		return;
 	}
 
-	if( !isForward )
+	Arena& arena = threadArena();
+	ArenaScope scope(arena);
+
+	double* markBuffer1 = arena.allocArray<double>(Config::markLength);
+	double* markBuffer2 = arena.allocArray<double>(Config::markLength);
+
+	transformRegion<Wavelet>(src, stride, width, height, Config::levels, false, [&]( coefficient* freqs, unsigned int planeWidth ) {
+		decodeMark<Config>(freqs, mark, markBuffer1, markBuffer2, planeWidth, markStrength, soft, agreeing);
+	});
+}
+
+// if mark is NULL, attempts to remove watermark from LH3 and HL3 and store the recontruction in dst
+// otherwise it inserts the mark into the image stores the new image in dst
+template<class Config, class Wavelet>
+static void insertWatermarkFor( unsigned int* src, unsigned int** dst, unsigned char* mark, int *width, int *height, bool isForward, double markStrength )
+{
+	const int tileSize = Config::tileSize;
+
+	int newWidth = nextPow2(*width);
+	int newHeight = nextPow2(*height);
+
+	// Only handles images of a single tile currently
+	if( newHeight != tileSize && newWidth != tileSize )
 	{
-		free(markBuffer1);
-		free(markBuffer2);
+		*dst = NULL;
+		fprintf(stderr,"Error: Expecting %dx%d source image", tileSize, tileSize);
+		return;
 	}
 
-	free(freqs);
-	free(freqTempColumn);
+	watermarkRegion<Config,Wavelet>(src, *width, mark, NULL, NULL, *width, *height, isForward, markStrength);
+
+	// the mark is written in place, return the source image
+	*dst = isForward ? src : NULL;
 }
 
-int main(int argc, char** argv)
+void insertWatermark( unsigned int* src, unsigned int** dst, unsigned char* mark, int *width, int *height, bool isForward, double markStrength, Codec codec )
+{
+	DISPATCH_REGION(codec, insertWatermarkFor, (src, dst, mark, width, height, isForward, markStrength));
+}
+
+template<class Config, class Wavelet>
+static bool decodeWatermarkFor( unsigned int* src, unsigned char* mark, int width, int height, double markStrength, DecodeResult* result )
 {
-	if( argc != 3 && argc != 5 )
+	const int tileSize = Config::tileSize;
+
+	if( nextPow2(height) != tileSize && nextPow2(width) != tileSize )
 	{
-		printf("    usage: WaveMark strength input.png [output.png \"string\"]\n");
-		exit(-1);
+		fprintf(stderr,"Error: Expecting %dx%d source image", tileSize, tileSize);
+		return false;
 	}
 
-	int width, height, channels;
-	unsigned int markWidth, markHeight;
+	if( result == NULL )
+	{
+		watermarkRegion<Config,Wavelet>(src, width, mark, NULL, NULL, width, height, false, markStrength);
+		return true;
+	}
 
-	markWidth = markHeight = 32;
+	Arena& arena = threadArena();
+	ArenaScope scope(arena);
 
-	//CCPNGInit();
+	double* soft = arena.allocArray<double>(Config::markLength);
+	unsigned int agreeing = 0;
 
-	//unsigned int* imageData = CCPNGReadFile(argv[2], &width, &height);
-	unsigned int* imageData = (unsigned int*)stbi_load( argv[2], &width, &height, &channels, 4 );
-	unsigned int* outputData = NULL;
-	double strength = atof(argv[1]);
-	unsigned char* boolMark = (unsigned char*)malloc(sizeof(unsigned char)*markWidth*markHeight);	
+	watermarkRegion<Config,Wavelet>(src, width, mark, soft, &agreeing, width, height, false, markStrength);
 
-	// encode string from command line
-	if( argc == 5 ) 
+	describeDecode<Config>(mark, soft, agreeing, 1, result);
+
+	return true;
+}
+
+bool decodeWatermark( unsigned int* src, unsigned char* mark, int width, int height, double markStrength, Codec codec, DecodeResult* result )
+{
+	if( result != NULL )
 	{
-		markWidth = 32;
-		markHeight = 32;
+		result->preset = codec.preset;
+		result->wavelet = codec.wavelet;
+		result->space = codec.space;
+	}
 
-		std::string message = argv[4];
+	DISPATCH_REGION(codec, decodeWatermarkFor, (src, mark, width, height, markStrength, result));
+}
 
-		// remove quotes
-		message.substr(1,message.length()-2);
+// Capacity mode. Bit k (most significant first) of symbol slot s is group 8s+k of the bits in order: the
+// mark's groups (layout of the mark size), then those of the level below (the layout of twice the mark
+// size lies in LH2/HL2). Symbol j of codeword b is in slot j*capacityBlocks + b, so a codeword spreads
+// over both levels however many of them a payload needs
+//
+// Level-2 groups of smooth areas hold coefficients so close together that the 8-bit write-back decides
+// their order. The smallest and largest coefficient of such a group are first moved apart to span
+// payloadSpread (in luminance), the bit is then written as usual and read back like any other
+static const double payloadSpread = 3.0;
+
+template<class T>
+static void spreadQuads( T* freqs, const unsigned int* indices, unsigned int count, T spread )
+{
+	for( unsigned int b = 0; b < count; ++b, indices += 4 )
+	{
+		unsigned int low = 0, high = 0;
 
-		if( message.length() > 32 )
+		for( unsigned int k = 1; k < 4; ++k )
 		{
-			printf("Error: string too long\n");
+			if( freqs[indices[k]] < freqs[indices[low]] ) low = k;
+			if( freqs[indices[k]] > freqs[indices[high]] ) high = k;
 		}
 
-		else
+		T range = freqs[indices[high]] - freqs[indices[low]];
+
+		if( range >= spread )
+			continue;
+
+		// four equal coefficients
+		if( low == high )
+			high = 1;
+
+		T half = (spread - range) / 2;
+
+		freqs[indices[low]] -= half;
+		freqs[indices[high]] += spread - range - half;
+	}
+}
+
+// Lists the groups of the slots of the first used codewords in slot order, the ones of the mark's level
+// first, and the slot behind every 8 of them. Returns how many groups are on the mark's level
+template<class Config>
+static unsigned int gatherPayloadGroups( unsigned int planeWidth, unsigned int used, unsigned int* lh, unsigned int* hl, unsigned int* slots )
+{
+	const MarkLayout& level3 = markLayout(planeWidth, Config::markSize);
+	const MarkLayout& level2 = markLayout(planeWidth, 2*Config::markSize);
+	unsigned int count = 0, level3Count = 0;
+
+	for( unsigned int slot = 0; slot < Config::capacityBlocks*Config::codeLength; ++slot )
+	{
+		if( slot % Config::capacityBlocks >= used )
+			continue;
+
+		slots[count/8] = slot;
+
+		for( unsigned int k = 0; k < 8; ++k, ++count )
 		{
-			// convert string to boolean matrix
-			encodeStringIntoBinaryMatrix(message.c_str(),boolMark,markWidth,markHeight);
+			unsigned int bit = 8*slot + k;
+			const MarkLayout& layout = bit < Config::markLength ? level3 : level2;
+			unsigned int group = 4*(bit < Config::markLength ? bit : bit - Config::markLength);
+
+			memcpy(lh + 4*count, &layout.lh3[group], 4*sizeof(unsigned int));
+			memcpy(hl + 4*count, &layout.hl3[group], 4*sizeof(unsigned int));
+
+			level3Count += bit < Config::markLength;
 		}
 	}
 
-	if( imageData != NULL )
-	{	
-		if( boolMark != NULL || argc == 3 )
+	return level3Count;
+}
+
+// the symbol of a slot
+template<class Config>
+static unsigned int payloadSymbol( unsigned int slot )
+{
+	return (slot % Config::capacityBlocks)*Config::codeLength + slot / Config::capacityBlocks;
+}
+
+template<class Config, class Wavelet>
+static bool insertPayloadFor( ThreadPool& pool, unsigned int* src, int width, int height, const unsigned char* payload, unsigned int length, double markStrength )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	const ReedSolomonCodec<Config>& codec = ReedSolomonCodec<Config>::instance();
+	const unsigned int n = Config::codeLength;
+	const unsigned int k = Config::dataLength;
+	const unsigned int blocks = (payloadHeaderLength + length + k - 1) / k;
+
+	if( nextPow2(width) != Config::tileSize || nextPow2(height) != Config::tileSize )
+	{
+		fprintf(stderr,"Error: Expecting %dx%d source image\n", Config::tileSize, Config::tileSize);
+		return false;
+	}
+
+	if( blocks > Config::capacityBlocks )
+		return false;
+
+	Arena& arena = threadArena();
+	ArenaScope scope(arena);
+
+	// header and payload run through the data of the codewords in order, the last one zero padded
+	unsigned char* codewords = arena.allocArray<unsigned char>(blocks*n);
+	memset(codewords, 0, blocks*n);
+
+	for( unsigned int i = 0; i < payloadHeaderLength + length; ++i )
+		codewords[(i/k)*n + i%k] = i < payloadHeaderLength ? (unsigned char)(length >> (8*i)) : payload[i - payloadHeaderLength];
+
+	// one codeword per lane of the batched kernels, or one per task with the scalar encoder
+	{
+		TRACE_SCOPE("rs encode");
+
+		if( codec.batchMatches )
+			codec.batch.encode(codewords, blocks);
+		else
 		{
-			insertWatermark( imageData, &outputData, boolMark, &width, &height, argc == 5, strength );
+			const ReedSolomonCodec<Config>* shared = &codec;
+			std::atomic<bool> failed(false);
+			TaskGroup group;
 
-			if( argc == 3 )
+			for( unsigned int b = 0; b < blocks; ++b )
+				pool.enqueue([=, &failed]{ if( !shared->encodeCodeword(codewords + b*n) ) failed = true; }, group);
+
+			pool.wait(group);
+
+			if( failed )
 			{
-				// convert boolean matrix into string result
-				char str[33];
-				str[32] = 0;
-					
-				decodeBinaryMatrixAsString(boolMark, str, markWidth, markHeight );
-				width = markWidth;
-				height = markHeight;
-
-				printf("Message obtained from image %s : %s\n", argv[2], str);
+				std::cerr << "Error - Critical encoding failure!" << std::endl;
+				return false;
 			}
+		}
+	}
 
-			if( outputData != NULL )
-			{
-				stbi_write_png( argv[3], width, height, 4, outputData, 4*width);
-				//CCPNGWriteFile(argv[3], outputData, width, height, 0, 1);
+	// only the slots of the codewords in use are written
+	const unsigned int count = blocks*n*8;
+	unsigned int* lh = arena.allocArray<unsigned int>(4*count);
+	unsigned int* hl = arena.allocArray<unsigned int>(4*count);
+	unsigned int* slots = arena.allocArray<unsigned int>(count/8);
+	unsigned char* bits = arena.allocArray<unsigned char>(count);
 
-				if( argc != 5 ) 
-					free(outputData);
-			}
+	transformRegion<Wavelet>(src, width, width, height, Config::levels, true, [&]( coefficient* freqs, unsigned int planeWidth ) {
+		TRACE_SCOPE("encodePayload");
+
+		unsigned int level3 = gatherPayloadGroups<Config>(planeWidth, blocks, lh, hl, slots);
+
+		for( unsigned int i = 0; i < count; ++i )
+			bits[i] = (codewords[payloadSymbol<Config>(slots[i/8])] >> (7 - i%8)) & 1;
+
+		// no two groups share a coefficient, so each worker writes a range of them in both bands
+		const unsigned int chunk = (count + pool.size() - 1) / pool.size();
+		const coefficient spread = Wavelet::fromLuminance(payloadSpread);
+		TaskGroup group;
+
+		for( unsigned int first = 0; first < count; first += chunk )
+		{
+			unsigned int last = count - first < chunk ? count : first + chunk;
+			unsigned int spreadFirst = first > level3 ? first : level3;
+
+			pool.enqueue([=]{
+				if( last > spreadFirst )
+				{
+					spreadQuads(freqs, lh + 4*spreadFirst, last - spreadFirst, spread);
+					spreadQuads(freqs, hl + 4*spreadFirst, last - spreadFirst, spread);
+				}
+
+				encodeQuads(freqs, lh + 4*first, bits + first, last - first, markStrength);
+				encodeQuads(freqs, hl + 4*first, bits + first, last - first, markStrength);
+			}, group);
 		}
 
-		free(imageData);
-	}
-	else
+		pool.wait(group);
+	});
+
+	return true;
+}
+
+bool insertPayload( ThreadPool& pool, unsigned int* src, int width, int height, const unsigned char* payload, unsigned int length, double markStrength, Codec codec )
+{
+	DISPATCH_REGION(codec, insertPayloadFor, (pool, src, width, height, payload, length, markStrength));
+}
+
+template<class Config, class Wavelet>
+static bool decodePayloadFor( ThreadPool& pool, unsigned int* src, int width, int height, double markStrength, PayloadResult* result )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	const ReedSolomonCodec<Config>& codec = ReedSolomonCodec<Config>::instance();
+	const unsigned int n = Config::codeLength;
+	const unsigned int k = Config::dataLength;
+	const unsigned int blocks = Config::capacityBlocks;
+
+	if( nextPow2(width) != Config::tileSize || nextPow2(height) != Config::tileSize )
 	{
-		fprintf(stderr,"Error: could not open file %s\n", argv[2]);
+		fprintf(stderr,"Error: Expecting %dx%d source image\n", Config::tileSize, Config::tileSize);
+		return false;
 	}
 
-	free(boolMark);
+	result->decoded = false;
+	result->length = 0;
+	result->blocks = 0;
+	result->correctedSymbols = 0;
+	result->margin = -1;
 
-	//CCPNGDestroy();
-	dwtcleanup();
+	Arena& arena = threadArena();
+	ArenaScope scope(arena);
 
-	return 0;
-}
+	// every slot is read, the header tells which codewords are in use
+	const unsigned int count = blocks*n*8;
+	unsigned int* lh = arena.allocArray<unsigned int>(4*count);
+	unsigned int* hl = arena.allocArray<unsigned int>(4*count);
+	unsigned int* slots = arena.allocArray<unsigned int>(count/8);
+	unsigned char* bits = arena.allocArray<unsigned char>(count);
+	double* buffer1 = arena.allocArray<double>(count);
+	double* buffer2 = arena.allocArray<double>(count);
+
+	transformRegion<Wavelet>(src, width, width, height, Config::levels, false, [&]( coefficient* freqs, unsigned int planeWidth ) {
+		TRACE_SCOPE("decodePayload");
+
+		gatherPayloadGroups<Config>(planeWidth, blocks, lh, hl, slots);
+
+		quadDistances(freqs, lh, buffer1, count, markStrength);
+		quadDistances(freqs, hl, buffer2, count, markStrength);
+	});
+
+	unsigned int i = fuzzyMeanBatched(buffer1, buffer2, bits, NULL, count);
+
+	for( ; i < count; ++i )
+		bits[i] = fuzzyMean(buffer1[i], buffer2[i]) < 0 ? 0 : 1;
+
+	unsigned char* codewords = arena.allocArray<unsigned char>(blocks*n);
+	unsigned char* clean = arena.allocArray<unsigned char>(blocks);
+	unsigned int* corrected = arena.allocArray<unsigned int>(blocks);
+	unsigned char* decoded = arena.allocArray<unsigned char>(blocks);
+
+	for( unsigned int c = 0; c < blocks*n; ++c )
+	{
+		unsigned char byte = 0;
+
+		for( unsigned int b = 0; b < 8; ++b )
+			byte = (unsigned char)((byte << 1) | bits[8*c + b]);
+
+		codewords[payloadSymbol<Config>(slots[c])] = byte;
+	}
+
+	if( codec.batchMatches )
+		codec.batch.checkSyndromes(codewords, clean, blocks);
+	else
+		memset(clean, 0, blocks);
+
+	// the first codeword holds the header
+	corrected[0] = 0;
+	decoded[0] = clean[0] || codec.decodeCodeword(codewords, &corrected[0]);
+
+	unsigned int length = codewords[0] | ((unsigned int)codewords[1] << 8);
+	unsigned int used = (payloadHeaderLength + length + k - 1) / k;
+
+	if( !decoded[0] || used > blocks )
+		return true;
+
+	// the others that need correcting are corrected at the same time
+	const ReedSolomonCodec<Config>* shared = &codec;
+	TaskGroup group;
+
+	for( unsigned int b = 1; b < used; ++b )
+	{
+		corrected[b] = 0;
+		decoded[b] = 1;
+
+		if( !clean[b] )
+			pool.enqueue([=]{ decoded[b] = shared->decodeCodeword(codewords + b*n, &corrected[b]); }, group);
+	}
+
+	pool.wait(group);
+
+	result->decoded = true;
+	result->length = length;
+	result->blocks = used;
+	result->margin = (int)(Config::fecLength/2);
+
+	for( unsigned int b = 0; b < used; ++b )
+	{
+		result->decoded = result->decoded && decoded[b];
+		result->correctedSymbols += corrected[b];
+		result->margin = std::min(result->margin, (int)(Config::fecLength/2) - (int)corrected[b]);
+	}
+
+	if( !result->decoded )
+	{
+		result->margin = -1;
+		return true;
+	}
+
+	for( unsigned int c = 0; c < length; ++c )
+	{
+		unsigned int d = payloadHeaderLength + c;
+		result->payload[c] = codewords[(d/k)*n + d%k];
+	}
+
+	return true;
+}
+
+bool decodePayload( ThreadPool& pool, unsigned int* src, int width, int height, double markStrength, Codec codec, PayloadResult* result )
+{
+	DISPATCH_REGION(codec, decodePayloadFor, (pool, src, width, height, markStrength, result));
+}
+
+// Alignment search. Shifting a plane by one coefficient before a level of the transform shifts the image
+// by 2^level pixels, so the 8x8 pixel phases of the level-3 bands form a tree of single-level transforms:
+// every node transforms one of the four one-coefficient shifts of its parent's approximation. A leaf holds
+// LH3 and HL3 of one phase, and tile origins a multiple of 8 pixels apart are offsets into those bands,
+// scored without another transform. The groups of four coefficients make the mark look the same every
+// 4 coefficients (32 pixels), so the score finds the phase and the lattice of the mark, and Reed-Solomon
+// decodes of the origins on that lattice, each read like an unshifted tile, pick the origin on it
+
+// a tile origin in window pixels and how strongly the mark reads there
+struct AlignmentCandidate
+{
+	int x;
+	int y;
+	double score;
+	unsigned int phase;
+};
+
+// phases are transformed in parallel down to this level, below it each task finishes its subtree
+static const unsigned int alignmentTaskLevels = 2;
+
+// only every rankStep-th bit is read to score an origin, and the lattices of this many of the best phases are decoded
+static const unsigned int alignmentRankStep = 4;
+static const unsigned int alignmentPhases = 2;
+
+// the mark repeats its structure every this many coefficients in both bands
+static const unsigned int alignmentPeriod = 4;
+
+template<class Config, class Wavelet>
+struct AlignmentSearch
+{
+	ThreadPool* pool;
+	TaskGroup group;         // every level of the tree
+	int range;               // window origins from 0 to 2*range, image origins from -range to range
+	unsigned int windowSize; // the window at image (-range,-range) the tree starts from
+	double markStrength;
+
+	std::mutex mutex;
+	std::vector<AlignmentCandidate> candidates;
+};
+
+static bool isFlatQuad( const double v[4] )
+{
+	return v[0] == v[1] && v[1] == v[2] && v[2] == v[3];
+}
+
+// mean belief magnitude of every step-th bit of a mark whose LH3 band starts at (column, row) of the LH
+// quadrant of an n x n leaf. Groups without any spread read as 0
+template<class Config, class T>
+static double alignmentScore( const T* plane, unsigned int n, unsigned int column, unsigned int row, double markStrength, unsigned int step )
+{
+	const unsigned int vecInLine = Config::markSize/2;
+	const T* lh = plane + (n/2 + row)*n + column;
+	const T* hl = plane + row*n + n/2 + column;
+
+	double v1[4];
+	double v2[4];
+	double sum = 0;
+	unsigned int read = 0;
+
+	for( unsigned int b = 0; b < Config::markLength; b += step, ++read )
+	{
+		unsigned int i = b / vecInLine;
+		unsigned int j = b % vecInLine;
+
+		for( unsigned int k = 0; k < 4; ++k )
+		{
+			v1[k] = (double)lh[i*n + j*4 + k];
+			v2[k] = (double)hl[(j*4 + k)*n + i];
+		}
+
+		if( !isFlatQuad(v1) && !isFlatQuad(v2) )
+			sum += fabs(fuzzyMean(getDistance(v1, markStrength), getDistance(v2, markStrength)));
+	}
+
+	return read > 0 ? sum / read : 0;
+}
+
+// scores the origins of one phase and keeps the best one with the origins on its lattice
+template<class Config, class Wavelet>
+static void rankAlignmentLeaf( AlignmentSearch<Config,Wavelet>* search, const typename Wavelet::coefficient* leaf, unsigned int n, int phaseX, int phaseY )
+{
+	const int cellSize = 1 << Config::levels;
+	const int limit = 2*search->range;
+
+	if( phaseX > limit || phaseY > limit )
+		return;
+
+	unsigned int columns = (limit - phaseX) / cellSize + 1;
+	unsigned int rows = (limit - phaseY) / cellSize + 1;
+
+	std::vector<double> scores(columns*rows);
+	unsigned int best = 0;
+
+	for( unsigned int c = 0; c < columns*rows; ++c )
+	{
+		scores[c] = alignmentScore<Config>(leaf, n, c % columns, c / columns, search->markStrength, alignmentRankStep);
+
+		if( scores[c] > scores[best] )
+			best = c;
+	}
+
+	std::unique_lock<std::mutex> lock(search->mutex);
+
+	for( unsigned int c = 0; c < columns*rows; ++c )
+	{
+		if( (c % columns) % alignmentPeriod != (best % columns) % alignmentPeriod || (c / columns) % alignmentPeriod != (best / columns) % alignmentPeriod )
+			continue;
+
+		AlignmentCandidate candidate = { phaseX + (int)(c % columns)*cellSize, phaseY + (int)(c / columns)*cellSize, scores[c], (unsigned int)(phaseY*cellSize + phaseX) };
+		search->candidates.push_back(candidate);
+	}
+}
+
+// one node of the tree: the n x n parent shifted left and up by (shiftX, shiftY) coefficients, transformed
+// one level. The last row and column of the shifted plane repeat the one before
+template<class Wavelet>
+static void shiftAndTransform( const typename Wavelet::coefficient* parent, typename Wavelet::coefficient* plane, typename Wavelet::coefficient* scratch, unsigned int n, unsigned int shiftX, unsigned int shiftY )
+{
+	for( unsigned int y = 0; y < n; ++y )
+	{
+		unsigned int sourceY = y + shiftY < n ? y + shiftY : n - 1;
+		typename Wavelet::coefficient* dst = plane + (size_t)y*n;
+
+		memcpy(dst, parent + (size_t)sourceY*n + shiftX, sizeof(*dst)*(n - shiftX));
+		if( shiftX > 0 )
+			dst[n-1] = dst[n-2];
+	}
+
+	Wavelet::forward(plane, scratch, n, n, n);
+}
+
+// transforms parent, an n x n approximation, shifted by each of the four one-coefficient shifts at the
+// given level and continues down the tree
+template<class Config, class Wavelet>
+static void searchAlignmentLevel( AlignmentSearch<Config,Wavelet>* search, std::shared_ptr< std::vector<typename Wavelet::coefficient> > parent, unsigned int n, unsigned int level, int phaseX, int phaseY )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	std::vector<coefficient> plane((size_t)n*n);
+	std::vector<coefficient> scratch(Wavelet::scratchSize(n, n));
+
+	for( int shift = 0; shift < 4; ++shift )
+	{
+		unsigned int shiftX = shift & 1;
+		unsigned int shiftY = shift >> 1;
+
+		shiftAndTransform<Wavelet>(&(*parent)[0], &plane[0], &scratch[0], n, shiftX, shiftY);
+
+		int childX = phaseX + (shiftX << level);
+		int childY = phaseY + (shiftY << level);
+
+		if( level + 1 == Config::levels )
+		{
+			rankAlignmentLeaf<Config,Wavelet>(search, &plane[0], n, childX, childY);
+			continue;
+		}
+
+		std::shared_ptr< std::vector<coefficient> > approximation = std::make_shared< std::vector<coefficient> >((size_t)(n/2)*(n/2));
+
+		for( unsigned int y = 0; y < n/2; ++y )
+			memcpy(&(*approximation)[(size_t)y*(n/2)], &plane[(size_t)y*n], sizeof(coefficient)*(n/2));
+
+		if( level + 1 < alignmentTaskLevels )
+			search->pool->enqueue([=]{ searchAlignmentLevel<Config,Wavelet>(search, approximation, n/2, level+1, childX, childY); }, search->group);
+		else
+			searchAlignmentLevel<Config,Wavelet>(search, approximation, n/2, level+1, childX, childY);
+	}
+}
+
+// index of the sample a symmetric extension of length samples puts at i
+static int mirrorIndex( int i, int length )
+{
+	if( length < 2 )
+		return 0;
+
+	int period = 2*(length - 1);
+
+	i %= period;
+	if( i < 0 )
+		i += period;
+
+	return i < length ? i : period - i;
+}
+
+// extends the width x height image at (origin,origin) of an n x n window symmetrically over the rest of it,
+// the way the transform extends a tile at its borders, so the borders do not read as strong edges
+template<class T>
+static void mirrorWindow( T* window, unsigned int n, int origin, int width, int height )
+{
+	std::vector<T> row(n);
+
+	for( int y = origin; y < origin + height; ++y )
+	{
+		T* line = window + (size_t)y*n;
+
+		for( int x = 0; x < (int)n; ++x )
+			row[x] = line[origin + mirrorIndex(x - origin, width)];
+
+		memcpy(line, &row[0], sizeof(T)*n);
+	}
+
+	for( int y = 0; y < (int)n; ++y )
+	{
+		int source = origin + mirrorIndex(y - origin, height);
+
+		if( source != y )
+			memcpy(window + (size_t)y*n, window + (size_t)source*n, sizeof(T)*n);
+	}
+}
+
+// reads the mark of the tile at (x,y) of an n x n luminance window exactly like an unshifted tile
+template<class Config, class Wavelet>
+static void readAlignedTile( const typename Wavelet::coefficient* window, unsigned int n, int x, int y, double markStrength, unsigned char* mark, double* soft, unsigned int* agreeing )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	const unsigned int tileSize = Config::tileSize;
+
+	Arena& arena = threadArena();
+	ArenaScope scope(arena);
+
+	coefficient* plane = arena.allocArray<coefficient>(tileSize*tileSize);
+	coefficient* scratch = arena.allocArray<coefficient>(Wavelet::scratchSize(tileSize, tileSize));
+	double* buffer1 = arena.allocArray<double>(Config::markLength);
+	double* buffer2 = arena.allocArray<double>(Config::markLength);
+
+	for( unsigned int i = 0; i < tileSize; ++i )
+		memcpy(plane + i*tileSize, window + (size_t)(y + i)*n + x, sizeof(coefficient)*tileSize);
+
+	decomposeImage<Wavelet>(plane, scratch, Config::levels, tileSize, tileSize);
+	decodeMark<Config>(plane, mark, buffer1, buffer2, tileSize, markStrength, soft, agreeing);
+}
+
+template<class Config, class Wavelet>
+static bool searchWatermarkFor( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, unsigned int searchRange, double markStrength, DecodeResult* result )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	const int tileSize = Config::tileSize;
+	const int range = (int)searchRange;
+
+	if( searchRange > (unsigned int)tileSize/2 )
+	{
+		fprintf(stderr,"Error: the alignment search reaches at most %d pixels\n", tileSize/2);
+		return false;
+	}
+
+	// every origin in range with the whole mark inside the window, which only has to split evenly into cells
+	const unsigned int cellSize = 1 << Config::levels;
+
+	AlignmentSearch<Config,Wavelet> search;
+	search.pool = &pool;
+	search.range = range;
+	search.windowSize = (tileSize + 2*range + 2*cellSize - 1) & ~(cellSize - 1);
+	search.markStrength = markStrength;
+
+	const unsigned int n = search.windowSize;
+	std::shared_ptr< std::vector<coefficient> > window = std::make_shared< std::vector<coefficient> >((size_t)n*n);
+
+	// the luminance is computed once for every phase and every decode
+	int visibleWidth = width < (int)n - range ? width : (int)n - range;
+	int visibleHeight = height < (int)n - range ? height : (int)n - range;
+
+	readLuminance<Wavelet>(src, width, visibleWidth, visibleHeight, &(*window)[(size_t)range*n + range], n);
+	mirrorWindow(&(*window)[0], n, range, visibleWidth, visibleHeight);
+
+	pool.enqueue([&search, window, n]{ searchAlignmentLevel<Config,Wavelet>(&search, window, n, 0, 0, 0); }, search.group);
+	pool.wait(search.group);
+
+	std::vector<AlignmentCandidate>& candidates = search.candidates;
+
+	std::sort(candidates.begin(), candidates.end(), []( const AlignmentCandidate& a, const AlignmentCandidate& b ) {
+		return a.score != b.score ? a.score > b.score : (a.y != b.y ? a.y < b.y : a.x < b.x);
+	});
+
+	// the origins on the lattices of the best phases, best scores first
+	std::vector<unsigned int> phases;
+	std::vector<AlignmentCandidate> lattice;
+
+	for( size_t c = 0; c < candidates.size(); ++c )
+	{
+		const unsigned int phase = candidates[c].phase;
+
+		if( std::find(phases.begin(), phases.end(), phase) == phases.end() )
+		{
+			if( phases.size() == alignmentPhases )
+				continue;
+
+			phases.push_back(phase);
+		}
+
+		lattice.push_back(candidates[c]);
+	}
+
+	// read like tiles a worker's worth at a time and decoded in rank order
+	const unsigned int markLength = Config::markLength;
+
+	std::vector<unsigned char> marks(lattice.size()*markLength);
+	std::vector<double> soft(lattice.size()*markLength);
+	std::vector<unsigned int> agreeing(lattice.size());
+
+	Arena& arena = threadArena();
+	ArenaScope scope(arena);
+
+	DecodeResult* attempt = result != NULL ? result : arena.allocArray<DecodeResult>(1);
+
+	for( size_t c = 0; c < lattice.size(); ++c )
+	{
+		if( c % pool.size() == 0 )
+		{
+			for( size_t r = c; r < lattice.size() && r < c + pool.size(); ++r )
+			{
+				pool.enqueue([&, r]{
+					readAlignedTile<Config,Wavelet>(&(*window)[0], n, lattice[r].x, lattice[r].y, markStrength, &marks[r*markLength], &soft[r*markLength], &agreeing[r]);
+				}, search.group);
+			}
+
+			pool.wait(search.group);
+		}
+
+		describeDecode<Config>(&marks[c*markLength], &soft[c*markLength], agreeing[c], 1, attempt);
+
+		attempt->offsetX = lattice[c].x - range;
+		attempt->offsetY = lattice[c].y - range;
+
+		if( attempt->decoded )
+		{
+			memcpy(mark, &marks[c*markLength], markLength);
+			return true;
+		}
+	}
+
+	// nothing decoded: leave the best ranked reading in mark and result
+	if( !lattice.empty() )
+	{
+		memcpy(mark, &marks[0], markLength);
+		describeDecode<Config>(mark, &soft[0], agreeing[0], 1, attempt);
+
+		attempt->offsetX = lattice[0].x - range;
+		attempt->offsetY = lattice[0].y - range;
+	}
+
+	return false;
+}
+
+bool searchWatermark( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, unsigned int searchRange, double markStrength, Codec codec, DecodeResult* result )
+{
+	if( result != NULL )
+	{
+		result->preset = codec.preset;
+		result->wavelet = codec.wavelet;
+		result->space = codec.space;
+	}
+
+	DISPATCH_REGION(codec, searchWatermarkFor, (pool, src, mark, width, height, searchRange, markStrength, result));
+}
+
+// Embeds the same mark independently into every full tile of the image, one tile per pool task
+// Pixels to the right and below the last full tile are left untouched
+template<class Config, class Wavelet>
+static bool insertTiledWatermarkFor( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, double markStrength )
+{
+	const int tileSize = Config::tileSize;
+
+	int tilesX = width / tileSize;
+	int tilesY = height / tileSize;
+
+	if( tilesX == 0 || tilesY == 0 )
+	{
+		fprintf(stderr,"Error: Tiled mode expects an image of at least %dx%d\n", tileSize, tileSize);
+		return false;
+	}
+
+	TaskGroup group;
+
+	for( int ty = 0; ty < tilesY; ++ty )
+	{
+		for( int tx = 0; tx < tilesX; ++tx )
+		{
+			unsigned int* tile = src + ty*tileSize*width + tx*tileSize;
+
+			pool.enqueue([=]{ watermarkRegion<Config,Wavelet>(tile, width, mark, NULL, NULL, tileSize, tileSize, true, markStrength); }, group);
+		}
+	}
+
+	pool.wait(group);
+
+	return true;
+}
+
+bool insertTiledWatermark( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, double markStrength, Codec codec )
+{
+	DISPATCH_REGION(codec, insertTiledWatermarkFor, (pool, src, mark, width, height, markStrength));
+}
+
+template<class Config, class Wavelet>
+static void insertWatermarkTileFor( unsigned int* src, unsigned char* mark, int width, unsigned int tile, double markStrength )
+{
+	const int tileSize = Config::tileSize;
+	const unsigned int tilesX = width / tileSize;
+
+	unsigned int* origin = src + (tile / tilesX)*tileSize*width + (tile % tilesX)*tileSize;
+
+	watermarkRegion<Config,Wavelet>(origin, width, mark, NULL, NULL, tileSize, tileSize, true, markStrength);
+}
+
+unsigned int countFullTiles( int width, int height, CodecPreset preset )
+{
+	const int tileSize = codecInfo(preset).tileSize;
+
+	return (unsigned int)((width / tileSize) * (height / tileSize));
+}
+
+void insertWatermarkTile( unsigned int* src, unsigned char* mark, int width, int height, unsigned int tile, double markStrength, Codec codec )
+{
+	if( tile >= countFullTiles(width, height, codec.preset) )
+		return;
+
+	DISPATCH_REGION(codec, insertWatermarkTileFor, (src, mark, width, tile, markStrength));
+}
+
+template<class Config, class Wavelet>
+static size_t workingSetSizeFor( int width, int height, bool tiled )
+{
+	const unsigned int planeWidth = tiled ? Config::tileSize : nextPow2(width);
+	const unsigned int planeHeight = tiled ? Config::tileSize : nextPow2(height);
+
+	return ((size_t)planeWidth*planeHeight + Wavelet::scratchSize(planeWidth, planeHeight))*sizeof(typename Wavelet::coefficient);
+}
+
+size_t workingSetSize( int width, int height, bool tiled, Codec codec )
+{
+	DISPATCH_REGION(codec, workingSetSizeFor, (width, height, tiled));
+}
+
+// Prepared images. Region r is the image outside tiled mode and full tile r in row order otherwise; its
+// plane of tileSize x tileSize coefficients starts at coefficient r*tileSize*tileSize
+unsigned int preparedRegions( int width, int height, bool tiled, CodecPreset preset )
+{
+	const int tileSize = codecInfo(preset).tileSize;
+
+	if( tiled )
+		return countFullTiles(width, height, preset);
+
+	return width > 0 && height > 0 && (int)nextPow2(width) == tileSize && (int)nextPow2(height) == tileSize ? 1 : 0;
+}
+
+size_t preparedCoefficientSize( WaveletKind wavelet )
+{
+	switch( wavelet )
+	{
+	case WaveletLeGall53:  return sizeof(LeGall53Wavelet::coefficient);
+	case WaveletInteger97: return sizeof(Integer97Wavelet::coefficient);
+	default:               return sizeof(Cdf97Wavelet::coefficient);
+	}
+}
+
+size_t preparedChromaSize( ColorSpace space )
+{
+	return space == ColorYCbCr ? 0 : 2*sizeof(double);
+}
+
+template<class Config, class Wavelet>
+static bool decomposePreparedFor( ThreadPool& pool, const unsigned int* src, int width, int height, bool tiled, unsigned int regions, void* planes, void* chroma )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	const int tileSize = Config::tileSize;
+	const unsigned int tilesX = width / tileSize;
+	TaskGroup group;
+
+	for( unsigned int r = 0; r < regions; ++r )
+	{
+		const unsigned int* origin = tiled ? src + (r / tilesX)*tileSize*width + (r % tilesX)*tileSize : src;
+		coefficient* plane = (coefficient*)planes + (size_t)r*tileSize*tileSize;
+		double* regionChroma = Wavelet::space != ColorYCbCr && chroma != NULL ? (double*)chroma + 2*(size_t)r*tileSize*tileSize : NULL;
+		int regionWidth = tiled ? tileSize : width;
+		int regionHeight = tiled ? tileSize : height;
+
+		pool.enqueue([=]{
+			Arena& arena = threadArena();
+			ArenaScope scope(arena);
+
+			coefficient* scratch = arena.allocArray<coefficient>(Wavelet::scratchSize(tileSize, tileSize));
+
+			analyzeRegion<Wavelet>(origin, width, regionWidth, regionHeight, Config::levels, plane, scratch, tileSize, tileSize);
+
+			if( regionChroma != NULL )
+				readChroma(origin, width, regionWidth, regionHeight, regionChroma, tileSize);
+		}, group);
+	}
+
+	pool.wait(group);
+
+	return true;
+}
+
+bool decomposePrepared( ThreadPool& pool, const unsigned int* src, int width, int height, bool tiled, void* planes, void* chroma, Codec codec )
+{
+	unsigned int regions = preparedRegions(width, height, tiled, codec.preset);
+
+	if( regions == 0 )
+		return false;
+
+	DISPATCH_REGION(codec, decomposePreparedFor, (pool, src, width, height, tiled, regions, planes, chroma));
+}
+
+template<class Config, class Wavelet>
+static bool markPreparedFor( ThreadPool& pool, unsigned int* src, int width, int height, bool tiled, unsigned int regions, void* planes, const void* chroma, const unsigned char* mark, double markStrength )
+{
+	typedef typename Wavelet::coefficient coefficient;
+
+	const int tileSize = Config::tileSize;
+	const unsigned int tilesX = width / tileSize;
+	TaskGroup group;
+
+	for( unsigned int r = 0; r < regions; ++r )
+	{
+		unsigned int* origin = tiled ? src + (r / tilesX)*tileSize*width + (r % tilesX)*tileSize : src;
+		coefficient* plane = (coefficient*)planes + (size_t)r*tileSize*tileSize;
+		const double* regionChroma = Wavelet::space != ColorYCbCr && chroma != NULL ? (const double*)chroma + 2*(size_t)r*tileSize*tileSize : NULL;
+		int regionWidth = tiled ? tileSize : width;
+		int regionHeight = tiled ? tileSize : height;
+
+		pool.enqueue([=]{
+			Arena& arena = threadArena();
+			ArenaScope scope(arena);
+
+			coefficient* scratch = arena.allocArray<coefficient>(Wavelet::scratchSize(tileSize, tileSize));
+
+			encodeMark<Config>(plane, (unsigned char*)mark, tileSize, markStrength);
+			synthesizeRegion<Wavelet>(origin, width, regionWidth, regionHeight, Config::levels, plane, scratch, tileSize, tileSize, regionChroma);
+		}, group);
+	}
+
+	pool.wait(group);
+
+	return true;
+}
+
+bool markPrepared( ThreadPool& pool, unsigned int* src, int width, int height, bool tiled, void* planes, const void* chroma, const unsigned char* mark, double markStrength, Codec codec )
+{
+	unsigned int regions = preparedRegions(width, height, tiled, codec.preset);
+
+	if( regions == 0 )
+		return false;
+
+	DISPATCH_REGION(codec, markPreparedFor, (pool, src, width, height, tiled, regions, planes, chroma, mark, markStrength));
+}
+
+// per-bit beliefs and hard readings of the tiles decoded so far, markLength entries per tile in tile order
+struct TileBeliefs
+{
+	std::vector<double> soft;
+	std::vector<unsigned char> marks;
+	std::vector<unsigned char> read;
+	std::vector<unsigned int> agreeing;
+};
+
+// sums the beliefs of every tile read so far in tile order, so the result does not depend on scheduling
+template<class Config>
+static void combineTileBeliefs( const TileBeliefs& beliefs, double* combined )
+{
+	const unsigned int tileMarkLength = Config::markLength;
+
+	memset(combined, 0, sizeof(double)*tileMarkLength);
+
+	for( size_t t = 0; t < beliefs.read.size(); ++t )
+	{
+		if( !beliefs.read[t] )
+			continue;
+
+		const double* soft = &beliefs.soft[t*tileMarkLength];
+		for( unsigned int i = 0; i < tileMarkLength; ++i )
+			combined[i] += soft[i];
+	}
+}
+
+// number of tiles whose own reading differs from the combined mark by at most agreeBits bits
+template<class Config>
+static unsigned int countAgreeingTiles( const TileBeliefs& beliefs, const double* combined )
+{
+	const unsigned int tileMarkLength = Config::markLength;
+	unsigned int agreeing = 0;
+
+	for( size_t t = 0; t < beliefs.read.size(); ++t )
+	{
+		if( !beliefs.read[t] )
+			continue;
+
+		const unsigned char* bits = &beliefs.marks[t*tileMarkLength];
+		unsigned int flips = 0;
+		for( unsigned int i = 0; i < tileMarkLength; ++i )
+			flips += bits[i] != (combined[i] < 0 ? 0 : 1);
+
+		if( flips <= Config::agreeBits )
+			++agreeing;
+	}
+
+	return agreeing;
+}
+
+// Reads every full tile of the image on the pool and appends their beliefs to the ones already collected.
+// With a non-zero quorum, tiles still queued are skipped once that many tiles agree with the combined mark.
+// Returns true once the quorum is reached
+template<class Config, class Wavelet>
+static bool decodeTiles( ThreadPool& pool, unsigned int* src, int width, int height, double markStrength, unsigned int quorum, TileBeliefs& beliefs )
+{
+	const int tileSize = Config::tileSize;
+	const unsigned int tileMarkLength = Config::markLength;
+
+	int tilesX = width / tileSize;
+	int tilesY = height / tileSize;
+	unsigned int tileCount = tilesX*tilesY;
+	size_t base = beliefs.read.size();
+
+	beliefs.soft.resize((base + tileCount)*tileMarkLength);
+	beliefs.marks.resize((base + tileCount)*tileMarkLength);
+	beliefs.read.resize(base + tileCount, 0);
+	beliefs.agreeing.resize(base + tileCount, 0);
+
+	double combined[tileMarkLength];
+	unsigned int tilesRead = 0;
+	std::mutex combineMutex;
+	std::atomic<bool> agreed(false);
+	TaskGroup group;
+
+	for( size_t t = 0; t < base; ++t )
+		tilesRead += beliefs.read[t];
+
+	for( unsigned int t = 0; t < tileCount; ++t )
+	{
+		pool.enqueue([&,t]{
+			if( agreed )
+				return;
+
+			unsigned int* tile = src + (t / tilesX)*tileSize*width + (t % tilesX)*tileSize;
+
+			// every tile owns its slot, only the bookkeeping below is shared
+			watermarkRegion<Config,Wavelet>(tile, width, &beliefs.marks[(base+t)*tileMarkLength], &beliefs.soft[(base+t)*tileMarkLength], &beliefs.agreeing[base+t], tileSize, tileSize, false, markStrength);
+
+			std::unique_lock<std::mutex> lock(combineMutex);
+
+			beliefs.read[base+t] = 1;
+			++tilesRead;
+
+			if( quorum > 0 && tilesRead >= quorum )
+			{
+				combineTileBeliefs<Config>(beliefs, combined);
+
+				if( countAgreeingTiles<Config>(beliefs, combined) >= quorum )
+					agreed = true;
+			}
+		}, group);
+	}
+
+	pool.wait(group);
+
+	return agreed;
+}
+
+// converts the combined beliefs into the mark and returns the number of tiles that contributed to it
+// result, if not NULL, receives the diagnostics of the combined mark
+template<class Config>
+static unsigned int resolveTileBeliefs( const TileBeliefs& beliefs, unsigned char* mark, DecodeResult* result )
+{
+	double combined[Config::markLength];
+	unsigned int tilesRead = 0;
+	unsigned int agreeing = 0;
+
+	combineTileBeliefs<Config>(beliefs, combined);
+
+	for( unsigned int i = 0; i < Config::markLength; ++i )
+		mark[i] = combined[i] < 0 ? 0 : 1;
+
+	for( size_t t = 0; t < beliefs.read.size(); ++t )
+	{
+		tilesRead += beliefs.read[t];
+		agreeing += beliefs.read[t] ? beliefs.agreeing[t] : 0;
+	}
+
+	if( result != NULL )
+		describeDecode<Config>(mark, combined, agreeing, tilesRead, result);
+
+	return tilesRead;
+}
+
+// Reads every full tile on the pool and sums the per-bit beliefs across tiles before the final vote.
+// With a non-zero quorum, tiles still queued are skipped once that many tiles agree with the combined mark.
+// Returns the number of tiles that contributed to mark
+template<class Config, class Wavelet>
+static unsigned int decodeTiledWatermarkFor( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, double markStrength, unsigned int quorum, DecodeResult* result )
+{
+	const int tileSize = Config::tileSize;
+
+	if( width < tileSize || height < tileSize )
+	{
+		fprintf(stderr,"Error: Tiled mode expects an image of at least %dx%d\n", tileSize, tileSize);
+		return 0;
+	}
+
+	TileBeliefs beliefs;
+
+	decodeTiles<Config,Wavelet>(pool, src, width, height, markStrength, quorum, beliefs);
+
+	return resolveTileBeliefs<Config>(beliefs, mark, result);
+}
+
+unsigned int decodeTiledWatermark( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, double markStrength, unsigned int quorum, Codec codec, DecodeResult* result )
+{
+	if( result != NULL )
+	{
+		result->preset = codec.preset;
+		result->wavelet = codec.wavelet;
+		result->space = codec.space;
+	}
+
+	DISPATCH_REGION(codec, decodeTiledWatermarkFor, (pool, src, mark, width, height, markStrength, quorum, result));
+}
+
+// Tiled encode of a row-streamed image, one strip of tiles at a time.
+// Only tileSize rows are held in memory, so peak memory grows with the width and not the area
+template<class Config, class Wavelet>
+static bool streamTiledWatermarkFor( ThreadPool& pool, RowReader& reader, RowWriter& writer, unsigned char* mark, double markStrength )
+{
+	const int tileSize = Config::tileSize;
+
+	int width = reader.width();
+	int height = reader.height();
+
+	if( width < tileSize || height < tileSize )
+	{
+		fprintf(stderr,"Error: Tiled mode expects an image of at least %dx%d\n", tileSize, tileSize);
+		return false;
+	}
+
+	std::vector<unsigned int> strip((size_t)width*tileSize);
+
+	for( int y = 0; y < height; y += tileSize )
+	{
+		int rows = height - y < tileSize ? height - y : tileSize;
+
+		if( !reader.readRows(&strip[0], rows) )
+		{
+			fprintf(stderr,"Error: truncated input at row %d\n", y);
+			return false;
+		}
+
+		// rows below the last full strip pass through unmarked
+		if( rows == tileSize )
+			insertTiledWatermarkFor<Config,Wavelet>(pool, &strip[0], mark, width, rows, markStrength);
+
+		if( !writer.writeRows(&strip[0], rows) )
+		{
+			fprintf(stderr,"Error: could not write output at row %d\n", y);
+			return false;
+		}
+	}
+
+	return writer.finish();
+}
+
+bool streamTiledWatermark( ThreadPool& pool, RowReader& reader, RowWriter& writer, unsigned char* mark, double markStrength, Codec codec )
+{
+	DISPATCH_REGION(codec, streamTiledWatermarkFor, (pool, reader, writer, mark, markStrength));
+}
+
+// Tiled decode of a row-streamed image. Reading stops at the first strip after which the quorum is reached
+template<class Config, class Wavelet>
+static unsigned int decodeStreamedTilesFor( ThreadPool& pool, RowReader& reader, unsigned char* mark, double markStrength, unsigned int quorum, DecodeResult* result )
+{
+	const int tileSize = Config::tileSize;
+
+	int width = reader.width();
+	int height = reader.height();
+
+	if( width < tileSize || height < tileSize )
+	{
+		fprintf(stderr,"Error: Tiled mode expects an image of at least %dx%d\n", tileSize, tileSize);
+		return 0;
+	}
+
+	std::vector<unsigned int> strip((size_t)width*tileSize);
+	TileBeliefs beliefs;
+
+	for( int y = 0; y + tileSize <= height; y += tileSize )
+	{
+		if( !reader.readRows(&strip[0], tileSize) )
+		{
+			fprintf(stderr,"Error: truncated input at row %d\n", y);
+			break;
+		}
+
+		if( decodeTiles<Config,Wavelet>(pool, &strip[0], width, tileSize, markStrength, quorum, beliefs) )
+			break;
+	}
+
+	return resolveTileBeliefs<Config>(beliefs, mark, result);
+}
+
+unsigned int decodeStreamedTiles( ThreadPool& pool, RowReader& reader, unsigned char* mark, double markStrength, unsigned int quorum, Codec codec, DecodeResult* result )
+{
+	if( result != NULL )
+	{
+		result->preset = codec.preset;
+		result->wavelet = codec.wavelet;
+		result->space = codec.space;
+	}
+
+	DISPATCH_REGION(codec, decodeStreamedTilesFor, (pool, reader, mark, markStrength, quorum, result));
+}
+
+DecodeAggregate::DecodeAggregate()
+	: images(0), decoded(0), correctedSymbols(0), marginSum(0), minMargin(-1),
+	  weakBits(0), bandAgreementSum(0), meanConfidenceSum(0)
+{
+}
+
+void addDecodeResult( DecodeAggregate& aggregate, const DecodeResult& result )
+{
+	++aggregate.images;
+	aggregate.bandAgreementSum += result.bandAgreement;
+	aggregate.meanConfidenceSum += result.meanConfidence;
+	aggregate.weakBits += result.weakBits;
+
+	if( !result.decoded )
+		return;
+
+	++aggregate.decoded;
+	aggregate.correctedSymbols += result.correctedSymbols;
+	aggregate.marginSum += result.margin;
+
+	if( aggregate.minMargin < 0 || result.margin < aggregate.minMargin )
+		aggregate.minMargin = result.margin;
+}
+
+void mergeDecodeAggregate( DecodeAggregate& aggregate, const DecodeAggregate& other )
+{
+	aggregate.images += other.images;
+	aggregate.decoded += other.decoded;
+	aggregate.correctedSymbols += other.correctedSymbols;
+	aggregate.marginSum += other.marginSum;
+	aggregate.weakBits += other.weakBits;
+	aggregate.bandAgreementSum += other.bandAgreementSum;
+	aggregate.meanConfidenceSum += other.meanConfidenceSum;
+
+	if( other.minMargin >= 0 && (aggregate.minMargin < 0 || other.minMargin < aggregate.minMargin) )
+		aggregate.minMargin = other.minMargin;
+}
+
+// writes str as a JSON string literal
+static void writeJsonString( FILE* file, const char* str )
+{
+	fputc('"', file);
+
+	for( ; *str; ++str )
+	{
+		unsigned char c = (unsigned char)*str;
+
+		if( c == '"' || c == '\\' )
+			fprintf(file, "\\%c", c);
+		else if( c < 32 )
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+
+	fputc('"', file);
+}
+
+void writeDecodeResultJson( FILE* file, const char* path, const DecodeResult& result, bool withConfidence )
+{
+	fprintf(file, "{\"file\":");
+	writeJsonString(file, path);
+	fprintf(file, ",\"config\":\"%s\",\"wavelet\":\"%s\",\"space\":\"%s\",\"decoded\":%s,\"message\":", codecInfo(result.preset).name, waveletName(result.wavelet), colorSpaceName(result.space), result.decoded ? "true" : "false");
+	writeJsonString(file, result.message);
+	fprintf(file, ",\"correctedSymbols\":%u,\"correctableSymbols\":%u,\"margin\":%d", result.correctedSymbols, result.correctableSymbols, result.margin);
+	fprintf(file, ",\"bandAgreement\":%.4f,\"meanConfidence\":%.4f,\"minConfidence\":%.4f,\"weakBits\":%u,\"tilesRead\":%u",
+	        result.bandAgreement, result.meanConfidence, result.minConfidence, result.weakBits, result.tilesRead);
+	fprintf(file, ",\"offset\":[%d,%d]", result.offsetX, result.offsetY);
+
+	if( withConfidence )
+	{
+		// one array per row of the mark
+		fprintf(file, ",\"confidence\":[");
+
+		for( unsigned int y = 0; y < result.markSize; ++y )
+		{
+			fprintf(file, y > 0 ? ",[" : "[");
+
+			for( unsigned int x = 0; x < result.markSize; ++x )
+				fprintf(file, x > 0 ? ",%.3f" : "%.3f", result.confidence[y*result.markSize + x]);
+
+			fputc(']', file);
+		}
+
+		fputc(']', file);
+	}
+
+	fprintf(file, "}\n");
+}
+
+void writePayloadResultJson( FILE* file, const char* path, const PayloadResult& result )
+{
+	fprintf(file, "{\"file\":");
+	writeJsonString(file, path);
+	fprintf(file, ",\"decoded\":%s,\"length\":%u,\"blocks\":%u,\"correctedSymbols\":%u,\"margin\":%d,\"payload\":\"",
+	        result.decoded ? "true" : "false", result.length, result.blocks, result.correctedSymbols, result.margin);
+
+	for( unsigned int i = 0; result.decoded && i < result.length; ++i )
+		fprintf(file, "%02x", result.payload[i]);
+
+	fprintf(file, "\"}\n");
+}
+
+void writeDecodeAggregateJson( FILE* file, const DecodeAggregate& aggregate, bool endLine )
+{
+	double images = aggregate.images > 0 ? (double)aggregate.images : 1.0;
+	double decoded = aggregate.decoded > 0 ? (double)aggregate.decoded : 1.0;
+
+	fprintf(file, "{\"images\":%llu,\"decoded\":%llu,\"failed\":%llu", aggregate.images, aggregate.decoded, aggregate.images - aggregate.decoded);
+	fprintf(file, ",\"meanCorrectedSymbols\":%.2f,\"meanMargin\":%.2f,\"minMargin\":%d",
+	        aggregate.correctedSymbols / decoded, aggregate.marginSum / decoded, aggregate.minMargin);
+	fprintf(file, ",\"meanBandAgreement\":%.4f,\"meanConfidence\":%.4f,\"weakBits\":%llu}%s",
+	        aggregate.bandAgreementSum / images, aggregate.meanConfidenceSum / images, aggregate.weakBits, endLine ? "\n" : "");
+}
+
+// built without main when linked into the self checks or another program
+#ifndef WAVESCRIBE_NO_MAIN
+
+// prints the decoded message, or the whole decode result as JSON
+static void printDecodeResult( const DecodeResult& result, const char* path, bool json )
+{
+	if( json )
+		writeDecodeResultJson(stdout, path, result, true);
+	else
+		printf("Message obtained from image %s : %s\n", path, result.message);
+}
+
+// printable bytes as they are, the others as \xNN
+static void printPayloadResult( const PayloadResult& result, const char* path, bool json )
+{
+	if( json )
+	{
+		writePayloadResultJson(stdout, path, result);
+		return;
+	}
+
+	if( !result.decoded )
+	{
+		printf("Payload obtained from image %s : ERROR\n", path);
+		return;
+	}
+
+	printf("Payload obtained from image %s (%u bytes in %u blocks) : ", path, result.length, result.blocks);
+
+	for( unsigned int i = 0; i < result.length; ++i )
+	{
+		unsigned char c = result.payload[i];
+
+		if( c >= 32 && c <= 126 && c != '\\' )
+			putchar(c);
+		else
+			printf("\\x%02x", c);
+	}
+
+	putchar('\n');
+}
+
+// writes the timeline recorded with --trace, if any
+static void finishTrace( const char* path )
+{
+	if( path != NULL && !traceWrite(path) )
+		fprintf(stderr,"Error: could not write file %s\n", path);
+}
+
+int main(int argc, char** argv)
+{
+	bool tiled = false;
+	bool strips = false;
+	unsigned int threads = 0;
+	unsigned int quorum = 0;
+	bool json = false;
+	int frameWidth = 0;
+	int frameHeight = 0;
+	unsigned int frameChannels = 4;
+	unsigned int inFlight = 0;
+	unsigned int searchRange = 0;
+	CodecPreset preset = CodecStandard;
+	WaveletKind wavelet = WaveletCdf97;
+	ColorSpace space = ColorLab;
+	PngOptions pngOptions;
+	bool zlibPng = false;
+	const char* batchManifest = NULL;
+	const char* batchLog = NULL;
+	unsigned int shard = 0;
+	unsigned int shards = 1;
+	unsigned int mergeShards = 0;
+	const char* cacheDir = NULL;
+	unsigned long long cacheMegabytes = 1024;
+	const char* tracePath = NULL;
+	bool asyncIo = true;
+	AsyncBackend ioBackend = AsyncUring;
+	unsigned long long ioMegabytes = 64;
+	unsigned long long memoryMegabytes = 0;
+	bool capacity = false;
+	const char* prepareTo = NULL;
+	const char* applyFrom = NULL;
+
+	// options come first, the remaining arguments are positional
+	const char* args[4];
+	int nargs = 0;
+
+	for( int a = 1; a < argc; ++a )
+	{
+		if( strcmp(argv[a],"--tiled") == 0 )
+			tiled = true;
+		else if( strcmp(argv[a],"--strips") == 0 )
+			tiled = strips = true;
+		else if( strcmp(argv[a],"--threads") == 0 && a+1 < argc )
+			threads = atoi(argv[++a]);
+		else if( strcmp(argv[a],"--quorum") == 0 && a+1 < argc )
+			quorum = atoi(argv[++a]);
+		else if( strcmp(argv[a],"--json") == 0 )
+			json = true;
+		else if( strcmp(argv[a],"--capacity") == 0 )
+			capacity = true;
+		else if( strcmp(argv[a],"--prepare") == 0 && a+1 < argc )
+			prepareTo = argv[++a];
+		else if( strcmp(argv[a],"--apply") == 0 && a+1 < argc )
+			applyFrom = argv[++a];
+		else if( strcmp(argv[a],"--stream") == 0 && a+1 < argc )
+		{
+			if( sscanf(argv[++a], "%dx%d", &frameWidth, &frameHeight) != 2 || frameWidth <= 0 || frameHeight <= 0 )
+			{
+				fprintf(stderr,"Error: expecting the frame size as WxH, not %s\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--rgb") == 0 )
+			frameChannels = 3;
+		else if( strcmp(argv[a],"--inflight") == 0 && a+1 < argc )
+			inFlight = atoi(argv[++a]);
+		else if( strcmp(argv[a],"--search") == 0 && a+1 < argc )
+			searchRange = atoi(argv[++a]);
+		else if( strcmp(argv[a],"--config") == 0 && a+1 < argc )
+		{
+			if( !findCodecPreset(argv[++a], &preset) )
+			{
+				fprintf(stderr,"Error: unknown codec configuration %s (standard, long or large)\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--wavelet") == 0 && a+1 < argc )
+		{
+			if( !findWaveletKind(argv[++a], &wavelet) )
+			{
+				fprintf(stderr,"Error: unknown wavelet %s (cdf97, legall53 or int97)\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--space") == 0 && a+1 < argc )
+		{
+			if( !findColorSpace(argv[++a], &space) )
+			{
+				fprintf(stderr,"Error: unknown colour space %s (lab or ycbcr)\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--png-level") == 0 && a+1 < argc )
+		{
+			pngOptions.level = atoi(argv[++a]);
+			zlibPng = true;
+
+			if( pngOptions.level < 0 || pngOptions.level > 9 )
+			{
+				fprintf(stderr,"Error: the PNG compression level is 0 to 9, not %s\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--png-filter") == 0 && a+1 < argc )
+		{
+			zlibPng = true;
+
+			if( !findPngFilter(argv[++a], &pngOptions.filter) )
+			{
+				fprintf(stderr,"Error: unknown PNG filter %s (adaptive, none, sub, up, average or paeth)\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--batch") == 0 && a+1 < argc )
+			batchManifest = argv[++a];
+		else if( strcmp(argv[a],"--shard") == 0 && a+1 < argc )
+		{
+			if( !parseShard(argv[++a], &shard, &shards) )
+			{
+				fprintf(stderr,"Error: expecting the shard as i/N with i < N, not %s\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--log") == 0 && a+1 < argc )
+			batchLog = argv[++a];
+		else if( strcmp(argv[a],"--merge") == 0 && a+1 < argc )
+			mergeShards = atoi(argv[++a]);
+		else if( strcmp(argv[a],"--cache") == 0 && a+1 < argc )
+			cacheDir = argv[++a];
+		else if( strcmp(argv[a],"--cache-size") == 0 && a+1 < argc )
+			cacheMegabytes = strtoull(argv[++a], NULL, 10);
+		else if( strcmp(argv[a],"--trace") == 0 && a+1 < argc )
+			tracePath = argv[++a];
+		else if( strcmp(argv[a],"--io") == 0 && a+1 < argc )
+		{
+			asyncIo = strcmp(argv[++a], "sync") != 0;
+
+			if( asyncIo && !findAsyncBackend(argv[a], &ioBackend) )
+			{
+				fprintf(stderr,"Error: unknown I/O %s (uring, threads or sync)\n", argv[a]);
+				exit(-1);
+			}
+		}
+		else if( strcmp(argv[a],"--io-budget") == 0 && a+1 < argc )
+			ioMegabytes = strtoull(argv[++a], NULL, 10);
+		else if( strcmp(argv[a],"--memory-budget") == 0 && a+1 < argc )
+			memoryMegabytes = strtoull(argv[++a], NULL, 10);
+		else if( nargs < 4 )
+			args[nargs++] = argv[a];
+		else
+			nargs = 5;
+	}
+
+	if( batchManifest != NULL && mergeShards > 0 )
+	{
+		// the stats of every shard's default log and their sum, nothing is run
+		BatchStats total;
+		std::vector<char> log(strlen(batchManifest) + 32);
+
+		for( unsigned int s = 0; s < mergeShards; ++s )
+		{
+			BatchStats stats;
+			char name[32];
+
+			batchLogPath(&log[0], batchManifest, s, mergeShards);
+
+			if( !readBatchStats(batchManifest, &log[0], s, mergeShards, &stats) )
+			{
+				fprintf(stderr,"Error: could not open file %s\n", batchManifest);
+				return 1;
+			}
+
+			sprintf(name, "%u/%u", s, mergeShards);
+			writeBatchStatsJson(stdout, name, stats);
+			mergeBatchStats(total, stats);
+		}
+
+		writeBatchStatsJson(stdout, "all", total);
+
+		return 0;
+	}
+
+	// prepare takes the master only, apply the arguments of an encode
+	bool prepared = prepareTo != NULL || applyFrom != NULL;
+
+	if( batchManifest != NULL ? (nargs != 1 && nargs != 2) || frameWidth > 0 || strips || capacity || prepared :
+	    prepared ? nargs != (prepareTo != NULL ? 1 : 4) || (prepareTo != NULL && applyFrom != NULL) || frameWidth > 0 || strips || capacity || searchRange > 0 :
+	    (nargs != 2 && nargs != 4) || (frameWidth > 0 && nargs != 4) || (capacity && (tiled || frameWidth > 0 || searchRange > 0)) )
+	{
+		printf("    usage: WaveMark [--tiled | --strips | --stream WxH [--rgb] [--inflight n]] [--threads n] [--quorum n] [--search n] [--config standard|long|large] [--wavelet cdf97|legall53|int97] [--space lab|ycbcr] [--png-level n] [--png-filter name] [--cache dir [--cache-size MB]] [--trace file] [--json] strength input.png [output.png \"string\"]\n");
+		printf("           WaveMark --capacity [--config name] [--wavelet name] [--space name] [--threads n] [--png-level n] [--png-filter name] [--json] strength input.png [output.png \"payload\"]\n");
+		printf("           WaveMark --prepare sidecar [--tiled] [--config name] [--wavelet name] [--space name] [--threads n] [--trace file] input.png\n");
+		printf("           WaveMark --apply sidecar [--tiled] [--config name] [--wavelet name] [--space name] [--threads n] [--png-level n] [--png-filter name] [--trace file] strength input.png output.png \"string\"\n");
+		printf("           WaveMark --batch manifest [--shard i/N] [--log path] [--tiled] [--threads n] [--quorum n] [--config name] [--wavelet name] [--space name] [--png-level n] [--png-filter name] [--io uring|threads|sync [--io-budget MB]] [--memory-budget MB] [--cache dir [--cache-size MB]] [--trace file] [--json] strength [\"string\"]\n");
+		printf("           WaveMark --batch manifest --merge N\n");
+		exit(-1);
+	}
+
+	if( tracePath != NULL )
+	{
+		if( !traceStart() )
+		{
+			fprintf(stderr,"Error: --trace needs a build with WAVESCRIBE_TRACE defined\n");
+			exit(-1);
+		}
+
+		traceThreadName("main");
+	}
+
+	// in batch mode the message follows the strength, the images are in the manifest
+	bool isEncode = batchManifest != NULL ? nargs == 2 : nargs == 4;
+	const char* messageArg = batchManifest != NULL ? args[1] : args[3];
+
+	int width, height;
+
+	const Codec codec(preset, wavelet, space);
+	const CodecInfo& info = codecInfo(preset);
+	const int tileSize = info.tileSize;
+
+	// encode outputs and decode results of pixels seen before, for single images and batches
+	ResultCache* cache = cacheDir != NULL && !capacity && !prepared ? new ResultCache(cacheDir, cacheMegabytes << 20) : NULL;
+
+	double strength = atof(args[0]);
+	unsigned char* boolMark = threadArena().allocArray<unsigned char>(info.markSize*info.markSize);
+	DecodeResult* result = threadArena().allocArray<DecodeResult>(1);
+
+	// encode string from command line
+	if( isEncode ) 
+	{
+		std::string message = messageArg;
+
+		// remove quotes
+		message.substr(1,message.length()-2);
+
+		if( message.length() > (capacity ? info.capacityLength : info.payloadLength) )
+		{
+			fprintf(stderr,"Error: string too long\n");
+		}
+
+		else if( !capacity )
+		{
+			// convert string to boolean matrix
+			encodeMessageMark(message.c_str(),boolMark,preset);
+		}
+	}
+
+	if( batchManifest != NULL )
+	{
+		if( isEncode && strlen(messageArg) > info.payloadLength )
+			return 1;
+
+		ThreadPool pool(threads, dwtcleanup);
+		pngOptions.threads = threads;
+		ImageBackend* images = zlibPng ? createZlibBackend(pngOptions, &pool) : createStbBackend();
+
+		BatchOptions options;
+		options.manifest = batchManifest;
+		options.log = batchLog;
+		options.shard = shard;
+		options.shards = shards;
+		options.mark = isEncode ? boolMark : NULL;
+		options.markStrength = strength;
+		options.codec = codec;
+		options.tiled = tiled;
+		options.quorum = quorum;
+		options.json = json;
+		options.message = messageArg;
+		options.cache = cache;
+		options.files = NULL;
+		options.memoryBudget = memoryMegabytes << 20;
+
+		// the budget is for each way, reads ahead and writes behind
+		const size_t ioBudget = (size_t)ioMegabytes << 20;
+
+		if( asyncIo && ioBudget > 0 )
+			options.files = new AsyncFiles(ioBudget, ioBudget, ioBackend);
+
+		BatchStats stats;
+		bool ran = runBatch(pool, *images, options, &stats);
+
+		delete options.files;
+
+		if( ran )
+		{
+			char name[32];
+			sprintf(name, "%u/%u", shard, shards);
+			writeBatchStatsJson(json ? stdout : stderr, name, stats);
+		}
+
+		delete images;
+		delete cache;
+		finishTrace(tracePath);
+		threadArena().reset();
+		dwtcleanup();
+
+		return ran && stats.failed == 0 ? 0 : 1;
+	}
+
+	if( frameWidth > 0 )
+	{
+		// raw frames from input to output ("-" for stdin/stdout), progress goes to stderr
+		ThreadPool pool(threads, dwtcleanup);
+		FrameStreamStats stats;
+
+		bool streamed = streamFrames(pool, args[1], args[2], frameWidth, frameHeight, frameChannels, inFlight, boolMark, strength, codec, &stats);
+
+		fprintf(stderr,"Marked %llu frames in %.2fs (%.1f frames/s)\n", stats.frames, stats.seconds, stats.seconds > 0 ? stats.frames / stats.seconds : 0.0);
+
+		delete cache;
+		finishTrace(tracePath);
+		threadArena().reset();
+		dwtcleanup();
+
+		return streamed ? 0 : 1;
+	}
+
+	if( strips )
+	{
+		// binary PGM/PPM streamed one strip of tiles at a time ("-" for stdin/stdout)
+		ThreadPool pool(threads, dwtcleanup);
+		RowReader* reader = openRowReader(args[1]);
+		bool streamed = false;
+
+		if( reader == NULL )
+		{
+			fprintf(stderr,"Error: could not open file %s\n", args[1]);
+		}
+		else if( isEncode )
+		{
+			RowWriter* writer = openRowWriter(args[2], reader->width(), reader->height());
+
+			if( writer == NULL )
+			{
+				fprintf(stderr,"Error: could not open file %s\n", args[2]);
+			}
+			else
+			{
+				streamed = streamTiledWatermark(pool, *reader, *writer, boolMark, strength, codec);
+				delete writer;
+			}
+		}
+		else
+		{
+			unsigned int tilesRead = decodeStreamedTiles(pool, *reader, boolMark, strength, quorum, codec, result);
+
+			if( !json )
+				printf("Combined %u of %u tiles\n", tilesRead, (reader->width()/tileSize)*(reader->height()/tileSize));
+
+			printDecodeResult(*result, args[1], json);
+			streamed = true;
+		}
+
+		delete reader;
+		delete cache;
+		finishTrace(tracePath);
+		threadArena().reset();
+		dwtcleanup();
+
+		return streamed ? 0 : 1;
+	}
+
+	if( prepared )
+	{
+		// the master is decoded and decomposed once by prepare, every apply starts from the sidecar
+		ThreadPool pool(threads, dwtcleanup);
+		bool done = false;
+
+		if( prepareTo != NULL )
+		{
+			ImageBackend* images = createStbBackend();
+			unsigned int* imageData = images->load(args[0], &width, &height);
+
+			if( imageData == NULL )
+			{
+				fprintf(stderr,"Error: could not open file %s\n", args[0]);
+			}
+			else
+			{
+				done = prepareSidecar(pool, prepareTo, args[0], imageData, width, height, tiled, codec);
+				images->release(imageData);
+			}
+
+			delete images;
+		}
+		else if( strlen(messageArg) <= info.payloadLength )
+		{
+			pngOptions.threads = threads;
+			ImageBackend* images = zlibPng ? createZlibBackend(pngOptions, &pool) : createStbBackend();
+			PreparedImage image;
+
+			done = image.open(applyFrom, args[1], tiled, codec) && image.apply(pool, boolMark, strength);
+
+			if( done && !images->save(args[2], image.pixels(), image.width(), image.height()) )
+			{
+				fprintf(stderr,"Error: could not write file %s\n", args[2]);
+				done = false;
+			}
+
+			delete images;
+		}
+
+		finishTrace(tracePath);
+		threadArena().reset();
+		dwtcleanup();
+
+		return done ? 0 : 1;
+	}
+
+	//CCPNGInit();
+
+	// stb unless a PNG level or filter was asked for
+	pngOptions.threads = threads;
+	ImageBackend* images = zlibPng ? createZlibBackend(pngOptions) : createStbBackend();
+
+	//unsigned int* imageData = CCPNGReadFile(args[1], &width, &height);
+	unsigned int* imageData = images->load( args[1], &width, &height );
+	unsigned int* outputData = NULL;
+
+	if( imageData != NULL )
+	{	
+		std::string params;
+		unsigned long long key = 0;
+		std::vector<unsigned char> payload;
+		bool cached = false;
+
+		// hashed before the pixels are marked in place
+		if( cache != NULL )
+		{
+			params = resultCacheParams(isEncode ? messageArg : NULL, strength, codec, tiled, quorum, searchRange, isEncode ? args[2] : NULL, *images);
+			key = cache->key(imageData, width, height, params);
+
+			if( isEncode )
+				cached = cache->findFile(key, params, args[2]);
+			else if( cache->find(key, params, payload) && payload.size() == sizeof(DecodeResult) )
+			{
+				memcpy(result, &payload[0], sizeof(DecodeResult));
+				cached = true;
+
+				if( !json && tiled )
+					printf("Combined %u of %u tiles\n", result->tilesRead, (width/tileSize)*(height/tileSize));
+				else if( !json && searchRange > 0 )
+					printf("Best alignment at offset %d,%d\n", result->offsetX, result->offsetY);
+
+				printDecodeResult(*result, args[1], json);
+			}
+		}
+
+		if( capacity )
+		{
+			ThreadPool pool(threads, dwtcleanup);
+			PayloadResult* payload = threadArena().allocArray<PayloadResult>(1);
+
+			if( isEncode )
+			{
+				if( strlen(messageArg) <= info.capacityLength && insertPayload( pool, imageData, width, height, (const unsigned char*)messageArg, (unsigned int)strlen(messageArg), strength, codec ) )
+					outputData = imageData;
+			}
+			else if( decodePayload( pool, imageData, width, height, strength, codec, payload ) )
+			{
+				printPayloadResult(*payload, args[1], json);
+			}
+
+			if( outputData != NULL && !images->save( args[2], outputData, width, height ) )
+				fprintf(stderr,"Error: could not write file %s\n", args[2]);
+		}
+		else if( !cached && (boolMark != NULL || !isEncode) )
+		{
+			if( tiled )
+			{
+				ThreadPool pool(threads, dwtcleanup);
+
+				if( isEncode )
+				{
+					if( insertTiledWatermark( pool, imageData, boolMark, width, height, strength, codec ) )
+						outputData = imageData;
+				}
+				else
+				{
+					unsigned int tilesRead = decodeTiledWatermark( pool, imageData, boolMark, width, height, strength, quorum, codec, result );
+
+					if( !json )
+						printf("Combined %u of %u tiles\n", tilesRead, (width/tileSize)*(height/tileSize));
+
+					printDecodeResult(*result, args[1], json);
+
+					if( cache != NULL )
+						cache->store(key, params, result, sizeof(DecodeResult));
+				}
+			}
+			else if( searchRange > 0 && !isEncode )
+			{
+				ThreadPool pool(threads, dwtcleanup);
+
+				searchWatermark( pool, imageData, boolMark, width, height, searchRange, strength, codec, result );
+
+				if( !json )
+					printf("Best alignment at offset %d,%d\n", result->offsetX, result->offsetY);
+
+				printDecodeResult(*result, args[1], json);
+
+				if( cache != NULL )
+					cache->store(key, params, result, sizeof(DecodeResult));
+			}
+			else if( isEncode )
+			{
+				insertWatermark( imageData, &outputData, boolMark, &width, &height, isEncode, strength, codec );
+			}
+			else if( decodeWatermark( imageData, boolMark, width, height, strength, codec, result ) )
+			{
+				printDecodeResult(*result, args[1], json);
+
+				if( cache != NULL )
+					cache->store(key, params, result, sizeof(DecodeResult));
+			}
+
+			if( outputData != NULL )
+			{
+				if( !images->save( args[2], outputData, width, height ) )
+					fprintf(stderr,"Error: could not write file %s\n", args[2]);
+				else if( cache != NULL && isEncode )
+					cache->storeFile(key, params, args[2]);
+				//CCPNGWriteFile(args[2], outputData, width, height, 0, 1);
+
+				if( !isEncode ) 
+					free(outputData);
+			}
+		}
+
+		images->release(imageData);
+	}
+	else
+	{
+		fprintf(stderr,"Error: could not open file %s\n", args[1]);
+	}
+
+	delete images;
+	delete cache;
+	finishTrace(tracePath);
+	threadArena().reset();
+
+	//CCPNGDestroy();
+	dwtcleanup();
+
+	return 0;
+}
+
+#endif // WAVESCRIBE_NO_MAIN
+
+//#define CAPACITY_STANDALONE
+#ifdef CAPACITY_STANDALONE
+
+// Capacity mode of every preset on a textured tile: bits per image, and the time per codeword of a
+// full payload through the whole image and through the Reed-Solomon stage alone
+// build: the WaveScribe sources with -DWAVESCRIBE_NO_MAIN -DCAPACITY_STANDALONE, without verify.cpp
+
+#include <chrono>
+
+static double secondsSince( std::chrono::steady_clock::time_point start )
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<class Config>
+static void benchmarkCapacity( ThreadPool& pool, CodecPreset preset, unsigned int rounds )
+{
+	const CodecInfo& info = codecInfo(preset);
+	const unsigned int size = Config::tileSize;
+	const unsigned int blocks = Config::capacityBlocks;
+	const unsigned int n = Config::codeLength;
+
+	std::vector<unsigned int> original(size*size), pixels;
+	std::vector<unsigned char> payload(info.capacityLength);
+	PayloadResult* result = new PayloadResult();
+
+	for( unsigned int y = 0; y < size; ++y )
+	{
+		for( unsigned int x = 0; x < size; ++x )
+		{
+			unsigned int r = (unsigned int)(128 + 60*sin(x/5.0) * cos(y/3.7) + 30*sin(x*y/900.0));
+			unsigned int g = (unsigned int)(128 + 50*sin((x+y)/31.0));
+			unsigned int b = (unsigned int)(120 + 80*sin(x/41.0 + y/29.0));
+
+			original[y*size + x] = r | (g << 8) | (b << 16) | (255u << 24);
+		}
+	}
+
+	for( unsigned int i = 0; i < payload.size(); ++i )
+		payload[i] = (unsigned char)(i*131 + 7);
+
+	double encodeSeconds = 0, decodeSeconds = 0;
+	bool intact = true;
+
+	for( unsigned int r = 0; r < rounds; ++r )
+	{
+		pixels = original;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		insertPayload(pool, &pixels[0], size, size, &payload[0], info.capacityLength, 0.5, Codec(preset));
+		encodeSeconds += secondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		decodePayload(pool, &pixels[0], size, size, 0.5, Codec(preset), result);
+		decodeSeconds += secondsSince(start);
+
+		intact = intact && result->decoded && result->length == info.capacityLength && memcmp(result->payload, &payload[0], payload.size()) == 0;
+	}
+
+	// the codewords alone: batched encode, then Schifra correcting a quarter of what each one can
+	const ReedSolomonCodec<Config>& codec = ReedSolomonCodec<Config>::instance();
+	const unsigned int codewordRounds = 200*rounds;
+	std::vector<unsigned char> codewords(blocks*n), damaged;
+	unsigned int corrected = 0;
+
+	for( unsigned int i = 0; i < codewords.size(); ++i )
+		codewords[i] = (unsigned char)(i*29 + 3);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for( unsigned int r = 0; r < codewordRounds; ++r )
+		codec.batch.encode(&codewords[0], blocks);
+
+	double rsEncodeSeconds = secondsSince(start);
+
+	damaged = codewords;
+
+	for( unsigned int b = 0; b < blocks; ++b )
+		for( unsigned int e = 0; e < Config::fecLength/8; ++e )
+			damaged[b*n + e*7 % n] ^= 0x5a;
+
+	start = std::chrono::steady_clock::now();
+
+	for( unsigned int r = 0; r < codewordRounds; ++r )
+	{
+		std::vector<unsigned char> copy(damaged);
+
+		for( unsigned int b = 0; b < blocks; ++b )
+			codec.decodeCodeword(&copy[b*n], &corrected);
+	}
+
+	double rsDecodeSeconds = secondsSince(start);
+
+	printf("%-8s %4ux%-4u %6u coded bits, %5u payload bits (%4u with one mark), %u x RS(%u,%u)%s\n", info.name, size, size,
+	       Config::capacityBits, 8*info.capacityLength, 8*info.payloadLength, blocks, n, (unsigned int)Config::fecLength,
+	       intact ? "" : "  DECODE FAILED");
+	printf("         image  encode %7.2f ms %8.0f blocks/s   decode %7.2f ms %8.0f blocks/s   margin %d\n",
+	       1000*encodeSeconds/rounds, blocks*rounds/encodeSeconds, 1000*decodeSeconds/rounds, blocks*rounds/decodeSeconds, result->margin);
+	printf("         RS     encode %8.0f blocks/s   decode (%u errors) %8.0f blocks/s\n",
+	       blocks*codewordRounds/rsEncodeSeconds, (unsigned int)(Config::fecLength/8), blocks*codewordRounds/rsDecodeSeconds);
+
+	delete result;
+}
+
+int main( int argc, char** argv )
+{
+	unsigned int rounds = argc > 1 ? (unsigned int)atoi(argv[1]) : 5;
+	ThreadPool pool(0, dwtcleanup);
+
+	printf("%u worker threads, strength 0.5, cdf97\n", pool.size());
+
+	benchmarkCapacity<StandardCodec>(pool, CodecStandard, rounds);
+	benchmarkCapacity<LongCodec>(pool, CodecLong, rounds);
+	benchmarkCapacity<LargeCodec>(pool, CodecLarge, rounds);
+
+	threadArena().reset();
+	dwtcleanup();
+
+	return 0;
+}
+
+#endif // CAPACITY_STANDALONE
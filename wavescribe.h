@@ -0,0 +1,227 @@
+// Author: Jonathan Decker
+// Description: Library interface of the WaveScribe encoder and decoder
+// Images are packed RGBA (unsigned int per pixel) and marks are square matrices of 0/1 bytes
+
+#pragma once
+
+#include <stdio.h>
+
+class ThreadPool;
+class RowReader;
+class RowWriter;
+
+// Codec presets selectable at run time, each one an instantiation of a CodecConfig (codecconfig.h)
+enum CodecPreset
+{
+	CodecStandard, // 32x32 mark, RS(128,96), 32 byte payload, 512x512 tiles
+	CodecLong,     // 32x32 mark, RS(128,64), 64 byte payload, 512x512 tiles
+	CodecLarge,    // 64x64 mark, RS(255,127), 128 byte payload, 1024x1024 tiles
+	CodecPresetCount
+};
+
+struct CodecInfo
+{
+	const char* name;
+	unsigned int markSize;
+	unsigned int tileSize;
+	unsigned int codeLength;
+	unsigned int payloadLength;
+	unsigned int capacityBlocks;  // codewords in capacity mode
+	unsigned int capacityLength;  // payload bytes in capacity mode
+};
+
+// largest mark and payload of any preset, for sizing buffers
+static const unsigned int maxMarkLength = 64*64;
+static const unsigned int maxPayloadLength = 128;
+static const unsigned int maxCapacityLength = 1280;
+
+const CodecInfo& codecInfo( CodecPreset preset );
+
+// Wavelet policies of the transform carrying the mark (wavelet.h). The integer ones work on fixed
+// point planes and reconstruct the unmarked coefficients exactly
+enum WaveletKind
+{
+	WaveletCdf97,     // floating point CDF 9/7, the original transform
+	WaveletLeGall53,  // reversible integer LeGall 5/3
+	WaveletInteger97, // reversible integer approximation of the CDF 9/7
+	WaveletKindCount
+};
+
+// Colour spaces whose luminance carries the mark
+enum ColorSpace
+{
+	ColorLab,    // CIE Lab L in double precision, the original
+	ColorYCbCr,  // BT.601 luma in fixed point on the packed pixels (ycbcr.h), several times faster
+	ColorSpaceCount
+};
+
+// the preset, wavelet and colour space a mark is written with, all have to match on decode
+struct Codec
+{
+	Codec( CodecPreset preset = CodecStandard, WaveletKind wavelet = WaveletCdf97, ColorSpace space = ColorLab ) : preset(preset), wavelet(wavelet), space(space) {}
+
+	CodecPreset preset;
+	WaveletKind wavelet;
+	ColorSpace space;
+};
+
+const char* waveletName( WaveletKind wavelet );
+
+// looks a wavelet up by its name ("cdf97", "legall53" or "int97")
+bool findWaveletKind( const char* name, WaveletKind* wavelet );
+
+const char* colorSpaceName( ColorSpace space );
+
+// looks a colour space up by its name ("lab" or "ycbcr")
+bool findColorSpace( const char* name, ColorSpace* space );
+
+// Diagnostics of one decode, to tell how close an image is to failing
+struct DecodeResult
+{
+	CodecPreset preset;
+	WaveletKind wavelet;
+	ColorSpace space;
+	bool decoded;                       // the Reed-Solomon decode succeeded
+	char message[maxPayloadLength+1];   // the message, or "ERROR"
+	unsigned int markSize;
+
+	// signed belief of each bit in mark order, averaged over the tiles read: the sign is the bit
+	// (negative reads as 0) and the magnitude, up to 2, how far the two bands are from flipping it
+	float confidence[maxMarkLength];
+	double meanConfidence;              // mean magnitude
+	double minConfidence;               // smallest magnitude
+	unsigned int weakBits;              // bits with a magnitude below 0.5
+
+	double bandAgreement;               // fraction of bit readings on which LH3 and HL3 voted the same way
+	unsigned int correctedSymbols;      // symbols the Reed-Solomon decode corrected
+	unsigned int correctableSymbols;    // symbols it can always correct
+	int margin;                         // correctable - corrected, -1 if the decode failed
+
+	unsigned int tilesRead;             // tiles combined into the mark (1 outside tiled mode)
+	int offsetX;                        // image position of the tile origin the mark was read at,
+	int offsetY;                        // negative if the image was cropped (0,0 unless searched)
+};
+
+// compact summary of many decodes for batch runs, shards are combined with mergeDecodeAggregate
+struct DecodeAggregate
+{
+	DecodeAggregate();
+
+	unsigned long long images;
+	unsigned long long decoded;
+	unsigned long long correctedSymbols; // over the decoded images
+	unsigned long long marginSum;        // over the decoded images
+	int minMargin;                       // smallest margin of a decoded image, -1 before the first one
+	unsigned long long weakBits;
+	double bandAgreementSum;
+	double meanConfidenceSum;
+};
+
+void addDecodeResult( DecodeAggregate& aggregate, const DecodeResult& result );
+void mergeDecodeAggregate( DecodeAggregate& aggregate, const DecodeAggregate& other );
+
+// one JSON object per line, the confidence matrix (one array per row) only if withConfidence is set
+void writeDecodeResultJson( FILE* file, const char* path, const DecodeResult& result, bool withConfidence );
+void writeDecodeAggregateJson( FILE* file, const DecodeAggregate& aggregate, bool endLine = true );
+
+// looks a preset up by its name ("standard", "long" or "large")
+bool findCodecPreset( const char* name, CodecPreset* preset );
+
+// Reed-Solomon encodes a string of up to 32 characters into a 32x32 binary matrix and back
+// decoding writes 32 characters (not terminated) or "ERROR"
+void encodeStringIntoBinaryMatrix( const char* str, unsigned char* dst, unsigned int width, unsigned int height );
+void decodeBinaryMatrixAsString( unsigned char* src, char* dst, unsigned int width, unsigned int height );
+
+// encodes a message of up to payloadLength characters into the preset's mark, repeated messages
+// are served from a shared cache
+void encodeMessageMark( const char* str, unsigned char* mark, CodecPreset preset = CodecStandard );
+
+// decodes the preset's mark into payloadLength characters plus a terminator, false (and "ERROR") if
+// the codeword could not be corrected
+bool decodeMessageMark( unsigned char* mark, char* dst, CodecPreset preset = CodecStandard );
+
+// the same for many messages at once, on the batched Reed-Solomon kernels (rsbatch.h) and without the cache:
+// marks holds count marks back to back and dst count strings maxPayloadLength+1 bytes apart.
+// Return the number of messages encoded or decoded
+unsigned int encodeMessageMarks( const char* const* strs, unsigned char* marks, unsigned int count, CodecPreset preset = CodecStandard );
+unsigned int decodeMessageMarks( unsigned char* marks, char* dst, unsigned int count, CodecPreset preset = CodecStandard );
+
+// every codeword the decoders cannot correct is reported on stderr ("Critical decoding failure"); callers
+// that read damaged or unmarked images on purpose can turn that off for the whole process and back on
+void setDecodeFailureReports( bool enabled );
+
+// if isForward is false, reads the mark from an image of one tile (512x512 for the standard preset) into mark
+// otherwise it inserts the mark into the image in place and stores the image in dst
+void insertWatermark( unsigned int* src, unsigned int** dst, unsigned char* mark, int *width, int *height, bool isForward = true, double markStrength = 0.5, Codec codec = Codec() );
+
+// The decoders below fill result, if not NULL, with the decoded message and its diagnostics.
+// Collecting them costs one pass over the mark after it has been read
+
+// reads the mark from an image of one tile, false if the image does not have the tile size
+bool decodeWatermark( unsigned int* src, unsigned char* mark, int width, int height, double markStrength = 0.5, Codec codec = Codec(), DecodeResult* result = NULL );
+
+// reads the mark from an image cropped or padded by up to searchRange pixels (at most half a tile) at the
+// top and left: tile origins from -searchRange to searchRange in both directions are ranked by how
+// strongly they read, on the pool, and the best ones are decoded until one succeeds. The origin found
+// goes to result. Returns false if none of them decoded
+bool searchWatermark( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, unsigned int searchRange, double markStrength = 0.5, Codec codec = Codec(), DecodeResult* result = NULL );
+
+// tiled mode: one copy of the mark per full tile, tiles are processed on the pool
+bool insertTiledWatermark( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, double markStrength = 0.5, Codec codec = Codec() );
+
+// The bytes of coefficients (plane and wavelet scratch) a thread allocates to encode or decode a region of
+// a width x height image: the image zero padded to powers of two, or one tile if tiled. They come from
+// the thread's arena, besides the pixels and the files
+size_t workingSetSize( int width, int height, bool tiled, Codec codec = Codec() );
+
+// the full tiles of a width x height image, and the encode of one of them (in row order) in place,
+// for callers that schedule tiles themselves
+unsigned int countFullTiles( int width, int height, CodecPreset preset = CodecStandard );
+void insertWatermarkTile( unsigned int* src, unsigned char* mark, int width, int height, unsigned int tile, double markStrength = 0.5, Codec codec = Codec() );
+unsigned int decodeTiledWatermark( ThreadPool& pool, unsigned int* src, unsigned char* mark, int width, int height, double markStrength = 0.5, unsigned int quorum = 0, Codec codec = Codec(), DecodeResult* result = NULL );
+
+// Prepared images (sidecar.h) split an encode where the message starts to matter. The luminance of the
+// image (one tile), or of every full tile if tiled, is decomposed into planes of tileSize x tileSize
+// coefficients of preparedCoefficientSize bytes, one per region in tile order. Marking them transforms
+// them back into the pixels the planes were decomposed from, which end up as an encode would leave them.
+// chroma (optional) keeps preparedChromaSize bytes per coefficient: the a and b of Lab of every pixel, the
+// doubles the conversion back to RGB would compute from it again; YCbCr writes the luma without them.
+// Both return false if the image has no region: not one tile, or no full tile in tiled mode
+unsigned int preparedRegions( int width, int height, bool tiled, CodecPreset preset = CodecStandard );
+size_t preparedCoefficientSize( WaveletKind wavelet );
+size_t preparedChromaSize( ColorSpace space );
+bool decomposePrepared( ThreadPool& pool, const unsigned int* src, int width, int height, bool tiled, void* planes, void* chroma, Codec codec = Codec() );
+bool markPrepared( ThreadPool& pool, unsigned int* src, int width, int height, bool tiled, void* planes, const void* chroma, const unsigned char* mark, double markStrength = 0.5, Codec codec = Codec() );
+
+// tiled mode over row-streamed images, one strip of tiles in memory at a time
+bool streamTiledWatermark( ThreadPool& pool, RowReader& reader, RowWriter& writer, unsigned char* mark, double markStrength = 0.5, Codec codec = Codec() );
+unsigned int decodeStreamedTiles( ThreadPool& pool, RowReader& reader, unsigned char* mark, double markStrength = 0.5, unsigned int quorum = 0, Codec codec = Codec(), DecodeResult* result = NULL );
+
+// Capacity mode: a payload of up to capacityLength bytes (any bytes, for signed tokens) behind a two byte
+// length header is split into as many codewords of the preset's code as it needs. Their symbols are
+// interleaved over the bits of the mark's level and of the level below it, each written to LH and HL like
+// the mark, so every codeword gets the same share of the weaker level-2 groups. The codewords are built
+// together on the batched kernels and corrected on the pool. Images of a single tile only
+struct PayloadResult
+{
+	bool decoded;                        // the header and every codeword it asks for decoded
+	unsigned int length;                 // payload bytes
+	unsigned int blocks;                 // codewords carrying the header and payload
+	unsigned int correctedSymbols;       // over all of them
+	int margin;                          // smallest correctable - corrected of a codeword, -1 if the decode failed
+	unsigned char payload[maxCapacityLength];
+};
+
+// marks the image in place, false if it is not one tile or the payload is too long
+bool insertPayload( ThreadPool& pool, unsigned int* src, int width, int height, const unsigned char* payload, unsigned int length, double markStrength = 0.5, Codec codec = Codec() );
+
+// false if the image is not one tile, otherwise the payload and its diagnostics are in result
+bool decodePayload( ThreadPool& pool, unsigned int* src, int width, int height, double markStrength, Codec codec, PayloadResult* result );
+
+// one JSON object per line, the payload as hex
+void writePayloadResultJson( FILE* file, const char* path, const PayloadResult& result );
+
+// scalar per-group kernels, the reference for the batched versions in quadsimd.h
+void encodeBit( double c[4], unsigned int i[4], unsigned char b, double markStrength );
+double getDistance( double c[4], double markStrength );
+double fuzzyMean( double distance1, double distance2 );
@@ -0,0 +1,146 @@
+// Author: Jonathan Decker
+// Description: Fixed point YCbCr luma of packed RGBA rows (ycbcr.h)
+//
+// The weights are 0.299, 0.587 and 0.114 times 100/255 in 16 bit fixed point, small enough for the
+// signed 16 bit multiplies of _mm_madd_epi16. A luma change goes back to 8 bit channels through 16 bit
+// lanes: the change is cut to 8 fractional bits, saturated, scaled by 255/100 with _mm_mulhi_epi16
+// into 3 fractional bits and rounded. The scalar code does the same steps, wrap-around and all.
+
+#include "ycbcr.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define LUMA_SIMD 4
+#endif
+
+static const int weightRed = 7684;
+static const int weightGreen = 15086;
+static const int weightBlue = 2930;
+
+// 255/100 in 11 fractional bits, applied as (change*scale) >> 16 to a change with 8 fractional bits
+static const int channelScale = 5224;
+
+static inline int clamp16( int x )
+{
+	return x < -32768 ? -32768 : (x > 32767 ? 32767 : x);
+}
+
+static inline int clamp8( int x )
+{
+	return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+void lumaRowScalar( const unsigned int* rgba, unsigned int count, int* luma )
+{
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		unsigned int c = rgba[i];
+
+		luma[i] = weightRed*(int)(c & 0xff) + weightGreen*(int)((c >> 8) & 0xff) + weightBlue*(int)((c >> 16) & 0xff);
+	}
+}
+
+void setLumaRowScalar( unsigned int* rgba, unsigned int count, const int* luma )
+{
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		unsigned int c = rgba[i];
+
+		int r = (int)(c & 0xff);
+		int g = (int)((c >> 8) & 0xff);
+		int b = (int)((c >> 16) & 0xff);
+		int current = weightRed*r + weightGreen*g + weightBlue*b;
+
+		// the 32 bit lanes wrap
+		int change = (int)((unsigned int)luma[i] - (unsigned int)current + 128u) >> 8;
+		int delta = ((clamp16(change)*channelScale) >> 16) + 4;
+		delta = (short)delta >> 3;
+
+		rgba[i] = (c & 0xff000000u) | (unsigned int)clamp8(r + delta) | ((unsigned int)clamp8(g + delta) << 8) | ((unsigned int)clamp8(b + delta) << 16);
+	}
+}
+
+#ifdef LUMA_SIMD
+
+// the luma of the 4 pixels in p
+static inline __m128i lumaOf( __m128i p )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weights = _mm_setr_epi16(weightRed, weightGreen, weightBlue, 0, weightRed, weightGreen, weightBlue, 0);
+
+	// (r*wr + g*wg, b*wb) of each pixel, then the pairs added
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), weights);
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero), weights);
+
+	__m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2,0,2,0)));
+	__m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3,1,3,1)));
+
+	return _mm_add_epi32(even, odd);
+}
+
+unsigned int lumaBatchWidth()
+{
+	return LUMA_SIMD;
+}
+
+void lumaRow( const unsigned int* rgba, unsigned int count, int* luma )
+{
+	unsigned int i = 0;
+
+	for( ; i + LUMA_SIMD <= count; i += LUMA_SIMD )
+		_mm_storeu_si128((__m128i*)(luma + i), lumaOf(_mm_loadu_si128((const __m128i*)(rgba + i))));
+
+	lumaRowScalar(rgba + i, count - i, luma + i);
+}
+
+void setLumaRow( unsigned int* rgba, unsigned int count, const int* luma )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+	const __m128i scale = _mm_set1_epi16(channelScale);
+	const __m128i four = _mm_set1_epi16(4);
+	const __m128i colour = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+
+	unsigned int i = 0;
+
+	for( ; i + LUMA_SIMD <= count; i += LUMA_SIMD )
+	{
+		__m128i p = _mm_loadu_si128((const __m128i*)(rgba + i));
+		__m128i change = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(luma + i)), lumaOf(p));
+		change = _mm_srai_epi32(_mm_add_epi32(change, round), 8);
+
+		// d0 d1 d2 d3 in 16 bit lanes, then each spread over the r, g and b lanes of its pixel
+		__m128i delta = _mm_packs_epi32(change, change);
+		delta = _mm_srai_epi16(_mm_add_epi16(_mm_mulhi_epi16(delta, scale), four), 3);
+		delta = _mm_unpacklo_epi16(delta, delta);
+
+		__m128i deltaLo = _mm_and_si128(_mm_unpacklo_epi32(delta, delta), colour);
+		__m128i deltaHi = _mm_and_si128(_mm_unpackhi_epi32(delta, delta), colour);
+
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(p, zero), deltaLo);
+		__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(p, zero), deltaHi);
+
+		_mm_storeu_si128((__m128i*)(rgba + i), _mm_packus_epi16(lo, hi));
+	}
+
+	setLumaRowScalar(rgba + i, count - i, luma + i);
+}
+
+#else
+
+unsigned int lumaBatchWidth()
+{
+	return 1;
+}
+
+void lumaRow( const unsigned int* rgba, unsigned int count, int* luma )
+{
+	lumaRowScalar(rgba, count, luma);
+}
+
+void setLumaRow( unsigned int* rgba, unsigned int count, const int* luma )
+{
+	setLumaRowScalar(rgba, count, luma);
+}
+
+#endif // LUMA_SIMD
@@ -0,0 +1,24 @@
+// Author: Jonathan Decker
+// Description: Fixed point YCbCr luma of packed RGBA rows, the fast colour space (--space ycbcr)
+//
+// The luma is the BT.601 Y scaled to 0..100 like the Lab L, so a mark strength means about the same in
+// both spaces, kept with lumaFractionBits fractional bits. Writing a luma back adds its change to R, G
+// and B alike, which leaves Cb and Cr where they were unless a channel saturates; alpha is kept.
+// The SIMD and scalar versions give the same results, bit for bit.
+
+#pragma once
+
+static const int lumaFractionBits = 16;
+
+// pixels handled per batch, 1 when no SIMD path is compiled in
+unsigned int lumaBatchWidth();
+
+// writes the luma of count pixels
+void lumaRow( const unsigned int* rgba, unsigned int count, int* luma );
+
+// moves the luma of count pixels to the given ones (as lumaRow returns them, any value)
+void setLumaRow( unsigned int* rgba, unsigned int count, const int* luma );
+
+// the scalar versions, which the SIMD ones are checked against
+void lumaRowScalar( const unsigned int* rgba, unsigned int count, int* luma );
+void setLumaRowScalar( unsigned int* rgba, unsigned int count, const int* luma );